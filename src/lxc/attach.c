@@ -958,6 +958,7 @@ static int lxc_attach_pty(struct lxc_conf *conf, struct lxc_console *pty)
 
 	/* Shift ttys to container. */
 	ret = lxc_pty_map_ids(conf, pty);
+	lxc_userns_helper_stop(conf);
 	if (ret < 0) {
 		ERROR("Failed to shift pty");
 		goto on_error;
@@ -40,7 +40,10 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,6 +51,7 @@
 #include <unistd.h>
 #include <linux/kdev_t.h>
 #include <linux/types.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "caps.h"
@@ -176,6 +180,36 @@ cgroup_layout_t cgroup_layout;
 /* What controllers is the container supposed to use. */
 char *cgroup_use;
 
+/* @cg_topology
+ * - The hierarchies above are discovered once per process and shared by all
+ *   handlers. They are only rediscovered when a new handler is initialized
+ *   while no other handler is using them and the process moved to another
+ *   mount namespace or the cgroup mounts changed.
+ * - mntns
+ *   The inode of the mount namespace the hierarchies were discovered in.
+ * - hash
+ *   A hash over the cgroup mounts in mountinfo, so that unrelated mount table
+ *   changes don't trigger a rediscovery.
+ * - fd, pid, dev, ino
+ *   /proc/self/mountinfo, opened on first use by process @pid. The kernel
+ *   flags it with POLLPRI when the mount table changes, so the hash only
+ *   has to be computed again when that happens.
+ * - users
+ *   The number of handlers currently using the hierarchies.
+ */
+static struct {
+	ino_t mntns;
+	uint64_t hash;
+	int fd;
+	pid_t pid;
+	dev_t dev;
+	ino_t ino;
+	unsigned int users;
+} cg_topology = {
+	.fd = -1,
+};
+static pthread_mutex_t cg_topology_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* @lxc_cgfsng_debug
  * - Whether to print debug info to stdout for the cgfsng driver.
  */
@@ -293,12 +327,15 @@ static void must_append_controller(char **klist, char **nlist, char ***clist,
 	(*clist)[newentry] = copy;
 }
 
+static void cg_topology_put(void);
+
 static void free_handler_data(struct cgfsng_handler_data *d)
 {
 	free(d->cgroup_pattern);
 	free(d->container_cgroup);
 	free(d->name);
 	free(d);
+	cg_topology_put();
 }
 
 /* Given a handler's cgroup data, return the struct hierarchy for the controller
@@ -328,43 +365,52 @@ struct hierarchy *get_hierarchy(const char *c)
 	return NULL;
 }
 
-#define BATCH_SIZE 50
-static void batch_realloc(char **mem, size_t oldlen, size_t newlen)
+/* Slurp in the rest of an open file, growing the buffer geometrically so that
+ * large files like mountinfo on busy hosts are read in a few syscalls.
+ */
+static char *read_file_fd(int fd)
 {
-	int newbatches = (newlen / BATCH_SIZE) + 1;
-	int oldbatches = (oldlen / BATCH_SIZE) + 1;
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+	ssize_t ret;
 
-	if (!*mem || newbatches > oldbatches) {
-		*mem = must_realloc(*mem, newbatches * BATCH_SIZE);
-	}
-}
+	for (;;) {
+		if (size - len < BUFSIZ) {
+			size = size ? size * 2 : 4 * BUFSIZ;
+			buf = must_realloc(buf, size);
+		}
 
-static void append_line(char **dest, size_t oldlen, char *new, size_t newlen)
-{
-	size_t full = oldlen + newlen;
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 
-	batch_realloc(dest, oldlen, full + 1);
+			free(buf);
+			return NULL;
+		}
 
-	memcpy(*dest + oldlen, new, newlen + 1);
+		if (ret == 0)
+			break;
+
+		len += ret;
+	}
+
+	buf[len] = '\0';
+	return buf;
 }
 
 /* Slurp in a whole file */
 static char *read_file(const char *fnam)
 {
-	FILE *f;
-	char *line = NULL, *buf = NULL;
-	size_t len = 0, fulllen = 0;
-	int linelen;
+	int fd;
+	char *buf;
 
-	f = fopen(fnam, "r");
-	if (!f)
+	fd = open(fnam, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return NULL;
-	while ((linelen = getline(&line, &len, f)) != -1) {
-		append_line(&buf, fulllen, line, linelen);
-		fulllen += linelen;
-	}
-	fclose(f);
-	free(line);
+
+	buf = read_file_fd(fd);
+	close(fd);
 	return buf;
 }
 
@@ -1072,18 +1118,23 @@ static void must_append_string(char ***list, char *entry)
 	(*list)[newentry] = copy;
 }
 
-static int get_existing_subsystems(char ***klist, char ***nlist)
+/* @cginfo is a copy of /proc/<pid>/cgroup. All processes list the same
+ * hierarchies there, only the cgroups they are in differ.
+ */
+static int get_existing_subsystems(const char *cginfo, char ***klist,
+				   char ***nlist)
 {
-	FILE *f;
-	char *line = NULL;
-	size_t len = 0;
+	char *buf, *line, *next;
 
-	f = fopen("/proc/self/cgroup", "r");
-	if (!f)
-		return -1;
+	buf = must_copy_string(cginfo);
 
-	while (getline(&line, &len, f) != -1) {
+	for (line = buf; line && *line; line = next) {
 		char *p, *p2, *tok, *saveptr = NULL;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
 		p = strchr(line, ':');
 		if (!p)
 			continue;
@@ -1114,8 +1165,7 @@ static int get_existing_subsystems(char ***klist, char ***nlist)
 		}
 	}
 
-	free(line);
-	fclose(f);
+	free(buf);
 	return 0;
 }
 
@@ -1185,16 +1235,15 @@ static void lxc_cgfsng_print_debuginfo(const struct cgfsng_handler_data *d)
 }
 
 /* At startup, parse_hierarchies finds all the info we need about cgroup
- * mountpoints and current cgroups, and stores it in @d.
+ * mountpoints and current cgroups, and stores it in @d. @mountinfo is a copy
+ * of /proc/self/mountinfo which is parsed in place.
  */
-static bool cg_hybrid_init(void)
+static bool cg_hybrid_init(char *mountinfo)
 {
 	int ret;
 	char *basecginfo;
 	bool will_escape;
-	FILE *f;
-	size_t len = 0;
-	char *line = NULL;
+	char *line, *next;
 	char **klist = NULL, **nlist = NULL;
 
 	/* Root spawned containers escape the current cgroup, so use init's
@@ -1208,30 +1257,27 @@ static bool cg_hybrid_init(void)
 	if (!basecginfo)
 		return false;
 
-	ret = get_existing_subsystems(&klist, &nlist);
+	ret = get_existing_subsystems(basecginfo, &klist, &nlist);
 	if (ret < 0) {
 		CGFSNG_DEBUG("Failed to retrieve available legacy cgroup controllers\n");
 		free(basecginfo);
 		return false;
 	}
 
-	f = fopen("/proc/self/mountinfo", "r");
-	if (!f) {
-		CGFSNG_DEBUG("Failed to open \"/proc/self/mountinfo\"\n");
-		free(basecginfo);
-		return false;
-	}
-
 	if (lxc_cgfsng_debug)
 		lxc_cgfsng_print_basecg_debuginfo(basecginfo, klist, nlist);
 
-	while (getline(&line, &len, f) != -1) {
+	for (line = mountinfo; line && *line; line = next) {
 		int type;
 		bool writeable;
 		struct hierarchy *new;
 		char *base_cgroup = NULL, *mountpoint = NULL;
 		char **controller_list = NULL;
 
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
 		type = get_cgroup_version(line);
 		if (type == 0)
 			continue;
@@ -1317,9 +1363,6 @@ static bool cg_hybrid_init(void)
 
 	free(basecginfo);
 
-	fclose(f);
-	free(line);
-
 	if (lxc_cgfsng_debug) {
 		printf("Writable cgroup hierarchies:\n");
 		lxc_cgfsng_print_hierarchies();
@@ -1429,10 +1472,46 @@ static int cg_unified_init(void)
 	return CGROUP2_SUPER_MAGIC;
 }
 
+/* Hash the cgroup mounts in a copy of mountinfo. */
+static uint64_t cg_mountinfo_hash(const char *mountinfo)
+{
+	const char *line, *eol;
+	uint64_t hash = FNV1A_64_INIT;
+
+	for (line = mountinfo; line && *line; line = eol ? eol + 1 : NULL) {
+		const char *p;
+		size_t len;
+
+		eol = strchr(line, '\n');
+		len = eol ? (size_t)(eol - line) : strlen(line);
+
+		p = memmem(line, len, " - cgroup", 9);
+		if (!p || (p[9] != ' ' && p[9] != '2'))
+			continue;
+
+		hash = fnv_64a_buf((void *)line, len, hash);
+	}
+
+	/* 0 means "not computed" */
+	return hash ? hash : 1;
+}
+
+static ino_t cg_current_mntns(void)
+{
+	struct stat st;
+
+	if (stat("/proc/self/ns/mnt", &st) < 0)
+		return 0;
+
+	return st.st_ino;
+}
+
 static bool cg_init(void)
 {
 	int ret;
+	bool bret;
 	const char *tmp;
+	char *mountinfo;
 
 	errno = 0;
 	tmp = lxc_global_config_value("lxc.cgroup.use");
@@ -1442,14 +1521,188 @@ static bool cg_init(void)
 	}
 	cgroup_use = must_copy_string(tmp);
 
+	mountinfo = read_file("/proc/self/mountinfo");
+	if (!mountinfo) {
+		CGFSNG_DEBUG("Failed to read \"/proc/self/mountinfo\"\n");
+		return false;
+	}
+	cg_topology.mntns = cg_current_mntns();
+	cg_topology.hash = cg_mountinfo_hash(mountinfo);
+
 	ret = cg_unified_init();
-	if (ret < 0)
+	if (ret < 0) {
+		free(mountinfo);
 		return false;
+	}
 
-	if (ret == CGROUP2_SUPER_MAGIC)
+	if (ret == CGROUP2_SUPER_MAGIC) {
+		free(mountinfo);
 		return true;
+	}
 
-	return cg_hybrid_init();
+	bret = cg_hybrid_init(mountinfo);
+	free(mountinfo);
+
+	return bret;
+}
+
+/* Hash the cgroup mounts read from the mountinfo fd @fd. */
+static bool cg_mountinfo_fd_hash(int fd, uint64_t *hash)
+{
+	char *buf, *tmp;
+	size_t len = 0, size = 8192;
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return false;
+
+	buf = malloc(size);
+	if (!buf)
+		return false;
+
+	for (;;) {
+		ret = read(fd, buf + len, size - len - 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			free(buf);
+			return false;
+		}
+		if (ret == 0)
+			break;
+
+		len += ret;
+		if (len == size - 1) {
+			size *= 2;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				return false;
+			}
+			buf = tmp;
+		}
+	}
+	buf[len] = '\0';
+
+	*hash = cg_mountinfo_hash(buf);
+	free(buf);
+	return true;
+}
+
+/* Whether cg_topology.fd is still the mountinfo fd this process opened. After
+ * a fork it may have been closed by lxc_check_inherited() and its number
+ * reused, so it is only ever forgotten, never closed.
+ */
+static bool cg_topology_fd_valid(void)
+{
+	struct stat st;
+
+	if (cg_topology.fd < 0 || cg_topology.pid != getpid())
+		return false;
+
+	if (fstat(cg_topology.fd, &st) < 0)
+		return false;
+
+	return st.st_dev == cg_topology.dev && st.st_ino == cg_topology.ino;
+}
+
+/* Check whether the hierarchies discovered by cg_init() are out of date. The
+ * mount table is only hashed again when it changed or once per process.
+ */
+static bool cg_topology_stale(void)
+{
+	struct pollfd pfd;
+	struct stat st;
+	uint64_t hash;
+
+	if (cg_topology.mntns != cg_current_mntns()) {
+		DEBUG("Mount namespace changed since cgroup discovery");
+		return true;
+	}
+
+	if (cg_topology_fd_valid()) {
+		pfd.fd = cg_topology.fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) == 0)
+			return false;
+	} else {
+		cg_topology.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (cg_topology.fd < 0)
+			return false;
+
+		if (fstat(cg_topology.fd, &st) < 0) {
+			close(cg_topology.fd);
+			cg_topology.fd = -1;
+			return false;
+		}
+		cg_topology.pid = getpid();
+		cg_topology.dev = st.st_dev;
+		cg_topology.ino = st.st_ino;
+	}
+
+	if (!cg_mountinfo_fd_hash(cg_topology.fd, &hash) ||
+	    hash == cg_topology.hash)
+		return false;
+
+	DEBUG("Cgroup mounts changed since cgroup discovery");
+	return true;
+}
+
+static void free_hierarchies(void)
+{
+	int i;
+
+	if (!hierarchies)
+		return;
+
+	for (i = 0; hierarchies[i]; i++) {
+		free_string_list(hierarchies[i]->controllers);
+		free(hierarchies[i]->mountpoint);
+		free(hierarchies[i]->base_cgroup);
+		free(hierarchies[i]->fullcgpath);
+		free(hierarchies[i]);
+	}
+	free(hierarchies);
+
+	hierarchies = NULL;
+	unified = NULL;
+}
+
+/* Take a reference to the hierarchies for a new handler, rediscovering them
+ * first if they are out of date and no other handler is using them. Callers
+ * of cgfsng_get_hierarchies() only hold pointers into them while they have a
+ * handler, so the previous ones can be freed at that point.
+ */
+static bool cg_topology_get(void)
+{
+	bool bret = true;
+
+	pthread_mutex_lock(&cg_topology_mutex);
+
+	if (cg_topology.users == 0 && cg_topology_stale()) {
+		free_hierarchies();
+		cgroup_layout = CGROUP_LAYOUT_UNKNOWN;
+		free(cgroup_use);
+		cgroup_use = NULL;
+
+		bret = cg_init();
+		if (!bret)
+			ERROR("Failed to rediscover cgroup hierarchies");
+	}
+
+	if (bret)
+		cg_topology.users++;
+
+	pthread_mutex_unlock(&cg_topology_mutex);
+	return bret;
+}
+
+static void cg_topology_put(void)
+{
+	pthread_mutex_lock(&cg_topology_mutex);
+	cg_topology.users--;
+	pthread_mutex_unlock(&cg_topology_mutex);
 }
 
 static void *cgfsng_init(struct lxc_handler *handler)
@@ -1457,6 +1710,9 @@ static void *cgfsng_init(struct lxc_handler *handler)
 	const char *cgroup_pattern;
 	struct cgfsng_handler_data *d;
 
+	if (!cg_topology_get())
+		return NULL;
+
 	d = must_alloc(sizeof(*d));
 	memset(d, 0, sizeof(*d));
 
@@ -2209,43 +2465,94 @@ on_error:
 	return retval;
 }
 
-static int recursive_count_nrtasks(char *dirname)
+/* Count the newline-terminated entries in the file open at @fd. */
+static int count_fd_lines(int fd)
+{
+	ssize_t ret;
+	int n = 0;
+	char buf[4096];
+
+	for (;;) {
+		char *p;
+
+		ret = lxc_read_nointr(fd, buf, sizeof(buf));
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0)
+			break;
+
+		for (p = buf; (p = memchr(p, '\n', buf + ret - p)); p++)
+			n++;
+	}
+
+	return n;
+}
+
+/* Return whether the cgroup open at @cgfd is populated according to its
+ * "cgroup.events" file. Legacy hierarchies don't have that file so they are
+ * always treated as populated.
+ */
+static bool cgroup_subtree_populated(int cgfd)
+{
+	int fd, ret;
+
+	fd = openat(cgfd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	ret = cg_events_populated(fd);
+	close(fd);
+	return ret != 0;
+}
+
+/* Count the tasks in the cgroup open at @cgfd and all of its descendants.
+ * Takes ownership of @cgfd. On the unified hierarchy, subtrees which report
+ * "populated 0" are skipped without being walked.
+ */
+static int recursive_count_nrtasks(int cgfd, bool unified_hierarchy)
 {
 	struct dirent *direntp;
 	DIR *dir;
-	int count = 0, ret;
-	char *path;
+	int fd, count = 0, ret;
 
-	dir = opendir(dirname);
-	if (!dir)
-		return 0;
+	fd = openat(cgfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ret = count_fd_lines(fd);
+		close(fd);
+		if (ret > 0)
+			count += ret;
+	}
+
+	dir = fdopendir(cgfd);
+	if (!dir) {
+		close(cgfd);
+		return count;
+	}
 
 	while ((direntp = readdir(dir))) {
-		struct stat mystat;
+		int childfd;
 
 		if (!strcmp(direntp->d_name, ".") ||
 		    !strcmp(direntp->d_name, ".."))
 			continue;
 
-		path = must_make_path(dirname, direntp->d_name, NULL);
+		if (direntp->d_type != DT_DIR && direntp->d_type != DT_UNKNOWN)
+			continue;
 
-		if (lstat(path, &mystat))
-			goto next;
+		childfd = openat(dirfd(dir), direntp->d_name,
+				 O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+		if (childfd < 0)
+			continue;
 
-		if (!S_ISDIR(mystat.st_mode))
-			goto next;
+		if (unified_hierarchy && !cgroup_subtree_populated(childfd)) {
+			close(childfd);
+			continue;
+		}
 
-		count += recursive_count_nrtasks(path);
-	next:
-		free(path);
+		count += recursive_count_nrtasks(childfd, unified_hierarchy);
 	}
 
-	path = must_make_path(dirname, "cgroup.procs", NULL);
-	ret = lxc_count_file_lines(path);
-	if (ret != -1)
-		count += ret;
-	free(path);
-
 	(void)closedir(dir);
 
 	return count;
@@ -2253,17 +2560,26 @@ static int recursive_count_nrtasks(char *dirname)
 
 static int cgfsng_nrtasks(void *hdata)
 {
-	int count;
-	char *path;
+	int fd;
+	bool unified_hierarchy;
 	struct cgfsng_handler_data *d = hdata;
 
-	if (!d || !d->container_cgroup || !hierarchies)
+	if (!d || !d->container_cgroup || !hierarchies ||
+	    !hierarchies[0]->fullcgpath)
 		return -1;
 
-	path = must_make_path(hierarchies[0]->fullcgpath, NULL);
-	count = recursive_count_nrtasks(path);
-	free(path);
-	return count;
+	fd = open(hierarchies[0]->fullcgpath,
+		  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	unified_hierarchy = hierarchies[0]->version == CGROUP2_SUPER_MAGIC;
+	if (unified_hierarchy && !cgroup_subtree_populated(fd)) {
+		close(fd);
+		return 0;
+	}
+
+	return recursive_count_nrtasks(fd, unified_hierarchy);
 }
 
 /* Only root needs to escape to the cgroup of its init. */
@@ -2519,6 +2835,58 @@ static int cgfsng_get(const char *filename, char *value, size_t len,
 	return ret;
 }
 
+/* Return the type of the hierarchy @controller is bound to, i.e.
+ * CGROUP_SUPER_MAGIC or CGROUP2_SUPER_MAGIC. A NULL @controller refers to the
+ * unified hierarchy.
+ */
+static int cgfsng_hierarchy_version(const char *controller)
+{
+	struct hierarchy *h;
+
+	if (!controller)
+		return unified ? CGROUP2_SUPER_MAGIC : -1;
+
+	h = get_hierarchy(controller);
+	if (!h)
+		return -1;
+
+	return h->version;
+}
+
+/* Called externally (e.g. from the cgroup stats code) to retrieve the absolute
+ * path of a running container's cgroup on the hierarchy @controller is bound
+ * to. A NULL @controller refers to the unified hierarchy. The caller must free
+ * the returned path.
+ */
+static char *cgfsng_get_cgroup_dir(const char *name, const char *lxcpath,
+				   const char *controller)
+{
+	char *fullpath, *path;
+	struct hierarchy *h;
+
+	if (controller) {
+		h = get_hierarchy(controller);
+	} else {
+		/* The monitor looks up the unified hierarchy by one of its
+		 * controllers unless it is empty.
+		 */
+		h = unified;
+		if (h && h->controllers)
+			controller = h->controllers[0];
+	}
+	if (!h)
+		return NULL;
+
+	path = lxc_cmd_get_cgroup_path(name, lxcpath, controller);
+	/* not running */
+	if (!path)
+		return NULL;
+
+	fullpath = build_full_cgpath_from_monitorpath(h, path, NULL);
+	free(path);
+	return fullpath;
+}
+
 /* Called externally (i.e. from 'lxc-cgroup') to set new cgroup limits.  Here we
  * don't have a cgroup_data set up, so we ask the running container through the
  * commands API for the cgroup path.
@@ -2761,6 +3129,8 @@ static struct cgroup_ops cgfsng_ops = {
 	.chown = cgfsng_chown,
 	.mount_cgroup = cgfsng_mount,
 	.nrtasks = cgfsng_nrtasks,
+	.hierarchy_version = cgfsng_hierarchy_version,
+	.get_cgroup_dir = cgfsng_get_cgroup_dir,
 	.driver = CGFSNG,
 
 	/* unsupported */
@@ -184,6 +184,23 @@ int cgroup_nrtasks(struct lxc_handler *handler)
 	return -1;
 }
 
+int cgroup_hierarchy_version(const char *controller)
+{
+	if (ops && ops->hierarchy_version)
+		return ops->hierarchy_version(controller);
+
+	return -1;
+}
+
+char *cgroup_get_cgroup_dir(const char *name, const char *lxcpath,
+			    const char *controller)
+{
+	if (ops && ops->get_cgroup_dir)
+		return ops->get_cgroup_dir(name, lxcpath, controller);
+
+	return NULL;
+}
+
 bool cgroup_attach(const char *name, const char *lxcpath, pid_t pid)
 {
 	if (ops)
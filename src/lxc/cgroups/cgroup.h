@@ -65,6 +65,8 @@ struct cgroup_ops {
 	bool (*attach)(const char *name, const char *lxcpath, pid_t pid);
 	bool (*mount_cgroup)(void *hdata, const char *root, int type);
 	int (*nrtasks)(void *hdata);
+	int (*hierarchy_version)(const char *controller);
+	char *(*get_cgroup_dir)(const char *name, const char *lxcpath, const char *controller);
 	void (*disconnect)(void);
 	cgroup_driver_t driver;
 };
@@ -80,6 +82,9 @@ extern bool cgroup_enter(struct lxc_handler *handler);
 extern void cgroup_cleanup(struct lxc_handler *handler);
 extern bool cgroup_create_legacy(struct lxc_handler *handler);
 extern int cgroup_nrtasks(struct lxc_handler *handler);
+extern int cgroup_hierarchy_version(const char *controller);
+extern char *cgroup_get_cgroup_dir(const char *name, const char *lxcpath,
+				   const char *controller);
 extern const char *cgroup_get_cgroup(struct lxc_handler *handler,
 				     const char *subsystem);
 extern bool cgroup_escape();
@@ -0,0 +1,406 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "cgroup_stats.h"
+#include "utils.h"
+
+/* Initial size of the buffer keyed files like "memory.stat" and "io.stat" are
+ * read into. It is grown when a file doesn't fit.
+ */
+#define STATS_BUFSIZE 4096
+
+/* @path is borrowed from cgroup_stats_handle->unified_path if @unified is
+ * true.
+ */
+struct cgroup_stats_dir {
+	char *path;
+	bool unified;
+};
+
+struct cgroup_stats_handle {
+	char *unified_path;
+	struct cgroup_stats_dir cpu;
+	struct cgroup_stats_dir mem;
+	struct cgroup_stats_dir io;
+	struct cgroup_stats_dir pids;
+	char *buf;
+	size_t buf_size;
+};
+
+/* Prefer the legacy controller @v1 if it is mounted. Otherwise use the
+ * unified hierarchy if @v2 is enabled there. A NULL @v2 refers to files every
+ * cgroup on the unified hierarchy has, like "cpu.stat".
+ */
+static void stats_dir_resolve(struct cgroup_stats_handle *h,
+			      struct cgroup_stats_dir *dir, const char *name,
+			      const char *lxcpath, const char *v1,
+			      const char *v2)
+{
+	if (cgroup_hierarchy_version(v1) == CGROUP_SUPER_MAGIC) {
+		dir->path = cgroup_get_cgroup_dir(name, lxcpath, v1);
+		dir->unified = false;
+		return;
+	}
+
+	if (!h->unified_path)
+		return;
+
+	if (v2 && cgroup_hierarchy_version(v2) != CGROUP2_SUPER_MAGIC)
+		return;
+
+	dir->path = h->unified_path;
+	dir->unified = true;
+}
+
+struct cgroup_stats_handle *cgroup_stats_open(const char *name,
+					      const char *lxcpath)
+{
+	struct cgroup_stats_handle *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return NULL;
+	memset(h, 0, sizeof(*h));
+
+	if (cgroup_hierarchy_version(NULL) == CGROUP2_SUPER_MAGIC)
+		h->unified_path = cgroup_get_cgroup_dir(name, lxcpath, NULL);
+
+	stats_dir_resolve(h, &h->cpu, name, lxcpath, "cpuacct", NULL);
+	stats_dir_resolve(h, &h->mem, name, lxcpath, "memory", "memory");
+	stats_dir_resolve(h, &h->io, name, lxcpath, "blkio", "io");
+	stats_dir_resolve(h, &h->pids, name, lxcpath, "pids", "pids");
+
+	if (!h->cpu.path && !h->mem.path && !h->io.path && !h->pids.path) {
+		cgroup_stats_close(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static void stats_dir_free(struct cgroup_stats_dir *dir)
+{
+	if (!dir->unified)
+		free(dir->path);
+	dir->path = NULL;
+}
+
+void cgroup_stats_close(struct cgroup_stats_handle *h)
+{
+	if (!h)
+		return;
+
+	stats_dir_free(&h->cpu);
+	stats_dir_free(&h->mem);
+	stats_dir_free(&h->io);
+	stats_dir_free(&h->pids);
+	free(h->unified_path);
+	free(h->buf);
+	free(h);
+}
+
+/* Read @file below @dir into @buf and NUL-terminate it. Anything that doesn't
+ * fit into @size is cut off.
+ */
+static ssize_t stats_read_file(const char *dir, const char *file, char *buf,
+			       size_t size)
+{
+	int fd, ret;
+	ssize_t bytes;
+	size_t len = 0;
+	char path[PATH_MAX];
+
+	ret = snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	while (len < size - 1) {
+		bytes = lxc_read_nointr(fd, buf + len, size - 1 - len);
+		if (bytes < 0) {
+			close(fd);
+			return -1;
+		}
+
+		if (bytes == 0)
+			break;
+
+		len += bytes;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* Read all of @file below @dir into h->buf and NUL-terminate it. The buffer is
+ * kept across calls and grown as needed.
+ */
+static ssize_t stats_read_all(struct cgroup_stats_handle *h, const char *dir,
+			      const char *file)
+{
+	int fd, ret;
+	ssize_t bytes;
+	size_t len = 0;
+	char path[PATH_MAX];
+
+	ret = snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	for (;;) {
+		if (h->buf_size - len < 2) {
+			size_t size = h->buf_size ? h->buf_size * 2 : STATS_BUFSIZE;
+			char *buf;
+
+			buf = realloc(h->buf, size);
+			if (!buf) {
+				close(fd);
+				return -1;
+			}
+			h->buf = buf;
+			h->buf_size = size;
+		}
+
+		bytes = lxc_read_nointr(fd, h->buf + len, h->buf_size - 1 - len);
+		if (bytes < 0) {
+			close(fd);
+			return -1;
+		}
+
+		if (bytes == 0)
+			break;
+
+		len += bytes;
+	}
+	close(fd);
+	h->buf[len] = '\0';
+
+	return len;
+}
+
+static bool stats_parse_u64(const char *s, uint64_t *val)
+{
+	char *end;
+
+	if (strncmp(s, "max", 3) == 0) {
+		*val = UINT64_MAX;
+		return true;
+	}
+
+	errno = 0;
+	*val = strtoull(s, &end, 10);
+	return errno == 0 && end != s;
+}
+
+static bool stats_read_u64(const char *dir, const char *file, uint64_t *val)
+{
+	char buf[64];
+
+	if (stats_read_file(dir, file, buf, sizeof(buf)) <= 0)
+		return false;
+
+	return stats_parse_u64(buf, val);
+}
+
+/* Find the "<key> <value>" line for @key in a flat keyed file like
+ * "cpu.stat" or "memory.stat".
+ */
+static bool stats_get_key(const char *buf, const char *key, uint64_t *val)
+{
+	size_t keylen = strlen(key);
+	const char *line = buf;
+
+	while (line && *line) {
+		if (strncmp(line, key, keylen) == 0 && line[keylen] == ' ')
+			return stats_parse_u64(line + keylen + 1, val);
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return false;
+}
+
+static void stats_read_cpu(struct cgroup_stats_handle *h,
+			   struct lxc_cgroup_stats *stats)
+{
+	uint64_t val;
+	const struct cgroup_stats_dir *dir = &h->cpu;
+
+	if (dir->unified) {
+		if (stats_read_all(h, dir->path, "cpu.stat") <= 0)
+			return;
+
+		if (!stats_get_key(h->buf, "usage_usec", &val))
+			return;
+		stats->cpu_use_nanos = val * 1000;
+
+		if (stats_get_key(h->buf, "user_usec", &val))
+			stats->cpu_user_nanos = val * 1000;
+
+		if (stats_get_key(h->buf, "system_usec", &val))
+			stats->cpu_sys_nanos = val * 1000;
+	} else {
+		long ticks;
+
+		if (!stats_read_u64(dir->path, "cpuacct.usage", &stats->cpu_use_nanos))
+			return;
+
+		ticks = sysconf(_SC_CLK_TCK);
+		if (ticks > 0 &&
+		    stats_read_all(h, dir->path, "cpuacct.stat") > 0) {
+			if (stats_get_key(h->buf, "user", &val))
+				stats->cpu_user_nanos = val * (1000000000 / ticks);
+
+			if (stats_get_key(h->buf, "system", &val))
+				stats->cpu_sys_nanos = val * (1000000000 / ticks);
+		}
+	}
+
+	stats->valid |= LXC_CGROUP_STATS_CPU;
+}
+
+static void stats_read_mem(struct cgroup_stats_handle *h,
+			   struct lxc_cgroup_stats *stats)
+{
+	uint64_t val;
+	const struct cgroup_stats_dir *dir = &h->mem;
+
+	if (dir->unified) {
+		static const char *const kernel_keys[] = {
+			"kernel_stack", "slab", "sock", "percpu", NULL,
+		};
+		int i;
+
+		if (!stats_read_u64(dir->path, "memory.current", &stats->mem_used))
+			return;
+		stats->valid |= LXC_CGROUP_STATS_MEM;
+		stats_read_u64(dir->path, "memory.max", &stats->mem_limit);
+
+		if (stats_read_all(h, dir->path, "memory.stat") <= 0)
+			return;
+
+		/* Newer kernels sum up all kernel memory for us. */
+		if (!stats_get_key(h->buf, "kernel", &stats->kmem_used)) {
+			for (i = 0; kernel_keys[i]; i++)
+				if (stats_get_key(h->buf, kernel_keys[i], &val))
+					stats->kmem_used += val;
+		}
+		stats->valid |= LXC_CGROUP_STATS_KMEM;
+	} else {
+		if (!stats_read_u64(dir->path, "memory.usage_in_bytes", &stats->mem_used))
+			return;
+		stats->valid |= LXC_CGROUP_STATS_MEM;
+		stats_read_u64(dir->path, "memory.limit_in_bytes", &stats->mem_limit);
+
+		if (!stats_read_u64(dir->path, "memory.kmem.usage_in_bytes", &stats->kmem_used))
+			return;
+		stats->valid |= LXC_CGROUP_STATS_KMEM;
+		stats_read_u64(dir->path, "memory.kmem.limit_in_bytes", &stats->kmem_limit);
+	}
+}
+
+static void stats_read_io(struct cgroup_stats_handle *h,
+			  struct lxc_cgroup_stats *stats)
+{
+	char *line, *saveptr = NULL;
+	const struct cgroup_stats_dir *dir = &h->io;
+
+	if (stats_read_all(h, dir->path,
+			   dir->unified ? "io.stat" : "blkio.throttle.io_service_bytes") < 0)
+		return;
+
+	for (line = strtok_r(h->buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		uint64_t val;
+		char *tok, *tokptr = NULL;
+
+		if (dir->unified) {
+			/* <maj>:<min> rbytes=<n> wbytes=<n> rios=<n> ... */
+			for (tok = strtok_r(line, " ", &tokptr); tok;
+			     tok = strtok_r(NULL, " ", &tokptr)) {
+				if (strncmp(tok, "rbytes=", 7) == 0 &&
+				    stats_parse_u64(tok + 7, &val))
+					stats->io_read_bytes += val;
+				else if (strncmp(tok, "wbytes=", 7) == 0 &&
+					 stats_parse_u64(tok + 7, &val))
+					stats->io_write_bytes += val;
+			}
+			continue;
+		}
+
+		/* <maj>:<min> <Read|Write|Sync|Async|Total> <n> */
+		tok = strchr(line, ' ');
+		if (!tok)
+			continue;
+		tok++;
+
+		if (strncmp(tok, "Read ", 5) == 0 &&
+		    stats_parse_u64(tok + 5, &val))
+			stats->io_read_bytes += val;
+		else if (strncmp(tok, "Write ", 6) == 0 &&
+			 stats_parse_u64(tok + 6, &val))
+			stats->io_write_bytes += val;
+	}
+
+	stats->valid |= LXC_CGROUP_STATS_IO;
+}
+
+int cgroup_stats_read(struct cgroup_stats_handle *h,
+		      struct lxc_cgroup_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (h->cpu.path)
+		stats_read_cpu(h, stats);
+
+	if (h->mem.path)
+		stats_read_mem(h, stats);
+
+	if (h->io.path)
+		stats_read_io(h, stats);
+
+	if (h->pids.path &&
+	    stats_read_u64(h->pids.path, "pids.current", &stats->pids_current))
+		stats->valid |= LXC_CGROUP_STATS_PIDS;
+
+	return stats->valid ? 0 : -1;
+}
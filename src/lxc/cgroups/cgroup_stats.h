@@ -0,0 +1,88 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __LXC_CGROUP_STATS_H
+#define __LXC_CGROUP_STATS_H
+
+#include <stdint.h>
+
+#define LXC_CGROUP_STATS_CPU  (1 << 0)
+#define LXC_CGROUP_STATS_MEM  (1 << 1)
+#define LXC_CGROUP_STATS_KMEM (1 << 2)
+#define LXC_CGROUP_STATS_IO   (1 << 3)
+#define LXC_CGROUP_STATS_PIDS (1 << 4)
+
+/* Resource usage of a container's cgroup, normalized across the legacy and
+ * the unified hierarchy.
+ *
+ * @valid
+ * - Bitmask of LXC_CGROUP_STATS_* flags for the groups of members that could
+ *   be read. All other members are zero.
+ *
+ * @cpu_use_nanos, @cpu_user_nanos, @cpu_sys_nanos
+ * - "cpuacct.usage" and "cpuacct.stat" or "cpu.stat" in nanoseconds.
+ *
+ * @mem_used, @mem_limit
+ * - "memory.usage_in_bytes" and "memory.limit_in_bytes" or "memory.current"
+ *   and "memory.max". A limit of "max" is reported as UINT64_MAX.
+ *
+ * @kmem_used, @kmem_limit
+ * - "memory.kmem.usage_in_bytes" and "memory.kmem.limit_in_bytes" or the
+ *   kernel memory accounted in "memory.stat". The unified hierarchy has no
+ *   separate kernel memory limit so @kmem_limit is zero there.
+ *
+ * @io_read_bytes, @io_write_bytes
+ * - Sum over all devices of "blkio.throttle.io_service_bytes" or "io.stat".
+ *
+ * @pids_current
+ * - "pids.current".
+ */
+struct lxc_cgroup_stats {
+	unsigned int valid;
+	uint64_t cpu_use_nanos;
+	uint64_t cpu_user_nanos;
+	uint64_t cpu_sys_nanos;
+	uint64_t mem_used;
+	uint64_t mem_limit;
+	uint64_t kmem_used;
+	uint64_t kmem_limit;
+	uint64_t io_read_bytes;
+	uint64_t io_write_bytes;
+	uint64_t pids_current;
+};
+
+struct cgroup_stats_handle;
+
+/* Resolve the cgroup directories of the running container @name once. This
+ * costs one command round-trip per hierarchy. Returns NULL if the container is
+ * not running or the cgroup driver doesn't support direct access.
+ */
+extern struct cgroup_stats_handle *cgroup_stats_open(const char *name,
+						     const char *lxcpath);
+
+/* Read all statistics of the container described by @h into @stats with one
+ * read per file. Returns 0 if at least one group of statistics could be read
+ * and -1 otherwise, e.g. when the container has stopped in the meantime.
+ */
+extern int cgroup_stats_read(struct cgroup_stats_handle *h,
+			     struct lxc_cgroup_stats *stats);
+
+extern void cgroup_stats_close(struct cgroup_stats_handle *h);
+
+#endif /* __LXC_CGROUP_STATS_H */
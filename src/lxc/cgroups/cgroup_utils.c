@@ -114,3 +114,42 @@ bool test_writeable_v2(char *mountpoint, char *path)
 
 	return ret == 0;
 }
+
+/* Read the boolean @key of an open v2 "cgroup.events" file. */
+static int cg_events_get(int events_fd, const char *key)
+{
+	ssize_t ret;
+	char *p;
+	char buf[256];
+	size_t len = strlen(key);
+
+	ret = pread(events_fd, buf, sizeof(buf) - 1, 0);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+
+	for (p = buf; (p = strstr(p, key)); p += len)
+		if ((p == buf || *(p - 1) == '\n') && p[len] == ' ')
+			break;
+	if (!p)
+		return -1;
+
+	p += len + 1;
+	if (*p == '0')
+		return 0;
+
+	if (*p == '1')
+		return 1;
+
+	return -1;
+}
+
+int cg_events_populated(int events_fd)
+{
+	return cg_events_get(events_fd, "populated");
+}
+
+int cg_events_frozen(int events_fd)
+{
+	return cg_events_get(events_fd, "frozen");
+}
@@ -48,4 +48,17 @@ extern bool test_writeable_v1(char *mountpoint, char *path);
  */
 extern bool test_writeable_v2(char *mountpoint, char *path);
 
+/* Parse the "populated" key of an open v2 "cgroup.events" file. The file is
+ * re-read from offset 0, which also acknowledges a pending EPOLLPRI/POLLPRI
+ * notification. Returns 1 if the cgroup or one of its descendants contains a
+ * task, 0 if the subtree is empty and -1 on error.
+ */
+extern int cg_events_populated(int events_fd);
+
+/* Parse the "frozen" key of an open v2 "cgroup.events" file like
+ * cg_events_populated(). Returns 1 if the cgroup is frozen, 0 if it is not and
+ * -1 on error or if the kernel has no cgroup2 freezer.
+ */
+extern int cg_events_frozen(int events_fd);
+
 #endif /* __LXC_CGROUP_UTILS_H */
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <net/if.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
@@ -50,6 +51,7 @@
 #include "lxclock.h"
 #include "mainloop.h"
 #include "monitor.h"
+#include "network.h"
 #include "start.h"
 #include "utils.h"
 
@@ -96,6 +98,8 @@ static const char *lxc_cmd_str(lxc_cmd_t cmd)
 		[LXC_CMD_ADD_STATE_CLIENT]    = "add_state_client",
 		[LXC_CMD_CONSOLE_LOG]         = "console_log",
 		[LXC_CMD_SERVE_STATE_CLIENTS] = "serve_state_clients",
+		[LXC_CMD_GET_NET_ADDRS]       = "get_net_addrs",
+		[LXC_CMD_SUBSCRIBE_NET_ADDRS] = "subscribe_net_addrs",
 	};
 
 	if (cmd >= LXC_CMD_MAX)
@@ -160,6 +164,13 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 		rsp->data = rspdata;
 	}
 
+	if (cmd->req.cmd == LXC_CMD_SUBSCRIBE_NET_ADDRS) {
+		if (rsp->ret == 0 && rspfd < 0)
+			rsp->ret = -EBADF;
+
+		rsp->data = INT_TO_PTR(rspfd);
+	}
+
 	if (rsp->datalen == 0) {
 		DEBUG("Response data length for command \"%s\" is 0",
 		      lxc_cmd_str(cmd->req.cmd));
@@ -976,6 +987,139 @@ reap_client_fd:
 	return 1;
 }
 
+/*
+ * lxc_cmd_get_net_addrs: Get the interfaces and addresses in the container's
+ * network namespace
+ *
+ * @name     : name of container to connect to
+ * @lxcpath  : the lxcpath in which the container is running
+ * @addrs    : set to an array of records which the caller must free()
+ *
+ * Returns the number of records on success, < 0 on failure
+ */
+int lxc_cmd_get_net_addrs(const char *name, const char *lxcpath,
+			  struct lxc_netaddr **addrs)
+{
+	int ret, stopped;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_GET_NET_ADDRS },
+	};
+
+	*addrs = NULL;
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath, NULL);
+	if (ret < 0)
+		return -1;
+
+	if (cmd.rsp.ret < 0)
+		return cmd.rsp.ret;
+
+	if (cmd.rsp.datalen <= 0)
+		return 0;
+
+	if (cmd.rsp.datalen % sizeof(struct lxc_netaddr)) {
+		free(cmd.rsp.data);
+		return -EINVAL;
+	}
+
+	*addrs = cmd.rsp.data;
+	return cmd.rsp.datalen / sizeof(struct lxc_netaddr);
+}
+
+static int lxc_cmd_get_net_addrs_callback(int fd, struct lxc_cmd_req *req,
+					  struct lxc_handler *handler)
+{
+	int n, ret;
+	struct lxc_netaddr *addrs = NULL;
+	struct lxc_cmd_rsp rsp = {0};
+
+	if (handler->netnsfd < 0) {
+		rsp.ret = -EOPNOTSUPP;
+		return lxc_cmd_rsp_send(fd, &rsp);
+	}
+
+	if (handler->netns_rtnl_fd < 0) {
+		handler->netns_rtnl_fd = lxc_netns_rtnl_open(handler->netnsfd, false);
+		if (handler->netns_rtnl_fd < 0) {
+			TRACE("Failed to open netlink socket in network namespace: %s",
+			      strerror(-handler->netns_rtnl_fd));
+			rsp.ret = handler->netns_rtnl_fd;
+			handler->netns_rtnl_fd = -EBADF;
+			return lxc_cmd_rsp_send(fd, &rsp);
+		}
+	}
+
+	n = lxc_netns_get_addrs(handler->netns_rtnl_fd, &addrs);
+	if (n < 0) {
+		/* Start over with a new socket on the next request. */
+		close(handler->netns_rtnl_fd);
+		handler->netns_rtnl_fd = -EBADF;
+		rsp.ret = n;
+	} else if ((size_t)n * sizeof(*addrs) > LXC_CMD_DATA_MAX) {
+		rsp.ret = -E2BIG;
+	} else {
+		rsp.data = addrs;
+		rsp.datalen = n * sizeof(*addrs);
+	}
+
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(addrs);
+	return ret;
+}
+
+/*
+ * lxc_cmd_subscribe_net_addrs: Get a netlink socket in the container's network
+ * namespace which receives RTM_NEWADDR and RTM_DELADDR notifications
+ *
+ * @name     : name of container to connect to
+ * @lxcpath  : the lxcpath in which the container is running
+ *
+ * Returns the socket on success, < 0 on failure
+ */
+int lxc_cmd_subscribe_net_addrs(const char *name, const char *lxcpath)
+{
+	int ret, stopped;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_SUBSCRIBE_NET_ADDRS },
+	};
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath, NULL);
+	if (ret < 0)
+		return -1;
+
+	if (cmd.rsp.ret < 0)
+		return cmd.rsp.ret;
+
+	return PTR_TO_INT(cmd.rsp.data);
+}
+
+static int lxc_cmd_subscribe_net_addrs_callback(int fd, struct lxc_cmd_req *req,
+						struct lxc_handler *handler)
+{
+	int ret, nlfd;
+	struct lxc_cmd_rsp rsp = {0};
+
+	if (handler->netnsfd < 0) {
+		rsp.ret = -EOPNOTSUPP;
+		return lxc_cmd_rsp_send(fd, &rsp);
+	}
+
+	nlfd = lxc_netns_rtnl_open(handler->netnsfd, true);
+	if (nlfd < 0) {
+		rsp.ret = nlfd;
+		return lxc_cmd_rsp_send(fd, &rsp);
+	}
+
+	ret = lxc_abstract_unix_send_fds(fd, &nlfd, 1, &rsp, sizeof(rsp));
+	close(nlfd);
+	if (ret < 0) {
+		ERROR("Failed to send netlink socket to client");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 			   struct lxc_handler *handler)
 {
@@ -995,6 +1139,8 @@ static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 		[LXC_CMD_ADD_STATE_CLIENT]    = lxc_cmd_add_state_client_callback,
 		[LXC_CMD_CONSOLE_LOG]         = lxc_cmd_console_log_callback,
 		[LXC_CMD_SERVE_STATE_CLIENTS] = lxc_cmd_serve_state_clients_callback,
+		[LXC_CMD_GET_NET_ADDRS]       = lxc_cmd_get_net_addrs_callback,
+		[LXC_CMD_SUBSCRIBE_NET_ADDRS] = lxc_cmd_subscribe_net_addrs_callback,
 	};
 
 	if (req->cmd >= LXC_CMD_MAX) {
@@ -57,6 +57,8 @@ typedef enum {
 	LXC_CMD_ADD_STATE_CLIENT,
 	LXC_CMD_CONSOLE_LOG,
 	LXC_CMD_SERVE_STATE_CLIENTS,
+	LXC_CMD_GET_NET_ADDRS,
+	LXC_CMD_SUBSCRIBE_NET_ADDRS,
 	LXC_CMD_MAX,
 } lxc_cmd_t;
 
@@ -118,6 +120,30 @@ extern int lxc_cmd_add_state_client(const char *name, const char *lxcpath,
 extern int lxc_cmd_serve_state_clients(const char *name, const char *lxcpath,
 				       lxc_state_t state);
 
+struct lxc_netaddr;
+
+/* lxc_cmd_get_net_addrs       Retrieve the interfaces and addresses in the
+ *                             container's network namespace from the monitor
+ *                             without forking.
+ *
+ * @param[in] name             Name of container to connect to.
+ * @param[in] lxcpath          The lxcpath in which the container is running.
+ * @param[out] addrs           Array of records, see struct lxc_netaddr. Must
+ *                             be freed by the caller.
+ * @return                     Number of records, < 0 on error.
+ */
+extern int lxc_cmd_get_net_addrs(const char *name, const char *lxcpath,
+				 struct lxc_netaddr **addrs);
+
+/* lxc_cmd_subscribe_net_addrs Retrieve a netlink socket in the container's
+ *                             network namespace subscribed to address changes.
+ *
+ * @param[in] name             Name of container to connect to.
+ * @param[in] lxcpath          The lxcpath in which the container is running.
+ * @return                     The socket, < 0 on error.
+ */
+extern int lxc_cmd_subscribe_net_addrs(const char *name, const char *lxcpath);
+
 struct lxc_epoll_descr;
 struct lxc_handler;
 
@@ -31,6 +31,7 @@
 #include <grp.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <linux/loop.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -82,6 +83,7 @@
 #include "namespace.h"
 #include "network.h"
 #include "parse.h"
+#include "profiler.h"
 #include "storage.h"
 #include "storage/aufs.h"
 #include "storage/overlay.h"
@@ -1207,6 +1209,9 @@ static int lxc_setup_rootfs(struct lxc_conf *conf)
 		return -1;
 	}
 
+	if (strcmp(bdev->type, "overlayfs") == 0)
+		bdev->ovl_tmpfs = rootfs->overlay_tmpfs;
+
 	ret = bdev->ops->mount(bdev);
 	storage_put(bdev);
 	if (ret < 0) {
@@ -1969,11 +1974,229 @@ static void cull_mntent_opt(struct mntent *mntent)
 	}
 }
 
+/* Directories known to exist below the rootfs while a batch of mount entries
+ * is processed. They are created with *at() calls relative to a single fd
+ * for the rootfs mount so every entry only pays for the components that are
+ * actually new instead of walking the full host path again.
+ */
+struct mount_dirs {
+	int dfd;
+	const char *base;
+	size_t base_len;
+	char **known;
+	size_t nr_known;
+	size_t capacity;
+};
+
+static void mount_dirs_init(struct mount_dirs *dirs,
+			    const struct lxc_rootfs *rootfs)
+{
+	memset(dirs, 0, sizeof(*dirs));
+	dirs->dfd = -EBADF;
+
+	if (!rootfs || !rootfs->path || !rootfs->mount)
+		return;
+
+	dirs->dfd = open(rootfs->mount, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+	if (dirs->dfd < 0)
+		return;
+
+	dirs->base = rootfs->mount;
+	dirs->base_len = strlen(rootfs->mount);
+	while (dirs->base_len > 1 && dirs->base[dirs->base_len - 1] == '/')
+		dirs->base_len--;
+}
+
+static void mount_dirs_fini(struct mount_dirs *dirs)
+{
+	size_t i;
+
+	for (i = 0; i < dirs->nr_known; i++)
+		free(dirs->known[i]);
+	free(dirs->known);
+
+	if (dirs->dfd >= 0)
+		close(dirs->dfd);
+	dirs->dfd = -EBADF;
+}
+
+/* Return @path relative to the rootfs fd or NULL if it is outside of it. */
+static const char *mount_dirs_relative(struct mount_dirs *dirs,
+				       const char *path)
+{
+	if (!dirs || dirs->dfd < 0)
+		return NULL;
+
+	if (strncmp(path, dirs->base, dirs->base_len) || path[dirs->base_len] != '/')
+		return NULL;
+
+	path += dirs->base_len;
+	path += strspn(path, "/");
+	if (*path == '\0')
+		return NULL;
+
+	return path;
+}
+
+static bool mount_dirs_known(struct mount_dirs *dirs, const char *rel,
+			     size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < dirs->nr_known; i++)
+		if (strlen(dirs->known[i]) == len &&
+		    !strncmp(dirs->known[i], rel, len))
+			return true;
+
+	return false;
+}
+
+static void mount_dirs_remember(struct mount_dirs *dirs, const char *rel,
+				size_t len)
+{
+	char *dir;
+
+	if (lxc_grow_array((void ***)&dirs->known, &dirs->capacity,
+			   dirs->nr_known + 1, 32) < 0)
+		return;
+
+	dir = strndup(rel, len);
+	if (!dir)
+		return;
+
+	dirs->known[dirs->nr_known++] = dir;
+}
+
+/* Something was mounted on @path so whatever we know about directories below
+ * it no longer holds.
+ */
+static void mount_dirs_forget(struct mount_dirs *dirs, const char *path)
+{
+	size_t i, len;
+	const char *rel;
+
+	rel = mount_dirs_relative(dirs, path);
+	if (!rel)
+		return;
+
+	len = strlen(rel);
+	for (i = 0; i < dirs->nr_known;) {
+		if (!strncmp(dirs->known[i], rel, len) && dirs->known[i][len] == '/') {
+			free(dirs->known[i]);
+			dirs->known[i] = dirs->known[--dirs->nr_known];
+			dirs->known[dirs->nr_known] = NULL;
+			continue;
+		}
+		i++;
+	}
+}
+
+/* Like mkdir_p() but relative to the rootfs fd when @path lies below it. If
+ * @parent_only is set the last path component is not created.
+ */
+static int mount_dirs_mkdir_p(struct mount_dirs *dirs, const char *path,
+			      bool parent_only)
+{
+	int ret;
+	char *copy;
+	const char *rel, *end, *cur;
+
+	rel = mount_dirs_relative(dirs, path);
+	if (!rel) {
+		char *p;
+
+		if (!parent_only)
+			return mkdir_p(path, 0755);
+
+		copy = strdup(path);
+		if (!copy)
+			return -1;
+
+		p = dirname(copy);
+		ret = mkdir_p(p, 0755);
+		free(copy);
+		return ret;
+	}
+
+	copy = strdup(rel);
+	if (!copy)
+		return -1;
+
+	end = copy + strlen(copy);
+	while (end > copy && *(end - 1) == '/')
+		end--;
+
+	if (parent_only) {
+		while (end > copy && *(end - 1) != '/')
+			end--;
+		while (end > copy && *(end - 1) == '/')
+			end--;
+	}
+
+	for (cur = copy; cur < end;) {
+		size_t len;
+
+		cur += strcspn(cur, "/");
+		if (cur > end)
+			cur = end;
+		len = cur - copy;
+
+		if (!mount_dirs_known(dirs, copy, len)) {
+			char c = copy[len];
+
+			copy[len] = '\0';
+			ret = mkdirat(dirs->dfd, copy, 0755);
+			copy[len] = c;
+			if (ret < 0 && errno != EEXIST) {
+				SYSERROR("Failed to create directory \"%s\"", path);
+				free(copy);
+				return -1;
+			}
+
+			mount_dirs_remember(dirs, copy, len);
+		}
+
+		cur += strspn(cur, "/");
+	}
+
+	free(copy);
+	return 0;
+}
+
+static int mount_dirs_create_file(struct mount_dirs *dirs, const char *path)
+{
+	int fd;
+	const char *rel;
+
+	rel = mount_dirs_relative(dirs, path);
+	if (rel)
+		fd = openat(dirs->dfd, rel, O_CREAT | O_CLOEXEC, 0644);
+	else
+		fd = open(path, O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	close(fd);
+	return 0;
+}
+
+static bool mount_dirs_exists(struct mount_dirs *dirs, const char *path)
+{
+	const char *rel;
+
+	rel = mount_dirs_relative(dirs, path);
+	if (rel)
+		return faccessat(dirs->dfd, rel, F_OK, 0) == 0;
+
+	return access(path, F_OK) == 0;
+}
+
 static int mount_entry_create_dir_file(const struct mntent *mntent,
 				       const char *path,
 				       const struct lxc_rootfs *rootfs,
 				       const char *lxc_name,
-				       const char *lxc_path)
+				       const char *lxc_path,
+				       struct mount_dirs *dirs)
 {
 	int ret = 0;
 
@@ -1985,34 +2208,22 @@ static int mount_entry_create_dir_file(const struct mntent *mntent,
 		return -1;
 
 	if (hasmntopt(mntent, "create=dir")) {
-		ret = mkdir_p(path, 0755);
+		ret = mount_dirs_mkdir_p(dirs, path, false);
 		if (ret < 0 && errno != EEXIST) {
 			SYSERROR("Failed to create directory \"%s\"", path);
 			return -1;
 		}
 	}
 
-	if (hasmntopt(mntent, "create=file") && access(path, F_OK)) {
-		int fd;
-		char *p1, *p2;
-
-		p1 = strdup(path);
-		if (!p1)
-			return -1;
-
-		p2 = dirname(p1);
-
-		ret = mkdir_p(p2, 0755);
-		free(p1);
+	if (hasmntopt(mntent, "create=file") && !mount_dirs_exists(dirs, path)) {
+		ret = mount_dirs_mkdir_p(dirs, path, true);
 		if (ret < 0 && errno != EEXIST) {
 			SYSERROR("Failed to create directory \"%s\"", path);
 			return -1;
 		}
 
-		fd = open(path, O_CREAT, 0644);
-		if (fd < 0)
+		if (mount_dirs_create_file(dirs, path) < 0)
 			return -1;
-		close(fd);
 	}
 
 	return 0;
@@ -2024,7 +2235,8 @@ static inline int mount_entry_on_generic(struct mntent *mntent,
 					 const char *path,
 					 const struct lxc_rootfs *rootfs,
 					 const char *lxc_name,
-					 const char *lxc_path)
+					 const char *lxc_path,
+					 struct mount_dirs *dirs)
 {
 	int ret;
 	unsigned long mntflags, pflags;
@@ -2039,7 +2251,7 @@ static inline int mount_entry_on_generic(struct mntent *mntent,
 		rootfs_path = rootfs->mount;
 
 	ret = mount_entry_create_dir_file(mntent, path, rootfs, lxc_name,
-					  lxc_path);
+					  lxc_path, dirs);
 	if (ret < 0) {
 		if (optional)
 			return 0;
@@ -2058,12 +2270,15 @@ static inline int mount_entry_on_generic(struct mntent *mntent,
 
 	ret = mount_entry(mntent->mnt_fsname, path, mntent->mnt_type, mntflags,
 			  pflags, mntdata, optional, dev, rootfs_path);
+	if (ret == 0)
+		mount_dirs_forget(dirs, path);
 
 	free(mntdata);
 	return ret;
 }
 
-static inline int mount_entry_on_systemfs(struct mntent *mntent)
+static inline int mount_entry_on_systemfs(struct mntent *mntent,
+					  struct mount_dirs *dirs)
 {
 	int ret;
 	char path[MAXPATHLEN];
@@ -2078,13 +2293,14 @@ static inline int mount_entry_on_systemfs(struct mntent *mntent)
 	if (ret < 0 || ret >= sizeof(path))
 		return -1;
 
-	return mount_entry_on_generic(mntent, path, NULL, NULL, NULL);
+	return mount_entry_on_generic(mntent, path, NULL, NULL, NULL, dirs);
 }
 
 static int mount_entry_on_absolute_rootfs(struct mntent *mntent,
 					  const struct lxc_rootfs *rootfs,
 					  const char *lxc_name,
-					  const char *lxc_path)
+					  const char *lxc_path,
+					  struct mount_dirs *dirs)
 {
 	int offset;
 	char *aux;
@@ -2122,13 +2338,15 @@ skipabs:
 	if (ret < 0 || ret >= MAXPATHLEN)
 		return -1;
 
-	return mount_entry_on_generic(mntent, path, rootfs, lxc_name, lxc_path);
+	return mount_entry_on_generic(mntent, path, rootfs, lxc_name, lxc_path,
+				      dirs);
 }
 
 static int mount_entry_on_relative_rootfs(struct mntent *mntent,
 					  const struct lxc_rootfs *rootfs,
 					  const char *lxc_name,
-					  const char *lxc_path)
+					  const char *lxc_path,
+					  struct mount_dirs *dirs)
 {
 	char path[MAXPATHLEN];
 	int ret;
@@ -2140,7 +2358,8 @@ static int mount_entry_on_relative_rootfs(struct mntent *mntent,
 		return -1;
 	}
 
-	return mount_entry_on_generic(mntent, path, rootfs, lxc_name, lxc_path);
+	return mount_entry_on_generic(mntent, path, rootfs, lxc_name, lxc_path,
+				      dirs);
 }
 
 /* This logs a NOTICE() when a user specifies mounts that would conflict with
@@ -2211,32 +2430,53 @@ static void log_notice_on_conflict(const struct lxc_conf *conf, const char *src,
 	free(clean_mnt_fsname);
 }
 
+static int mount_one_entry(const struct lxc_conf *conf,
+			   const struct lxc_rootfs *rootfs,
+			   struct mntent *mntent, const char *lxc_name,
+			   const char *lxc_path, struct mount_dirs *dirs)
+{
+	int ret, slot;
+
+	log_notice_on_conflict(conf, mntent->mnt_fsname, mntent->mnt_dir);
+
+	slot = lxc_prof_begin("mount %s", mntent->mnt_dir);
+	if (!rootfs->path)
+		ret = mount_entry_on_systemfs(mntent, dirs);
+	else if (mntent->mnt_dir[0] != '/')
+		ret = mount_entry_on_relative_rootfs(mntent, rootfs, lxc_name,
+						     lxc_path, dirs);
+	else
+		ret = mount_entry_on_absolute_rootfs(mntent, rootfs, lxc_name,
+						     lxc_path, dirs);
+	lxc_prof_end(slot);
+
+	return ret;
+}
+
 static int mount_file_entries(const struct lxc_conf *conf,
 			      const struct lxc_rootfs *rootfs, FILE *file,
 			      const char *lxc_name, const char *lxc_path)
 {
 	struct mntent mntent;
+	struct mount_dirs dirs;
 	char buf[4096];
-	int ret = -1;
+	int ret = 0;
+
+	mount_dirs_init(&dirs, rootfs);
 
 	while (getmntent_r(file, &mntent, buf, sizeof(buf))) {
-		log_notice_on_conflict(conf, mntent.mnt_fsname, mntent.mnt_dir);
-
-		if (!rootfs->path)
-			ret = mount_entry_on_systemfs(&mntent);
-		else if (mntent.mnt_dir[0] != '/')
-			ret = mount_entry_on_relative_rootfs(&mntent, rootfs,
-							     lxc_name, lxc_path);
-		else
-			ret = mount_entry_on_absolute_rootfs(&mntent, rootfs,
-					                     lxc_name, lxc_path);
+		ret = mount_one_entry(conf, rootfs, &mntent, lxc_name, lxc_path,
+				      &dirs);
 		if (ret < 0)
-			return -1;
+			break;
 	}
-	ret = 0;
+
+	mount_dirs_fini(&dirs);
+	if (ret < 0)
+		return -1;
 
 	INFO("Set up mount entries");
-	return ret;
+	return 0;
 }
 
 static int setup_mount(const struct lxc_conf *conf,
@@ -2313,22 +2553,42 @@ on_error:
 	return NULL;
 }
 
-static int setup_mount_entries(const struct lxc_conf *conf,
+/* Mount the lxc.mount.entry list straight from the entries tokenized at
+ * config load time.
+ */
+static int setup_mount_entries(struct lxc_conf *conf,
 			       const struct lxc_rootfs *rootfs,
-			       struct lxc_list *mount, const char *lxc_name,
-			       const char *lxc_path)
+			       const char *lxc_name, const char *lxc_path)
 {
-	FILE *f;
-	int ret;
+	size_t i;
+	struct mount_dirs dirs;
+	int ret = 0;
 
-	f = make_anonymous_mount_file(mount);
-	if (!f)
+	/* mount_list was edited without going through lxc_add_mount_entry(). */
+	if (conf->nr_mount_entries != lxc_list_len(&conf->mount_list) &&
+	    lxc_tokenize_mount_entries(conf) < 0)
 		return -1;
 
-	ret = mount_file_entries(conf, rootfs, f, lxc_name, lxc_path);
+	mount_dirs_init(&dirs, rootfs);
 
-	fclose(f);
-	return ret;
+	for (i = 0; i < conf->nr_mount_entries; i++) {
+		struct lxc_mount_entry *entry = &conf->mount_entries[i];
+
+		if (!entry->mntent.mnt_dir)
+			continue;
+
+		ret = mount_one_entry(conf, rootfs, &entry->mntent, lxc_name,
+				      lxc_path, &dirs);
+		if (ret < 0)
+			break;
+	}
+
+	mount_dirs_fini(&dirs);
+	if (ret < 0)
+		return -1;
+
+	INFO("Set up mount entries");
+	return 0;
 }
 
 static int parse_cap(const char *cap)
@@ -2586,39 +2846,16 @@ int write_id_mapping(enum idtype idtype, pid_t pid, const char *buf,
 	return 0;
 }
 
-/* Check whether a binary exist and has either CAP_SETUID, CAP_SETGID or both.
- *
- * @return  1      if functional binary was found
- * @return  0      if binary exists but is lacking privilege
- * @return -ENOENT if binary does not exist
- * @return -EINVAL if cap to check is neither CAP_SETUID nor CAP_SETGID
- *
- */
-static int idmaptool_on_path_and_privileged(const char *binary, cap_value_t cap)
+/* Check whether the binary at @path has either CAP_SETUID, CAP_SETGID or both. */
+static int idmaptool_probe(const char *path, const struct stat *st,
+			   cap_value_t cap)
 {
-	char *path;
-	int ret;
-	struct stat st;
 	int fret = 0;
 
-	if (cap != CAP_SETUID && cap != CAP_SETGID)
-		return -EINVAL;
-
-	path = on_path(binary, NULL);
-	if (!path)
-		return -ENOENT;
-
-	ret = stat(path, &st);
-	if (ret < 0) {
-		fret = -errno;
-		goto cleanup;
-	}
-
 	/* Check if the binary is setuid. */
-	if (st.st_mode & S_ISUID) {
+	if (st->st_mode & S_ISUID) {
 		DEBUG("The binary \"%s\" does have the setuid bit set.", path);
-		fret = 1;
-		goto cleanup;
+		return 1;
 	}
 
 	#if HAVE_LIBCAP && LIBCAP_SUPPORTS_FILE_CAPABILITIES
@@ -2628,8 +2865,7 @@ static int idmaptool_on_path_and_privileged(const char *binary, cap_value_t cap)
 	    lxc_file_cap_is_set(path, CAP_SETUID, CAP_PERMITTED)) {
 		DEBUG("The binary \"%s\" has CAP_SETUID in its CAP_EFFECTIVE "
 		      "and CAP_PERMITTED sets.", path);
-		fret = 1;
-		goto cleanup;
+		return 1;
 	}
 
 	/* Check if it has the CAP_SETGID capability. */
@@ -2638,8 +2874,7 @@ static int idmaptool_on_path_and_privileged(const char *binary, cap_value_t cap)
 	    lxc_file_cap_is_set(path, CAP_SETGID, CAP_PERMITTED)) {
 		DEBUG("The binary \"%s\" has CAP_SETGID in its CAP_EFFECTIVE "
 		      "and CAP_PERMITTED sets.", path);
-		fret = 1;
-		goto cleanup;
+		return 1;
 	}
 	#else
 	/* If we cannot check for file capabilities we need to give the benefit
@@ -2651,11 +2886,180 @@ static int idmaptool_on_path_and_privileged(const char *binary, cap_value_t cap)
 	fret = 1;
 	#endif
 
-cleanup:
-	free(path);
 	return fret;
 }
 
+/* Result of the last probe for a given id mapping tool. Looking the binary up
+ * in PATH and reading its file capabilities is redone only when PATH changes
+ * or the binary found last time is replaced.
+ */
+struct idmaptool_cache {
+	char *env_path;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	mode_t mode;
+	struct timespec ctime;
+	int result;
+};
+
+static struct idmaptool_cache idmaptool_cache[2];
+static pthread_mutex_t idmaptool_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool idmaptool_cache_valid(struct idmaptool_cache *cache,
+				  const char *env_path)
+{
+	int ret;
+	struct stat st;
+
+	if (!cache->env_path || strcmp(cache->env_path, env_path))
+		return false;
+
+	/* The binary was missing last time. */
+	if (!cache->path)
+		return true;
+
+	ret = stat(cache->path, &st);
+	if (ret < 0)
+		return false;
+
+	return st.st_dev == cache->dev && st.st_ino == cache->ino &&
+	       st.st_mode == cache->mode &&
+	       st.st_ctim.tv_sec == cache->ctime.tv_sec &&
+	       st.st_ctim.tv_nsec == cache->ctime.tv_nsec;
+}
+
+/* Check whether a binary exist and has either CAP_SETUID, CAP_SETGID or both.
+ *
+ * @return  1      if functional binary was found
+ * @return  0      if binary exists but is lacking privilege
+ * @return -ENOENT if binary does not exist
+ * @return -EINVAL if cap to check is neither CAP_SETUID nor CAP_SETGID
+ *
+ */
+static int idmaptool_on_path_and_privileged(const char *binary, cap_value_t cap)
+{
+	int ret;
+	char *path;
+	const char *env_path;
+	struct stat st;
+	struct idmaptool_cache *cache;
+
+	if (cap != CAP_SETUID && cap != CAP_SETGID)
+		return -EINVAL;
+
+	env_path = getenv("PATH");
+	if (!env_path)
+		env_path = "";
+
+	cache = &idmaptool_cache[cap == CAP_SETUID ? 0 : 1];
+
+	pthread_mutex_lock(&idmaptool_cache_mutex);
+	if (idmaptool_cache_valid(cache, env_path)) {
+		ret = cache->result;
+		pthread_mutex_unlock(&idmaptool_cache_mutex);
+		return ret;
+	}
+
+	free(cache->env_path);
+	free(cache->path);
+	memset(cache, 0, sizeof(*cache));
+
+	path = on_path(binary, NULL);
+	if (!path) {
+		ret = -ENOENT;
+	} else if (stat(path, &st) < 0) {
+		ret = -errno;
+		free(path);
+		path = NULL;
+	} else {
+		ret = idmaptool_probe(path, &st, cap);
+		cache->dev = st.st_dev;
+		cache->ino = st.st_ino;
+		cache->mode = st.st_mode;
+		cache->ctime = st.st_ctim;
+	}
+
+	/* Only remember results we can revalidate. */
+	cache->env_path = strdup(env_path);
+	cache->path = path;
+	cache->result = ret;
+	if (!cache->env_path || (ret != -ENOENT && !path)) {
+		free(cache->env_path);
+		free(cache->path);
+		memset(cache, 0, sizeof(*cache));
+	}
+	pthread_mutex_unlock(&idmaptool_cache_mutex);
+
+	return ret;
+}
+
+/* Check that the host ranges of all @idtype mappings in @idmap are delegated to
+ * root in /etc/sub{g,u}id in the same way new{g,u}idmap would check it.
+ */
+static bool idmap_reserved_for_root(struct lxc_list *idmap, enum idtype idtype)
+{
+	FILE *f;
+	struct lxc_list *it;
+	struct id_map *map;
+	char *line = NULL;
+	size_t len = 0;
+	bool reserved = true;
+	const char *file = idtype == ID_TYPE_UID ? "/etc/subuid" : "/etc/subgid";
+
+	f = fopen(file, "re");
+	if (!f) {
+		SYSERROR("Failed to open \"%s\"", file);
+		return false;
+	}
+
+	lxc_list_for_each(it, idmap) {
+		bool found = false;
+
+		map = it->elem;
+		if (map->idtype != idtype)
+			continue;
+
+		/* Mapping one's own id is always allowed. */
+		if (map->hostid == 0 && map->range == 1)
+			continue;
+
+		rewind(f);
+		while (getline(&line, &len, f) != -1) {
+			char *ranges;
+			unsigned long start, count;
+
+			if (!strncmp(line, "root:", 5))
+				ranges = line + 5;
+			else if (!strncmp(line, "0:", 2))
+				ranges = line + 2;
+			else
+				continue;
+
+			if (sscanf(ranges, "%lu:%lu", &start, &count) != 2)
+				continue;
+
+			if (map->hostid >= start &&
+			    map->hostid + map->range <= start + count) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found) {
+			ERROR("The %cid range %lu-%lu is not delegated to root in \"%s\"",
+			      idtype == ID_TYPE_UID ? 'u' : 'g', map->hostid,
+			      map->hostid + map->range - 1, file);
+			reserved = false;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return reserved;
+}
+
 int lxc_map_ids_exec_wrapper(void *args)
 {
 	execl("/bin/sh", "sh", "-c", (char *)args, (char *)NULL);
@@ -2735,11 +3139,23 @@ int lxc_map_ids(struct lxc_list *idmap, pid_t pid)
 		      "write directly with euid %d", hostuid);
 	}
 
-	/* Check if we really need to use newuidmap and newgidmap.
-	* If the user is only remapping his own {g,u}id, we don't need it.
-	*/
-	if (use_shadow && lxc_list_len(idmap) == 2) {
-		use_shadow = false;
+	/* Root does not need new{g,u}idmap to write the mappings. Enforce the
+	 * same policy they would and write directly instead of forking them.
+	 */
+	if (use_shadow && hostuid == 0) {
+		if (!idmap_reserved_for_root(idmap, ID_TYPE_UID) ||
+		    !idmap_reserved_for_root(idmap, ID_TYPE_GID))
+			return -1;
+
+		DEBUG("Writing mappings directly as root");
+		use_shadow = false;
+	}
+
+	/* Check if we really need to use newuidmap and newgidmap.
+	* If the user is only remapping his own {g,u}id, we don't need it.
+	*/
+	if (use_shadow && lxc_list_len(idmap) == 2) {
+		use_shadow = false;
 		lxc_list_for_each(iterator, idmap) {
 			map = iterator->elem;
 			if (map->idtype == ID_TYPE_UID && map->range == 1 &&
@@ -2875,6 +3291,9 @@ again:
 	return freeid;
 }
 
+static int userns_helper_chown(struct lxc_conf *conf, const char *path,
+			       uid_t uid, gid_t gid);
+
 int chown_mapped_root_exec_wrapper(void *args)
 {
 	execvp("lxc-usernsexec", args);
@@ -2982,6 +3401,26 @@ int chown_mapped_root(char *path, struct lxc_conf *conf)
 		return -1;
 	}
 
+	/* The helper's user namespace uses the container's mappings. As long as
+	 * they map namespace gid pathgid to the same host gid lxc-usernsexec
+	 * would map it to below, chown in-process instead of exec'ing it.
+	 */
+	if (hostgid == sb.st_gid) {
+		ret = userns_helper_chown(conf, path, 0, (gid_t)-1);
+		if (ret != -2)
+			return ret;
+	} else {
+		struct id_map *map;
+
+		map = find_mapped_nsid_entry(conf, sb.st_gid, ID_TYPE_GID);
+		if (map && map->hostid + (sb.st_gid - map->nsid) ==
+			       rootgid + (gid_t)sb.st_gid) {
+			ret = userns_helper_chown(conf, path, 0, sb.st_gid);
+			if (ret != -2)
+				return ret;
+		}
+	}
+
 	// "u:0:rootuid:1"
 	ret = snprintf(map1, 100, "u:0:%d:1", rootuid);
 	if (ret < 0 || ret >= 100) {
@@ -3282,35 +3721,28 @@ static bool verify_start_hooks(struct lxc_conf *conf)
 	return true;
 }
 
-int lxc_setup(struct lxc_handler *handler)
+/* Mount the rootfs and everything that is mounted below it. None of this
+ * depends on the cgroup or network setup done by the parent, so the child may
+ * call this while the parent is still configuring the container. It has not
+ * been moved into its cgroups yet then, so pre-mount hooks and mount helpers
+ * are accounted to the monitor's cgroups.
+ */
+int lxc_setup_mounts(struct lxc_handler *handler)
 {
-	int ret;
 	const char *name = handler->name;
 	struct lxc_conf *lxc_conf = handler->conf;
 	const char *lxcpath = handler->lxcpath;
 
+	if (handler->mounts_setup)
+		return 0;
+
+	lxc_prof_phase("setup: rootfs");
 	if (do_rootfs_setup(lxc_conf, name, lxcpath) < 0) {
 		ERROR("Error setting up rootfs mount after spawn");
 		return -1;
 	}
 
-	if (lxc_conf->inherit_ns_fd[LXC_NS_UTS] == -1) {
-		if (setup_utsname(lxc_conf->utsname)) {
-			ERROR("failed to setup the utsname for '%s'", name);
-			return -1;
-		}
-	}
-
-	if (lxc_setup_network_in_child_namespaces(lxc_conf, &lxc_conf->network)) {
-		ERROR("failed to setup the network for '%s'", name);
-		return -1;
-	}
-
-	if (lxc_network_send_name_and_ifindex_to_parent(handler) < 0) {
-		ERROR("Failed to network device names and ifindices to parent");
-		return -1;
-	}
-
+	lxc_prof_phase("setup: autodev");
 	if (lxc_conf->autodev > 0) {
 		if (mount_autodev(name, &lxc_conf->rootfs, lxcpath)) {
 			ERROR("failed to mount /dev in the container");
@@ -3321,22 +3753,60 @@ int lxc_setup(struct lxc_handler *handler)
 	/* do automatic mounts (mainly /proc and /sys), but exclude
 	 * those that need to wait until other stuff has finished
 	 */
+	lxc_prof_phase("setup: auto mounts");
 	if (lxc_mount_auto_mounts(lxc_conf, lxc_conf->auto_mounts & ~LXC_AUTO_CGROUP_MASK, handler) < 0) {
 		ERROR("failed to setup the automatic mounts for '%s'", name);
 		return -1;
 	}
 
+	lxc_prof_phase("setup: fstab");
 	if (setup_mount(lxc_conf, &lxc_conf->rootfs, lxc_conf->fstab, name, lxcpath)) {
 		ERROR("failed to setup the mounts for '%s'", name);
 		return -1;
 	}
 
-	if (!lxc_list_empty(&lxc_conf->mount_list) && setup_mount_entries(lxc_conf, &lxc_conf->rootfs, &lxc_conf->mount_list, name, lxcpath)) {
+	lxc_prof_phase("setup: mount entries");
+	if (!lxc_list_empty(&lxc_conf->mount_list) && setup_mount_entries(lxc_conf, &lxc_conf->rootfs, name, lxcpath)) {
 		ERROR("failed to setup the mount entries for '%s'", name);
 		return -1;
 	}
 
+	lxc_prof_phase(NULL);
+	handler->mounts_setup = true;
+	return 0;
+}
+
+int lxc_setup(struct lxc_handler *handler)
+{
+	int ret;
+	const char *name = handler->name;
+	struct lxc_conf *lxc_conf = handler->conf;
+	const char *lxcpath = handler->lxcpath;
+
+	if (lxc_setup_mounts(handler) < 0)
+		return -1;
+
+	lxc_prof_phase("setup: utsname");
+	if (lxc_conf->inherit_ns_fd[LXC_NS_UTS] == -1) {
+		if (setup_utsname(lxc_conf->utsname)) {
+			ERROR("failed to setup the utsname for '%s'", name);
+			return -1;
+		}
+	}
+
+	lxc_prof_phase("setup: network");
+	if (lxc_setup_network_in_child_namespaces(lxc_conf, &lxc_conf->network)) {
+		ERROR("failed to setup the network for '%s'", name);
+		return -1;
+	}
+
+	if (lxc_network_send_name_and_ifindex_to_parent(handler) < 0) {
+		ERROR("Failed to network device names and ifindices to parent");
+		return -1;
+	}
+
 	/* Make sure any start hooks are in the container */
+	lxc_prof_phase("setup: start hooks check");
 	if (!verify_start_hooks(lxc_conf))
 		return -1;
 
@@ -3347,16 +3817,19 @@ int lxc_setup(struct lxc_handler *handler)
 	 * before, /sys could not have been mounted
 	 * (is either mounted automatically or via fstab entries)
 	 */
+	lxc_prof_phase("setup: cgroup mounts");
 	if (lxc_mount_auto_mounts(lxc_conf, lxc_conf->auto_mounts & (LXC_AUTO_CGROUP_MASK), handler) < 0) {
 		ERROR("failed to setup the automatic mounts for '%s'", name);
 		return -1;
 	}
 
+	lxc_prof_phase("setup: mount hooks");
 	if (run_lxc_hooks(name, "mount", lxc_conf, lxcpath, NULL)) {
 		ERROR("failed to run mount hooks for container '%s'.", name);
 		return -1;
 	}
 
+	lxc_prof_phase("setup: autodev hooks");
 	if (lxc_conf->autodev > 0) {
 		if (run_lxc_hooks(name, "autodev", lxc_conf, lxcpath, NULL)) {
 			ERROR("failed to run autodev hooks for container '%s'.", name);
@@ -3369,6 +3842,7 @@ int lxc_setup(struct lxc_handler *handler)
 		}
 	}
 
+	lxc_prof_phase("setup: console");
 	ret = lxc_setup_console(&lxc_conf->rootfs, &lxc_conf->console,
 				lxc_conf->ttydir);
 	if (ret < 0) {
@@ -3381,6 +3855,7 @@ int lxc_setup(struct lxc_handler *handler)
 			ERROR("failed to setup kmsg for '%s'", name);
 	}
 
+	lxc_prof_phase("setup: dev symlinks");
 	ret = lxc_setup_dev_symlinks(&lxc_conf->rootfs);
 	if (ret < 0) {
 		ERROR("Failed to setup /dev symlinks");
@@ -3388,25 +3863,30 @@ int lxc_setup(struct lxc_handler *handler)
 	}
 
 	/* mount /proc if it's not already there */
+	lxc_prof_phase("setup: proc");
 	if (lxc_create_tmp_proc_mount(lxc_conf) < 0) {
 		ERROR("failed to LSM mount proc for '%s'", name);
 		return -1;
 	}
 
+	lxc_prof_phase("setup: pivot root");
 	if (setup_pivot_root(&lxc_conf->rootfs)) {
 		ERROR("failed to set rootfs for '%s'", name);
 		return -1;
 	}
 
+	lxc_prof_phase("setup: devpts");
 	if (lxc_setup_devpts(lxc_conf)) {
 		ERROR("failed to setup the new pts instance");
 		return -1;
 	}
 
+	lxc_prof_phase("setup: ttys");
 	ret = lxc_create_ttys(handler);
 	if (ret < 0)
 		return -1;
 
+	lxc_prof_phase("setup: personality and caps");
 	if (setup_personality(lxc_conf->personality)) {
 		ERROR("failed to setup personality");
 		return -1;
@@ -3426,6 +3906,7 @@ int lxc_setup(struct lxc_handler *handler)
 		return -1;
 	}
 
+	lxc_prof_phase(NULL);
 	NOTICE("Container \"%s\" is set up", name);
 
 	return 0;
@@ -3458,9 +3939,12 @@ int run_lxc_hooks(const char *name, char *hook, struct lxc_conf *conf,
 	else
 		return -1;
 	lxc_list_for_each(it, &conf->hooks[which]) {
-		int ret;
+		int ret, slot;
 		char *hookname = it->elem;
+
+		slot = lxc_prof_begin("hook %s: %s", hook, hookname);
 		ret = run_script_argv(name, "lxc", hookname, hook, lxcpath, argv);
+		lxc_prof_end(slot);
 		if (ret)
 			return ret;
 	}
@@ -3648,6 +4132,17 @@ int lxc_clear_environment(struct lxc_conf *c)
 	return 0;
 }
 
+static void free_mount_entries(struct lxc_conf *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nr_mount_entries; i++)
+		free(c->mount_entries[i].buf);
+	free(c->mount_entries);
+	c->mount_entries = NULL;
+	c->nr_mount_entries = 0;
+}
+
 int lxc_clear_mount_entries(struct lxc_conf *c)
 {
 	struct lxc_list *it,*next;
@@ -3657,6 +4152,72 @@ int lxc_clear_mount_entries(struct lxc_conf *c)
 		free(it->elem);
 		free(it);
 	}
+	free_mount_entries(c);
+	return 0;
+}
+
+static int tokenize_mount_entry(struct lxc_conf *c, const char *value)
+{
+	struct lxc_mount_entry *entries;
+
+	entries = realloc(c->mount_entries,
+			  (c->nr_mount_entries + 1) * sizeof(*entries));
+	if (!entries)
+		return -1;
+	c->mount_entries = entries;
+
+	if (lxc_parse_mount_entry(value, &entries[c->nr_mount_entries]) < 0)
+		return -1;
+	c->nr_mount_entries++;
+
+	return 0;
+}
+
+/* Add an lxc.mount.entry both verbatim, to be written back out, and
+ * tokenized, to be mounted from directly at container start.
+ */
+int lxc_add_mount_entry(struct lxc_conf *c, const char *value)
+{
+	char *mntelem;
+	struct lxc_list *mntlist;
+
+	mntlist = malloc(sizeof(*mntlist));
+	if (!mntlist)
+		return -1;
+
+	mntelem = strdup(value);
+	if (!mntelem) {
+		free(mntlist);
+		return -1;
+	}
+	mntlist->elem = mntelem;
+
+	if (tokenize_mount_entry(c, value) < 0) {
+		free(mntelem);
+		free(mntlist);
+		return -1;
+	}
+
+	lxc_list_add_tail(&c->mount_list, mntlist);
+	return 0;
+}
+
+/* Rebuild the tokenized mount entries after mount_list has been edited in
+ * place.
+ */
+int lxc_tokenize_mount_entries(struct lxc_conf *c)
+{
+	struct lxc_list *it;
+
+	free_mount_entries(c);
+
+	lxc_list_for_each(it, &c->mount_list) {
+		if (tokenize_mount_entry(c, it->elem) < 0) {
+			free_mount_entries(c);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -3730,6 +4291,7 @@ void lxc_conf_free(struct lxc_conf *conf)
 	free(conf->rootfs.mount);
 	free(conf->rootfs.bdev_type);
 	free(conf->rootfs.options);
+	free(conf->rootfs.overlay_tmpfs);
 	free(conf->rootfs.path);
 	free(conf->logfile);
 	if (conf->logfd != -1)
@@ -3738,8 +4300,9 @@ void lxc_conf_free(struct lxc_conf *conf)
 	free(conf->ttydir);
 	free(conf->fstab);
 	free(conf->rcfile);
+	free(conf->start_profile);
 	free(conf->init_cmd);
-	free(conf->unexpanded_config);
+	lxc_unexp_config_free(&conf->unexpanded_config);
 	free(conf->pty_names);
 	lxc_clear_config_network(conf);
 	free(conf->lsm_aa_profile);
@@ -3755,6 +4318,7 @@ void lxc_conf_free(struct lxc_conf *conf)
 	lxc_clear_includes(conf);
 	lxc_clear_aliens(conf);
 	lxc_clear_environment(conf);
+	lxc_userns_helper_stop(conf);
 	free(conf);
 }
 
@@ -4069,45 +4633,18 @@ on_error:
 	return ret;
 }
 
-int userns_exec_full(struct lxc_conf *conf, int (*fn)(void *), void *data,
-		     const char *fn_name)
+/* Build the container's {g,u}id mappings extended by a mapping for the caller's
+ * euid and egid in case they are not mapped yet.
+ */
+static struct lxc_list *get_full_idmap(struct lxc_conf *conf)
 {
-	pid_t pid;
 	uid_t euid, egid;
-	struct userns_fn_data d;
-	int p[2];
 	struct id_map *map;
 	struct lxc_list *cur;
-	char c = '1';
-	int ret = -1;
 	struct lxc_list *idmap = NULL, *tmplist = NULL;
 	struct id_map *container_root_uid = NULL, *container_root_gid = NULL,
 		      *host_uid_map = NULL, *host_gid_map = NULL;
 
-	if (!conf)
-		return -EINVAL;
-
-	ret = pipe2(p, O_CLOEXEC);
-	if (ret < 0) {
-		SYSERROR("opening pipe");
-		return -1;
-	}
-	d.fn = fn;
-	d.fn_name = fn_name;
-	d.arg = data;
-	d.p[0] = p[0];
-	d.p[1] = p[1];
-
-	/* Clone child in new user namespace. */
-	pid = lxc_clone(run_userns_fn, &d, CLONE_NEWUSER);
-	if (pid < 0) {
-		ERROR("failed to clone child process in new user namespace");
-		goto on_error;
-	}
-
-	close(p[0]);
-	p[0] = -1;
-
 	euid = geteuid();
 	egid = getegid();
 
@@ -4206,6 +4743,64 @@ int userns_exec_full(struct lxc_conf *conf, int (*fn)(void *), void *data,
 	/* idmap will now keep track of that memory. */
 	host_gid_map = NULL;
 
+	return idmap;
+
+on_error:
+	if (idmap) {
+		lxc_free_idmap(idmap);
+		free(idmap);
+	}
+
+	if (host_uid_map && (host_uid_map != container_root_uid))
+		free(host_uid_map);
+	if (host_gid_map && (host_gid_map != container_root_gid))
+		free(host_gid_map);
+
+	return NULL;
+}
+
+int userns_exec_full(struct lxc_conf *conf, int (*fn)(void *), void *data,
+		     const char *fn_name)
+{
+	pid_t pid;
+	struct userns_fn_data d;
+	int p[2];
+	struct id_map *map;
+	struct lxc_list *cur;
+	char c = '1';
+	int ret = -1;
+	struct lxc_list *idmap;
+
+	if (!conf)
+		return -EINVAL;
+
+	idmap = get_full_idmap(conf);
+	if (!idmap)
+		return -1;
+
+	ret = pipe2(p, O_CLOEXEC);
+	if (ret < 0) {
+		SYSERROR("opening pipe");
+		lxc_free_idmap(idmap);
+		free(idmap);
+		return -1;
+	}
+	d.fn = fn;
+	d.fn_name = fn_name;
+	d.arg = data;
+	d.p[0] = p[0];
+	d.p[1] = p[1];
+
+	/* Clone child in new user namespace. */
+	pid = lxc_clone(run_userns_fn, &d, CLONE_NEWUSER);
+	if (pid < 0) {
+		ERROR("failed to clone child process in new user namespace");
+		goto on_error;
+	}
+
+	close(p[0]);
+	p[0] = -1;
+
 	if (lxc_log_get_level() == LXC_LOG_LEVEL_TRACE ||
 	    conf->loglevel == LXC_LOG_LEVEL_TRACE) {
 		lxc_list_for_each(cur, idmap) {
@@ -4241,17 +4836,194 @@ on_error:
 	if (pid > 0)
 		ret = wait_for_pid(pid);
 
-	if (idmap) {
-		lxc_free_idmap(idmap);
-		free(idmap);
+	lxc_free_idmap(idmap);
+	free(idmap);
+
+	return ret;
+}
+
+struct userns_chown_request {
+	uid_t uid;
+	gid_t gid;
+	char path[MAXPATHLEN];
+};
+
+static int userns_helper_fn(void *data)
+{
+	int *sockets = data;
+	int sock = sockets[1];
+	struct userns_chown_request req;
+
+	close(sockets[0]);
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+
+	/* Serve requests until the other end is closed. */
+	for (;;) {
+		int ret, err = 0;
+
+		ret = lxc_read_nointr(sock, &req, sizeof(req));
+		if (ret != sizeof(req))
+			break;
+
+		req.path[sizeof(req.path) - 1] = '\0';
+		ret = chown(req.path, req.uid, req.gid);
+		if (ret < 0)
+			err = errno;
+
+		ret = lxc_write_nointr(sock, &err, sizeof(err));
+		if (ret != sizeof(err))
+			break;
 	}
 
-	if (host_uid_map && (host_uid_map != container_root_uid))
-		free(host_uid_map);
-	if (host_gid_map && (host_gid_map != container_root_gid))
-		free(host_gid_map);
+	close(sock);
+	return 0;
+}
 
-	return ret;
+static struct lxc_userns_helper *userns_helper_start(struct lxc_conf *conf)
+{
+	pid_t pid;
+	int ret;
+	int sock[2];
+	struct userns_fn_data d;
+	struct lxc_userns_helper *helper;
+	struct lxc_list *idmap;
+	char c = '1';
+
+	if (conf->userns_helper) {
+		if (conf->userns_helper->owner == lxc_raw_getpid())
+			return conf->userns_helper;
+
+		/* Inherited across fork(). The helper belongs to our parent. */
+		close(conf->userns_helper->sock);
+		free(conf->userns_helper);
+		conf->userns_helper = NULL;
+	}
+
+	helper = malloc(sizeof(*helper));
+	if (!helper)
+		return NULL;
+
+	idmap = get_full_idmap(conf);
+	if (!idmap) {
+		free(helper);
+		return NULL;
+	}
+
+	ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sock);
+	if (ret < 0) {
+		SYSERROR("Failed to create socket pair");
+		goto on_error;
+	}
+
+	ret = pipe2(d.p, O_CLOEXEC);
+	if (ret < 0) {
+		SYSERROR("Failed to create pipe");
+		close(sock[0]);
+		close(sock[1]);
+		goto on_error;
+	}
+	d.fn = userns_helper_fn;
+	d.fn_name = "userns_helper_fn";
+	d.arg = sock;
+
+	pid = lxc_clone(run_userns_fn, &d, CLONE_NEWUSER);
+	close(d.p[0]);
+	close(sock[1]);
+	if (pid < 0) {
+		ERROR("Failed to clone helper process in new user namespace");
+		close(d.p[1]);
+		close(sock[0]);
+		goto on_error;
+	}
+
+	ret = lxc_map_ids(idmap, pid);
+	if (ret == 0 && lxc_write_nointr(d.p[1], &c, 1) != 1)
+		ret = -1;
+	close(d.p[1]);
+	if (ret < 0) {
+		ERROR("Failed to set up {g,u}id mappings for helper process \"%d\"", pid);
+		close(sock[0]);
+		wait_for_pid(pid);
+		goto on_error;
+	}
+
+	lxc_free_idmap(idmap);
+	free(idmap);
+
+	helper->owner = lxc_raw_getpid();
+	helper->pid = pid;
+	helper->sock = sock[0];
+	conf->userns_helper = helper;
+	TRACE("Started user namespace helper process \"%d\"", pid);
+
+	return helper;
+
+on_error:
+	lxc_free_idmap(idmap);
+	free(idmap);
+	free(helper);
+	return NULL;
+}
+
+/* Chown @path to the namespace {g,u}id @uid and @gid in a user namespace set up
+ * with the container's mappings.
+ *
+ * @return  0 on success
+ * @return -1 if the helper failed to chown @path
+ * @return -2 if the helper could not be used
+ */
+static int userns_helper_chown(struct lxc_conf *conf, const char *path,
+			       uid_t uid, gid_t gid)
+{
+	int ret, err;
+	struct lxc_userns_helper *helper;
+	struct userns_chown_request req = {
+		.uid = uid,
+		.gid = gid,
+	};
+
+	if (strlen(path) >= sizeof(req.path))
+		return -2;
+	strcpy(req.path, path);
+
+	helper = userns_helper_start(conf);
+	if (!helper)
+		return -2;
+
+	ret = lxc_write_nointr(helper->sock, &req, sizeof(req));
+	if (ret != sizeof(req) ||
+	    lxc_read_nointr(helper->sock, &err, sizeof(err)) != sizeof(err)) {
+		SYSERROR("Failed to talk to user namespace helper \"%d\"",
+			 helper->pid);
+		lxc_userns_helper_stop(conf);
+		return -2;
+	}
+
+	if (err) {
+		errno = err;
+		SYSERROR("Failed to chown \"%s\" to %d:%d", path, (int)uid,
+			 (int)gid);
+		return -1;
+	}
+
+	return 0;
+}
+
+void lxc_userns_helper_stop(struct lxc_conf *conf)
+{
+	struct lxc_userns_helper *helper = conf->userns_helper;
+
+	if (!helper)
+		return;
+
+	/* Closing our end makes the helper exit. */
+	close(helper->sock);
+	if (helper->owner == lxc_raw_getpid())
+		(void)wait_for_pid(helper->pid);
+
+	free(helper);
+	conf->userns_helper = NULL;
 }
 
 /* not thread-safe, do not use from api without first forking */
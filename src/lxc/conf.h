@@ -32,6 +32,12 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+#if IS_BIONIC
+#include <../include/lxcmntent.h>
+#else
+#include <mntent.h>
+#endif
+
 #include "list.h"
 #include "start.h" /* for lxc_handler */
 
@@ -132,6 +138,8 @@ struct lxc_rootfs {
 	char *mount;
 	char *options;
 	char *bdev_type;
+	/* size of the tmpfs the upper layer of an overlay rootfs is kept in */
+	char *overlay_tmpfs;
 };
 
 /*
@@ -199,6 +207,55 @@ enum lxchooks {
 
 extern char *lxchook_names[NUM_LXC_HOOKS];
 
+/* A tokenized lxc.mount.entry. The strings in @mntent point into @buf. Lines
+ * getmntent() would skip, i.e. blank lines and comments, have a NULL mnt_dir.
+ */
+struct lxc_mount_entry {
+	char *buf;
+	struct mntent mntent;
+};
+
+/* A process in a user namespace set up with the container's {g,u}id mappings
+ * that performs chown_mapped_root() requests sent over @sock. It is kept
+ * around until lxc_userns_helper_stop() so that a start, create or clone only
+ * has to set up the mappings once.
+ */
+struct lxc_userns_helper {
+	pid_t owner;
+	pid_t pid;
+	int sock;
+};
+
+/* A line of the unexpanded config including its trailing newline. @key_len is
+ * the length of the key the line starts with and 0 for comments, blank and
+ * indented lines. Cleared lines have @line set to NULL.
+ */
+struct lxc_unexp_line {
+	char *line;
+	size_t len;
+	size_t key_len;
+};
+
+/* Indices of all lines starting with @key in the order they were appended. */
+struct lxc_unexp_key {
+	char *key;
+	size_t *idx;
+	size_t nr_idx, alloced;
+	struct lxc_unexp_key *next;
+};
+
+/* The unexpanded config is kept as a vector of lines that is indexed by key so
+ * appending a line takes constant time and clearing a key only touches the
+ * lines of that key. It is only turned back into text when it is written out.
+ */
+struct lxc_unexp_config {
+	struct lxc_unexp_line *lines;
+	size_t nr_lines, alloced;
+	size_t nr_cleared;
+	struct lxc_unexp_key **keys;
+	size_t nr_keys, nr_buckets;
+};
+
 struct lxc_conf {
 	int is_execute;
 	char *fstab;
@@ -223,6 +280,9 @@ struct lxc_conf {
 	struct lxc_list network;
 	int auto_mounts;
 	struct lxc_list mount_list;
+	/* mount_list tokenized when the config is loaded, in the same order */
+	struct lxc_mount_entry *mount_entries;
+	size_t nr_mount_entries;
 	struct lxc_list caps;
 	struct lxc_list keepcaps;
 	struct lxc_tty_info tty_info;
@@ -240,6 +300,11 @@ struct lxc_conf {
 	char *seccomp;  // filename with the seccomp rules
 #if HAVE_SCMP_FILTER_CTX
 	scmp_filter_ctx seccomp_ctx;
+	/* Compiled BPF program read from the seccomp cache. When set it is
+	 * loaded instead of seccomp_ctx.
+	 */
+	void *seccomp_bpf;
+	size_t seccomp_bpf_len;
 #endif
 	int maincmd_fd;
 	unsigned int autodev;  // if 1, mount and fill a /dev at start
@@ -263,6 +328,8 @@ struct lxc_conf {
 	unsigned int start_auto;
 	unsigned int start_delay;
 	int start_order;
+	/* path the start-time profile is written to */
+	char *start_profile;
 	struct lxc_list groups;
 	int nbd_idx;
 
@@ -282,8 +349,7 @@ struct lxc_conf {
 	struct lxc_list environment;
 
 	/* text representation of the config file */
-	char *unexpanded_config;
-	size_t unexpanded_len, unexpanded_alloced;
+	struct lxc_unexp_config unexpanded_config;
 
 	/* init command */
 	char *init_cmd;
@@ -295,6 +361,17 @@ struct lxc_conf {
 
 	/* indicator if the container will be destroyed on shutdown */
 	unsigned int ephemeral;
+
+	/* number of ephemeral clones lxc-copy --from-pool keeps ready and
+	 * whether they are kept started and frozen */
+	unsigned int ephemeral_pool_size;
+	unsigned int ephemeral_pool_frozen;
+
+	/* whether snapshots of a directory rootfs share unchanged files with
+	 * the previous snapshot */
+	unsigned int snapshot_dedup;
+
+	struct lxc_userns_helper *userns_helper;
 };
 
 extern int write_id_mapping(enum idtype idtype, pid_t pid, const char *buf,
@@ -328,6 +405,8 @@ extern int lxc_clear_config_caps(struct lxc_conf *c);
 extern int lxc_clear_config_keepcaps(struct lxc_conf *c);
 extern int lxc_clear_cgroups(struct lxc_conf *c, const char *key);
 extern int lxc_clear_mount_entries(struct lxc_conf *c);
+extern int lxc_add_mount_entry(struct lxc_conf *c, const char *value);
+extern int lxc_tokenize_mount_entries(struct lxc_conf *c);
 extern int lxc_clear_automounts(struct lxc_conf *c);
 extern int lxc_clear_hooks(struct lxc_conf *c, const char *key);
 extern int lxc_clear_idmaps(struct lxc_conf *c);
@@ -344,6 +423,7 @@ extern int do_rootfs_setup(struct lxc_conf *conf, const char *name,
  */
 
 struct cgroup_process_info;
+extern int lxc_setup_mounts(struct lxc_handler *handler);
 extern int lxc_setup(struct lxc_handler *handler);
 extern int find_unmapped_nsid(struct lxc_conf *conf, enum idtype idtype);
 extern int mapped_hostid(unsigned id, struct lxc_conf *conf, enum idtype idtype);
@@ -352,6 +432,7 @@ extern int userns_exec_1(struct lxc_conf *conf, int (*fn)(void *), void *data,
 			 const char *fn_name);
 extern int userns_exec_full(struct lxc_conf *conf, int (*fn)(void *),
 			    void *data, const char *fn_name);
+extern void lxc_userns_helper_stop(struct lxc_conf *conf);
 extern int parse_mntopts(const char *mntopts, unsigned long *mntflags,
 			 char **mntdata);
 extern void tmp_proc_unmount(struct lxc_conf *lxc_conf);
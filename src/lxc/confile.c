@@ -37,6 +37,7 @@
 #include <net/if.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "storage/storage_utils.h"
 #include "parse.h"
@@ -147,6 +148,13 @@ static int get_config_rootfs_options(const char *, char *, int,
 				     struct lxc_conf *);
 static int clr_config_rootfs_options(const char *, struct lxc_conf *, void *);
 
+static int set_config_rootfs_overlay_tmpfs(const char *, const char *,
+					   struct lxc_conf *, void *);
+static int get_config_rootfs_overlay_tmpfs(const char *, char *, int,
+					   struct lxc_conf *);
+static int clr_config_rootfs_overlay_tmpfs(const char *, struct lxc_conf *,
+					   void *);
+
 static int set_config_rootfs_backend(const char *, const char *,
 				     struct lxc_conf *, void *);
 static int get_config_rootfs_backend(const char *, char *, int,
@@ -302,11 +310,23 @@ static int set_config_init_gid(const char *, const char *, struct lxc_conf *,
 static int get_config_init_gid(const char *, char *, int, struct lxc_conf *);
 static int clr_config_init_gid(const char *, struct lxc_conf *, void *);
 
+static int set_config_ephemeral_pool(const char *, const char *,
+				     struct lxc_conf *, void *);
+static int get_config_ephemeral_pool(const char *, char *, int,
+				     struct lxc_conf *);
+static int clr_config_ephemeral_pool(const char *, struct lxc_conf *, void *);
+
 static int set_config_ephemeral(const char *, const char *, struct lxc_conf *,
 				void *);
 static int get_config_ephemeral(const char *, char *, int, struct lxc_conf *);
 static int clr_config_ephemeral(const char *, struct lxc_conf *, void *);
 
+static int set_config_snapshot_dedup(const char *, const char *,
+				     struct lxc_conf *, void *);
+static int get_config_snapshot_dedup(const char *, char *, int,
+				     struct lxc_conf *);
+static int clr_config_snapshot_dedup(const char *, struct lxc_conf *, void *);
+
 static struct lxc_config_t config[] = {
 	{ "lxc.arch",                 set_config_personality,          get_config_personality,       clr_config_personality,       },
 	{ "lxc.pts",                  set_config_pts,                  get_config_pts,               clr_config_pts,               },
@@ -325,6 +345,7 @@ static struct lxc_config_t config[] = {
 	{ "lxc.mount",                set_config_fstab,	               get_config_fstab,             clr_config_fstab,             },
 	{ "lxc.rootfs.mount",         set_config_rootfs_mount,         get_config_rootfs_mount,      clr_config_rootfs_mount,      },
 	{ "lxc.rootfs.options",       set_config_rootfs_options,       get_config_rootfs_options,    clr_config_rootfs_options,    },
+	{ "lxc.rootfs.overlay.tmpfs", set_config_rootfs_overlay_tmpfs, get_config_rootfs_overlay_tmpfs, clr_config_rootfs_overlay_tmpfs, },
 	{ "lxc.rootfs.backend",       set_config_rootfs_backend,       get_config_rootfs_backend,    clr_config_rootfs_backend,    },
 	{ "lxc.rootfs",               set_config_rootfs,               get_config_rootfs,            clr_config_rootfs,            },
 	{ "lxc.pivotdir",             set_config_pivotdir,             get_config_pivotdir,          clr_config_pivotdir,          },
@@ -369,13 +390,17 @@ static struct lxc_config_t config[] = {
 	{ "lxc.start.auto",           set_config_start,                get_config_start,             clr_config_start,             },
 	{ "lxc.start.delay",          set_config_start,                get_config_start,             clr_config_start,             },
 	{ "lxc.start.order",          set_config_start,                get_config_start,             clr_config_start,             },
+	{ "lxc.start.profile",        set_config_start,                get_config_start,             clr_config_start,             },
 	{ "lxc.monitor.unshare",      set_config_monitor,              get_config_monitor,           clr_config_monitor,           },
 	{ "lxc.group",                set_config_group,                get_config_group,             clr_config_group,             },
 	{ "lxc.environment",          set_config_environment,          get_config_environment,       clr_config_environment,       },
 	{ "lxc.init_cmd",             set_config_init_cmd,             get_config_init_cmd,          clr_config_init_cmd,          },
 	{ "lxc.init_uid",             set_config_init_uid,             get_config_init_uid,          clr_config_init_uid,          },
 	{ "lxc.init_gid",             set_config_init_gid,             get_config_init_gid,          clr_config_init_gid,          },
+	{ "lxc.ephemeral.pool.size",  set_config_ephemeral_pool,       get_config_ephemeral_pool,    clr_config_ephemeral_pool,    },
+	{ "lxc.ephemeral.pool.frozen", set_config_ephemeral_pool,      get_config_ephemeral_pool,    clr_config_ephemeral_pool,    },
 	{ "lxc.ephemeral",            set_config_ephemeral,            get_config_ephemeral,         clr_config_ephemeral,         },
+	{ "lxc.snapshot.dedup",       set_config_snapshot_dedup,       get_config_snapshot_dedup,    clr_config_snapshot_dedup,    },
 };
 
 struct signame {
@@ -1498,6 +1523,8 @@ static int set_config_start(const char *key, const char *value,
 
 		/* Parse new config value. */
 		return lxc_safe_int(value, &lxc_conf->start_order);
+	} else if (*(key + 10) == 'p') { /* lxc.start.profile */
+		return set_config_path_item(&lxc_conf->start_profile, value);
 	}
 
 	SYSERROR("Unknown key: %s", key);
@@ -2051,26 +2078,10 @@ static int set_config_mount_auto(const char *key, const char *value,
 static int set_config_mount(const char *key, const char *value,
 			    struct lxc_conf *lxc_conf, void *data)
 {
-	char *mntelem;
-	struct lxc_list *mntlist;
-
 	if (lxc_config_value_empty(value))
 		return lxc_clear_mount_entries(lxc_conf);
 
-	mntlist = malloc(sizeof(*mntlist));
-	if (!mntlist)
-		return -1;
-
-	mntelem = strdup(value);
-	if (!mntelem) {
-		free(mntlist);
-		return -1;
-	}
-	mntlist->elem = mntelem;
-
-	lxc_list_add_tail(&lxc_conf->mount_list, mntlist);
-
-	return 0;
+	return lxc_add_mount_entry(lxc_conf, value);
 }
 
 static int set_config_cap_keep(const char *key, const char *value,
@@ -2218,28 +2229,9 @@ static void update_hwaddr(const char *line)
 
 int append_unexp_config_line(const char *line, struct lxc_conf *conf)
 {
-	size_t len = conf->unexpanded_len, linelen = strlen(line);
-
 	update_hwaddr(line);
 
-	while (conf->unexpanded_alloced <= len + linelen + 2) {
-		char *tmp = realloc(conf->unexpanded_config,
-				    conf->unexpanded_alloced + 1024);
-		if (!tmp)
-			return -1;
-
-		if (!conf->unexpanded_config)
-			*tmp = '\0';
-		conf->unexpanded_config = tmp;
-		conf->unexpanded_alloced += 1024;
-	}
-	strcat(conf->unexpanded_config, line);
-	conf->unexpanded_len += linelen;
-	if (line[linelen - 1] != '\n') {
-		strcat(conf->unexpanded_config, "\n");
-		conf->unexpanded_len++;
-	}
-	return 0;
+	return lxc_unexp_config_append(&conf->unexpanded_config, line);
 }
 
 static int do_includedir(const char *dirp, struct lxc_conf *lxc_conf)
@@ -2323,6 +2315,27 @@ static int set_config_rootfs_options(const char *key, const char *value,
 	return set_config_string_item(&lxc_conf->rootfs.options, value);
 }
 
+static int set_config_rootfs_overlay_tmpfs(const char *key, const char *value,
+					   struct lxc_conf *lxc_conf,
+					   void *data)
+{
+	const char *p;
+
+	if (lxc_config_value_empty(value))
+		return set_config_string_item(&lxc_conf->rootfs.overlay_tmpfs, value);
+
+	/* A tmpfs size: a number with an optional k, m, g or % suffix. */
+	for (p = value; isdigit(*p); p++)
+		;
+
+	if (p == value || (*p && (strchr("kKmMgG%", *p) == NULL || *(p + 1)))) {
+		ERROR("Invalid tmpfs size \"%s\"", value);
+		return -1;
+	}
+
+	return set_config_string_item(&lxc_conf->rootfs.overlay_tmpfs, value);
+}
+
 static int set_config_rootfs_backend(const char *key, const char *value,
 				     struct lxc_conf *lxc_conf, void *data)
 {
@@ -2381,93 +2394,323 @@ struct parse_line_conf {
 	bool from_include;
 };
 
-static int parse_line(char *buffer, void *data)
+/* Split @line in place into @key and @value. Returns 1 if @line sets a key, 0
+ * for empty lines, comments and non "lxc." lines and -1 on error.
+ */
+static int parse_line_key_value(char *line, char **key, char **value)
 {
-	char *dot, *key, *line, *linep, *value;
-	bool empty_line;
-	struct lxc_config_t *config;
-	int ret = 0;
-	char *dup = buffer;
-	struct parse_line_conf *plc = data;
-
-	/* If there are newlines in the config file we should keep them. */
-	empty_line = lxc_is_line_empty(dup);
-	if (empty_line)
-		dup = "\n";
-
-	/* we have to dup the buffer otherwise, at the re-exec for
-	 * reboot we modified the original string on the stack by
-	 * replacing '=' by '\0' below
-	 */
-	linep = line = strdup(buffer);
-	if (!line)
-		return -1;
-
-	if (!plc->from_include) {
-		ret = append_unexp_config_line(line, plc->conf);
-		if (ret < 0)
-			goto on_error;
-	}
-
-	if (empty_line)
-		goto on_error;
+	char *dot;
 
 	line += lxc_char_left_gc(line, strlen(line));
 
 	/* ignore comments */
 	if (line[0] == '#')
-		goto on_error;
+		return 0;
 
 	/* martian option - don't add it to the config itself */
 	if (strncmp(line, "lxc.", 4))
-		goto on_error;
-
-	ret = -1;
+		return 0;
 
 	dot = strchr(line, '=');
 	if (!dot) {
 		ERROR("Invalid configuration line: %s", line);
-		goto on_error;
+		return -1;
 	}
 
 	*dot = '\0';
-	value = dot + 1;
+	*value = dot + 1;
 
-	key = line;
-	key[lxc_char_right_gc(key, strlen(key))] = '\0';
+	*key = line;
+	(*key)[lxc_char_right_gc(*key, strlen(*key))] = '\0';
 
-	value += lxc_char_left_gc(value, strlen(value));
-	value[lxc_char_right_gc(value, strlen(value))] = '\0';
+	*value += lxc_char_left_gc(*value, strlen(*value));
+	(*value)[lxc_char_right_gc(*value, strlen(*value))] = '\0';
 
-	if (*value == '\'' || *value == '\"') {
-		size_t len = strlen(value);
-		if (len > 1 && value[len - 1] == *value) {
-			value[len - 1] = '\0';
-			value++;
+	if (**value == '\'' || **value == '\"') {
+		size_t len = strlen(*value);
+		if (len > 1 && (*value)[len - 1] == **value) {
+			(*value)[len - 1] = '\0';
+			(*value)++;
 		}
 	}
 
+	return 1;
+}
+
+/* Parses @buffer in place. */
+static int parse_line(char *buffer, void *data)
+{
+	int ret;
+	char *key, *value;
+	struct lxc_config_t *config;
+	struct parse_line_conf *plc = data;
+
+	if (!plc->from_include) {
+		ret = append_unexp_config_line(buffer, plc->conf);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = parse_line_key_value(buffer, &key, &value);
+	if (ret <= 0)
+		return ret;
+
 	config = lxc_getconfig(key);
 	if (!config) {
 		ERROR("Unknown configuration key \"%s\"", key);
-		goto on_error;
+		return -1;
 	}
 
-	ret = config->set(key, value, plc->conf, data);
-
-on_error:
-	free(linep);
-	return ret;
+	return config->set(key, value, plc->conf, data);
 }
 
 static int lxc_config_readline(char *buffer, struct lxc_conf *conf)
 {
+	int ret;
+	char *line;
 	struct parse_line_conf c;
 
 	c.conf = conf;
 	c.from_include = false;
 
-	return parse_line(buffer, &c);
+	/* we have to dup the buffer otherwise, at the re-exec for
+	 * reboot we modified the original string on the stack by
+	 * replacing '=' by '\0' in parse_line()
+	 */
+	line = strdup(buffer);
+	if (!line)
+		return -1;
+
+	ret = parse_line(line, &c);
+	free(line);
+	return ret;
+}
+
+/* Included files such as the distro common.conf and userns.conf are shared by
+ * most containers on a host. Since they don't end up in the unexpanded config
+ * only the keys they set need to be remembered. Those are kept in a
+ * process-wide cache keyed by the file's identity and modification time so
+ * loading many containers parses each included file once.
+ */
+struct include_item {
+	struct lxc_config_t *config;
+	/* @key and @value share one allocation. */
+	char *key;
+	char *value;
+};
+
+struct include_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct include_item *items;
+	size_t nr_items, alloced;
+	/* One reference is held by the cache itself. */
+	int refcount;
+	struct include_cache_entry *next;
+};
+
+#define INCLUDE_CACHE_MAX 64
+
+static struct include_cache_entry *include_cache;
+static size_t include_cache_len;
+static pthread_mutex_t include_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void include_cache_entry_free(struct include_cache_entry *e)
+{
+	size_t i;
+
+	for (i = 0; i < e->nr_items; i++)
+		free(e->items[i].key);
+	free(e->items);
+	free(e);
+}
+
+static void include_cache_put(struct include_cache_entry *e)
+{
+	bool last;
+
+	pthread_mutex_lock(&include_cache_mutex);
+	last = --e->refcount == 0;
+	pthread_mutex_unlock(&include_cache_mutex);
+
+	if (last)
+		include_cache_entry_free(e);
+}
+
+static bool include_cache_match(const struct include_cache_entry *e,
+				const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino &&
+	       e->size == st->st_size &&
+	       e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Look up @st in the cache and take a reference. Hits are moved to the front
+ * and entries for the same file with a different mtime are dropped. Must be
+ * called with include_cache_mutex held.
+ */
+static struct include_cache_entry *include_cache_find(const struct stat *st)
+{
+	struct include_cache_entry **pp, *e;
+
+	for (pp = &include_cache; (e = *pp); pp = &e->next) {
+		if (e->dev != st->st_dev || e->ino != st->st_ino)
+			continue;
+
+		*pp = e->next;
+		if (!include_cache_match(e, st)) {
+			include_cache_len--;
+			if (--e->refcount == 0)
+				include_cache_entry_free(e);
+			return NULL;
+		}
+
+		e->next = include_cache;
+		include_cache = e;
+		e->refcount++;
+		return e;
+	}
+
+	return NULL;
+}
+
+/* Add @new to the cache evicting the least recently used entry if it is full.
+ * Returns the entry to use with a reference taken which is an existing one if
+ * another thread parsed the same file in the meantime.
+ */
+static struct include_cache_entry *include_cache_add(struct include_cache_entry *new,
+						     const struct stat *st)
+{
+	struct include_cache_entry **pp, *e, *evict = NULL;
+
+	pthread_mutex_lock(&include_cache_mutex);
+	e = include_cache_find(st);
+	if (e) {
+		pthread_mutex_unlock(&include_cache_mutex);
+		include_cache_entry_free(new);
+		return e;
+	}
+
+	if (include_cache_len >= INCLUDE_CACHE_MAX) {
+		for (pp = &include_cache; (*pp)->next; pp = &(*pp)->next)
+			;
+		evict = *pp;
+		*pp = NULL;
+		include_cache_len--;
+		if (--evict->refcount > 0)
+			evict = NULL;
+	}
+
+	new->refcount = 2;
+	new->next = include_cache;
+	include_cache = new;
+	include_cache_len++;
+	pthread_mutex_unlock(&include_cache_mutex);
+
+	if (evict)
+		include_cache_entry_free(evict);
+
+	return new;
+}
+
+static int include_cache_parse_line(char *buffer, void *data)
+{
+	int ret;
+	size_t keylen, valuelen;
+	char *key, *value;
+	struct include_item *item;
+	struct lxc_config_t *config;
+	struct include_cache_entry *e = data;
+
+	ret = parse_line_key_value(buffer, &key, &value);
+	if (ret <= 0)
+		return ret;
+
+	config = lxc_getconfig(key);
+	if (!config) {
+		ERROR("Unknown configuration key \"%s\"", key);
+		return -1;
+	}
+
+	if (e->nr_items == e->alloced) {
+		size_t alloced = e->alloced ? e->alloced * 2 : 32;
+
+		item = realloc(e->items, alloced * sizeof(*item));
+		if (!item)
+			return -1;
+		e->items = item;
+		e->alloced = alloced;
+	}
+	item = &e->items[e->nr_items];
+
+	keylen = strlen(key);
+	valuelen = strlen(value);
+	item->key = malloc(keylen + valuelen + 2);
+	if (!item->key)
+		return -1;
+	memcpy(item->key, key, keylen + 1);
+	item->value = item->key + keylen + 1;
+	memcpy(item->value, value, valuelen + 1);
+	item->config = config;
+	e->nr_items++;
+
+	return 0;
+}
+
+static int lxc_config_read_include(const char *file, struct lxc_conf *conf)
+{
+	int ret = 0;
+	size_t i;
+	struct stat st, cur;
+	struct include_cache_entry *e;
+
+	if (stat(file, &st) < 0) {
+		SYSERROR("Failed to stat %s", file);
+		return -1;
+	}
+
+	pthread_mutex_lock(&include_cache_mutex);
+	e = include_cache_find(&st);
+	pthread_mutex_unlock(&include_cache_mutex);
+
+	if (!e) {
+		e = malloc(sizeof(*e));
+		if (!e)
+			return -1;
+		memset(e, 0, sizeof(*e));
+		e->dev = st.st_dev;
+		e->ino = st.st_ino;
+		e->size = st.st_size;
+		e->mtime = st.st_mtim;
+
+		ret = lxc_file_for_each_line(file, include_cache_parse_line, e);
+		if (ret) {
+			include_cache_entry_free(e);
+			return ret;
+		}
+
+		/* Only remember what was read if the file didn't change while
+		 * it was being parsed.
+		 */
+		if (stat(file, &cur) == 0 && include_cache_match(e, &cur))
+			e = include_cache_add(e, &st);
+		else
+			e->refcount = 1;
+	}
+
+	for (i = 0; i < e->nr_items; i++) {
+		struct include_item *item = &e->items[i];
+
+		ret = item->config->set(item->key, item->value, conf, NULL);
+		if (ret)
+			break;
+	}
+
+	include_cache_put(e);
+	return ret;
 }
 
 int lxc_config_read(const char *file, struct lxc_conf *conf, bool from_include)
@@ -2485,6 +2728,9 @@ int lxc_config_read(const char *file, struct lxc_conf *conf, bool from_include)
 	if (!conf->rcfile)
 		conf->rcfile = strdup(file);
 
+	if (from_include)
+		return lxc_config_read_include(file, conf);
+
 	return lxc_file_for_each_line(file, parse_line, &c);
 }
 
@@ -2621,14 +2867,13 @@ static inline int lxc_get_conf_int(struct lxc_conf *c, char *retv, int inlen,
 /* Write out a configuration file. */
 void write_config(FILE *fout, struct lxc_conf *c)
 {
-	int ret;
-	size_t len = c->unexpanded_len;
-
-	if (!len)
-		return;
+	write_config_without_key(fout, c, NULL);
+}
 
-	ret = fwrite(c->unexpanded_config, 1, len, fout);
-	if (ret != len)
+/* Write out a configuration file leaving out all lines setting @key. */
+void write_config_without_key(FILE *fout, struct lxc_conf *c, const char *key)
+{
+	if (lxc_unexp_config_write(&c->unexpanded_config, fout, key) < 0)
 		SYSERROR("Error writing configuration file");
 }
 
@@ -2659,37 +2904,29 @@ bool do_append_unexp_config_line(struct lxc_conf *conf, const char *key,
 void clear_unexp_config_line(struct lxc_conf *conf, const char *key,
 			     bool rm_subkeys)
 {
-	char *lend;
-	char *lstart = conf->unexpanded_config;
+	lxc_unexp_config_clear(&conf->unexpanded_config, key, rm_subkeys);
+}
 
-	if (!conf->unexpanded_config)
-		return;
+/* Replace the @oldlen bytes at @p in @l with @new. */
+static bool unexp_line_replace(struct lxc_unexp_line *l, char *p, size_t oldlen,
+			       const char *new, size_t newlen)
+{
+	size_t off = p - l->line;
 
-	while (*lstart) {
-		lend = strchr(lstart, '\n');
-		char v;
-		if (!lend)
-			lend = lstart + strlen(lstart);
-		else
-			lend++;
-		if (strncmp(lstart, key, strlen(key)) != 0) {
-			lstart = lend;
-			continue;
-		}
-		if (!rm_subkeys) {
-			v = lstart[strlen(key)];
-			if (!isspace(v) && v != '=') {
-				lstart = lend;
-				continue;
-			}
-		}
-		conf->unexpanded_len -= (lend - lstart);
-		if (*lend == '\0') {
-			*lstart = '\0';
-			return;
-		}
-		memmove(lstart, lend, strlen(lend) + 1);
+	if (newlen > oldlen) {
+		char *tmp;
+
+		tmp = realloc(l->line, l->len - oldlen + newlen + 1);
+		if (!tmp)
+			return false;
+		l->line = tmp;
 	}
+
+	memmove(l->line + off + newlen, l->line + off + oldlen,
+		l->len - off - oldlen + 1);
+	memcpy(l->line + off, new, newlen);
+	l->len = l->len - oldlen + newlen;
+	return true;
 }
 
 bool clone_update_unexp_ovl_paths(struct lxc_conf *conf, const char *oldpath,
@@ -2697,9 +2934,10 @@ bool clone_update_unexp_ovl_paths(struct lxc_conf *conf, const char *oldpath,
 				  const char *newname, const char *ovldir)
 {
 	int ret;
-	char *lend, *newdir, *olddir, *p, *q;
+	size_t i;
+	char *newdir, *olddir, *p, *q;
 	size_t newdirlen, olddirlen;
-	char *lstart = conf->unexpanded_config;
+	struct lxc_unexp_config *u = &conf->unexpanded_config;
 	const char *key = "lxc.mount.entry";
 
 	olddirlen = strlen(ovldir) + strlen(oldpath) + strlen(oldname) + 2;
@@ -2720,30 +2958,20 @@ bool clone_update_unexp_ovl_paths(struct lxc_conf *conf, const char *oldpath,
 		return false;
 	}
 
-	if (!conf->unexpanded_config)
-		return true;
+	for (i = 0; i < u->nr_lines; i++) {
+		struct lxc_unexp_line *l = &u->lines[i];
 
-	while (*lstart) {
-		lend = strchr(lstart, '\n');
-		if (!lend)
-			lend = lstart + strlen(lstart);
-		else
-			lend++;
-
-		if (strncmp(lstart, key, strlen(key)) != 0)
-			goto next;
+		if (!l->line || strncmp(l->line, key, strlen(key)) != 0)
+			continue;
 
-		p = strchr(lstart + strlen(key), '=');
+		p = strchr(l->line + strlen(key), '=');
 		if (!p)
-			goto next;
+			continue;
 		p++;
 
 		while (isblank(*p))
 			p++;
 
-		if (p >= lend)
-			goto next;
-
 		/* Whenever an lxc.mount.entry entry is found in a line we check
 		*  if the substring " overlay" or the substring " aufs" is
 		*  present before doing any further work. We check for "
@@ -2751,52 +2979,19 @@ bool clone_update_unexp_ovl_paths(struct lxc_conf *conf, const char *oldpath,
 		*  least one space before them in a valid overlay
 		*  lxc.mount.entry (/A B overlay).  When the space before is
 		*  missing it is very likely that these substrings are part of a
-		*  path or something else. (Checking q >= lend ensures that we
-		*  only count matches in the current line.) */
-		if ((!(q = strstr(p, " overlay")) || q >= lend) &&
-		    (!(q = strstr(p, " aufs")) || q >= lend))
-			goto next;
+		*  path or something else. */
+		if (!strstr(p, " overlay") && !strstr(p, " aufs"))
+			continue;
 
-		if (!(q = strstr(p, olddir)) || (q >= lend))
-			goto next;
+		q = strstr(p, olddir);
+		if (!q)
+			continue;
 
 		/* replace the olddir with newdir */
-		if (olddirlen >= newdirlen) {
-			size_t diff = olddirlen - newdirlen;
-			memcpy(q, newdir, newdirlen);
-			if (olddirlen != newdirlen) {
-				memmove(q + newdirlen, q + newdirlen + diff,
-					strlen(q) - newdirlen - diff + 1);
-				lend -= diff;
-				conf->unexpanded_len -= diff;
-			}
-		} else {
-			char *new;
-			size_t diff = newdirlen - olddirlen;
-			size_t oldlen = conf->unexpanded_len;
-			size_t newlen = oldlen + diff;
-			size_t poffset = q - conf->unexpanded_config;
-
-			new = realloc(conf->unexpanded_config, newlen + 1);
-			if (!new) {
-				ERROR("Out of memory");
-				return false;
-			}
-			conf->unexpanded_len = newlen;
-			conf->unexpanded_alloced = newlen + 1;
-			new[newlen - 1] = '\0';
-			lend = new + (lend - conf->unexpanded_config);
-			/* move over the remainder to make room for the newdir
-			 */
-			memmove(new + poffset + newdirlen,
-				new + poffset + olddirlen,
-				oldlen - poffset - olddirlen + 1);
-			conf->unexpanded_config = new;
-			memcpy(new + poffset, newdir, newdirlen);
-			lend += diff;
+		if (!unexp_line_replace(l, q, olddirlen, newdir, newdirlen)) {
+			ERROR("Out of memory");
+			return false;
 		}
-	next:
-		lstart = lend;
 	}
 
 	return true;
@@ -2807,9 +3002,10 @@ bool clone_update_unexp_hooks(struct lxc_conf *conf, const char *oldpath,
 			      const char *newname)
 {
 	int ret;
-	char *lend, *newdir, *olddir, *p;
-	char *lstart = conf->unexpanded_config;
+	size_t i;
+	char *newdir, *olddir, *p;
 	size_t newdirlen, olddirlen;
+	struct lxc_unexp_config *u = &conf->unexpanded_config;
 	const char *key = "lxc.hook";
 
 	olddirlen = strlen(oldpath) + strlen(oldname) + 1;
@@ -2827,69 +3023,29 @@ bool clone_update_unexp_hooks(struct lxc_conf *conf, const char *oldpath,
 		ERROR("failed to create string");
 		return false;
 	}
-	if (!conf->unexpanded_config)
-		return true;
-	while (*lstart) {
-		lend = strchr(lstart, '\n');
-		if (!lend)
-			lend = lstart + strlen(lstart);
-		else
-			lend++;
 
-		if (strncmp(lstart, key, strlen(key)) != 0)
-			goto next;
+	for (i = 0; i < u->nr_lines; i++) {
+		struct lxc_unexp_line *l = &u->lines[i];
+
+		if (!l->line || strncmp(l->line, key, strlen(key)) != 0)
+			continue;
 
-		p = strchr(lstart + strlen(key), '=');
+		p = strchr(l->line + strlen(key), '=');
 		if (!p)
-			goto next;
+			continue;
 		p++;
 
 		while (isblank(*p))
 			p++;
 
-		if (p >= lend)
-			goto next;
-
 		if (strncmp(p, olddir, strlen(olddir)) != 0)
-			goto next;
+			continue;
 
 		/* replace the olddir with newdir */
-		if (olddirlen >= newdirlen) {
-			size_t diff = olddirlen - newdirlen;
-			memcpy(p, newdir, newdirlen);
-			if (olddirlen != newdirlen) {
-				memmove(p + newdirlen, p + newdirlen + diff,
-					strlen(p) - newdirlen - diff + 1);
-				lend -= diff;
-				conf->unexpanded_len -= diff;
-			}
-		} else {
-			char *new;
-			size_t diff = newdirlen - olddirlen;
-			size_t oldlen = conf->unexpanded_len;
-			size_t newlen = oldlen + diff;
-			size_t poffset = p - conf->unexpanded_config;
-
-			new = realloc(conf->unexpanded_config, newlen + 1);
-			if (!new) {
-				ERROR("failed to allocate memory");
-				return false;
-			}
-			conf->unexpanded_len = newlen;
-			conf->unexpanded_alloced = newlen + 1;
-			new[newlen - 1] = '\0';
-			lend = new + (lend - conf->unexpanded_config);
-			/* move over the remainder to make room for the newdir
-			 */
-			memmove(new + poffset + newdirlen,
-				new + poffset + olddirlen,
-				oldlen - poffset - olddirlen + 1);
-			conf->unexpanded_config = new;
-			memcpy(new + poffset, newdir, newdirlen);
-			lend += diff;
+		if (!unexp_line_replace(l, p, olddirlen, newdir, newdirlen)) {
+			ERROR("failed to allocate memory");
+			return false;
 		}
-	next:
-		lstart = lend;
 	}
 
 	return true;
@@ -2930,39 +3086,26 @@ static bool new_hwaddr(char *hwaddr)
  */
 bool network_new_hwaddrs(struct lxc_conf *conf)
 {
-	char *lend, *p, *p2;
+	size_t i;
+	char *p, *p2;
 	struct lxc_list *it;
 	const char *key = "lxc.network.hwaddr";
-	char *lstart = conf->unexpanded_config;
+	struct lxc_unexp_config *u = &conf->unexpanded_config;
 
-	if (!conf->unexpanded_config)
-		return true;
-
-	while (*lstart) {
+	for (i = 0; i < u->nr_lines; i++) {
 		char newhwaddr[18], oldhwaddr[17];
+		char *line = u->lines[i].line;
 
-		lend = strchr(lstart, '\n');
-		if (!lend)
-			lend = lstart + strlen(lstart);
-		else
-			lend++;
-
-		if (strncmp(lstart, key, strlen(key)) != 0) {
-			lstart = lend;
+		if (!line || strncmp(line, key, strlen(key)) != 0)
 			continue;
-		}
 
-		p = strchr(lstart + strlen(key), '=');
-		if (!p) {
-			lstart = lend;
+		p = strchr(line + strlen(key), '=');
+		if (!p)
 			continue;
-		}
 
 		p++;
 		while (isblank(*p))
 			p++;
-		if (!*p)
-			return true;
 
 		p2 = p;
 		while (*p2 && !isblank(*p2) && *p2 != '\n')
@@ -2970,7 +3113,6 @@ bool network_new_hwaddrs(struct lxc_conf *conf)
 
 		if ((p2 - p) != 17) {
 			WARN("Bad hwaddr entry");
-			lstart = lend;
 			continue;
 		}
 
@@ -2986,8 +3128,6 @@ bool network_new_hwaddrs(struct lxc_conf *conf)
 			if (n->hwaddr && memcmp(oldhwaddr, n->hwaddr, 17) == 0)
 				memcpy(n->hwaddr, newhwaddr, 17);
 		}
-
-		lstart = lend;
 	}
 
 	return true;
@@ -3015,6 +3155,64 @@ static int set_config_ephemeral(const char *key, const char *value,
 	return 0;
 }
 
+static int set_config_snapshot_dedup(const char *key, const char *value,
+				     struct lxc_conf *lxc_conf, void *data)
+{
+	/* Set config value to default. */
+	if (lxc_config_value_empty(value)) {
+		lxc_conf->snapshot_dedup = 0;
+		return 0;
+	}
+
+	/* Parse new config value. */
+	if (lxc_safe_uint(value, &lxc_conf->snapshot_dedup) < 0)
+		return -1;
+
+	if (lxc_conf->snapshot_dedup > 1) {
+		ERROR("Wrong value for lxc.snapshot.dedup. Can only be set to 0 or 1");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int set_config_ephemeral_pool(const char *key, const char *value,
+				     struct lxc_conf *lxc_conf, void *data)
+{
+	bool is_empty;
+
+	is_empty = lxc_config_value_empty(value);
+
+	if (strcmp(key + 19, "size") == 0) { /* lxc.ephemeral.pool.size */
+		/* Set config value to default. */
+		if (is_empty) {
+			lxc_conf->ephemeral_pool_size = 0;
+			return 0;
+		}
+
+		/* Parse new config value. */
+		return lxc_safe_uint(value, &lxc_conf->ephemeral_pool_size);
+	} else if (strcmp(key + 19, "frozen") == 0) { /* lxc.ephemeral.pool.frozen */
+		/* Set config value to default. */
+		if (is_empty) {
+			lxc_conf->ephemeral_pool_frozen = 0;
+			return 0;
+		}
+
+		/* Parse new config value. */
+		if (lxc_safe_uint(value, &lxc_conf->ephemeral_pool_frozen) < 0)
+			return -1;
+
+		if (lxc_conf->ephemeral_pool_frozen > 1)
+			return -1;
+
+		return 0;
+	}
+
+	SYSERROR("Unknown key: %s", key);
+	return -1;
+}
+
 /* Callbacks to get configuration items. */
 static int get_config_personality(const char *key, char *retv, int inlen,
 				  struct lxc_conf *c)
@@ -3320,6 +3518,12 @@ static int get_config_rootfs_options(const char *key, char *retv, int inlen,
 	return lxc_get_conf_str(retv, inlen, c->rootfs.options);
 }
 
+static int get_config_rootfs_overlay_tmpfs(const char *key, char *retv,
+					   int inlen, struct lxc_conf *c)
+{
+	return lxc_get_conf_str(retv, inlen, c->rootfs.overlay_tmpfs);
+}
+
 static int get_config_rootfs_backend(const char *key, char *retv, int inlen,
 				     struct lxc_conf *c)
 {
@@ -3609,6 +3813,8 @@ static int get_config_start(const char *key, char *retv, int inlen,
 		return lxc_get_conf_int(c, retv, inlen, c->start_delay);
 	else if (strcmp(key + 10, "order") == 0)
 		return lxc_get_conf_int(c, retv, inlen, c->start_order);
+	else if (strcmp(key + 10, "profile") == 0)
+		return lxc_get_conf_str(retv, inlen, c->start_profile);
 
 	return -1;
 }
@@ -3677,6 +3883,23 @@ static int get_config_ephemeral(const char *key, char *retv, int inlen,
 	return lxc_get_conf_int(c, retv, inlen, c->ephemeral);
 }
 
+static int get_config_snapshot_dedup(const char *key, char *retv, int inlen,
+				     struct lxc_conf *c)
+{
+	return lxc_get_conf_int(c, retv, inlen, c->snapshot_dedup);
+}
+
+static int get_config_ephemeral_pool(const char *key, char *retv, int inlen,
+				     struct lxc_conf *c)
+{
+	if (strcmp(key + 19, "size") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->ephemeral_pool_size);
+	else if (strcmp(key + 19, "frozen") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->ephemeral_pool_frozen);
+
+	return -1;
+}
+
 /* Callbacks to clear config items. */
 static inline int clr_config_personality(const char *key, struct lxc_conf *c,
 					 void *data)
@@ -3808,6 +4031,15 @@ static inline int clr_config_rootfs_options(const char *key, struct lxc_conf *c,
 	return 0;
 }
 
+static inline int clr_config_rootfs_overlay_tmpfs(const char *key,
+						  struct lxc_conf *c,
+						  void *data)
+{
+	free(c->rootfs.overlay_tmpfs);
+	c->rootfs.overlay_tmpfs = NULL;
+	return 0;
+}
+
 static inline int clr_config_rootfs_backend(const char *key, struct lxc_conf *c,
 					    void *data)
 {
@@ -3921,6 +4153,10 @@ static inline int clr_config_start(const char *key, struct lxc_conf *c,
 		c->start_delay = 0;
 	else if (strcmp(key + 10, "order") == 0)
 		c->start_order = 0;
+	else if (strcmp(key + 10, "profile") == 0) {
+		free(c->start_profile);
+		c->start_profile = NULL;
+	}
 
 	return 0;
 }
@@ -3973,6 +4209,24 @@ static inline int clr_config_ephemeral(const char *key, struct lxc_conf *c,
 	return 0;
 }
 
+static inline int clr_config_snapshot_dedup(const char *key,
+					    struct lxc_conf *c, void *data)
+{
+	c->snapshot_dedup = 0;
+	return 0;
+}
+
+static inline int clr_config_ephemeral_pool(const char *key, struct lxc_conf *c,
+					    void *data)
+{
+	if (strcmp(key + 19, "size") == 0)
+		c->ephemeral_pool_size = 0;
+	else if (strcmp(key + 19, "frozen") == 0)
+		c->ephemeral_pool_frozen = 0;
+
+	return 0;
+}
+
 static inline int clr_config_includefiles(const char *key, struct lxc_conf *c,
 					  void *data)
 {
@@ -61,6 +61,8 @@ extern int lxc_fill_elevated_privileges(char *flaglist, int *flags);
 
 extern int lxc_clear_config_item(struct lxc_conf *c, const char *key);
 extern void write_config(FILE *fout, struct lxc_conf *c);
+extern void write_config_without_key(FILE *fout, struct lxc_conf *c,
+				     const char *key);
 
 extern bool do_append_unexp_config_line(struct lxc_conf *conf, const char *key, const char *v);
 
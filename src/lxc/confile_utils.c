@@ -19,6 +19,8 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -165,6 +167,96 @@ on_error:
 	return ret;
 }
 
+/* Undo the octal escapes getmntent() understands in place. */
+static char *decode_mntent_field(char *field)
+{
+	char *rp = field, *wp = field;
+
+	while (*rp) {
+		if (rp[0] != '\\') {
+			*wp++ = *rp++;
+		} else if (!strncmp(rp + 1, "040", 3)) {
+			*wp++ = ' ';
+			rp += 4;
+		} else if (!strncmp(rp + 1, "011", 3)) {
+			*wp++ = '\t';
+			rp += 4;
+		} else if (!strncmp(rp + 1, "012", 3)) {
+			*wp++ = '\n';
+			rp += 4;
+		} else if (rp[1] == '\\') {
+			*wp++ = '\\';
+			rp += 2;
+		} else if (!strncmp(rp + 1, "134", 3)) {
+			*wp++ = '\\';
+			rp += 4;
+		} else {
+			*wp++ = *rp++;
+		}
+	}
+	*wp = '\0';
+
+	return field;
+}
+
+static char *next_mntent_field(char **head)
+{
+	char *field;
+
+	field = strsep(head, " \t");
+	if (!field)
+		return "";
+
+	if (*head)
+		*head += strspn(*head, " \t");
+
+	return decode_mntent_field(field);
+}
+
+/* Tokenize an lxc.mount.entry exactly like getmntent() would tokenize the same
+ * line read from an fstab file.
+ */
+int lxc_parse_mount_entry(const char *value, struct lxc_mount_entry *entry)
+{
+	size_t len;
+	char *head;
+
+	memset(entry, 0, sizeof(*entry));
+
+	entry->buf = strdup(value);
+	if (!entry->buf)
+		return -1;
+
+	len = strlen(entry->buf);
+	while (len > 0 && (entry->buf[len - 1] == ' ' ||
+			   entry->buf[len - 1] == '\t' ||
+			   entry->buf[len - 1] == '\n'))
+		entry->buf[--len] = '\0';
+
+	head = entry->buf + strspn(entry->buf, " \t");
+	if (*head == '\0' || *head == '#')
+		return 0;
+
+	entry->mntent.mnt_fsname = next_mntent_field(&head);
+	entry->mntent.mnt_dir = next_mntent_field(&head);
+	entry->mntent.mnt_type = next_mntent_field(&head);
+	entry->mntent.mnt_opts = next_mntent_field(&head);
+
+	switch (head ? sscanf(head, " %d %d ", &entry->mntent.mnt_freq,
+			      &entry->mntent.mnt_passno) : 0) {
+	case 0:
+		entry->mntent.mnt_freq = 0;
+		/* fallthrough */
+	case 1:
+		entry->mntent.mnt_passno = 0;
+		/* fallthrough */
+	case 2:
+		break;
+	}
+
+	return 0;
+}
+
 bool lxc_config_value_empty(const char *value)
 {
 	if (value && strlen(value) > 0)
@@ -325,3 +417,267 @@ int network_ifname(char *valuep, const char *value)
 	strcpy(valuep, value);
 	return 0;
 }
+
+/* Length of the key @line starts with. Comments, blank lines and indented lines
+ * have no key.
+ */
+static size_t unexp_key_len(const char *line)
+{
+	if (isspace(line[0]) || line[0] == '#')
+		return 0;
+
+	return strcspn(line, " \t\n\v\f\r=");
+}
+
+static size_t unexp_key_hash(const char *key, size_t len)
+{
+	size_t i;
+	uint32_t hash = 2166136261U;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct lxc_unexp_key *unexp_key_lookup(const struct lxc_unexp_config *u,
+					      const char *key, size_t len)
+{
+	struct lxc_unexp_key *k;
+
+	if (!u->nr_buckets)
+		return NULL;
+
+	k = u->keys[unexp_key_hash(key, len) & (u->nr_buckets - 1)];
+	for (; k; k = k->next)
+		if (strncmp(k->key, key, len) == 0 && k->key[len] == '\0')
+			return k;
+
+	return NULL;
+}
+
+static int unexp_keys_grow(struct lxc_unexp_config *u)
+{
+	size_t i, nr_buckets;
+	struct lxc_unexp_key **keys, *k, *next;
+
+	nr_buckets = u->nr_buckets ? u->nr_buckets * 2 : 64;
+	keys = calloc(nr_buckets, sizeof(*keys));
+	if (!keys)
+		return -1;
+
+	for (i = 0; i < u->nr_buckets; i++) {
+		for (k = u->keys[i]; k; k = next) {
+			size_t h;
+
+			next = k->next;
+			h = unexp_key_hash(k->key, strlen(k->key)) & (nr_buckets - 1);
+			k->next = keys[h];
+			keys[h] = k;
+		}
+	}
+
+	free(u->keys);
+	u->keys = keys;
+	u->nr_buckets = nr_buckets;
+	return 0;
+}
+
+static struct lxc_unexp_key *unexp_key_get(struct lxc_unexp_config *u,
+					   const char *key, size_t len)
+{
+	size_t h;
+	struct lxc_unexp_key *k;
+
+	k = unexp_key_lookup(u, key, len);
+	if (k)
+		return k;
+
+	if (u->nr_keys >= u->nr_buckets && unexp_keys_grow(u) < 0)
+		return NULL;
+
+	k = malloc(sizeof(*k));
+	if (!k)
+		return NULL;
+	memset(k, 0, sizeof(*k));
+
+	k->key = strndup(key, len);
+	if (!k->key) {
+		free(k);
+		return NULL;
+	}
+
+	h = unexp_key_hash(key, len) & (u->nr_buckets - 1);
+	k->next = u->keys[h];
+	u->keys[h] = k;
+	u->nr_keys++;
+	return k;
+}
+
+/* Squeeze out cleared lines once they make up half of the vector and rebuild
+ * the key index. The number of lines per key can only shrink so this cannot
+ * fail.
+ */
+static void unexp_config_compact(struct lxc_unexp_config *u)
+{
+	size_t i, n = 0;
+
+	if (u->nr_cleared < 64 || u->nr_cleared * 2 < u->nr_lines)
+		return;
+
+	for (i = 0; i < u->nr_buckets; i++) {
+		struct lxc_unexp_key *k;
+
+		for (k = u->keys[i]; k; k = k->next)
+			k->nr_idx = 0;
+	}
+
+	for (i = 0; i < u->nr_lines; i++) {
+		struct lxc_unexp_line *l = &u->lines[i];
+
+		if (!l->line)
+			continue;
+
+		if (l->key_len) {
+			struct lxc_unexp_key *k;
+
+			k = unexp_key_lookup(u, l->line, l->key_len);
+			k->idx[k->nr_idx++] = n;
+		}
+		u->lines[n++] = *l;
+	}
+
+	u->nr_lines = n;
+	u->nr_cleared = 0;
+}
+
+int lxc_unexp_config_append(struct lxc_unexp_config *u, const char *line)
+{
+	size_t len = strlen(line);
+	struct lxc_unexp_line *l;
+	struct lxc_unexp_key *k = NULL;
+
+	if (u->nr_lines == u->alloced) {
+		size_t alloced = u->alloced ? u->alloced * 2 : 64;
+
+		l = realloc(u->lines, alloced * sizeof(*l));
+		if (!l)
+			return -1;
+		u->lines = l;
+		u->alloced = alloced;
+	}
+	l = &u->lines[u->nr_lines];
+
+	l->key_len = unexp_key_len(line);
+	if (l->key_len) {
+		k = unexp_key_get(u, line, l->key_len);
+		if (!k)
+			return -1;
+
+		if (k->nr_idx == k->alloced) {
+			size_t alloced = k->alloced ? k->alloced * 2 : 4;
+			size_t *idx;
+
+			idx = realloc(k->idx, alloced * sizeof(*idx));
+			if (!idx)
+				return -1;
+			k->idx = idx;
+			k->alloced = alloced;
+		}
+	}
+
+	l->line = malloc(len + 2);
+	if (!l->line)
+		return -1;
+	memcpy(l->line, line, len);
+	if (len == 0 || line[len - 1] != '\n')
+		l->line[len++] = '\n';
+	l->line[len] = '\0';
+	l->len = len;
+
+	if (k)
+		k->idx[k->nr_idx++] = u->nr_lines;
+	u->nr_lines++;
+	return 0;
+}
+
+static void unexp_key_clear(struct lxc_unexp_config *u, struct lxc_unexp_key *k)
+{
+	size_t i;
+
+	for (i = 0; i < k->nr_idx; i++) {
+		struct lxc_unexp_line *l = &u->lines[k->idx[i]];
+
+		free(l->line);
+		l->line = NULL;
+		u->nr_cleared++;
+	}
+	k->nr_idx = 0;
+}
+
+void lxc_unexp_config_clear(struct lxc_unexp_config *u, const char *key,
+			    bool prefix)
+{
+	size_t i, len = strlen(key);
+	struct lxc_unexp_key *k;
+
+	if (!prefix) {
+		k = unexp_key_lookup(u, key, len);
+		if (k)
+			unexp_key_clear(u, k);
+	} else {
+		for (i = 0; i < u->nr_buckets; i++)
+			for (k = u->keys[i]; k; k = k->next)
+				if (strncmp(k->key, key, len) == 0)
+					unexp_key_clear(u, k);
+	}
+
+	unexp_config_compact(u);
+}
+
+int lxc_unexp_config_write(const struct lxc_unexp_config *u, FILE *f,
+			   const char *skip_key)
+{
+	size_t i, skip_len = skip_key ? strlen(skip_key) : 0;
+
+	for (i = 0; i < u->nr_lines; i++) {
+		const struct lxc_unexp_line *l = &u->lines[i];
+
+		if (!l->line)
+			continue;
+
+		if (skip_len && l->key_len == skip_len &&
+		    strncmp(l->line, skip_key, skip_len) == 0)
+			continue;
+
+		if (fwrite(l->line, 1, l->len, f) != l->len)
+			return -1;
+	}
+
+	return 0;
+}
+
+void lxc_unexp_config_free(struct lxc_unexp_config *u)
+{
+	size_t i;
+
+	for (i = 0; i < u->nr_lines; i++)
+		free(u->lines[i].line);
+	free(u->lines);
+
+	for (i = 0; i < u->nr_buckets; i++) {
+		struct lxc_unexp_key *k, *next;
+
+		for (k = u->keys[i]; k; k = next) {
+			next = k->next;
+			free(k->key);
+			free(k->idx);
+			free(k);
+		}
+	}
+	free(u->keys);
+
+	memset(u, 0, sizeof(*u));
+}
@@ -21,6 +21,7 @@
 #define __LXC_CONFILE_UTILS_H
 
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "conf.h"
 #include "confile_utils.h"
@@ -48,6 +49,9 @@
 extern int parse_idmaps(const char *idmap, char *type, unsigned long *nsid,
 			unsigned long *hostid, unsigned long *range);
 
+extern int lxc_parse_mount_entry(const char *value,
+				 struct lxc_mount_entry *entry);
+
 extern bool lxc_config_value_empty(const char *value);
 extern struct lxc_netdev *lxc_find_netdev_by_idx(struct lxc_conf *conf,
 						 unsigned int idx);
@@ -56,4 +60,17 @@ extern struct lxc_netdev *lxc_get_netdev_by_idx(struct lxc_conf *conf,
 extern void lxc_log_configured_netdevs(const struct lxc_conf *conf);
 extern int network_ifname(char *valuep, const char *value);
 
+/* Append @line to @u, adding a trailing newline if it is missing. */
+extern int lxc_unexp_config_append(struct lxc_unexp_config *u,
+				   const char *line);
+/* Clear all lines whose key is @key or, if @prefix is true, whose key starts
+ * with @key.
+ */
+extern void lxc_unexp_config_clear(struct lxc_unexp_config *u, const char *key,
+				   bool prefix);
+/* Write all lines of @u to @f except for the ones whose key is @skip_key. */
+extern int lxc_unexp_config_write(const struct lxc_unexp_config *u, FILE *f,
+				  const char *skip_key);
+extern void lxc_unexp_config_free(struct lxc_unexp_config *u);
+
 #endif /* __LXC_CONFILE_UTILS_H */
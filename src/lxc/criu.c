@@ -21,6 +21,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 #define _GNU_SOURCE
+#include <fcntl.h>
 #include <inttypes.h>
 #include <linux/limits.h>
 #include <sched.h>
@@ -62,6 +63,17 @@
 
 #define CRIU_IN_FLIGHT_SUPPORT	"2.4"
 #define CRIU_EXTERNAL_NOT_VETH	"2.8"
+#define CRIU_STREAM_SUPPORT	"3.15"
+
+/* criu records per-dump statistics in this (service) image, see
+ * images/stats.proto in the criu sources.
+ */
+#define CRIU_STATS_DUMP_IMG	"stats-dump.img"
+#define CRIU_IMG_SERVICE_MAGIC	0x55105940
+#define CRIU_STATS_MAGIC	0x57093306
+
+/* Pre-dump iterations if the caller didn't ask for a specific number. */
+#define CRIU_DEFAULT_PREDUMP_ITERATIONS 8
 
 lxc_log_define(lxc_criu, lxc);
 
@@ -211,6 +223,10 @@ static void exec_criu(struct criu_opts *opts)
 		if (opts->user->predump_dir)
 			static_args += 2;
 
+		/* --track-mem */
+		if (strcmp(opts->action, "pre-dump") == 0 || opts->user->predump_dir)
+			static_args++;
+
 		/* --page-server --address <address> --port <port> */
 		if (opts->user->pageserver_address && opts->user->pageserver_port)
 			static_args += 5;
@@ -257,6 +273,10 @@ static void exec_criu(struct criu_opts *opts)
 	if (opts->user->action_script)
 		static_args += 2;
 
+	/* --stream */
+	if (opts->user->stream)
+		static_args++;
+
 	static_args += 2 * lxc_list_len(&opts->c->lxc_conf->mount_list);
 
 	ret = snprintf(log, PATH_MAX, "%s/%s.log", opts->user->directory, opts->action);
@@ -378,6 +398,9 @@ static void exec_criu(struct criu_opts *opts)
 		DECLARE_ARG(opts->user->action_script);
 	}
 
+	if (opts->user->stream)
+		DECLARE_ARG("--stream");
+
 	mnts = make_anonymous_mount_file(&opts->c->lxc_conf->mount_list);
 	if (!mnts)
 		goto err;
@@ -459,6 +482,12 @@ static void exec_criu(struct criu_opts *opts)
 			DECLARE_ARG(opts->user->predump_dir);
 		}
 
+		/* Let criu track dirty pages so that the next iteration only
+		 * has to dump what changed since this one.
+		 */
+		if (strcmp(opts->action, "pre-dump") == 0 || opts->user->predump_dir)
+			DECLARE_ARG("--track-mem");
+
 		if (opts->user->pageserver_address && opts->user->pageserver_port) {
 			DECLARE_ARG("--page-server");
 			DECLARE_ARG("--address");
@@ -765,7 +794,8 @@ version_error:
 
 /* Check and make sure the container has a configuration that we know CRIU can
  * dump. */
-static bool criu_ok(struct lxc_container *c, char **criu_version)
+static bool criu_ok(struct lxc_container *c, struct migrate_opts *opts,
+		    char **criu_version)
 {
 	struct lxc_list *it;
 
@@ -777,6 +807,13 @@ static bool criu_ok(struct lxc_container *c, char **criu_version)
 	if (!criu_version_ok(criu_version))
 		return false;
 
+	if (opts->stream && cmp_version(*criu_version, CRIU_STREAM_SUPPORT) < 0) {
+		ERROR("Image streaming requires criu " CRIU_STREAM_SUPPORT " or greater");
+		free(*criu_version);
+		*criu_version = NULL;
+		return false;
+	}
+
 	/* We only know how to restore containers with veth networks. */
 	lxc_list_for_each(it, &c->lxc_conf->network) {
 		struct lxc_netdev *n = it->elem;
@@ -835,16 +872,119 @@ out_unlock:
 	return !has_error;
 }
 
+/* Run criu-image-streamer in directory, connected to the caller's stream fd.
+ * In "capture" mode it writes the images criu dumps to the fd, in "serve" mode
+ * it feeds criu the images it reads from the fd. Returns the pid of the
+ * streamer once its socket is ready for criu to connect to. The streamer keeps
+ * reporting progress on *progress_fd, which must stay open until it exited.
+ */
+static pid_t start_image_streamer(const char *directory, const char *mode,
+				  int stream_fd, int *progress_fd)
+{
+	pid_t pid;
+	ssize_t n;
+	int progress[2];
+	char buf[64];
+
+	if (pipe(progress) < 0) {
+		SYSERROR("pipe() failed");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("fork failed");
+		close(progress[0]);
+		close(progress[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		int fd;
+		char *path, fdstr[32];
+		int target = strcmp(mode, "capture") == 0 ? STDOUT_FILENO : STDIN_FILENO;
+
+		close(progress[0]);
+
+		/* keep the progress pipe clear of the standard fds */
+		fd = fcntl(progress[1], F_DUPFD, 3);
+		if (fd < 0)
+			_exit(EXIT_FAILURE);
+
+		if (dup2(stream_fd, target) < 0)
+			_exit(EXIT_FAILURE);
+
+		if (snprintf(fdstr, sizeof(fdstr), "%d", fd) < 0)
+			_exit(EXIT_FAILURE);
+
+		path = on_path("criu-image-streamer", NULL);
+		if (!path) {
+			ERROR("Couldn't find criu-image-streamer binary");
+			_exit(EXIT_FAILURE);
+		}
+
+		execl(path, "criu-image-streamer", "--images-dir", directory,
+		      "--progress-fd", fdstr, mode, (char *)NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(progress[1]);
+
+	/* The streamer reports "socket-init" once criu can connect. */
+	n = lxc_read_nointr(progress[0], buf, sizeof(buf) - 1);
+	if (n <= 0 || strncmp(buf, "socket-init", strlen("socket-init"))) {
+		ERROR("criu-image-streamer failed to start in \"%s\"", directory);
+		close(progress[0]);
+		(void)wait_for_pid(pid);
+		return -1;
+	}
+
+	if (lxc_set_cloexec(progress[0]) < 0) {
+		SYSERROR("Failed to set FD_CLOEXEC on progress pipe");
+		close(progress[0]);
+		kill(pid, SIGKILL);
+		(void)wait_for_pid(pid);
+		return -1;
+	}
+
+	*progress_fd = progress[0];
+	return pid;
+}
+
+/* Wait for the streamer after criu is done with it, or kill it if criu
+ * failed and might never have connected.
+ */
+static bool finish_image_streamer(pid_t pid, int progress_fd, bool abort)
+{
+	int ret;
+	char buf[4096];
+
+	if (abort)
+		kill(pid, SIGKILL);
+
+	/* drain the progress reports so the streamer never blocks on them */
+	while (lxc_read_nointr(progress_fd, buf, sizeof(buf)) > 0)
+		;
+	close(progress_fd);
+
+	ret = wait_for_pid(pid);
+	if (ret < 0)
+		ERROR("criu-image-streamer failed");
+
+	return ret == 0;
+}
+
 /* do_restore never returns, the calling process is used as the monitor process.
  * do_restore calls _exit() if it fails.
  */
 static void do_restore(struct lxc_container *c, int status_pipe, struct migrate_opts *opts, char *criu_version)
 {
 	int fd, ret;
-	pid_t pid;
+	pid_t pid, streamer = -1;
 	struct lxc_handler *handler;
 	int status = 0;
 	int pipes[2] = {-1, -1};
+	int progress_fd = -1;
 
 	/* Try to detach from the current controlling tty if it exists.
 	 * Othwerise, lxc_init (via lxc_console) will attach the container's
@@ -887,6 +1027,13 @@ static void do_restore(struct lxc_container *c, int status_pipe, struct migrate_
 		goto out_fini_handler;
 	}
 
+	if (opts->stream) {
+		streamer = start_image_streamer(opts->directory, "serve",
+						opts->stream_fd, &progress_fd);
+		if (streamer < 0)
+			goto out_fini_handler;
+	}
+
 	if (pipe2(pipes, O_CLOEXEC) < 0) {
 		SYSERROR("pipe() failed");
 		goto out_fini_handler;
@@ -904,6 +1051,9 @@ static void do_restore(struct lxc_container *c, int status_pipe, struct migrate_
 		close(status_pipe);
 		status_pipe = -1;
 
+		/* the streamer belongs to our parent */
+		streamer = -1;
+
 		close(pipes[0]);
 		pipes[0] = -1;
 
@@ -977,6 +1127,15 @@ static void do_restore(struct lxc_container *c, int status_pipe, struct migrate_
 			goto out_fini_handler;
 		}
 
+		/* Reap the streamer before looking for the restored init among
+		 * our children.
+		 */
+		if (streamer > 0) {
+			finish_image_streamer(streamer, progress_fd,
+					      !WIFEXITED(status) || WEXITSTATUS(status));
+			streamer = -1;
+		}
+
 		if (WIFEXITED(status)) {
 			char buf[4096];
 
@@ -1062,6 +1221,9 @@ out_fini_handler:
 	if (pipes[1] >= 0)
 		close(pipes[1]);
 
+	if (streamer > 0)
+		finish_image_streamer(streamer, progress_fd, true);
+
 	lxc_fini(c->name, handler);
 
 out:
@@ -1136,16 +1298,41 @@ static int save_tty_major_minor(char *directory, struct lxc_container *c, char *
 static bool do_dump(struct lxc_container *c, char *mode, struct migrate_opts *opts)
 {
 	int ret;
-	pid_t pid;
-	int criuout[2];
+	pid_t pid, streamer = -1;
+	int criuout[2], progress_fd = -1;
 	char *criu_version = NULL;
 
-	if (!criu_ok(c, &criu_version))
+	if (!criu_ok(c, opts, &criu_version))
 		return false;
 
+	/* Start the streamer first so that it doesn't inherit criu's output
+	 * pipe and keep it open.
+	 */
+	if (opts->stream) {
+		if (strcmp(mode, "dump")) {
+			ERROR("Image streaming is only supported for the final dump");
+			free(criu_version);
+			return false;
+		}
+
+		if (mkdir_p(opts->directory, 0700) < 0) {
+			free(criu_version);
+			return false;
+		}
+
+		streamer = start_image_streamer(opts->directory, "capture",
+						opts->stream_fd, &progress_fd);
+		if (streamer < 0) {
+			free(criu_version);
+			return false;
+		}
+	}
+
 	ret = pipe(criuout);
 	if (ret < 0) {
 		SYSERROR("pipe() failed");
+		if (streamer > 0)
+			finish_image_streamer(streamer, progress_fd, true);
 		free(criu_version);
 		return false;
 	}
@@ -1202,6 +1389,8 @@ static bool do_dump(struct lxc_container *c, char *mode, struct migrate_opts *op
 		if (w == -1) {
 			SYSERROR("waitpid");
 			close(criuout[0]);
+			if (streamer > 0)
+				finish_image_streamer(streamer, progress_fd, true);
 			free(criu_version);
 			return false;
 		}
@@ -1236,12 +1425,17 @@ static bool do_dump(struct lxc_container *c, char *mode, struct migrate_opts *op
 		if (!ret)
 			ERROR("criu output: %s", buf);
 
+		if (streamer > 0 && !finish_image_streamer(streamer, progress_fd, !ret))
+			ret = false;
+
 		free(criu_version);
 		return ret;
 	}
 fail:
 	close(criuout[0]);
 	close(criuout[1]);
+	if (streamer > 0)
+		finish_image_streamer(streamer, progress_fd, true);
 	rmdir(opts->directory);
 	free(criu_version);
 	return false;
@@ -1269,6 +1463,272 @@ bool __criu_dump(struct lxc_container *c, struct migrate_opts *opts)
 	return do_dump(c, "dump", opts);
 }
 
+/* Decode a protobuf varint starting at buf[*pos]. */
+static int pb_read_varint(const unsigned char *buf, size_t len, size_t *pos,
+			  uint64_t *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift = 0; shift < 64 && *pos < len; shift += 7) {
+		unsigned char b = buf[(*pos)++];
+
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Walk the fields of a protobuf encoded message, calling cb for each varint
+ * and length delimited field and skipping everything else.
+ */
+static int pb_for_each_field(const unsigned char *buf, size_t len,
+			     int (*cb)(unsigned int field, uint64_t val,
+				       const unsigned char *data, void *arg),
+			     void *arg)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		uint64_t key, val;
+		unsigned int field, wire;
+
+		if (pb_read_varint(buf, len, &pos, &key) < 0)
+			return -1;
+
+		field = key >> 3;
+		wire = key & 0x7;
+
+		switch (wire) {
+		case 0: /* varint */
+			if (pb_read_varint(buf, len, &pos, &val) < 0)
+				return -1;
+			if (cb(field, val, NULL, arg) < 0)
+				return -1;
+			break;
+		case 1: /* 64 bit */
+			pos += 8;
+			break;
+		case 2: /* length delimited */
+			if (pb_read_varint(buf, len, &pos, &val) < 0)
+				return -1;
+			if (val > len - pos)
+				return -1;
+			if (cb(field, val, buf + pos, arg) < 0)
+				return -1;
+			pos += val;
+			break;
+		case 5: /* 32 bit */
+			pos += 4;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return pos == len ? 0 : -1;
+}
+
+static int dump_stats_field(unsigned int field, uint64_t val,
+			    const unsigned char *data, void *arg)
+{
+	struct migrate_iteration_stats *stats = arg;
+
+	if (data)
+		return 0;
+
+	switch (field) {
+	case 1:
+		stats->freezing_time = val;
+		break;
+	case 2:
+		stats->frozen_time = val;
+		break;
+	case 3:
+		stats->memdump_time = val;
+		break;
+	case 4:
+		stats->memwrite_time = val;
+		break;
+	case 5:
+		stats->pages_scanned = val;
+		break;
+	case 6:
+		stats->pages_skipped_parent = val;
+		break;
+	case 7:
+		stats->pages_written = val;
+		break;
+	}
+
+	return 0;
+}
+
+static int stats_entry_field(unsigned int field, uint64_t val,
+			     const unsigned char *data, void *arg)
+{
+	/* StatsEntry.dump is field 1 */
+	if (field != 1 || !data)
+		return 0;
+
+	return pb_for_each_field(data, val, dump_stats_field, arg);
+}
+
+/* Read the statistics criu left in the images directory of a dump. */
+static bool load_dump_stats(const char *directory,
+			    struct migrate_iteration_stats *stats)
+{
+	int fd, ret;
+	ssize_t len;
+	uint32_t hdr[3];
+	unsigned char buf[512];
+	char path[PATH_MAX];
+
+	ret = snprintf(path, sizeof(path), "%s/" CRIU_STATS_DUMP_IMG, directory);
+	if (ret < 0 || ret >= sizeof(path))
+		return false;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("Failed to open \"%s\"", path);
+		return false;
+	}
+
+	/* service magic, image magic and the size of the single entry */
+	len = lxc_read_nointr(fd, hdr, sizeof(hdr));
+	if (len != sizeof(hdr) || hdr[0] != CRIU_IMG_SERVICE_MAGIC ||
+	    hdr[1] != CRIU_STATS_MAGIC || hdr[2] > sizeof(buf)) {
+		ERROR("Invalid criu statistics image \"%s\"", path);
+		close(fd);
+		return false;
+	}
+
+	len = lxc_read_nointr(fd, buf, hdr[2]);
+	close(fd);
+	if (len != hdr[2]) {
+		ERROR("Short read from criu statistics image \"%s\"", path);
+		return false;
+	}
+
+	if (pb_for_each_field(buf, len, stats_entry_field, stats) < 0) {
+		ERROR("Failed to decode criu statistics image \"%s\"", path);
+		return false;
+	}
+
+	return true;
+}
+
+/* Load, log and hand the statistics of one iteration to the caller. */
+static bool report_iteration(struct migrate_opts *opts, const char *directory,
+			     unsigned int iteration, bool final,
+			     struct migrate_iteration_stats *stats)
+{
+	bool loaded;
+	const char *what = final ? "dump" : "pre-dump";
+
+	memset(stats, 0, sizeof(*stats));
+	stats->iteration = iteration;
+	stats->final = final;
+
+	loaded = load_dump_stats(directory, stats);
+	if (!loaded)
+		WARN("No statistics for %s %u", what, iteration);
+	else
+		INFO("%s %u: %" PRIu64 " pages scanned, %" PRIu64
+		     " unchanged, %" PRIu64 " written, frozen for %" PRIu32 "us",
+		     what, iteration, stats->pages_scanned,
+		     stats->pages_skipped_parent, stats->pages_written,
+		     stats->frozen_time);
+
+	if (opts->iteration_cb)
+		opts->iteration_cb(stats, opts->iteration_data);
+
+	return loaded;
+}
+
+/* Run successive pre-dumps, each one only writing out the pages dirtied since
+ * the previous one, until the dirty set is small enough (or stops shrinking),
+ * then do the final dump on top of the last pre-dump. The pre-dumps live in
+ * "predump.N" subdirectories of the dump directory.
+ */
+bool __criu_iterative_dump(struct lxc_container *c, struct migrate_opts *opts)
+{
+	int ret;
+	unsigned int i, iterations;
+	uint64_t prev_written = UINT64_MAX;
+	struct migrate_opts iter_opts;
+	struct migrate_iteration_stats stats;
+	char dir[PATH_MAX], prev[32];
+
+	if (opts->predump_dir) {
+		ERROR("The iterative dump manages the pre-dump directories itself");
+		return false;
+	}
+
+	if (opts->stream) {
+		ERROR("Image streaming is not supported for iterative dumps");
+		return false;
+	}
+
+	iterations = opts->predump_iterations;
+	if (!iterations)
+		iterations = CRIU_DEFAULT_PREDUMP_ITERATIONS;
+
+	for (i = 0; i < iterations; i++) {
+		ret = snprintf(dir, sizeof(dir), "%s/predump.%u", opts->directory, i);
+		if (ret < 0 || ret >= sizeof(dir))
+			return false;
+
+		iter_opts = *opts;
+		iter_opts.directory = dir;
+		iter_opts.predump_dir = NULL;
+		if (i > 0) {
+			ret = snprintf(prev, sizeof(prev), "../predump.%u", i - 1);
+			if (ret < 0 || ret >= sizeof(prev))
+				return false;
+			iter_opts.predump_dir = prev;
+		}
+
+		if (!do_dump(c, "pre-dump", &iter_opts))
+			return false;
+
+		/* Without statistics we cannot tell whether we are converging,
+		 * so just go on until the iteration limit.
+		 */
+		if (!report_iteration(opts, dir, i, false, &stats))
+			continue;
+
+		if (stats.pages_written <= opts->predump_converge_pages) {
+			INFO("Dirty set converged after %u pre-dumps", i + 1);
+			break;
+		}
+
+		if (stats.pages_written >= prev_written) {
+			INFO("Dirty set stopped shrinking after %u pre-dumps", i + 1);
+			break;
+		}
+
+		prev_written = stats.pages_written;
+	}
+
+	if (i == iterations)
+		i--;
+
+	ret = snprintf(prev, sizeof(prev), "predump.%u", i);
+	if (ret < 0 || ret >= sizeof(prev))
+		return false;
+
+	iter_opts = *opts;
+	iter_opts.predump_dir = prev;
+	if (!__criu_dump(c, &iter_opts))
+		return false;
+
+	report_iteration(opts, opts->directory, i + 1, true, &stats);
+	return true;
+}
+
 bool __criu_restore(struct lxc_container *c, struct migrate_opts *opts)
 {
 	pid_t pid;
@@ -1286,7 +1746,7 @@ bool __criu_restore(struct lxc_container *c, struct migrate_opts *opts)
 		return false;
 	}
 
-	if (!criu_ok(c, &criu_version)) {
+	if (!criu_ok(c, opts, &criu_version)) {
 		close(pipefd[0]);
 		close(pipefd[1]);
 		return false;
@@ -28,16 +28,23 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/param.h>
 
+#include "cgroup.h"
+#include "cgroup_utils.h"
 #include "commands.h"
 #include "error.h"
 #include "log.h"
 #include "lxc.h"
+#include "lxccontainer.h"
 #include "monitor.h"
 #include "parse.h"
 #include "state.h"
+#include "utils.h"
 
 lxc_log_define(lxc_freezer, lxc);
 
@@ -56,49 +63,295 @@ lxc_state_t freezer_state(const char *name, const char *lxcpath)
 	return lxc_str2state(v);
 }
 
-static int do_freeze_thaw(bool freeze, const char *name, const char *lxcpath)
+/* Waiting for the legacy freezer starts polling freezer.state after 1ms and
+ * backs off to at most 100ms between polls. The unified freezer signals state
+ * changes through cgroup.events.
+ */
+#define FREEZER_POLL_MIN_MS 1
+#define FREEZER_POLL_MAX_MS 100
+
+enum freezer_type {
+	/* Go through the command socket of the container. */
+	FREEZER_CMD,
+	/* Access freezer.state of the legacy hierarchy directly. */
+	FREEZER_LEGACY,
+	/* Use cgroup.freeze and cgroup.events of the unified hierarchy. */
+	FREEZER_UNIFIED,
+};
+
+struct freezer_target {
+	const char *name;
+	const char *lxcpath;
+	enum freezer_type type;
+	char *dir;
+	int events_fd;
+	struct timespec start;
+	bool done;
+	int ret;
+	int64_t latency;
+};
+
+static void freezer_target_resolve(struct freezer_target *t)
+{
+	char *path;
+
+	t->type = FREEZER_CMD;
+	t->dir = NULL;
+	t->events_fd = -EBADF;
+
+	if (cgroup_hierarchy_version("freezer") == CGROUP_SUPER_MAGIC) {
+		t->dir = cgroup_get_cgroup_dir(t->name, t->lxcpath, "freezer");
+		if (t->dir)
+			t->type = FREEZER_LEGACY;
+		return;
+	}
+
+	if (cgroup_hierarchy_version(NULL) != CGROUP2_SUPER_MAGIC)
+		return;
+
+	t->dir = cgroup_get_cgroup_dir(t->name, t->lxcpath, NULL);
+	if (!t->dir)
+		return;
+
+	/* The unified freezer was added in 5.2. */
+	path = must_make_path(t->dir, "cgroup.events", NULL);
+	t->events_fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (t->events_fd < 0 || cg_events_frozen(t->events_fd) < 0) {
+		if (t->events_fd >= 0)
+			close(t->events_fd);
+		t->events_fd = -EBADF;
+		free(t->dir);
+		t->dir = NULL;
+		return;
+	}
+
+	t->type = FREEZER_UNIFIED;
+}
+
+static int freezer_target_write(struct freezer_target *t, bool freeze)
+{
+	int ret;
+	char *path;
+	const char *state = freeze ? "FROZEN" : "THAWED";
+
+	switch (t->type) {
+	case FREEZER_LEGACY:
+		path = must_make_path(t->dir, "freezer.state", NULL);
+		ret = lxc_write_to_file(path, state, strlen(state), false);
+		free(path);
+		return ret;
+	case FREEZER_UNIFIED:
+		path = must_make_path(t->dir, "cgroup.freeze", NULL);
+		ret = lxc_write_to_file(path, freeze ? "1" : "0", 1, false);
+		free(path);
+		return ret;
+	case FREEZER_CMD:
+		break;
+	}
+
+	return lxc_cgroup_set("freezer.state", state, t->name, t->lxcpath);
+}
+
+/* Returns 1 if @t reached the requested state, 0 if not and -1 on error. */
+static int freezer_target_check(struct freezer_target *t, bool freeze)
 {
 	int ret;
+	char *path;
 	char v[100];
 	const char *state = freeze ? "FROZEN" : "THAWED";
-	size_t state_len = 6;
+
+	switch (t->type) {
+	case FREEZER_UNIFIED:
+		ret = cg_events_frozen(t->events_fd);
+		if (ret < 0)
+			return -1;
+		return ret == freeze;
+	case FREEZER_LEGACY:
+		path = must_make_path(t->dir, "freezer.state", NULL);
+		ret = lxc_read_from_file(path, v, sizeof(v) - 1);
+		free(path);
+		if (ret < 0)
+			return -1;
+		v[ret] = '\0';
+		break;
+	case FREEZER_CMD:
+		ret = lxc_cgroup_get("freezer.state", v, sizeof(v), t->name,
+				     t->lxcpath);
+		if (ret < 0)
+			return -1;
+		v[99] = '\0';
+		break;
+	}
+
+	v[lxc_char_right_gc(v, strlen(v))] = '\0';
+
+	return strncmp(v, state, strlen(state)) == 0;
+}
+
+static int64_t timespec_diff_usec(const struct timespec *start,
+				  const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+	       (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Request the new state from all targets first so the kernel freezes them
+ * concurrently and then wait for all of them at once. Returns the number of
+ * targets that reached the requested state.
+ */
+static int do_freeze_thaw(bool freeze, struct freezer_target *targets,
+			  int count)
+{
+	int i, ret;
+	int done = 0, pending = count;
+	int timeout = FREEZER_POLL_MIN_MS;
 	lxc_state_t new_state = freeze ? FROZEN : THAWED;
+	struct pollfd *fds;
 
-	ret = lxc_cgroup_set("freezer.state", state, name, lxcpath);
-	if (ret < 0) {
-		ERROR("Failed to freeze %s", name);
+	fds = malloc(count * sizeof(*fds));
+	if (!fds)
 		return -1;
-	}
 
-	for (;;) {
-		ret = lxc_cgroup_get("freezer.state", v, sizeof(v), name, lxcpath);
+	for (i = 0; i < count; i++) {
+		struct freezer_target *t = &targets[i];
+
+		freezer_target_resolve(t);
+		t->done = false;
+		t->ret = -1;
+		t->latency = -1;
+
+		if (freeze) {
+			lxc_cmd_serve_state_clients(t->name, t->lxcpath, FREEZING);
+			lxc_monitor_send_state(t->name, FREEZING, t->lxcpath);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t->start);
+		ret = freezer_target_write(t, freeze);
 		if (ret < 0) {
-			ERROR("Failed to get freezer state of %s", name);
-			return -1;
+			ERROR("Failed to %s %s", freeze ? "freeze" : "unfreeze",
+			      t->name);
+			t->done = true;
+			pending--;
 		}
+	}
 
-		v[99] = '\0';
-		v[lxc_char_right_gc(v, strlen(v))] = '\0';
+	while (pending > 0) {
+		int nfds = 0;
+		bool legacy = false;
+		struct timespec now;
 
-		ret = strncmp(v, state, state_len);
-		if (ret == 0) {
-			lxc_cmd_serve_state_clients(name, lxcpath, new_state);
-			lxc_monitor_send_state(name, new_state, lxcpath);
-			return 0;
+		for (i = 0; i < count; i++) {
+			struct freezer_target *t = &targets[i];
+
+			if (t->done)
+				continue;
+
+			ret = freezer_target_check(t, freeze);
+			if (ret == 0) {
+				if (t->type == FREEZER_UNIFIED) {
+					fds[nfds].fd = t->events_fd;
+					fds[nfds].events = POLLPRI;
+					nfds++;
+				} else {
+					legacy = true;
+				}
+				continue;
+			}
+
+			t->done = true;
+			pending--;
+			if (ret < 0) {
+				ERROR("Failed to get freezer state of %s",
+				      t->name);
+				continue;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			t->latency = timespec_diff_usec(&t->start, &now);
+			t->ret = 0;
+			done++;
+			lxc_cmd_serve_state_clients(t->name, t->lxcpath, new_state);
+			lxc_monitor_send_state(t->name, new_state, t->lxcpath);
 		}
 
-		sleep(1);
+		if (pending == 0)
+			break;
+
+		/* cgroup.events changes are signalled via POLLPRI. The timeout
+		 * only matters for targets on the legacy hierarchy.
+		 */
+		ret = poll(fds, nfds, legacy ? timeout : -1);
+		if (ret < 0 && errno != EINTR) {
+			SYSERROR("Failed to wait for freezer state change");
+			break;
+		}
+
+		if (legacy && timeout < FREEZER_POLL_MAX_MS)
+			timeout = timeout * 2 < FREEZER_POLL_MAX_MS
+					  ? timeout * 2
+					  : FREEZER_POLL_MAX_MS;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (targets[i].events_fd >= 0)
+			close(targets[i].events_fd);
+		free(targets[i].dir);
 	}
+	free(fds);
+
+	return done;
+}
+
+static int freeze_thaw_one(bool freeze, const char *name, const char *lxcpath)
+{
+	struct freezer_target t = {
+		.name = name,
+		.lxcpath = lxcpath,
+	};
+
+	if (do_freeze_thaw(freeze, &t, 1) != 1)
+		return -1;
+
+	TRACE("%s %s in %" PRId64 "us", freeze ? "Froze" : "Unfroze", name,
+	      t.latency);
+	return 0;
 }
 
 int lxc_freeze(const char *name, const char *lxcpath)
 {
-	lxc_cmd_serve_state_clients(name, lxcpath, FREEZING);
-	lxc_monitor_send_state(name, FREEZING, lxcpath);
-	return do_freeze_thaw(true, name, lxcpath);
+	return freeze_thaw_one(true, name, lxcpath);
 }
 
 int lxc_unfreeze(const char *name, const char *lxcpath)
 {
-	return do_freeze_thaw(false, name, lxcpath);
+	return freeze_thaw_one(false, name, lxcpath);
+}
+
+int lxc_freeze_many(struct lxc_container **containers, int count, bool freeze,
+		    int64_t *latency_usecs)
+{
+	int i, ret;
+	struct freezer_target *targets;
+
+	if (count <= 0)
+		return 0;
+
+	targets = malloc(count * sizeof(*targets));
+	if (!targets)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		targets[i].name = containers[i]->name;
+		targets[i].lxcpath = containers[i]->config_path;
+	}
+
+	ret = do_freeze_thaw(freeze, targets, count);
+
+	if (latency_usecs)
+		for (i = 0; i < count; i++)
+			latency_usecs[i] = targets[i].latency;
+
+	free(targets);
+	return ret;
 }
@@ -0,0 +1,674 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "conf.h"
+#include "idshift.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_idshift, lxc);
+
+/* On-disk formats of POSIX ACLs and file capabilities, see
+ * include/uapi/linux/{posix_acl_xattr,capability}.h in the kernel.
+ */
+#define IDSHIFT_ACL_ACCESS "system.posix_acl_access"
+#define IDSHIFT_ACL_DEFAULT "system.posix_acl_default"
+#define IDSHIFT_ACL_VERSION 0x0002
+#define IDSHIFT_ACL_USER 0x02
+#define IDSHIFT_ACL_GROUP 0x08
+
+struct idshift_acl_entry {
+	uint16_t e_tag;
+	uint16_t e_perm;
+	uint32_t e_id;
+};
+
+#define IDSHIFT_CAPS "security.capability"
+#define IDSHIFT_CAPS_REVISION_MASK 0xFF000000
+#define IDSHIFT_CAPS_REVISION_2 0x02000000
+#define IDSHIFT_CAPS_REVISION_3 0x03000000
+#define IDSHIFT_CAPS_SZ_2 20
+#define IDSHIFT_CAPS_SZ_3 24
+
+struct idshift_caps {
+	uint32_t magic_etc;
+	uint32_t data[4];
+	uint32_t rootid;
+};
+
+/* chown() drops the setuid and setgid bits and the file capabilities of an
+ * inode. What has to be put back is recorded on the inode before the chown and
+ * only removed once it has been restored, so that an interrupted shift can be
+ * finished by running it again.
+ */
+#define IDSHIFT_RESTORE "trusted.lxc.idshift"
+
+struct idshift_restore {
+	uint32_t mode;
+	uint32_t caps_len;
+	struct idshift_caps caps;
+};
+
+/* Ids are looked up for every inode so keep the ranges in a flat array. */
+struct idshift_range {
+	unsigned long nsid;
+	unsigned long hostid;
+	unsigned long range;
+};
+
+struct idshift_ranges {
+	struct idshift_range *ranges;
+	size_t nr;
+};
+
+struct idshift_ctx {
+	struct idshift_ranges uid;
+	struct idshift_ranges gid;
+	dev_t dev;
+
+	/* Directories waiting for a thread. Bounded so that the number of open
+	 * file descriptors stays small for wide trees. Threads walk directories
+	 * they cannot queue themselves.
+	 */
+	pthread_mutex_t lock;
+	/* Signalled when a directory is queued or the walk is done. */
+	pthread_cond_t work;
+	/* Signalled when the walk is done. */
+	pthread_cond_t cond;
+	int *queue;
+	size_t nr_queue;
+	size_t max_queue;
+	unsigned int busy;
+	bool done;
+
+	struct lxc_idshift_stats stats;
+};
+
+enum {
+	IDSHIFT_UNMAPPED = -1,
+	IDSHIFT_KEEP = 0,
+	IDSHIFT_SHIFT = 1,
+};
+
+static int idshift_id(const struct idshift_ranges *r, unsigned long id,
+		      unsigned long *shifted)
+{
+	size_t i;
+
+	for (i = 0; i < r->nr; i++) {
+		if (id >= r->ranges[i].nsid &&
+		    id < r->ranges[i].nsid + r->ranges[i].range) {
+			*shifted = r->ranges[i].hostid + (id - r->ranges[i].nsid);
+			return IDSHIFT_SHIFT;
+		}
+	}
+
+	/* Already shifted. */
+	for (i = 0; i < r->nr; i++)
+		if (id >= r->ranges[i].hostid &&
+		    id < r->ranges[i].hostid + r->ranges[i].range)
+			return IDSHIFT_KEEP;
+
+	return IDSHIFT_UNMAPPED;
+}
+
+static int idshift_ranges_init(struct idshift_ranges *r, struct lxc_list *idmap,
+			       enum idtype idtype)
+{
+	size_t i, j;
+	struct lxc_list *it;
+	struct id_map *map;
+
+	r->nr = 0;
+	r->ranges = malloc((lxc_list_len(idmap) + 1) * sizeof(*r->ranges));
+	if (!r->ranges)
+		return -1;
+
+	lxc_list_for_each(it, idmap) {
+		map = it->elem;
+		if (map->idtype != idtype)
+			continue;
+
+		r->ranges[r->nr].nsid = map->nsid;
+		r->ranges[r->nr].hostid = map->hostid;
+		r->ranges[r->nr].range = map->range;
+		r->nr++;
+	}
+
+	/* Overlapping source and target ranges would make it impossible to
+	 * tell shifted from unshifted inodes.
+	 */
+	for (i = 0; i < r->nr; i++) {
+		for (j = 0; j < r->nr; j++) {
+			if (r->ranges[i].nsid < r->ranges[j].hostid + r->ranges[j].range &&
+			    r->ranges[j].hostid < r->ranges[i].nsid + r->ranges[i].range) {
+				ERROR("The %cid mapping %lu %lu %lu overlaps with "
+				      "the host ids of %lu %lu %lu",
+				      idtype == ID_TYPE_UID ? 'u' : 'g',
+				      r->ranges[i].nsid, r->ranges[i].hostid,
+				      r->ranges[i].range, r->ranges[j].nsid,
+				      r->ranges[j].hostid, r->ranges[j].range);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void idshift_error(struct idshift_ctx *ctx)
+{
+	__sync_fetch_and_add(&ctx->stats.errors, 1);
+}
+
+static int idshift_acl(struct idshift_ctx *ctx, const char *path,
+		       const char *name)
+{
+	ssize_t len;
+	size_t i, nr;
+	bool changed = false;
+	char *buf;
+	struct idshift_acl_entry *entries;
+
+	len = lgetxattr(path, name, NULL, 0);
+	if (len < 0)
+		return errno == ENODATA ? 0 : -1;
+
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+
+	len = lgetxattr(path, name, buf, len);
+	if (len < (ssize_t)sizeof(uint32_t) ||
+	    le32toh(*(uint32_t *)buf) != IDSHIFT_ACL_VERSION ||
+	    (len - sizeof(uint32_t)) % sizeof(*entries)) {
+		free(buf);
+		return len < 0 ? -1 : 0;
+	}
+
+	entries = (struct idshift_acl_entry *)(buf + sizeof(uint32_t));
+	nr = (len - sizeof(uint32_t)) / sizeof(*entries);
+	for (i = 0; i < nr; i++) {
+		int ret;
+		unsigned long id;
+		const struct idshift_ranges *r;
+
+		switch (le16toh(entries[i].e_tag)) {
+		case IDSHIFT_ACL_USER:
+			r = &ctx->uid;
+			break;
+		case IDSHIFT_ACL_GROUP:
+			r = &ctx->gid;
+			break;
+		default:
+			continue;
+		}
+
+		ret = idshift_id(r, le32toh(entries[i].e_id), &id);
+		if (ret != IDSHIFT_SHIFT)
+			continue;
+
+		entries[i].e_id = htole32((uint32_t)id);
+		changed = true;
+	}
+
+	if (changed) {
+		if (lsetxattr(path, name, buf, len, 0) < 0) {
+			free(buf);
+			return -1;
+		}
+		__sync_fetch_and_add(&ctx->stats.xattrs, 1);
+	}
+
+	free(buf);
+	return 0;
+}
+
+/* Read the file capabilities of @path. They are dropped by the kernel when the
+ * owner changes and need to be written back afterwards.
+ */
+static ssize_t idshift_caps_get(const char *path, struct idshift_caps *caps)
+{
+	ssize_t len;
+
+	len = lgetxattr(path, IDSHIFT_CAPS, caps, sizeof(*caps));
+	if (len < 0)
+		return errno == ENODATA ? 0 : -1;
+
+	if (len != IDSHIFT_CAPS_SZ_2 && len != IDSHIFT_CAPS_SZ_3)
+		return 0;
+
+	return len;
+}
+
+/* Namespaced (v3) file capabilities record the host uid of the root user of
+ * the user namespace they are valid in. Plain (v2) ones are only honoured in
+ * the initial user namespace so turn them into v3 ones for the container's
+ * root.
+ */
+static ssize_t idshift_caps_shift(struct idshift_ctx *ctx,
+				  struct idshift_caps *caps, ssize_t len)
+{
+	unsigned long rootid = 0;
+	uint32_t magic = le32toh(caps->magic_etc);
+
+	if (len == IDSHIFT_CAPS_SZ_3)
+		rootid = le32toh(caps->rootid);
+
+	if (idshift_id(&ctx->uid, rootid, &rootid) == IDSHIFT_SHIFT) {
+		magic = (magic & ~IDSHIFT_CAPS_REVISION_MASK) | IDSHIFT_CAPS_REVISION_3;
+		caps->magic_etc = htole32(magic);
+		caps->rootid = htole32((uint32_t)rootid);
+		len = IDSHIFT_CAPS_SZ_3;
+	}
+
+	return len;
+}
+
+/* Put back what the chown of @name in @dfd dropped and remove the record of
+ * it. Safe to redo.
+ */
+static void idshift_restore(struct idshift_ctx *ctx, int dfd, const char *name,
+			    const char *path, const struct idshift_restore *r)
+{
+	int ret;
+	bool failed = false;
+
+	if (r->mode & (S_ISUID | S_ISGID)) {
+		if (*name)
+			ret = fchmodat(dfd, name, r->mode & 07777, 0);
+		else
+			ret = fchmod(dfd, r->mode & 07777);
+		if (ret < 0) {
+			SYSERROR("Failed to restore mode of \"%s\"", path);
+			failed = true;
+		}
+	}
+
+	if (r->caps_len > 0) {
+		ret = lsetxattr(path, IDSHIFT_CAPS, &r->caps, r->caps_len, 0);
+		if (ret < 0) {
+			SYSERROR("Failed to restore file capabilities of \"%s\"", path);
+			failed = true;
+		} else {
+			__sync_fetch_and_add(&ctx->stats.xattrs, 1);
+		}
+	}
+
+	if (failed) {
+		idshift_error(ctx);
+		return;
+	}
+
+	if (lremovexattr(path, IDSHIFT_RESTORE) < 0 && errno != ENODATA &&
+	    errno != ENOTSUP) {
+		SYSERROR("Failed to remove \"%s\" from \"%s\"", IDSHIFT_RESTORE, path);
+		idshift_error(ctx);
+	}
+}
+
+/* Finish the restore of an inode whose shift was interrupted after the chown. */
+static void idshift_resume(struct idshift_ctx *ctx, int dfd, const char *name,
+			   const char *path)
+{
+	ssize_t len;
+	struct idshift_restore r;
+
+	len = lgetxattr(path, IDSHIFT_RESTORE, &r, sizeof(r));
+	if (len != sizeof(r))
+		return;
+
+	if (r.caps_len != 0 && r.caps_len != IDSHIFT_CAPS_SZ_2 &&
+	    r.caps_len != IDSHIFT_CAPS_SZ_3)
+		return;
+
+	INFO("Finishing interrupted shift of \"%s\"", path);
+	idshift_restore(ctx, dfd, name, path, &r);
+}
+
+/* Shift the inode @name in @dfd. If @name is empty @dfd itself is shifted. */
+static void idshift_inode(struct idshift_ctx *ctx, int dfd, const char *name,
+			  const struct stat *st)
+{
+	int ret, uid_ret, gid_ret;
+	ssize_t len, caps_len = 0;
+	unsigned long uid = st->st_uid, gid = st->st_gid;
+	char path[LXC_PROC_PID_FD_LEN + MAXPATHLEN];
+	char names[128];
+	struct idshift_caps caps;
+	struct idshift_restore restore;
+	bool need_restore;
+	bool is_lnk = S_ISLNK(st->st_mode);
+
+	__sync_fetch_and_add(&ctx->stats.inodes, 1);
+
+	uid_ret = idshift_id(&ctx->uid, st->st_uid, &uid);
+	gid_ret = idshift_id(&ctx->gid, st->st_gid, &gid);
+	if (uid_ret == IDSHIFT_UNMAPPED || gid_ret == IDSHIFT_UNMAPPED)
+		__sync_fetch_and_add(&ctx->stats.unmapped, 1);
+
+	/* Go through /proc/self/fd for the *xattr() calls so that lookups stay
+	 * relative to @dfd.
+	 */
+	ret = snprintf(path, sizeof(path), "/proc/self/fd/%d%s%s", dfd,
+		       *name ? "/" : "", name);
+	if (ret < 0 || (size_t)ret >= sizeof(path)) {
+		ERROR("Path to \"%s\" is too long", name);
+		idshift_error(ctx);
+		return;
+	}
+
+	/* Symlinks can't carry ACLs or file capabilities. */
+	if (!is_lnk) {
+		len = llistxattr(path, names, sizeof(names));
+		if (len < 0 && errno == ERANGE)
+			len = sizeof(names);
+
+		if (len > 0) {
+			/* ACL entries are shifted one by one so this is safe
+			 * to redo on resume.
+			 */
+			if (idshift_acl(ctx, path, IDSHIFT_ACL_ACCESS) < 0 ||
+			    (S_ISDIR(st->st_mode) &&
+			     idshift_acl(ctx, path, IDSHIFT_ACL_DEFAULT) < 0)) {
+				SYSERROR("Failed to shift ACLs of \"%s\"", path);
+				idshift_error(ctx);
+			}
+
+			if (uid_ret == IDSHIFT_SHIFT || gid_ret == IDSHIFT_SHIFT)
+				caps_len = idshift_caps_get(path, &caps);
+			else
+				idshift_resume(ctx, dfd, name, path);
+		}
+	}
+
+	if (uid_ret != IDSHIFT_SHIFT && gid_ret != IDSHIFT_SHIFT)
+		return;
+
+	memset(&restore, 0, sizeof(restore));
+	if (!is_lnk) {
+		restore.mode = st->st_mode;
+		if (caps_len > 0) {
+			restore.caps_len = idshift_caps_shift(ctx, &caps, caps_len);
+			memcpy(&restore.caps, &caps, sizeof(caps));
+		}
+	}
+
+	need_restore = (restore.mode & (S_ISUID | S_ISGID)) || restore.caps_len > 0;
+	if (need_restore) {
+		ret = lsetxattr(path, IDSHIFT_RESTORE, &restore, sizeof(restore), 0);
+		if (ret < 0 && errno != ENOTSUP) {
+			SYSERROR("Failed to record mode and capabilities of \"%s\"", path);
+			idshift_error(ctx);
+			return;
+		}
+	}
+
+	if (*name)
+		ret = fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+	else
+		ret = fchownat(dfd, "", uid, gid, AT_EMPTY_PATH);
+	if (ret < 0) {
+		SYSERROR("Failed to chown \"%s\"", path);
+		idshift_error(ctx);
+		return;
+	}
+	__sync_fetch_and_add(&ctx->stats.shifted, 1);
+
+	if (need_restore)
+		idshift_restore(ctx, dfd, name, path, &restore);
+}
+
+static bool idshift_queue(struct idshift_ctx *ctx, int dfd)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nr_queue < ctx->max_queue) {
+		ctx->queue[ctx->nr_queue++] = dfd;
+		pthread_cond_signal(&ctx->work);
+		queued = true;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return queued;
+}
+
+/* Shift everything below @dfd. Takes ownership of @dfd. */
+static void idshift_dir(struct idshift_ctx *ctx, int dfd)
+{
+	DIR *dir;
+	struct dirent *direntp;
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		SYSERROR("Failed to open directory");
+		idshift_error(ctx);
+		close(dfd);
+		return;
+	}
+
+	while ((direntp = readdir(dir))) {
+		int fd, ret;
+		struct stat st;
+
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+
+		ret = fstatat(dfd, direntp->d_name, &st, AT_SYMLINK_NOFOLLOW);
+		if (ret < 0) {
+			SYSERROR("Failed to stat \"%s\"", direntp->d_name);
+			idshift_error(ctx);
+			continue;
+		}
+
+		/* Don't cross into other filesystems. */
+		if (st.st_dev != ctx->dev)
+			continue;
+
+		idshift_inode(ctx, dfd, direntp->d_name, &st);
+
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		fd = openat(dfd, direntp->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			SYSERROR("Failed to open \"%s\"", direntp->d_name);
+			idshift_error(ctx);
+			continue;
+		}
+
+		if (!idshift_queue(ctx, fd))
+			idshift_dir(ctx, fd);
+	}
+
+	closedir(dir);
+}
+
+static void *idshift_worker(void *data)
+{
+	struct idshift_ctx *ctx = data;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		int dfd;
+
+		while (ctx->nr_queue == 0 && ctx->busy > 0)
+			pthread_cond_wait(&ctx->work, &ctx->lock);
+
+		if (ctx->nr_queue == 0)
+			break;
+
+		dfd = ctx->queue[--ctx->nr_queue];
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		idshift_dir(ctx, dfd);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->busy--;
+	}
+
+	/* Nothing queued and nobody left who could queue more. */
+	ctx->done = true;
+	pthread_cond_broadcast(&ctx->work);
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+static double idshift_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+int lxc_idshift_tree(const char *path, struct lxc_list *idmap,
+		     unsigned int threads, lxc_idshift_progress_t progress,
+		     void *data, struct lxc_idshift_stats *stats)
+{
+	int dfd, ret;
+	unsigned int i, started = 0;
+	struct stat st;
+	struct timespec start, deadline;
+	pthread_t *tids = NULL;
+	struct idshift_ctx ctx = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.work = PTHREAD_COND_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	memset(stats, 0, sizeof(*stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (threads == 0)
+		threads = 1;
+
+	ret = idshift_ranges_init(&ctx.uid, idmap, ID_TYPE_UID);
+	if (ret == 0)
+		ret = idshift_ranges_init(&ctx.gid, idmap, ID_TYPE_GID);
+	if (ret < 0)
+		goto out;
+
+	if (ctx.uid.nr == 0 && ctx.gid.nr == 0) {
+		ERROR("No {g,u}id mappings to shift to");
+		ret = -1;
+		goto out;
+	}
+
+	dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		SYSERROR("Failed to open \"%s\"", path);
+		ret = -1;
+		goto out;
+	}
+
+	ret = fstat(dfd, &st);
+	if (ret < 0) {
+		SYSERROR("Failed to stat \"%s\"", path);
+		close(dfd);
+		goto out;
+	}
+	ctx.dev = st.st_dev;
+
+	idshift_inode(&ctx, dfd, "", &st);
+
+	ctx.max_queue = threads * 4;
+	ctx.queue = malloc(ctx.max_queue * sizeof(*ctx.queue));
+	tids = malloc(threads * sizeof(*tids));
+	if (!ctx.queue || !tids) {
+		close(dfd);
+		ret = -1;
+		goto out;
+	}
+	ctx.queue[ctx.nr_queue++] = dfd;
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&tids[i], NULL, idshift_worker, &ctx);
+		if (ret) {
+			errno = ret;
+			SYSERROR("Failed to create thread");
+			break;
+		}
+		started++;
+	}
+
+	if (started == 0) {
+		close(ctx.queue[--ctx.nr_queue]);
+		ret = -1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec++;
+	pthread_mutex_lock(&ctx.lock);
+	while (!ctx.done) {
+		ret = pthread_cond_timedwait(&ctx.cond, &ctx.lock, &deadline);
+		if (ctx.done || ret != ETIMEDOUT)
+			continue;
+
+		deadline.tv_sec++;
+		if (!progress)
+			continue;
+
+		pthread_mutex_unlock(&ctx.lock);
+		ctx.stats.seconds = idshift_elapsed(&start);
+		progress(&ctx.stats, data);
+		pthread_mutex_lock(&ctx.lock);
+	}
+	pthread_mutex_unlock(&ctx.lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	ret = ctx.stats.errors ? -1 : 0;
+
+out:
+	ctx.stats.seconds = idshift_elapsed(&start);
+	memcpy(stats, &ctx.stats, sizeof(*stats));
+	free(ctx.uid.ranges);
+	free(ctx.gid.ranges);
+	free(ctx.queue);
+	free(tids);
+
+	return ret;
+}
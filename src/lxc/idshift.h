@@ -0,0 +1,65 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_IDSHIFT_H
+#define __LXC_IDSHIFT_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+struct lxc_idshift_stats {
+	/* Inodes visited. */
+	uint64_t inodes;
+	/* Inodes whose owner or group was changed. */
+	uint64_t shifted;
+	/* ACL and file capability xattrs that were rewritten. */
+	uint64_t xattrs;
+	/* Inodes owned by a {g,u}id not covered by the mappings. */
+	uint64_t unmapped;
+	/* Inodes that could not be shifted. */
+	uint64_t errors;
+	/* Time spent so far. */
+	double seconds;
+};
+
+typedef void (*lxc_idshift_progress_t)(const struct lxc_idshift_stats *stats,
+				       void *data);
+
+/*
+ * Shift the ownership of every inode below @path from the namespace ids of the
+ * {g,u}id mappings in @idmap to the host ids they map to. The ids stored in
+ * POSIX ACLs and the root id of namespaced file capabilities are shifted as
+ * well. The tree is walked by @threads threads. The walk does not cross into
+ * other filesystems.
+ *
+ * Source and target ranges of the mappings must not overlap. Inodes that are
+ * already owned by a host id of the mappings are left alone which makes it
+ * possible to resume an interrupted shift by simply running it again.
+ *
+ * @progress is called about once per second from the calling thread.
+ *
+ * Returns 0 on success and -1 if the mappings are unusable or any inode could
+ * not be shifted. @stats is filled in in either case.
+ */
+extern int lxc_idshift_tree(const char *path, struct lxc_list *idmap,
+			    unsigned int threads,
+			    lxc_idshift_progress_t progress, void *data,
+			    struct lxc_idshift_stats *stats);
+
+#endif /* __LXC_IDSHIFT_H */
@@ -24,7 +24,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -37,6 +39,7 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "af_unix.h"
@@ -456,6 +459,25 @@ static rettype fnname(struct lxc_container *c, t1 a1, t2 a2, t3 a3)	\
 	return ret;							\
 }
 
+#define WRAP_API_4(rettype, fnname, t1, t2, t3, t4)			\
+static rettype fnname(struct lxc_container *c, t1 a1, t2 a2, t3 a3,	\
+		      t4 a4)						\
+{									\
+	rettype ret;							\
+	bool reset_config = false;					\
+									\
+	if (!current_config && c && c->lxc_conf) {			\
+		current_config = c->lxc_conf;				\
+		reset_config = true;					\
+	}								\
+									\
+	ret = do_##fnname(c, a1, a2, a3, a4);				\
+	if (reset_config)						\
+		current_config = NULL;					\
+									\
+	return ret;							\
+}
+
 WRAP_API(bool, lxcapi_is_defined)
 
 static const char *do_lxcapi_state(struct lxc_container *c)
@@ -1770,6 +1792,8 @@ out_unlock:
 	if (partial_fd >= 0)
 		remove_partial(c, partial_fd);
 out:
+	if (c->lxc_conf)
+		lxc_userns_helper_stop(c->lxc_conf);
 	if (!ret)
 		container_destroy(c);
 free_tpath:
@@ -2043,12 +2067,104 @@ static bool remove_from_array(char ***names, char *cname, int size)
 	return false;
 }
 
+/* Build the get_interfaces() and get_ips() results from the records the
+ * container's monitor sent back.
+ */
+static char **netaddrs_to_interfaces(struct lxc_netaddr *addrs, int naddrs)
+{
+	int i, count = 0;
+	char **interfaces = NULL;
+
+	for (i = 0; i < naddrs; i++) {
+		if (addrs[i].family != AF_UNSPEC)
+			continue;
+
+		if (array_contains(&interfaces, addrs[i].ifname, count))
+			continue;
+
+		if (!add_to_array(&interfaces, addrs[i].ifname, count)) {
+			ERROR("Failed to add \"%s\" to array", addrs[i].ifname);
+			continue;
+		}
+
+		count++;
+	}
+
+	if (interfaces)
+		interfaces = (char **)lxc_append_null_to_array((void **)interfaces, count);
+
+	return interfaces;
+}
+
+static char **netaddrs_to_ips(struct lxc_netaddr *addrs, int naddrs,
+			      const char *interface, const char *family,
+			      int scope)
+{
+	int i, count = 0;
+	char **addresses = NULL;
+	char address[INET6_ADDRSTRLEN];
+
+	for (i = 0; i < naddrs; i++) {
+		struct lxc_netaddr *a = &addrs[i];
+
+		if (a->family == AF_INET) {
+			if (family && strcmp(family, "inet"))
+				continue;
+		} else if (a->family == AF_INET6) {
+			struct in6_addr *in6 = (struct in6_addr *)a->addr;
+			int scope_id = 0;
+
+			if (family && strcmp(family, "inet6"))
+				continue;
+
+			/* Same scope id getifaddrs() reports. */
+			if (IN6_IS_ADDR_LINKLOCAL(in6) || IN6_IS_ADDR_MC_LINKLOCAL(in6))
+				scope_id = a->ifindex;
+
+			if (scope_id != scope)
+				continue;
+		} else {
+			continue;
+		}
+
+		if (interface && strcmp(interface, a->ifname))
+			continue;
+		else if (!interface && strcmp("lo", a->ifname) == 0)
+			continue;
+
+		if (!inet_ntop(a->family, a->addr, address, sizeof(address)))
+			continue;
+
+		if (!add_to_array(&addresses, address, count)) {
+			ERROR("Failed to add \"%s\" to array", address);
+			continue;
+		}
+
+		count++;
+	}
+
+	if (addresses)
+		addresses = (char **)lxc_append_null_to_array((void **)addresses, count);
+
+	return addresses;
+}
+
 static char **do_lxcapi_get_interfaces(struct lxc_container *c)
 {
 	pid_t pid;
 	int i, count = 0, pipefd[2];
 	char **interfaces = NULL;
 	char interface[IFNAMSIZ];
+	struct lxc_netaddr *addrs;
+
+	/* Let the monitor answer from inside the network namespace. */
+	count = lxc_cmd_get_net_addrs(c->name, c->config_path, &addrs);
+	if (count >= 0) {
+		interfaces = netaddrs_to_interfaces(addrs, count);
+		free(addrs);
+		return interfaces;
+	}
+	count = 0;
 
 	if (pipe2(pipefd, O_CLOEXEC) < 0)
 		return NULL;
@@ -2142,6 +2258,15 @@ static char **do_lxcapi_get_ips(struct lxc_container *c, const char *interface,
 	char address[INET6_ADDRSTRLEN];
 	int count = 0;
 	char **addresses = NULL;
+	struct lxc_netaddr *addrs;
+
+	/* Let the monitor answer from inside the network namespace. */
+	ret = lxc_cmd_get_net_addrs(c->name, c->config_path, &addrs);
+	if (ret >= 0) {
+		addresses = netaddrs_to_ips(addrs, ret, interface, family, scope);
+		free(addrs);
+		return addresses;
+	}
 
 	ret = pipe2(pipefd, O_CLOEXEC);
 	if (ret < 0) {
@@ -2262,6 +2387,90 @@ static char **do_lxcapi_get_ips(struct lxc_container *c, const char *interface,
 
 WRAP_API_3(char **, lxcapi_get_ips, const char *, const char *, int)
 
+static char **do_lxcapi_wait_ips(struct lxc_container *c, const char *interface,
+				 const char *family, int scope, int timeout)
+{
+	int nlfd;
+	char **addresses = NULL;
+	struct timespec deadline = {0};
+
+	if (!c)
+		return NULL;
+
+	/* Subscribe before the first query so that no change is missed. */
+	nlfd = lxc_cmd_subscribe_net_addrs(c->name, c->config_path);
+	if (nlfd < 0)
+		DEBUG("Polling for addresses of container \"%s\"", c->name);
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout;
+	}
+
+	for (;;) {
+		int ret, wait_ms;
+		struct pollfd pfd;
+
+		addresses = do_lxcapi_get_ips(c, interface, family, scope);
+		if (addresses || timeout == 0)
+			break;
+
+		/* With notifications wake up now and then anyway to notice a
+		 * container that stopped; without them poll once a second.
+		 */
+		wait_ms = nlfd >= 0 ? 5000 : 1000;
+		if (timeout > 0) {
+			struct timespec now;
+			int64_t remaining;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+				    (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (remaining <= 0)
+				break;
+
+			if (remaining < wait_ms)
+				wait_ms = remaining;
+		}
+
+		if (nlfd < 0) {
+			(void)poll(NULL, 0, wait_ms);
+			if (!do_lxcapi_is_running(c))
+				break;
+
+			continue;
+		}
+
+		pfd.fd = nlfd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, wait_ms);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret == 0) {
+			if (!do_lxcapi_is_running(c))
+				break;
+
+			continue;
+		}
+
+		/* We re-query anyway so just drain the notifications. */
+		for (;;) {
+			char buf[8192];
+
+			if (recv(nlfd, buf, sizeof(buf), MSG_DONTWAIT) < 0)
+				break;
+		}
+	}
+
+	if (nlfd >= 0)
+		close(nlfd);
+
+	return addresses;
+}
+
+WRAP_API_4(char **, lxcapi_wait_ips, const char *, const char *, int, int)
+
 static int do_lxcapi_get_config_item(struct lxc_container *c, const char *key, char *retv, int inlen)
 {
 	int ret = -1;
@@ -2584,6 +2793,9 @@ out:
 	return bret;
 }
 
+/* The snapshot index, see snapshot_index_load(). */
+#define LXC_SNAPSHOT_INDEX ".index"
+
 static bool has_snapshots(struct lxc_container *c)
 {
 	char path[MAXPATHLEN];
@@ -2602,6 +2814,11 @@ static bool has_snapshots(struct lxc_container *c)
 
 		if (!strcmp(direntp->d_name, ".."))
 			continue;
+
+		/* The index and its temporary file are not snapshots. */
+		if (!strncmp(direntp->d_name, LXC_SNAPSHOT_INDEX,
+			     strlen(LXC_SNAPSHOT_INDEX)))
+			continue;
 		count++;
 		break;
 	}
@@ -3278,7 +3495,15 @@ static int clone_update_rootfs(struct clone_update_data *data)
 		bdev->dest = strdup(bdev->src);
 	}
 
-	if (!lxc_list_empty(&conf->hooks[LXCHOOK_CLONE])) {
+	/* The files of a deduplicated snapshot are hardlinks shared with older
+	 * snapshots, so a hook writing to them in place would change those
+	 * snapshots as well.
+	 */
+	if ((flags & LXC_STORAGE_DEDUP) &&
+	    !lxc_list_empty(&conf->hooks[LXCHOOK_CLONE])) {
+		INFO("Not running clone hooks for deduplicated snapshot \"%s\"",
+		     c->name);
+	} else if (!lxc_list_empty(&conf->hooks[LXCHOOK_CLONE])) {
 		/* Start of environment variable setup for hooks */
 		if (c0->name && setenv("LXC_SRC_NAME", c0->name, 1)) {
 			SYSERROR("failed to set environment variable for source container name");
@@ -3359,30 +3584,22 @@ static int create_file_dirname(char *path, struct lxc_conf *conf)
 	return ret;
 }
 
-static struct lxc_container *do_lxcapi_clone(struct lxc_container *c, const char *newname,
-		const char *lxcpath, int flags,
-		const char *bdevtype, const char *bdevdata, uint64_t newsize,
-		char **hookargs)
+/* Write the configuration of the clone @newname of @c and copy or snapshot its
+ * storage. Called with @c's memory lock held. Everything that was created is
+ * removed again on failure.
+ */
+static struct lxc_container *clone_prepare(struct lxc_container *c,
+					   const char *newname,
+					   const char *lxcpath, int flags,
+					   const char *bdevtype,
+					   const char *bdevdata,
+					   uint64_t newsize)
 {
 	struct lxc_container *c2 = NULL;
 	char newpath[MAXPATHLEN];
 	int ret, storage_copied = 0;
-	char *origroot = NULL, *saved_unexp_conf = NULL;
-	struct clone_update_data data;
-	size_t saved_unexp_len;
+	char *origroot = NULL;
 	FILE *fout;
-	pid_t pid;
-
-	if (!c || !do_lxcapi_is_defined(c))
-		return NULL;
-
-	if (container_mem_lock(c))
-		return NULL;
-
-	if (!is_stopped(c)) {
-		ERROR("error: Original container (%s) is running", c->name);
-		goto out;
-	}
 
 	// Make sure the container doesn't yet exist.
 	if (!newname)
@@ -3416,22 +3633,9 @@ static struct lxc_container *do_lxcapi_clone(struct lxc_container *c, const char
 		goto out;
 	}
 
-	saved_unexp_conf = c->lxc_conf->unexpanded_config;
-	saved_unexp_len = c->lxc_conf->unexpanded_len;
-	c->lxc_conf->unexpanded_config = strdup(saved_unexp_conf);
-	if (!c->lxc_conf->unexpanded_config) {
-		ERROR("Out of memory");
-		fclose(fout);
-		goto out;
-	}
-	clear_unexp_config_line(c->lxc_conf, "lxc.rootfs", false);
-	write_config(fout, c->lxc_conf);
+	write_config_without_key(fout, c->lxc_conf, "lxc.rootfs");
 	fclose(fout);
 	c->lxc_conf->rootfs.path = origroot;
-	free(c->lxc_conf->unexpanded_config);
-	c->lxc_conf->unexpanded_config = saved_unexp_conf;
-	saved_unexp_conf = NULL;
-	c->lxc_conf->unexpanded_len = saved_unexp_len;
 
 	ret = snprintf(newpath, MAXPATHLEN, "%s/%s/rootfs", lxcpath, newname);
 	if (ret < 0 || ret >= MAXPATHLEN) {
@@ -3504,17 +3708,38 @@ static struct lxc_container *do_lxcapi_clone(struct lxc_container *c, const char
 	if (!c2->save_config(c2, NULL))
 		goto out;
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("fork");
-		goto out;
+	return c2;
+
+out:
+	if (c2) {
+		if (!storage_copied)
+			c2->lxc_conf->rootfs.path = NULL;
+		c2->destroy(c2);
+		lxc_container_put(c2);
 	}
-	if (pid > 0) {
-		ret = wait_for_pid(pid);
-		if (ret)
-			goto out;
-		container_mem_unlock(c);
-		return c2;
+
+	return NULL;
+}
+
+/* Fork a child that updates the rootfs of the freshly cloned @c2 and runs the
+ * clone hooks. Returns the pid of the child or -1.
+ */
+static pid_t clone_update_rootfs_start(struct lxc_container *c,
+				       struct lxc_container *c2, int flags,
+				       char **hookargs)
+{
+	struct clone_update_data data;
+	int ret;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("fork");
+		return -1;
 	}
+	if (pid > 0)
+		return pid;
+
 	data.c0 = c;
 	data.c1 = c2;
 	data.flags = flags;
@@ -3527,18 +3752,51 @@ static struct lxc_container *do_lxcapi_clone(struct lxc_container *c, const char
 	if (ret < 0)
 		_exit(EXIT_FAILURE);
 
-	container_mem_unlock(c);
 	_exit(EXIT_SUCCESS);
+}
 
-out:
-	container_mem_unlock(c);
-	if (c2) {
-		if (!storage_copied)
-			c2->lxc_conf->rootfs.path = NULL;
+static struct lxc_container *do_lxcapi_clone(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags,
+		const char *bdevtype, const char *bdevdata, uint64_t newsize,
+		char **hookargs)
+{
+	struct lxc_container *c2;
+	pid_t pid;
+
+	if (!c || !do_lxcapi_is_defined(c))
+		return NULL;
+
+	if (container_mem_lock(c))
+		return NULL;
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out;
+	}
+
+	c2 = clone_prepare(c, newname, lxcpath, flags, bdevtype, bdevdata,
+			   newsize);
+	if (!c2)
+		goto out;
+
+	/* All paths have been chowned to the container's root by now. */
+	lxc_userns_helper_stop(c->lxc_conf);
+	lxc_userns_helper_stop(c2->lxc_conf);
+
+	pid = clone_update_rootfs_start(c, c2, flags, hookargs);
+	if (pid < 0 || wait_for_pid(pid)) {
 		c2->destroy(c2);
 		lxc_container_put(c2);
+		goto out;
 	}
 
+	container_mem_unlock(c);
+	return c2;
+
+out:
+	lxc_userns_helper_stop(c->lxc_conf);
+	container_mem_unlock(c);
+
 	return NULL;
 }
 
@@ -3554,6 +3812,111 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	return ret;
 }
 
+int lxc_clone_many(struct lxc_container *c, char *const names[], int count,
+		   const char *lxcpath, int flags, const char *bdevtype,
+		   unsigned int jobs)
+{
+	int i, next, oldest, ret;
+	unsigned int running = 0;
+	int created = -1;
+	struct lxc_container **clones = NULL;
+	pid_t *pids = NULL;
+
+	if (!c || !names || count <= 0 || !do_lxcapi_is_defined(c))
+		return -1;
+
+	if (jobs == 0)
+		jobs = 1;
+
+	clones = malloc(count * sizeof(*clones));
+	pids = malloc(count * sizeof(*pids));
+	if (!clones || !pids) {
+		ERROR("Out of memory");
+		goto out_free;
+	}
+
+	current_config = c->lxc_conf;
+
+	if (container_mem_lock(c))
+		goto out_free;
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out_unlock;
+	}
+
+	/* Snapshots and configs are created one after the other since the
+	 * storage drivers and the rdepends bookkeeping of @c are not safe to
+	 * use concurrently. They are cheap compared to updating the rootfs.
+	 */
+	for (i = 0; i < count; i++) {
+		pids[i] = -1;
+		clones[i] = clone_prepare(c, names[i], lxcpath, flags, bdevtype,
+					  NULL, 0);
+		if (!clones[i])
+			ERROR("Failed to clone %s to %s", c->name, names[i]);
+	}
+
+	lxc_userns_helper_stop(c->lxc_conf);
+	for (i = 0; i < count; i++)
+		if (clones[i])
+			lxc_userns_helper_stop(clones[i]->lxc_conf);
+
+	/* Update the root filesystems with up to @jobs children at a time.
+	 * Children are reaped in the order they were started so that we never
+	 * reap a child that the caller forked itself.
+	 */
+	for (next = 0, oldest = 0; oldest < count;) {
+		if (next < count && running < jobs) {
+			if (clones[next]) {
+				pids[next] = clone_update_rootfs_start(c, clones[next],
+								       flags, NULL);
+				if (pids[next] > 0)
+					running++;
+			}
+			next++;
+			continue;
+		}
+
+		if (pids[oldest] > 0) {
+			ret = wait_for_pid(pids[oldest]);
+			running--;
+			if (ret == 0) {
+				oldest++;
+				continue;
+			}
+		}
+
+		if (clones[oldest]) {
+			ERROR("Failed to update the rootfs of %s", names[oldest]);
+			clones[oldest]->destroy(clones[oldest]);
+			lxc_container_put(clones[oldest]);
+			clones[oldest] = NULL;
+		}
+		oldest++;
+	}
+
+	created = 0;
+	for (i = 0; i < count; i++) {
+		if (!clones[i])
+			continue;
+
+		lxc_container_put(clones[i]);
+		created++;
+	}
+
+out_unlock:
+	lxc_userns_helper_stop(c->lxc_conf);
+	container_mem_unlock(c);
+
+out_free:
+	current_config = NULL;
+	free(clones);
+	free(pids);
+
+	return created;
+}
+
 static bool do_lxcapi_rename(struct lxc_container *c, const char *newname)
 {
 	struct lxc_storage *bdev;
@@ -3676,26 +4039,564 @@ static bool get_snappath_dir(struct lxc_container *c, char *snappath)
 	return true;
 }
 
-static int do_lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
-{
-	int i, flags, ret;
-	struct lxc_container *c2;
-	char snappath[MAXPATHLEN], newname[20];
+/*
+ * Every snapshot directory carries an index. It starts with a header recording
+ * the inode, link count and mtime of the snapshot directory, followed by one
+ * line per snapshot:
+ *
+ *	name<TAB>timestamp<TAB>size<TAB>comment
+ *
+ * The size is the disk space used by the snapshot directory without crossing
+ * into other filesystems or "-" if it has not been measured yet, see
+ * lxc_snapshot_size(). Backslashes, tabs and newlines in the comment are
+ * escaped. The index is replaced atomically. Adding or removing a snapshot
+ * changes the link count and mtime of the directory, so an index whose header
+ * does not match is stale and the snapshots are listed from the directory
+ * instead. The link count catches changes within the granularity of the mtime.
+ */
 
-	if (!c || !lxcapi_is_defined(c))
-		return -1;
+/* Fixed width so the header can be rewritten in place. */
+#define SNAPSHOT_INDEX_HEADER \
+	"#lxc-snapshot-index %020" PRIu64 " %020" PRIu64 " %020" PRId64 ".%09ld\n"
 
-	if (!storage_can_backup(c->lxc_conf)) {
-		ERROR("%s's backing store cannot be backed up.", c->name);
-		ERROR("Your container must use another backing store type.");
-		return -1;
-	}
+struct snapshot_index_entry {
+	char *name;
+	char *timestamp;
+	char *comment;
+	int64_t size;
+};
 
-	if (!get_snappath_dir(c, snappath))
-		return -1;
+struct snapshot_index {
+	struct snapshot_index_entry *entries;
+	size_t nr;
+};
+
+static void snapshot_index_free(struct snapshot_index *idx)
+{
+	size_t i;
+
+	for (i = 0; i < idx->nr; i++) {
+		free(idx->entries[i].name);
+		free(idx->entries[i].timestamp);
+		free(idx->entries[i].comment);
+	}
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->nr = 0;
+}
+
+/* Takes over @name, @timestamp and @comment, also on error. */
+static int snapshot_index_add(struct snapshot_index *idx, char *name,
+			      char *timestamp, char *comment, int64_t size)
+{
+	struct snapshot_index_entry *entries;
+
+	entries = realloc(idx->entries, (idx->nr + 1) * sizeof(*entries));
+	if (!entries) {
+		free(name);
+		free(timestamp);
+		free(comment);
+		return -1;
+	}
+	idx->entries = entries;
+
+	entries[idx->nr].name = name;
+	entries[idx->nr].timestamp = timestamp;
+	entries[idx->nr].comment = comment;
+	entries[idx->nr].size = size;
+	idx->nr++;
+
+	return 0;
+}
+
+static void snapshot_index_remove(struct snapshot_index *idx, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < idx->nr; i++) {
+		if (strcmp(idx->entries[i].name, name) != 0)
+			continue;
+
+		free(idx->entries[i].name);
+		free(idx->entries[i].timestamp);
+		free(idx->entries[i].comment);
+		memmove(&idx->entries[i], &idx->entries[i + 1],
+			(idx->nr - i - 1) * sizeof(*idx->entries));
+		idx->nr--;
+		return;
+	}
+}
+
+/* Read $snappath/$name/$file into a string. */
+static char *read_snapshot_file(const char *snappath, const char *name,
+				const char *file)
+{
+	char path[MAXPATHLEN], *s = NULL;
+	int ret, len;
+	FILE *fin;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/%s", snappath, name, file);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return NULL;
+	fin = fopen(path, "r");
+	if (!fin)
+		return NULL;
+	(void) fseek(fin, 0, SEEK_END);
+	len = ftell(fin);
+	(void) fseek(fin, 0, SEEK_SET);
+	if (len > 0) {
+		s = malloc(len+1);
+		if (s) {
+			s[len] = '\0';
+			if (fread(s, 1, len, fin) != len) {
+				SYSERROR("reading %s", path);
+				free(s);
+				s = NULL;
+			}
+		}
+	}
+	fclose(fin);
+	return s;
+}
+
+/* Disk space used below @dfd, not counting other filesystems. Closes @dfd. */
+static int64_t snapshot_disk_usage(int dfd, dev_t dev)
+{
+	DIR *dir;
+	struct dirent *direntp;
+	struct stat st;
+	int fd;
+	int64_t size = 0;
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		close(dfd);
+		return 0;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+
+		if (fstatat(dirfd(dir), direntp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+
+		if (st.st_dev != dev)
+			continue;
+
+		/* Files shared with other snapshots are charged in equal
+		 * parts to every name they have.
+		 */
+		if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+			size += (int64_t)st.st_blocks * 512 / st.st_nlink;
+		else
+			size += (int64_t)st.st_blocks * 512;
+
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		fd = openat(dirfd(dir), direntp->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0)
+			size += snapshot_disk_usage(fd, dev);
+	}
+
+	closedir(dir);
+	return size;
+}
+
+static int64_t snapshot_size(const char *snappath, const char *name)
+{
+	char path[MAXPATHLEN];
+	int fd, ret;
+	struct stat st;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s", snappath, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return (int64_t)st.st_blocks * 512 + snapshot_disk_usage(fd, st.st_dev);
+}
+
+static void snapshot_index_escape(FILE *f, const char *s)
+{
+	for (; s && *s; s++) {
+		if (*s == '\\')
+			fputs("\\\\", f);
+		else if (*s == '\t')
+			fputs("\\t", f);
+		else if (*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+}
+
+/* Undo snapshot_index_escape() in place. */
+static void snapshot_index_unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++) {
+		if (*s == '\\' && *(s + 1)) {
+			s++;
+			if (*s == 't')
+				*d++ = '\t';
+			else if (*s == 'n')
+				*d++ = '\n';
+			else
+				*d++ = *s;
+			continue;
+		}
+		*d++ = *s;
+	}
+	*d = '\0';
+}
+
+static int snapshot_index_header(char *buf, size_t size, const struct stat *st)
+{
+	int ret;
+
+	ret = snprintf(buf, size, SNAPSHOT_INDEX_HEADER, (uint64_t)st->st_ino,
+		       (uint64_t)st->st_nlink, (int64_t)st->st_mtim.tv_sec,
+		       (long)st->st_mtim.tv_nsec);
+	if (ret < 0 || (size_t)ret >= size)
+		return -1;
+
+	return ret;
+}
+
+static bool snapshot_dir_unchanged(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_nlink == b->st_nlink &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Load the index of @snappath. Fails if it is missing or if its header does
+ * not match @st, the state of the snapshot directory.
+ */
+static int snapshot_index_load(const char *snappath, const struct stat *st,
+			       struct snapshot_index *idx)
+{
+	char path[MAXPATHLEN], header[128];
+	char *buf, *line, *next, *fields[4];
+	int fd, i, ret;
+	struct stat st_idx;
+	long long int size;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/" LXC_SNAPSHOT_INDEX, snappath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st_idx) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	buf = malloc(st_idx.st_size + 1);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	ret = lxc_read_nointr(fd, buf, st_idx.st_size);
+	close(fd);
+	if (ret != st_idx.st_size) {
+		free(buf);
+		return -1;
+	}
+	buf[st_idx.st_size] = '\0';
+
+	ret = snapshot_index_header(header, sizeof(header), st);
+	if (ret < 0 || strncmp(buf, header, ret) != 0) {
+		INFO("Snapshot index %s is stale", path);
+		free(buf);
+		return -1;
+	}
+
+	for (line = buf + ret; *line; line = next) {
+		next = strchr(line, '\n');
+		if (!next) {
+			/* truncated */
+			goto on_error;
+		}
+		*next++ = '\0';
+
+		fields[0] = line;
+		for (i = 1; i < 4; i++) {
+			fields[i] = strchr(fields[i - 1], '\t');
+			if (!fields[i])
+				goto on_error;
+			*fields[i]++ = '\0';
+		}
+
+		if (strcmp(fields[2], "-") == 0)
+			size = -1;
+		else if (lxc_safe_long_long(fields[2], &size) < 0)
+			goto on_error;
+
+		snapshot_index_unescape(fields[3]);
+		if (snapshot_index_add(idx, strdup(fields[0]), strdup(fields[1]),
+				       *fields[3] ? strdup(fields[3]) : NULL,
+				       size) < 0)
+			goto on_error;
+	}
+
+	free(buf);
+	return 0;
+
+on_error:
+	ERROR("Invalid snapshot index %s", path);
+	snapshot_index_free(idx);
+	free(buf);
+	return -1;
+}
+
+/* Build the index of @snappath from the snapshot directories. */
+static int snapshot_index_scan(const char *snappath, struct snapshot_index *idx)
+{
+	char path[MAXPATHLEN];
+	int ret;
+	DIR *dir;
+	struct dirent *direntp;
+
+	dir = opendir(snappath);
+	if (!dir) {
+		INFO("failed to open %s - assuming no snapshots", snappath);
+		return 0;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+
+		if (!strcmp(direntp->d_name, ".."))
+			continue;
+
+		ret = snprintf(path, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			ERROR("pathname too long");
+			goto on_error;
+		}
+		if (!file_exists(path))
+			continue;
+
+		if (snapshot_index_add(idx, strdup(direntp->d_name),
+				       read_snapshot_file(snappath, direntp->d_name, "ts"),
+				       read_snapshot_file(snappath, direntp->d_name, "comment"),
+				       -1) < 0)
+			goto on_error;
+
+		if (!idx->entries[idx->nr - 1].name)
+			goto on_error;
+	}
+
+	if (closedir(dir))
+		WARN("failed to close directory");
+
+	return 0;
+
+on_error:
+	snapshot_index_free(idx);
+	if (closedir(dir))
+		WARN("failed to close directory");
+	return -1;
+}
+
+/* Replace the index of @snappath. The caller holds the index lock. Nothing is
+ * written if the directory was changed by someone else and no longer looks
+ * like @before, the state the index was built against.
+ */
+static int snapshot_index_write(const char *snappath, struct snapshot_index *idx,
+				const struct stat *before)
+{
+	char path[MAXPATHLEN], tmp[MAXPATHLEN], header[128];
+	int fd, len, ret;
+	size_t i;
+	FILE *f;
+	struct stat st;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/" LXC_SNAPSHOT_INDEX, snappath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	ret = snprintf(tmp, MAXPATHLEN, "%s/" LXC_SNAPSHOT_INDEX ".tmp", snappath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	if (stat(snappath, &st) < 0 || !snapshot_dir_unchanged(&st, before)) {
+		INFO("Snapshots in %s changed, not writing index", snappath);
+		return -1;
+	}
+
+	/* Don't keep an index in a directory without snapshots. */
+	if (idx->nr == 0) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			return -1;
+		return 0;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	f = fdopen(dup(fd), "w");
+	if (!f) {
+		close(fd);
+		(void)unlink(tmp);
+		return -1;
+	}
+
+	/* Written again once the index is in place. */
+	len = snapshot_index_header(header, sizeof(header), &st);
+	if (len < 0) {
+		fclose(f);
+		close(fd);
+		(void)unlink(tmp);
+		return -1;
+	}
+	fputs(header, f);
+
+	for (i = 0; i < idx->nr; i++) {
+		struct snapshot_index_entry *e = &idx->entries[i];
+
+		fprintf(f, "%s\t%s\t", e->name, e->timestamp ? e->timestamp : "");
+		if (e->size < 0)
+			fprintf(f, "-\t");
+		else
+			fprintf(f, "%" PRId64 "\t", e->size);
+		snapshot_index_escape(f, e->comment);
+		fputc('\n', f);
+	}
+
+	if (fclose(f) != 0) {
+		SYSERROR("Failed to write snapshot index %s", tmp);
+		close(fd);
+		(void)unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, path) < 0) {
+		SYSERROR("Failed to write snapshot index %s", path);
+		close(fd);
+		(void)unlink(tmp);
+		return -1;
+	}
+
+	/* Renaming the index changed the mtime of the directory. */
+	ret = -1;
+	if (stat(snappath, &st) == 0 &&
+	    snapshot_index_header(header, sizeof(header), &st) == len &&
+	    pwrite(fd, header, len, 0) == len)
+		ret = 0;
+	close(fd);
+
+	return ret;
+}
+
+static int snapshot_index_lock(const char *snappath, bool wait)
+{
+	int fd;
+
+	fd = open(snappath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Record that snapshot @add was created or that @del was removed. @before is
+ * the state of the snapshot directory before that, or NULL if it did not
+ * exist. Failures are not fatal, a missing or stale index is rebuilt the next
+ * time the snapshots are listed.
+ */
+static void snapshot_index_update(const char *snappath, const char *add,
+				  const char *del, const struct stat *before)
+{
+	int fd;
+	struct snapshot_index idx = {0};
+	struct stat st;
+
+	fd = snapshot_index_lock(snappath, true);
+	if (fd < 0) {
+		WARN("Failed to lock snapshot index of %s", snappath);
+		return;
+	}
+
+	if (stat(snappath, &st) < 0)
+		goto out;
+
+	/* Only an index that was current before this change can be updated,
+	 * otherwise it is rebuilt.
+	 */
+	if (!before || snapshot_index_load(snappath, before, &idx) < 0) {
+		if (snapshot_index_scan(snappath, &idx) < 0)
+			goto out;
+	}
+
+	if (del)
+		snapshot_index_remove(&idx, del);
+
+	if (add) {
+		snapshot_index_remove(&idx, add);
+		if (snapshot_index_add(&idx, strdup(add),
+				       read_snapshot_file(snappath, add, "ts"),
+				       read_snapshot_file(snappath, add, "comment"),
+				       -1) < 0)
+			goto out;
+	}
+
+	if (snapshot_index_write(snappath, &idx, &st) < 0)
+		WARN("Failed to update snapshot index of %s", snappath);
+
+out:
+	snapshot_index_free(&idx);
+	close(fd);
+}
+
+static int do_lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
+{
+	int i, flags, ret;
+	struct lxc_container *c2;
+	char snappath[MAXPATHLEN], newname[20];
+	struct stat before;
+	bool existed;
+
+	if (!c || !lxcapi_is_defined(c))
+		return -1;
+
+	if (!storage_can_backup(c->lxc_conf)) {
+		ERROR("%s's backing store cannot be backed up.", c->name);
+		ERROR("Your container must use another backing store type.");
+		return -1;
+	}
+
+	if (!get_snappath_dir(c, snappath))
+		return -1;
 
 	i = get_next_index(snappath, c->name);
 
+	existed = stat(snappath, &before) == 0;
 	if (mkdir_p(snappath, 0755) < 0) {
 		ERROR("Failed to create snapshot directory %s", snappath);
 		return -1;
@@ -3712,10 +4613,15 @@ static int do_lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 	flags = LXC_CLONE_SNAPSHOT | LXC_CLONE_KEEPMACADDR | LXC_CLONE_KEEPNAME |
 		LXC_CLONE_KEEPBDEVTYPE | LXC_CLONE_MAYBE_SNAPSHOT;
 	if (storage_is_dir(c->lxc_conf, c->lxc_conf->rootfs.path)) {
-		ERROR("Snapshot of directory-backed container requested.");
-		ERROR("Making a copy-clone.  If you do want snapshots, then");
-		ERROR("please create an aufs or overlayfs clone first, snapshot that");
-		ERROR("and keep the original container pristine.");
+		if (c->lxc_conf->snapshot_dedup) {
+			INFO("Taking deduplicated snapshot of directory-backed container");
+			flags |= LXC_STORAGE_DEDUP;
+		} else {
+			ERROR("Snapshot of directory-backed container requested.");
+			ERROR("Making a copy-clone.  If you do want snapshots, then");
+			ERROR("please create an aufs or overlayfs clone first, snapshot that");
+			ERROR("and keep the original container pristine.");
+		}
 		flags &= ~LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
 	}
 	c2 = do_lxcapi_clone(c, newname, snappath, flags, NULL, NULL, 0, NULL);
@@ -3760,9 +4666,11 @@ static int do_lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 		int len = strlen(snappath) + strlen(newname) + 10;
 		char *path = alloca(len);
 		sprintf(path, "%s/%s/comment", snappath, newname);
-		return copy_file(commentfile, path) < 0 ? -1 : i;
+		if (copy_file(commentfile, path) < 0)
+			return -1;
 	}
 
+	snapshot_index_update(snappath, newname, NULL, existed ? &before : NULL);
 	return i;
 }
 
@@ -3792,43 +4700,14 @@ static char *get_snapcomment_path(char* snappath, char *name)
 	return s;
 }
 
-static char *get_timestamp(char* snappath, char *name)
-{
-	char path[MAXPATHLEN], *s = NULL;
-	int ret, len;
-	FILE *fin;
-
-	ret = snprintf(path, MAXPATHLEN, "%s/%s/ts", snappath, name);
-	if (ret < 0 || ret >= MAXPATHLEN)
-		return NULL;
-	fin = fopen(path, "r");
-	if (!fin)
-		return NULL;
-	(void) fseek(fin, 0, SEEK_END);
-	len = ftell(fin);
-	(void) fseek(fin, 0, SEEK_SET);
-	if (len > 0) {
-		s = malloc(len+1);
-		if (s) {
-			s[len] = '\0';
-			if (fread(s, 1, len, fin) != len) {
-				SYSERROR("reading timestamp");
-				free(s);
-				s = NULL;
-			}
-		}
-	}
-	fclose(fin);
-	return s;
-}
-
 static int do_lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
 {
-	char snappath[MAXPATHLEN], path2[MAXPATHLEN];
-	int count = 0, ret;
-	struct dirent *direntp;
-	struct lxc_snapshot *snaps =NULL, *nsnaps;
-	DIR *dir;
+	char snappath[MAXPATHLEN];
+	int count = 0, fd;
+	size_t i;
+	struct lxc_snapshot *snaps = NULL;
+	struct snapshot_index idx = {0};
+	struct stat st;
 
 	if (!c || !lxcapi_is_defined(c))
 		return -1;
@@ -3837,69 +4716,114 @@ static int do_lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot
 		ERROR("path name too long");
 		return -1;
 	}
-	dir = opendir(snappath);
-	if (!dir) {
+
+	if (stat(snappath, &st) < 0) {
 		INFO("failed to open %s - assuming no snapshots", snappath);
 		return 0;
 	}
 
-	while ((direntp = readdir(dir))) {
-		if (!direntp)
-			break;
+	if (snapshot_index_load(snappath, &st, &idx) < 0) {
+		if (snapshot_index_scan(snappath, &idx) < 0)
+			return -1;
 
-		if (!strcmp(direntp->d_name, "."))
-			continue;
+		/* Rebuild the index if nobody else is writing it. */
+		fd = snapshot_index_lock(snappath, false);
+		if (fd >= 0) {
+			(void)snapshot_index_write(snappath, &idx, &st);
+			close(fd);
+		}
+	}
 
-		if (!strcmp(direntp->d_name, ".."))
-			continue;
+	if (idx.nr == 0)
+		goto out;
 
-		ret = snprintf(path2, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
-		if (ret < 0 || ret >= MAXPATHLEN) {
-			ERROR("pathname too long");
-			goto out_free;
-		}
-		if (!file_exists(path2))
-			continue;
-		nsnaps = realloc(snaps, (count + 1)*sizeof(*snaps));
-		if (!nsnaps) {
-			SYSERROR("Out of memory");
-			goto out_free;
-		}
-		snaps = nsnaps;
+	snaps = calloc(idx.nr, sizeof(*snaps));
+	if (!snaps) {
+		SYSERROR("Out of memory");
+		goto out_free;
+	}
+
+	for (i = 0; i < idx.nr; i++) {
 		snaps[count].free = lxcsnap_free;
-		snaps[count].name = strdup(direntp->d_name);
-		if (!snaps[count].name)
-			goto out_free;
+		snaps[count].name = idx.entries[i].name;
+		idx.entries[i].name = NULL;
+		snaps[count].timestamp = idx.entries[i].timestamp;
+		idx.entries[i].timestamp = NULL;
 		snaps[count].lxcpath = strdup(snappath);
-		if (!snaps[count].lxcpath) {
-			free(snaps[count].name);
-			goto out_free;
-		}
-		snaps[count].comment_pathname = get_snapcomment_path(snappath, direntp->d_name);
-		snaps[count].timestamp = get_timestamp(snappath, direntp->d_name);
+		snaps[count].comment_pathname = get_snapcomment_path(snappath, snaps[count].name);
 		count++;
+		if (!snaps[count - 1].lxcpath)
+			goto out_free;
 	}
 
-	if (closedir(dir))
-		WARN("failed to close directory");
-
+out:
+	snapshot_index_free(&idx);
 	*ret_snaps = snaps;
 	return count;
 
 out_free:
 	if (snaps) {
-		int i;
-		for (i=0; i<count; i++)
-			lxcsnap_free(&snaps[i]);
+		int j;
+		for (j = 0; j < count; j++)
+			lxcsnap_free(&snaps[j]);
 		free(snaps);
 	}
-	if (closedir(dir))
-		WARN("failed to close directory");
+	snapshot_index_free(&idx);
 	return -1;
 }
 
 WRAP_API_1(int, lxcapi_snapshot_list, struct lxc_snapshot **)
 
+int64_t lxc_snapshot_size(struct lxc_snapshot *s)
+{
+	int fd;
+	size_t i;
+	int64_t size = -1;
+	bool found = false;
+	struct snapshot_index idx = {0};
+	struct stat st;
+
+	if (!s || !s->name || !s->lxcpath)
+		return -1;
+
+	/* Walking a snapshot is expensive, so sizes are only measured when
+	 * asked for and then kept in the index.
+	 */
+	fd = snapshot_index_lock(s->lxcpath, true);
+	if (fd < 0)
+		return snapshot_size(s->lxcpath, s->name);
+
+	if (stat(s->lxcpath, &st) < 0 ||
+	    snapshot_index_load(s->lxcpath, &st, &idx) < 0) {
+		close(fd);
+		return snapshot_size(s->lxcpath, s->name);
+	}
+
+	for (i = 0; i < idx.nr; i++) {
+		struct snapshot_index_entry *e = &idx.entries[i];
+
+		if (strcmp(e->name, s->name) != 0)
+			continue;
+
+		found = true;
+		if (e->size < 0) {
+			e->size = snapshot_size(s->lxcpath, s->name);
+			if (e->size >= 0)
+				(void)snapshot_index_write(s->lxcpath, &idx, &st);
+		}
+		size = e->size;
+		break;
+	}
+
+	snapshot_index_free(&idx);
+	close(fd);
+
+	if (!found)
+		return snapshot_size(s->lxcpath, s->name);
+
+	return size;
+}
+
 static bool do_lxcapi_snapshot_restore(struct lxc_container *c, const char *snapname, const char *newname)
 {
 	char clonelxcpath[MAXPATHLEN];
@@ -3963,10 +4887,15 @@ static bool do_lxcapi_snapshot_restore(struct lxc_container *c, const char *snap
 
 WRAP_API_2(bool, lxcapi_snapshot_restore, const char *, const char *)
 
-static bool do_snapshot_destroy(const char *snapname, const char *clonelxcpath)
+static bool do_snapshot_destroy(const char *snapname, const char *clonelxcpath,
+				bool update_index)
 {
 	struct lxc_container *snap = NULL;
 	bool bret = false;
+	struct stat before;
+	bool existed;
+
+	existed = stat(clonelxcpath, &before) == 0;
 
 	snap = lxc_container_new(snapname, clonelxcpath);
 	if (!snap) {
@@ -3980,6 +4909,17 @@ static bool do_snapshot_destroy(const char *snapname, const char *clonelxcpath)
 	}
 	bret = true;
 
+	if (update_index) {
+		snapshot_index_update(clonelxcpath, NULL, snapname,
+				      existed ? &before : NULL);
+
+		/* Remove the snapshot directory along with the last snapshot,
+		 * lxc-destroy refuses to remove containers that still have
+		 * one. This fails if other snapshots are left.
+		 */
+		(void)rmdir(clonelxcpath);
+	}
+
 err:
 	if (snap)
 		lxc_container_put(snap);
@@ -4002,7 +4942,13 @@ static bool remove_all_snapshots(const char *path)
 			continue;
 		if (!strcmp(direntp->d_name, ".."))
 			continue;
-		if (!do_snapshot_destroy(direntp->d_name, path)) {
+		if (!strncmp(direntp->d_name, LXC_SNAPSHOT_INDEX,
+			     strlen(LXC_SNAPSHOT_INDEX))) {
+			if (unlinkat(dirfd(dir), direntp->d_name, 0))
+				SYSERROR("Error removing %s/%s", path, direntp->d_name);
+			continue;
+		}
+		if (!do_snapshot_destroy(direntp->d_name, path, false)) {
 			bret = false;
 			continue;
 		}
@@ -4026,7 +4972,7 @@ static bool do_lxcapi_snapshot_destroy(struct lxc_container *c, const char *snap
 	if (!get_snappath_dir(c, clonelxcpath))
 		return false;
 
-	return do_snapshot_destroy(snapname, clonelxcpath);
+	return do_snapshot_destroy(snapname, clonelxcpath, true);
 }
 
 WRAP_API_1(bool, lxcapi_snapshot_destroy, const char *)
@@ -4362,6 +5308,13 @@ static int do_lxcapi_migrate(struct lxc_container *c, unsigned int cmd,
 		}
 		ret = !__criu_dump(c, valid_opts);
 		break;
+	case MIGRATE_ITERATIVE_DUMP:
+		if (!do_lxcapi_is_running(c)) {
+			ERROR("container is not running");
+			goto on_error;
+		}
+		ret = !__criu_iterative_dump(c, valid_opts);
+		break;
 	case MIGRATE_RESTORE:
 		if (do_lxcapi_is_running(c)) {
 			ERROR("container is already running");
@@ -4545,6 +5498,7 @@ struct lxc_container *lxc_container_new(const char *name, const char *configpath
 	c->clone = lxcapi_clone;
 	c->get_interfaces = lxcapi_get_interfaces;
 	c->get_ips = lxcapi_get_ips;
+	c->wait_ips = lxcapi_wait_ips;
 	c->attach = lxcapi_attach;
 	c->attach_run_wait = lxcapi_attach_run_wait;
 	c->attach_run_waitl = lxcapi_attach_run_waitl;
@@ -823,6 +823,26 @@ struct lxc_container {
 	 * \return \c 0 on success, nonzero on failure.
 	 */
 	int (*migrate)(struct lxc_container *c, unsigned int cmd, struct migrate_opts *opts, unsigned int size);
+
+	/*!
+	 * \brief Wait until the container has an IP address.
+	 *
+	 * \param c Container.
+	 * \param interface Network interface name to consider.
+	 * \param family Network family (for example "inet", "inet6").
+	 * \param scope IPv6 scope id (ignored if \p family is not "inet6").
+	 * \param timeout Timeout in seconds, \c -1 to wait forever.
+	 *
+	 * \return Newly-allocated array of the addresses \ref get_ips
+	 *  would return, or \c NULL if none showed up before the timeout or
+	 *  the container stopped.
+	 *
+	 * \note Address changes are pushed by the container's monitor where
+	 *  possible. Otherwise the addresses are polled once a second.
+	 * \note The returned array is allocated, so the caller must free it.
+	 * \note The returned array is terminated with a \c NULL entry.
+	 */
+	char** (*wait_ips)(struct lxc_container *c, const char *interface, const char *family, int scope, int timeout);
 };
 
 /*!
@@ -870,6 +890,25 @@ enum {
 	MIGRATE_PRE_DUMP,
 	MIGRATE_DUMP,
 	MIGRATE_RESTORE,
+	MIGRATE_ITERATIVE_DUMP,
+};
+
+/*!
+ * \brief Statistics of a single migration dump iteration.
+ *
+ * Filled from the statistics criu records in the images directory of each
+ * pre-dump and of the final dump.
+ */
+struct migrate_iteration_stats {
+	unsigned int iteration; /*!< Iteration number, starting at 0 */
+	bool final; /*!< \c true for the final dump, \c false for a pre-dump */
+	uint64_t pages_scanned; /*!< Pages criu looked at */
+	uint64_t pages_skipped_parent; /*!< Pages unchanged since the previous iteration */
+	uint64_t pages_written; /*!< Pages dumped, i.e. the dirty set of this iteration */
+	uint32_t freezing_time; /*!< Time it took to freeze the container (usecs) */
+	uint32_t frozen_time; /*!< Time the container stayed frozen (usecs) */
+	uint32_t memdump_time; /*!< Time spent collecting memory (usecs) */
+	uint32_t memwrite_time; /*!< Time spent writing memory out (usecs) */
 };
 
 /*!
@@ -908,6 +947,30 @@ struct migrate_opts {
 	 * which at this time is 1MB.
 	 */
 	uint64_t ghost_limit;
+
+	/* MIGRATE_ITERATIVE_DUMP: run at most this many pre-dumps before the
+	 * final dump. 0 selects the default of 8 iterations.
+	 */
+	unsigned int predump_iterations;
+
+	/* MIGRATE_ITERATIVE_DUMP: stop pre-dumping once an iteration had to
+	 * write no more than this many dirty pages.
+	 */
+	uint64_t predump_converge_pages;
+
+	/* MIGRATE_ITERATIVE_DUMP: if set, called after each pre-dump and after
+	 * the final dump with the statistics of that iteration.
+	 */
+	void (*iteration_cb)(const struct migrate_iteration_stats *stats, void *data);
+	void *iteration_data;
+
+	/* Stream the images through criu-image-streamer instead of storing
+	 * them in directory, which then only holds the streamer's socket,
+	 * logs and lxc's own metadata. A dump writes the image stream to
+	 * stream_fd, a restore reads it from stream_fd. Requires criu 3.15.
+	 */
+	bool stream;
+	int stream_fd;
 };
 
 /*!
@@ -1017,6 +1080,64 @@ int list_active_containers(const char *lxcpath, char ***names, struct lxc_contai
  */
 int list_all_containers(const char *lxcpath, char ***names, struct lxc_container ***cret);
 
+/*!
+ * \brief Create clones of a stopped container in bulk.
+ *
+ * \param c Container to clone, usually a freshly created golden container.
+ * \param names Names of the new containers.
+ * \param count Number of entries in \p names.
+ * \param lxcpath lxcpath of the new containers, or \c NULL to use the
+ *  lxcpath of \p c.
+ * \param flags \c LXC_CLONE_* flags as for \ref clone.
+ * \param bdevtype Backing store type of the new containers as for
+ *  \ref clone.
+ * \param jobs Maximum number of clones whose root filesystem is updated
+ *  concurrently.
+ *
+ * \return Number of containers created, or \c -1 on error.
+ *
+ * \note The configuration and storage of all clones are created first.
+ *  Pass \c LXC_CLONE_SNAPSHOT to use btrfs or zfs snapshots, lvm
+ *  snapshots or an overlay over a directory rootfs. The root filesystems
+ *  of the clones are then updated in parallel.
+ * \note Clones that fail are destroyed again. The others are kept.
+ */
+int lxc_clone_many(struct lxc_container *c, char *const names[], int count,
+		   const char *lxcpath, int flags, const char *bdevtype,
+		   unsigned int jobs);
+
+/*!
+ * \brief Disk space used by a snapshot.
+ *
+ * \param s Snapshot as returned by \c snapshot_list().
+ *
+ * \return Size in bytes, or \c -1 on error.
+ *
+ * \note The size is measured the first time it is asked for, which walks
+ *  the snapshot's directory tree without descending into other filesystems.
+ *  It is then kept in the snapshot index.
+ */
+int64_t lxc_snapshot_size(struct lxc_snapshot *s);
+
+/*!
+ * \brief Freeze or unfreeze running containers in bulk.
+ *
+ * \param containers Containers to freeze or unfreeze.
+ * \param count Number of entries in \p containers.
+ * \param freeze \c true to freeze, \c false to unfreeze.
+ * \param latency_usecs If not \c NULL, an array of \p count entries that
+ *  receives the time in microseconds each container took to reach the new
+ *  state, or \c -1 if it failed.
+ *
+ * \return Number of containers that reached the new state, or \c -1 on
+ *  error.
+ *
+ * \note The new state is requested for all containers before waiting for
+ *  any of them so the kernel freezes them concurrently.
+ */
+int lxc_freeze_many(struct lxc_container **containers, int count, bool freeze,
+		    int64_t *latency_usecs);
+
 /*!
  * \brief Close log file.
  */
@@ -3099,3 +3099,265 @@ void lxc_delete_network(struct lxc_handler *handler)
 	else
 		DEBUG("Deleted network devices");
 }
+
+int lxc_netns_rtnl_open(int netnsfd, bool addr_events)
+{
+	int oldfd, ret, saved_errno;
+	struct nl_handler nlh;
+
+	oldfd = lxc_preserve_ns(lxc_raw_getpid(), "net");
+	if (oldfd < 0)
+		return -errno;
+
+	ret = setns(netnsfd, CLONE_NEWNET);
+	if (ret < 0) {
+		saved_errno = errno;
+		close(oldfd);
+		return -saved_errno;
+	}
+
+	ret = netlink_open(&nlh, NETLINK_ROUTE);
+	if (ret == 0 && addr_events) {
+		int groups[] = { RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR };
+		size_t i;
+
+		for (i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+			if (setsockopt(nlh.fd, SOL_NETLINK,
+				       NETLINK_ADD_MEMBERSHIP, &groups[i],
+				       sizeof(groups[i])) < 0) {
+				ret = -errno;
+				netlink_close(&nlh);
+				break;
+			}
+		}
+	}
+
+	/* Switching back must not fail, we'd be stuck in the container's
+	 * network namespace otherwise.
+	 */
+	if (setns(oldfd, CLONE_NEWNET) < 0) {
+		saved_errno = errno;
+		SYSERROR("Failed to switch back to original network namespace");
+		if (ret == 0)
+			netlink_close(&nlh);
+		ret = -saved_errno;
+	}
+	close(oldfd);
+
+	if (ret < 0)
+		return ret;
+
+	if (fcntl(nlh.fd, F_SETFD, FD_CLOEXEC) < 0) {
+		ret = -errno;
+		netlink_close(&nlh);
+		return ret;
+	}
+
+	return nlh.fd;
+}
+
+static int netaddr_add_link(struct lxc_netaddr **addrs, int *n,
+			    struct nlmsghdr *msg)
+{
+	struct lxc_netaddr *new, *rec;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+
+	new = realloc(*addrs, (*n + 1) * sizeof(**addrs));
+	if (!new)
+		return -ENOMEM;
+	*addrs = new;
+
+	rec = &new[*n];
+	memset(rec, 0, sizeof(*rec));
+	rec->ifindex = ifi->ifi_index;
+	rec->family = AF_UNSPEC;
+
+	for (; RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type != IFLA_IFNAME)
+			continue;
+
+		(void)strlcpy(rec->ifname, RTA_DATA(rta), sizeof(rec->ifname));
+	}
+
+	/* Interface names are unique within a network namespace. */
+	if (rec->ifname[0] != '\0')
+		(*n)++;
+
+	return 0;
+}
+
+static int netaddr_add_addr(struct lxc_netaddr **addrs, int *n, int nlinks,
+			    struct nlmsghdr *msg)
+{
+	int i;
+	struct lxc_netaddr *new, *rec;
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+	struct rtattr *rta = IFA_RTA(ifa);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+	const char *label = NULL;
+	void *local = NULL, *address = NULL;
+	size_t addrlen;
+
+	if (ifa->ifa_family == AF_INET)
+		addrlen = sizeof(struct in_addr);
+	else if (ifa->ifa_family == AF_INET6)
+		addrlen = sizeof(struct in6_addr);
+	else
+		return 0;
+
+	for (; RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			address = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_LABEL)
+			label = RTA_DATA(rta);
+	}
+
+	/* Like getifaddrs() prefer the local address over the peer address of
+	 * point-to-point links.
+	 */
+	if (local)
+		address = local;
+	if (!address)
+		return 0;
+
+	new = realloc(*addrs, (*n + 1) * sizeof(**addrs));
+	if (!new)
+		return -ENOMEM;
+	*addrs = new;
+
+	rec = &new[*n];
+	memset(rec, 0, sizeof(*rec));
+	rec->ifindex = ifa->ifa_index;
+	rec->family = ifa->ifa_family;
+	rec->prefixlen = ifa->ifa_prefixlen;
+	rec->scope = ifa->ifa_scope;
+	rec->flags = ifa->ifa_flags;
+	memcpy(rec->addr, address, addrlen);
+
+	if (label && ifa->ifa_family == AF_INET) {
+		(void)strlcpy(rec->ifname, label, sizeof(rec->ifname));
+	} else {
+		for (i = 0; i < nlinks; i++) {
+			if ((*addrs)[i].ifindex != rec->ifindex)
+				continue;
+
+			memcpy(rec->ifname, (*addrs)[i].ifname, sizeof(rec->ifname));
+			break;
+		}
+	}
+
+	(*n)++;
+	return 0;
+}
+
+static int netns_dump(struct nl_handler *nlh, int type, struct lxc_netaddr **addrs,
+		      int *n)
+{
+	int err, nlinks = *n;
+	int recv_len = 0, answer_len;
+	int readmore = 0;
+	struct nlmsg *nlmsg = NULL, *answer = NULL;
+	struct nlmsghdr *msg;
+
+	err = -ENOMEM;
+	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!nlmsg)
+		goto out;
+
+	answer = nlmsg_alloc_reserve(NLMSG_GOOD_SIZE);
+	if (!answer)
+		goto out;
+	answer_len = answer->nlmsghdr->nlmsg_len;
+
+	nlmsg->nlmsghdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlmsg->nlmsghdr->nlmsg_type = type;
+
+	if (type == RTM_GETLINK) {
+		struct ifinfomsg *ifi;
+
+		ifi = nlmsg_reserve(nlmsg, sizeof(struct ifinfomsg));
+		if (!ifi)
+			goto out;
+		ifi->ifi_family = AF_UNSPEC;
+	} else {
+		struct ifaddrmsg *ifa;
+
+		ifa = nlmsg_reserve(nlmsg, sizeof(struct ifaddrmsg));
+		if (!ifa)
+			goto out;
+		ifa->ifa_family = AF_UNSPEC;
+	}
+
+	err = netlink_send(nlh, nlmsg);
+	if (err < 0)
+		goto out;
+
+	do {
+		answer->nlmsghdr->nlmsg_len = answer_len;
+
+		err = netlink_rcv(nlh, answer);
+		if (err < 0)
+			goto out;
+
+		recv_len = err;
+		msg = answer->nlmsghdr;
+
+		while (NLMSG_OK(msg, recv_len)) {
+			if (msg->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *errmsg = (struct nlmsgerr *)NLMSG_DATA(msg);
+				err = errmsg->error;
+				goto out;
+			}
+
+			if (msg->nlmsg_type == NLMSG_DONE) {
+				readmore = 0;
+				break;
+			}
+
+			if (msg->nlmsg_type == RTM_NEWLINK)
+				err = netaddr_add_link(addrs, n, msg);
+			else if (msg->nlmsg_type == RTM_NEWADDR)
+				err = netaddr_add_addr(addrs, n, nlinks, msg);
+			else
+				err = 0;
+			if (err < 0)
+				goto out;
+
+			readmore = (msg->nlmsg_flags & NLM_F_MULTI);
+			msg = NLMSG_NEXT(msg, recv_len);
+		}
+	} while (readmore);
+
+	err = 0;
+
+out:
+	nlmsg_free(answer);
+	nlmsg_free(nlmsg);
+	return err;
+}
+
+int lxc_netns_get_addrs(int fd, struct lxc_netaddr **addrs)
+{
+	int err, n = 0;
+	struct nl_handler nlh = {
+		.fd = fd,
+	};
+
+	*addrs = NULL;
+
+	/* Links first so that addresses can be matched to interface names. */
+	err = netns_dump(&nlh, RTM_GETLINK, addrs, &n);
+	if (err == 0)
+		err = netns_dump(&nlh, RTM_GETADDR, addrs, &n);
+	if (err < 0) {
+		free(*addrs);
+		*addrs = NULL;
+		return err;
+	}
+
+	return n;
+}
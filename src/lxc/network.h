@@ -24,6 +24,7 @@
 #define __LXC_NETWORK_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -297,4 +298,31 @@ extern int lxc_network_recv_veth_names_from_parent(struct lxc_handler *handler);
 extern int lxc_network_send_name_and_ifindex_to_parent(struct lxc_handler *handler);
 extern int lxc_network_recv_name_and_ifindex_from_child(struct lxc_handler *handler);
 
+/* A network interface or one of its addresses as seen in a container's
+ * network namespace. Every interface is reported once with @family set to
+ * AF_UNSPEC, followed by one record per address. The layout is fixed since
+ * arrays of these records are sent over the command socket.
+ */
+struct lxc_netaddr {
+	char ifname[IFNAMSIZ];
+	int32_t ifindex;
+	uint8_t family;
+	uint8_t prefixlen;
+	uint8_t scope;
+	uint8_t flags;
+	uint8_t addr[16];
+};
+
+/* Open a NETLINK_ROUTE socket in the network namespace referred to by
+ * @netnsfd. If @addr_events is true the socket is subscribed to IPv4 and IPv6
+ * address changes. Returns the socket or a negative errno.
+ */
+extern int lxc_netns_rtnl_open(int netnsfd, bool addr_events);
+
+/* Dump all interfaces and addresses visible to the NETLINK_ROUTE socket @fd
+ * into a newly allocated array. Returns the number of records or a negative
+ * errno.
+ */
+extern int lxc_netns_get_addrs(int fd, struct lxc_netaddr **addrs);
+
 #endif /* __LXC_NETWORK_H */
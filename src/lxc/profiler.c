@@ -0,0 +1,340 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "profiler.h"
+#include "namespace.h"
+#include "utils.h"
+
+#ifndef HAVE_STRLCPY
+#include "include/strlcpy.h"
+#endif
+
+lxc_log_define(lxc_profiler, lxc);
+
+struct lxc_prof *lxc_prof_current = NULL;
+
+/* Per-process bookkeeping. The child inherits a copy of these on clone() so
+ * they are only trusted if they were set by the calling process.
+ */
+static pid_t prof_owner = -1;
+static int prof_phase_slot = -1;
+static int prof_open_spans = 0;
+
+static uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void prof_claim(void)
+{
+	pid_t pid;
+
+	pid = lxc_raw_getpid();
+	if (prof_owner == pid)
+		return;
+
+	prof_owner = pid;
+	prof_phase_slot = -1;
+	prof_open_spans = 0;
+}
+
+int lxc_prof_init(void)
+{
+	struct lxc_prof *prof;
+
+	if (lxc_prof_current)
+		return 0;
+
+	prof = mmap(NULL, sizeof(*prof), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (prof == MAP_FAILED) {
+		SYSERROR("Failed to allocate start profile");
+		return -1;
+	}
+
+	prof->monitor_pid = lxc_raw_getpid();
+	prof->start_ns = prof_now();
+	lxc_prof_current = prof;
+	prof_claim();
+
+	return 0;
+}
+
+void lxc_prof_fini(void)
+{
+	if (!lxc_prof_current)
+		return;
+
+	munmap(lxc_prof_current, sizeof(*lxc_prof_current));
+	lxc_prof_current = NULL;
+	prof_owner = -1;
+}
+
+static int prof_open(const char *name, int depth)
+{
+	unsigned int slot;
+	struct lxc_prof_phase *phase;
+
+	slot = __sync_fetch_and_add(&lxc_prof_current->nr_phases, 1);
+	if (slot >= LXC_PROF_MAX_PHASES) {
+		__sync_fetch_and_add(&lxc_prof_current->dropped, 1);
+		return -1;
+	}
+
+	phase = &lxc_prof_current->phases[slot];
+	(void)strlcpy(phase->name, name, sizeof(phase->name));
+	phase->depth = depth;
+	phase->pid = prof_owner;
+	phase->begin_ns = prof_now();
+
+	return slot;
+}
+
+static void prof_close(int slot)
+{
+	if (slot < 0 || slot >= LXC_PROF_MAX_PHASES)
+		return;
+
+	lxc_prof_current->phases[slot].end_ns = prof_now();
+}
+
+int lxc_prof_begin(const char *fmt, ...)
+{
+	int ret;
+	va_list args;
+	char name[LXC_PROF_NAME_LEN];
+
+	if (!lxc_prof_current)
+		return -1;
+
+	prof_claim();
+
+	va_start(args, fmt);
+	ret = vsnprintf(name, sizeof(name), fmt, args);
+	va_end(args);
+	if (ret < 0)
+		return -1;
+
+	ret = prof_open(name, prof_open_spans + (prof_phase_slot >= 0 ? 1 : 0));
+	if (ret >= 0)
+		prof_open_spans++;
+
+	return ret;
+}
+
+void lxc_prof_end(int slot)
+{
+	if (!lxc_prof_current || slot < 0)
+		return;
+
+	prof_claim();
+	prof_close(slot);
+	if (prof_open_spans > 0)
+		prof_open_spans--;
+}
+
+void lxc_prof_phase(const char *name)
+{
+	if (!lxc_prof_current)
+		return;
+
+	prof_claim();
+
+	if (prof_phase_slot >= 0) {
+		prof_close(prof_phase_slot);
+		prof_phase_slot = -1;
+	}
+
+	if (name)
+		prof_phase_slot = prof_open(name, prof_open_spans);
+}
+
+static void prof_write_escaped(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+}
+
+int lxc_prof_write(const char *path, const char *name)
+{
+	int ret;
+	unsigned int i, nr;
+	FILE *f;
+	bool first = true;
+	struct lxc_prof *prof = lxc_prof_current;
+
+	if (!prof)
+		return 0;
+
+	f = fopen(path, "we");
+	if (!f) {
+		SYSERROR("Failed to open \"%s\"", path);
+		return -1;
+	}
+
+	nr = prof->nr_phases;
+	if (nr > LXC_PROF_MAX_PHASES)
+		nr = LXC_PROF_MAX_PHASES;
+
+	fprintf(f, "{\n  \"container\": \"");
+	prof_write_escaped(f, name);
+	fprintf(f, "\",\n  \"total_us\": %" PRIu64 ",\n  \"dropped\": %u,\n"
+		   "  \"phases\": [\n",
+		(prof_now() - prof->start_ns) / 1000, prof->dropped);
+
+	/* One phase per line so the record stays easy to consume with line
+	 * based tools like lxc-profile-stats.
+	 */
+	for (i = 0; i < nr; i++) {
+		struct lxc_prof_phase *phase = &prof->phases[i];
+
+		/* Still running or never closed because of an error. */
+		if (phase->end_ns < phase->begin_ns)
+			continue;
+
+		fprintf(f, "%s    {\"name\": \"", first ? "" : ",\n");
+		prof_write_escaped(f, phase->name);
+		fprintf(f, "\", \"process\": \"%s\", \"depth\": %d, "
+			   "\"start_us\": %" PRIu64 ", \"duration_us\": %" PRIu64 "}",
+			phase->pid == prof->monitor_pid ? "monitor" : "child",
+			phase->depth, (phase->begin_ns - prof->start_ns) / 1000,
+			(phase->end_ns - phase->begin_ns) / 1000);
+		first = false;
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	ret = fclose(f);
+	if (ret < 0) {
+		SYSERROR("Failed to write \"%s\"", path);
+		return -1;
+	}
+
+	TRACE("Wrote start profile with %u phases to \"%s\"", nr, path);
+	return 0;
+}
+
+/* Extract the string value of @key from a single line of JSON. */
+static bool prof_parse_string(const char *line, const char *key, char *buf,
+			      size_t size)
+{
+	size_t i = 0;
+	const char *p;
+
+	p = strstr(line, key);
+	if (!p)
+		return false;
+
+	p = strchr(p + strlen(key), '"');
+	if (!p)
+		return false;
+
+	for (p++; *p && *p != '"'; p++) {
+		if (*p == '\\' && *(p + 1))
+			p++;
+
+		if (i + 1 < size)
+			buf[i++] = *p;
+	}
+	buf[i] = '\0';
+
+	return *p == '"';
+}
+
+static bool prof_parse_uint(const char *line, const char *key,
+			    unsigned long long *val)
+{
+	const char *p;
+
+	p = strstr(line, key);
+	if (!p)
+		return false;
+
+	return sscanf(p + strlen(key), ": %llu", val) == 1;
+}
+
+int lxc_prof_print_file(const char *path)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	unsigned long long total = 0, dropped = 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	printf("%-48s %-8s %12s %12s\n", "PHASE", "PROCESS", "START (ms)",
+	       "TIME (ms)");
+
+	while (getline(&line, &len, f) != -1) {
+		char name[LXC_PROF_NAME_LEN], process[16];
+		unsigned long long depth, start, duration;
+
+		if (!prof_parse_string(line, "\"name\"", name, sizeof(name))) {
+			prof_parse_uint(line, "\"total_us\"", &total);
+			prof_parse_uint(line, "\"dropped\"", &dropped);
+			continue;
+		}
+
+		if (!prof_parse_string(line, "\"process\"", process, sizeof(process)) ||
+		    !prof_parse_uint(line, "\"depth\"", &depth) ||
+		    !prof_parse_uint(line, "\"start_us\"", &start) ||
+		    !prof_parse_uint(line, "\"duration_us\"", &duration))
+			continue;
+
+		if (depth > 8)
+			depth = 8;
+
+		printf("%*s%-*.*s %-8s %12.3f %12.3f\n", (int)depth * 2, "",
+		       48 - (int)depth * 2, 48 - (int)depth * 2, name, process,
+		       start / 1000.0, duration / 1000.0);
+	}
+	free(line);
+	fclose(f);
+
+	printf("%-48s %-8s %12s %12.3f\n", "total", "", "", total / 1000.0);
+	if (dropped)
+		printf("%llu phases were not recorded\n", dropped);
+
+	return 0;
+}
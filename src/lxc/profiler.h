@@ -0,0 +1,72 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_PROFILER_H
+#define __LXC_PROFILER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LXC_PROF_MAX_PHASES 512
+#define LXC_PROF_NAME_LEN 96
+
+struct lxc_prof_phase {
+	char name[LXC_PROF_NAME_LEN];
+	uint64_t begin_ns;
+	uint64_t end_ns;
+	int depth;
+	pid_t pid;
+};
+
+/* Start-time profile of a single container start. The record lives in a
+ * MAP_SHARED mapping created before clone() so that phases timed by the child
+ * in lxc_setup() end up in the same record as the ones timed by the monitor.
+ */
+struct lxc_prof {
+	pid_t monitor_pid;
+	uint64_t start_ns;
+	unsigned int nr_phases;
+	unsigned int dropped;
+	struct lxc_prof_phase phases[LXC_PROF_MAX_PHASES];
+};
+
+/* Non-NULL while a start is being profiled. */
+extern struct lxc_prof *lxc_prof_current;
+
+extern int lxc_prof_init(void);
+extern void lxc_prof_fini(void);
+
+/* Time a nested span. lxc_prof_begin() returns a slot to be passed to
+ * lxc_prof_end() or -1 if profiling is disabled or the record is full.
+ */
+extern int lxc_prof_begin(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+extern void lxc_prof_end(int slot);
+
+/* Close the current sequential phase of the calling process and open a new one
+ * called @name. Passing NULL only closes the current phase.
+ */
+extern void lxc_prof_phase(const char *name);
+
+/* Write the record as JSON to @path. */
+extern int lxc_prof_write(const char *path, const char *name);
+
+/* Pretty-print a JSON record written by lxc_prof_write(). */
+extern int lxc_prof_print_file(const char *path);
+
+#endif /* __LXC_PROFILER_H */
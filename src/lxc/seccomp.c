@@ -23,15 +23,26 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <seccomp.h>
+#include <linux/filter.h>
 #include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 
 #include "config.h"
 #include "log.h"
 #include "lxcseccomp.h"
+#include "utils.h"
+
+#ifndef SECCOMP_MODE_FILTER
+#define SECCOMP_MODE_FILTER 2
+#endif
 
 lxc_log_define(lxc_seccomp, lxc);
 
@@ -726,17 +737,216 @@ static bool use_seccomp(void)
 	return true;
 }
 
+#if HAVE_SCMP_FILTER_CTX
+/*
+ * Compiled policies are cached as raw BPF programs in <rundir>/lxc/seccomp so
+ * that subsequent starts and attaches using the same policy do not need to
+ * parse it and build a new filter through libseccomp. The cache key is made up
+ * of the policy contents, the host architecture, the libseccomp version and the
+ * lxc version since all of them influence the generated program.
+ */
+static char *seccomp_cache_path(char *policy)
+{
+	int ret;
+	char *rundir, *path;
+	char key[128], version[32];
+	struct utsname uts;
+#if HAVE_LIBGNUTLS
+	int i;
+	unsigned char digest[20];
+#else
+	struct stat st;
+#endif
+
+#if HAVE_LIBGNUTLS
+	ret = sha1sum_file(policy, digest);
+	if (ret < 0)
+		return NULL;
+
+	for (i = 0; i < 20; i++)
+		snprintf(key + i * 2, 3, "%02x", digest[i]);
+#else
+	/* Without a hash implementation fall back to the identity of the
+	 * policy file. Any modification of the file changes its mtime.
+	 */
+	ret = stat(policy, &st);
+	if (ret < 0)
+		return NULL;
+
+	ret = snprintf(key, sizeof(key), "%llx-%llx-%llx-%lld.%09ld",
+		       (unsigned long long)st.st_dev,
+		       (unsigned long long)st.st_ino,
+		       (unsigned long long)st.st_size,
+		       (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	if (ret < 0 || (size_t)ret >= sizeof(key))
+		return NULL;
+#endif
+
+	if (uname(&uts) < 0)
+		return NULL;
+
+#ifdef SCMP_VER_MAJOR
+	{
+		const struct scmp_version *v = seccomp_version();
+
+		ret = snprintf(version, sizeof(version), "%u.%u.%u", v->major,
+			       v->minor, v->micro);
+	}
+#else
+	ret = snprintf(version, sizeof(version), "0");
+#endif
+	if (ret < 0 || (size_t)ret >= sizeof(version))
+		return NULL;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	path = must_make_path(rundir, "lxc", "seccomp", NULL);
+	free(rundir);
+	ret = mkdir_p(path, 0700);
+	if (ret < 0) {
+		free(path);
+		return NULL;
+	}
+
+	rundir = path;
+	path = malloc(strlen(rundir) + strlen(key) + strlen(uts.machine) +
+		      strlen(version) + strlen(PACKAGE_VERSION) + 10);
+	if (path)
+		sprintf(path, "%s/%s-%s-%s-%s.bpf", rundir, key, uts.machine,
+			version, PACKAGE_VERSION);
+	free(rundir);
+
+	return path;
+}
+
+/* Returns 0 on a cache hit, -1 on a miss. */
+static int seccomp_cache_read(struct lxc_conf *conf, const char *path)
+{
+	int fd;
+	ssize_t ret;
+	void *bpf;
+	struct stat st;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	/* Only trust programs written by ourselves. */
+	ret = fstat(fd, &st);
+	if (ret < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || st.st_size == 0 ||
+	    st.st_size % sizeof(struct sock_filter) ||
+	    st.st_size > BPF_MAXINSNS * sizeof(struct sock_filter)) {
+		close(fd);
+		return -1;
+	}
+
+	bpf = malloc(st.st_size);
+	if (!bpf) {
+		close(fd);
+		return -1;
+	}
+
+	ret = lxc_read_nointr(fd, bpf, st.st_size);
+	close(fd);
+	if (ret != st.st_size) {
+		free(bpf);
+		return -1;
+	}
+
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = bpf;
+	conf->seccomp_bpf_len = st.st_size;
+
+	return 0;
+}
+
+static void seccomp_cache_write(struct lxc_conf *conf, const char *path)
+{
+	int fd, ret;
+	char *tmp;
+
+	tmp = malloc(strlen(path) + 8);
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return;
+	}
+
+	ret = seccomp_export_bpf(conf->seccomp_ctx, fd);
+	if (ret < 0) {
+		WARN("Failed to export seccomp filter to \"%s\": %s", tmp,
+		     strerror(-ret));
+		goto on_error;
+	}
+
+	if (close(fd) < 0) {
+		fd = -1;
+		goto on_error;
+	}
+	fd = -1;
+
+	/* Publish atomically so concurrent starts never see partial programs. */
+	if (rename(tmp, path) < 0)
+		goto on_error;
+
+	TRACE("Cached seccomp filter in \"%s\"", path);
+	free(tmp);
+	return;
+
+on_error:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+}
+
+static int seccomp_load_bpf(struct lxc_conf *conf)
+{
+	struct sock_fprog prog = {
+		.len = conf->seccomp_bpf_len / sizeof(struct sock_filter),
+		.filter = conf->seccomp_bpf,
+	};
+
+	/* no-new-privs is deliberately left untouched, see
+	 * lxc_read_seccomp_config().
+	 */
+	return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0);
+}
+#endif
+
 int lxc_read_seccomp_config(struct lxc_conf *conf)
 {
 	FILE *f;
 	int ret;
 	int check_seccomp_attr_set;
+#if HAVE_SCMP_FILTER_CTX
+	char *cache_path;
+#endif
 
 	if (!conf->seccomp)
 		return 0;
 
 	if (!use_seccomp())
 		return 0;
+#if HAVE_SCMP_FILTER_CTX
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
+	conf->seccomp_bpf_len = 0;
+
+	cache_path = seccomp_cache_path(conf->seccomp);
+	if (cache_path && seccomp_cache_read(conf, cache_path) == 0) {
+		TRACE("Using cached seccomp filter \"%s\"", cache_path);
+		free(cache_path);
+		return 0;
+	}
+#endif
 #if HAVE_SCMP_FILTER_CTX
 	/* XXX for debug, pass in SCMP_ACT_TRAP */
 	conf->seccomp_ctx = seccomp_init(SCMP_ACT_KILL);
@@ -769,10 +979,18 @@ int lxc_read_seccomp_config(struct lxc_conf *conf)
 	f = fopen(conf->seccomp, "r");
 	if (!f) {
 		SYSERROR("Failed to open seccomp policy file %s.", conf->seccomp);
+#if HAVE_SCMP_FILTER_CTX
+		free(cache_path);
+#endif
 		return -1;
 	}
 	ret = parse_config(f, conf);
 	fclose(f);
+#if HAVE_SCMP_FILTER_CTX
+	if (ret == 0 && cache_path)
+		seccomp_cache_write(conf, cache_path);
+	free(cache_path);
+#endif
 	return ret;
 }
 
@@ -783,6 +1001,18 @@ int lxc_seccomp_load(struct lxc_conf *conf)
 		return 0;
 	if (!use_seccomp())
 		return 0;
+#if HAVE_SCMP_FILTER_CTX
+	if (conf->seccomp_bpf) {
+		ret = seccomp_load_bpf(conf);
+		if (ret < 0) {
+			SYSERROR("Error loading the cached seccomp policy.");
+			return -1;
+		}
+		TRACE("Loaded cached seccomp filter with %zu instructions",
+		      conf->seccomp_bpf_len / sizeof(struct sock_filter));
+		return 0;
+	}
+#endif
 	ret = seccomp_load(
 #if HAVE_SCMP_FILTER_CTX
 	    conf->seccomp_ctx
@@ -816,5 +1046,8 @@ void lxc_seccomp_free(struct lxc_conf *conf)
 		seccomp_release(conf->seccomp_ctx);
 		conf->seccomp_ctx = NULL;
 	}
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
+	conf->seccomp_bpf_len = 0;
 #endif
 }
@@ -76,6 +76,7 @@
 #include "monitor.h"
 #include "namespace.h"
 #include "network.h"
+#include "profiler.h"
 #include "start.h"
 #include "sync.h"
 #include "utils.h"
@@ -605,6 +606,8 @@ void lxc_zero_handler(struct lxc_handler *handler)
 
 	handler->sigfd = -1;
 
+	handler->netns_rtnl_fd = -1;
+
 	for (i = 0; i < LXC_NS_MAX; i++)
 		handler->nsfd[i] = -1;
 
@@ -677,6 +680,7 @@ struct lxc_handler *lxc_init_handler(const char *name, struct lxc_conf *conf,
 	handler->lxcpath = lxcpath;
 	handler->pinfd = -1;
 	handler->sigfd = -EBADF;
+	handler->netns_rtnl_fd = -EBADF;
 	handler->init_died = false;
 	handler->state_socket_pair[0] = handler->state_socket_pair[1] = -1;
 	lxc_list_init(&handler->state_clients);
@@ -822,6 +826,7 @@ int lxc_init(const char *name, struct lxc_handler *handler)
 	TRACE("Created console");
 
 	ret = lxc_pty_map_ids(conf, &conf->console);
+	lxc_userns_helper_stop(conf);
 	if (ret < 0) {
 		ERROR("Failed to chown console");
 		goto out_restore_sigmask;
@@ -893,6 +898,11 @@ void lxc_fini(const char *name, struct lxc_handler *handler)
 		handler->netnsfd = -1;
 	}
 
+	if (handler->netns_rtnl_fd >= 0) {
+		close(handler->netns_rtnl_fd);
+		handler->netns_rtnl_fd = -EBADF;
+	}
+
 	cgroup_destroy(handler);
 
 	/* For all new state clients simply close the command socket.
@@ -1064,6 +1074,50 @@ static int lxc_set_death_signal(int signal)
 	return 0;
 }
 
+static int do_start_switch_creds(struct lxc_handler *handler)
+{
+	int ret;
+
+	/* If we are in a new user namespace, become root there to have
+	 * privilege over our namespace.
+	 */
+	if (!lxc_list_empty(&handler->conf->id_map)) {
+		uid_t nsuid = (handler->conf->root_nsuid_map != NULL)
+				  ? 0
+				  : handler->conf->init_uid;
+		gid_t nsgid = (handler->conf->root_nsgid_map != NULL)
+				  ? 0
+				  : handler->conf->init_gid;
+
+		if (!lxc_switch_uid_gid(nsuid, nsgid))
+			return -1;
+
+		/* Drop groups only after we switched to a valid gid in the new
+		 * user namespace.
+		 */
+		if (!lxc_setgroups(0, NULL) && (handler->am_root || errno != EPERM))
+			return -1;
+
+		ret = prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
+		if (ret < 0)
+			return -1;
+
+		/* set{g,u}id() clears deathsignal */
+		ret = lxc_set_death_signal(SIGKILL);
+		if (ret < 0) {
+			SYSERROR("Failed to set PR_SET_PDEATHSIG to SIGKILL");
+			return -1;
+		}
+	}
+
+	if (access(handler->lxcpath, X_OK)) {
+		print_top_failing_dir(handler->lxcpath);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int do_start(void *data)
 {
 	int ret;
@@ -1109,6 +1163,7 @@ static int do_start(void *data)
 	ret = lxc_sync_wait_parent(handler, LXC_SYNC_STARTUP);
 	if (ret < 0)
 		goto out_warn_father;
+	lxc_prof_phase("child: namespace setup");
 
 	/* Unshare CLONE_NEWNET after CLONE_NEWUSER. See
 	 * https://github.com/lxc/lxd/issues/1978.
@@ -1123,55 +1178,58 @@ static int do_start(void *data)
 		INFO("Unshared CLONE_NEWNET.");
 	}
 
-	/* Tell the parent task it can begin to configure the container and wait
-	 * for it to finish.
+	/* Add the requested environment variables to the current environment to
+	 * allow them to be used by the various hooks, including the
+	 * pre-mount hooks run by lxc_setup_mounts() below.
 	 */
-	ret = lxc_sync_barrier_parent(handler, LXC_SYNC_CONFIGURE);
-	if (ret < 0)
-		goto out_warn_father;
-
-	if (lxc_network_recv_veth_names_from_parent(handler) < 0) {
-		ERROR("Failed to receive veth names from parent");
-		goto out_warn_father;
+	lxc_list_for_each(iterator, &handler->conf->environment) {
+		if (putenv((char *)iterator->elem)) {
+			SYSERROR("Failed to set environment variable: %s.", (char *)iterator->elem);
+			goto out_warn_father;
+		}
 	}
 
-	/* If we are in a new user namespace, become root there to have
-	 * privilege over our namespace.
+	/* When the monitor runs as root it does not depend on our credentials
+	 * to move us into our cgroups and to set up our network devices. So we
+	 * can switch credentials right away and mount our rootfs while the
+	 * parent configures the container, instead of idling in the barrier.
+	 * An unprivileged monitor needs us to keep our uid until it has
+	 * attached us to our cgroups.
 	 */
-	if (!lxc_list_empty(&handler->conf->id_map)) {
-		uid_t nsuid = (handler->conf->root_nsuid_map != NULL)
-				  ? 0
-				  : handler->conf->init_uid;
-		gid_t nsgid = (handler->conf->root_nsgid_map != NULL)
-				  ? 0
-				  : handler->conf->init_gid;
-
-		if (!lxc_switch_uid_gid(nsuid, nsgid))
-			goto out_warn_father;
-
-		/* Drop groups only after we switched to a valid gid in the new
-		 * user namespace.
-		 */
-		if (!lxc_setgroups(0, NULL) && (handler->am_root || errno != EPERM))
+	if (handler->am_root) {
+		lxc_prof_phase("child: credentials");
+		if (do_start_switch_creds(handler) < 0)
 			goto out_warn_father;
+	}
 
-		ret = prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
-		if (ret < 0)
-			goto out_warn_father;
+	/* Tell the parent task it can begin to configure the container. */
+	ret = lxc_sync_wake_parent(handler, LXC_SYNC_CONFIGURE);
+	if (ret < 0)
+		goto out_warn_father;
 
-		/* set{g,u}id() clears deathsignal */
-		ret = lxc_set_death_signal(SIGKILL);
+	if (handler->am_root) {
+		ret = lxc_setup_mounts(handler);
 		if (ret < 0) {
-			SYSERROR("Failed to set PR_SET_PDEATHSIG to SIGKILL");
+			ERROR("Failed to setup mounts for container \"%s\"", handler->name);
 			goto out_warn_father;
 		}
 	}
 
-	if (access(handler->lxcpath, X_OK)) {
-		print_top_failing_dir(handler->lxcpath);
+	/* Wait for the parent to finish configuring the container. */
+	lxc_prof_phase("child: wait for configure");
+	ret = lxc_sync_wait_parent(handler, LXC_SYNC_POST_CONFIGURE);
+	if (ret < 0)
+		goto out_warn_father;
+
+	lxc_prof_phase("child: post configure");
+	if (lxc_network_recv_veth_names_from_parent(handler) < 0) {
+		ERROR("Failed to receive veth names from parent");
 		goto out_warn_father;
 	}
 
+	if (!handler->am_root && do_start_switch_creds(handler) < 0)
+		goto out_warn_father;
+
 	#if HAVE_LIBCAP
 	if (handler->conf->need_utmp_watch) {
 		if (prctl(PR_CAPBSET_DROP, CAP_SYS_BOOT, 0, 0, 0)) {
@@ -1206,9 +1264,12 @@ static int do_start(void *data)
 	}
 
 	/* Ask father to setup cgroups and wait for him to finish. */
+	lxc_prof_phase("child: wait for cgroups");
 	if (lxc_sync_barrier_parent(handler, LXC_SYNC_CGROUP))
 		goto out_error;
 
+	lxc_prof_phase("child: cgroup namespace");
+
 	/* Unshare cgroup namespace after we have setup our cgroups. If we do it
 	 * earlier we end up with a wrong view of /proc/self/cgroup. For
 	 * example, assume we unshare(CLONE_NEWCGROUP) first, and then create
@@ -1229,18 +1290,8 @@ static int do_start(void *data)
 		INFO("Unshared CLONE_NEWCGROUP.");
 	}
 
-	/* Add the requested environment variables to the current environment to
-	 * allow them to be used by the various hooks, such as the start hook
-	 * above.
-	 */
-	lxc_list_for_each(iterator, &handler->conf->environment) {
-		if (putenv((char *)iterator->elem)) {
-			SYSERROR("Failed to set environment variable: %s.", (char *)iterator->elem);
-			goto out_warn_father;
-		}
-	}
-
 	/* Setup the container, ip, names, utsname, ... */
+	lxc_prof_phase(NULL);
 	ret = lxc_setup(handler);
 	close(handler->data_sock[1]);
 	close(handler->data_sock[0]);
@@ -1249,6 +1300,7 @@ static int do_start(void *data)
 		goto out_warn_father;
 	}
 
+	lxc_prof_phase("child: lsm and console");
 	/* Set the label to change to when we exec(2) the container's init. */
 	if (lsm_process_label_set(NULL, handler->conf, 1, 1) < 0)
 		goto out_warn_father;
@@ -1275,9 +1327,11 @@ static int do_start(void *data)
 	/* If we mounted a temporary proc, then unmount it now. */
 	tmp_proc_unmount(handler->conf);
 
+	lxc_prof_phase("child: seccomp");
 	if (lxc_seccomp_load(handler->conf) != 0)
 		goto out_warn_father;
 
+	lxc_prof_phase("child: start hooks");
 	if (run_lxc_hooks(handler->name, "start", handler->conf, handler->lxcpath, NULL)) {
 		ERROR("Failed to run lxc.hook.start for container \"%s\".", handler->name);
 		goto out_warn_father;
@@ -1301,6 +1355,8 @@ static int do_start(void *data)
 
 	setsid();
 
+	/* The parent writes out the profile once we're past this barrier. */
+	lxc_prof_phase(NULL);
 	if (lxc_sync_barrier_parent(handler, LXC_SYNC_CGROUP_LIMITS))
 		goto out_warn_father;
 
@@ -1509,6 +1565,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 			 * before creating network interfaces, since goto
 			 * out_delete_net does not work before lxc_clone.
 			 */
+			lxc_prof_phase("network: find gateways");
 			if (lxc_find_gateway_addresses(handler)) {
 				ERROR("Failed to find gateway addresses.");
 				lxc_sync_fini(handler);
@@ -1518,6 +1575,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 			/* That should be done before the clone because we will
 			 * fill the netdev index and use them in the child.
 			 */
+			lxc_prof_phase("network: create");
 			if (lxc_create_network_priv(handler)) {
 				ERROR("Failed to create the network.");
 				lxc_sync_fini(handler);
@@ -1526,6 +1584,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 		}
 	}
 
+	lxc_prof_phase("cgroup: init");
 	if (!cgroup_init(handler)) {
 		ERROR("Failed initializing cgroup support.");
 		goto out_delete_net;
@@ -1533,6 +1592,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 
 	cgroups_connected = true;
 
+	lxc_prof_phase("cgroup: create");
 	if (!cgroup_create(handler)) {
 		ERROR("Failed creating cgroups.");
 		goto out_delete_net;
@@ -1565,6 +1625,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 		flags &= ~CLONE_NEWNET;
 	}
 
+	lxc_prof_phase("clone");
 	handler->pid = lxc_raw_clone_cb(do_start, handler, flags);
 	if (handler->pid < 0) {
 		SYSERROR("Failed to clone a new set of namespaces.");
@@ -1590,17 +1651,20 @@ static int lxc_spawn(struct lxc_handler *handler)
 	 * mapped to something else on the host.) later to become a valid uid
 	 * again.
 	 */
+	lxc_prof_phase("idmap");
 	if (wants_to_map_ids && lxc_map_ids(id_map, handler->pid)) {
 		ERROR("Failed to set up id mapping.");
 		goto out_delete_net;
 	}
 
+	lxc_prof_phase("wait: child configure");
 	if (lxc_sync_wake_child(handler, LXC_SYNC_STARTUP))
 		goto out_delete_net;
 
 	if (lxc_sync_wait_child(handler, LXC_SYNC_CONFIGURE))
 		goto out_delete_net;
 
+	lxc_prof_phase("cgroup: limits");
 	if (!cgroup_create_legacy(handler)) {
 		ERROR("Failed to setup legacy cgroups for container \"%s\".", name);
 		goto out_delete_net;
@@ -1623,6 +1687,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 	}
 
 	/* Create the network configuration. */
+	lxc_prof_phase("network: move");
 	if (handler->clone_flags & CLONE_NEWNET) {
 		if (lxc_network_move_created_netdev_priv(handler->lxcpath,
 							 handler->name,
@@ -1648,12 +1713,14 @@ static int lxc_spawn(struct lxc_handler *handler)
 	/* Tell the child to continue its initialization. We'll get
 	 * LXC_SYNC_CGROUP when it is ready for us to setup cgroups.
 	 */
+	lxc_prof_phase("wait: child cgroup");
 	if (lxc_sync_barrier_child(handler, LXC_SYNC_POST_CONFIGURE))
 		goto out_delete_net;
 
 	if (lxc_sync_barrier_child(handler, LXC_SYNC_CGROUP_UNSHARE))
 		goto out_delete_net;
 
+	lxc_prof_phase("cgroup: devices");
 	if (!cgroup_setup_limits(handler, true)) {
 		ERROR("Failed to setup the devices cgroup for container \"%s\".", name);
 		goto out_delete_net;
@@ -1680,9 +1747,12 @@ static int lxc_spawn(struct lxc_handler *handler)
 	 * lxc_sync_barrier_child to return success, or return a different
 	 * value, causing us to error out).
 	 */
+	lxc_prof_phase("wait: child setup");
 	if (lxc_sync_barrier_child(handler, LXC_SYNC_POST_CGROUP))
 		return -1;
 
+	lxc_prof_phase("post start");
+
 	if (lxc_network_recv_name_and_ifindex_from_child(handler) < 0) {
 		ERROR("Failed to receive names and ifindices for network "
 		      "devices from child");
@@ -1705,6 +1775,14 @@ static int lxc_spawn(struct lxc_handler *handler)
 	if (handler->ops->post_start(handler, handler->data))
 		goto out_abort;
 
+	/* Write the profile before we report RUNNING so that callers waiting
+	 * for the container to start find it on disk.
+	 */
+	lxc_prof_phase(NULL);
+	if (handler->conf->start_profile &&
+	    lxc_prof_write(handler->conf->start_profile, name) < 0)
+		WARN("Failed to write start profile for container \"%s\"", name);
+
 	if (lxc_set_state(name, handler, RUNNING)) {
 		ERROR("Failed to set state for container \"%s\" to \"%s\".", name,
 		      lxc_state2str(RUNNING));
@@ -1754,8 +1832,13 @@ int __lxc_start(const char *name, struct lxc_handler *handler,
 	int err = -1;
 	struct lxc_conf *conf = handler->conf;
 
+	if (conf->start_profile && lxc_prof_init() < 0)
+		WARN("Failed to enable start profiling");
+
+	lxc_prof_phase("init");
 	if (lxc_init(name, handler) < 0) {
 		ERROR("Failed to initialize container \"%s\".", name);
+		lxc_prof_fini();
 		return -1;
 	}
 	handler->ops = ops;
@@ -1774,6 +1857,7 @@ int __lxc_start(const char *name, struct lxc_handler *handler,
 		handler->conf->need_utmp_watch = 0;
 	}
 
+	lxc_prof_phase("attach block device");
 	if (!attach_block_device(handler->conf)) {
 		ERROR("Failed to attach block device.");
 		goto out_fini_nonet;
@@ -1788,6 +1872,7 @@ int __lxc_start(const char *name, struct lxc_handler *handler,
 			}
 			INFO("Unshared CLONE_NEWNS.");
 
+			lxc_prof_phase("rootfs: mount as host root");
 			remount_all_slave();
 			if (do_rootfs_setup(conf, name, lxcpath) < 0) {
 				ERROR("Error setting up rootfs mount as root before spawn.");
@@ -1797,7 +1882,9 @@ int __lxc_start(const char *name, struct lxc_handler *handler,
 		}
 	}
 
+	lxc_prof_phase("spawn: setup");
 	err = lxc_spawn(handler);
+	lxc_prof_fini();
 	if (err) {
 		ERROR("Failed to spawn container \"%s\".", name);
 		goto out_detach_blockdev;
@@ -1869,6 +1956,7 @@ out_detach_blockdev:
 	detach_block_device(handler->conf);
 
 out_fini_nonet:
+	lxc_prof_fini();
 	lxc_fini(name, handler);
 	return err;
 
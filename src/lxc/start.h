@@ -43,6 +43,11 @@ struct lxc_handler {
 	/* File descriptors referring to the network namespace of the container. */
 	int netnsfd;
 
+	/* NETLINK_ROUTE socket in the container's network namespace. It is
+	 * opened on first use to answer address queries without forking.
+	 */
+	int netns_rtnl_fd;
+
 	/* File descriptor to pin the rootfs for privileged containers. */
 	int pinfd;
 
@@ -85,6 +90,11 @@ struct lxc_handler {
 	/* Whether the child has already exited. */
 	bool init_died;
 
+	/* Whether the child mounted its rootfs while the parent was still
+	 * setting up cgroups and network. Only meaningful in the child.
+	 */
+	bool mounts_setup;
+
 	/* The signal mask prior to setting up the signal file descriptor. */
 	sigset_t oldmask;
 
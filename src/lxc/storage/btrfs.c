@@ -26,6 +26,8 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,6 +53,9 @@
 
 lxc_log_define(btrfs, lxc);
 
+/* Upper bound for threads destroying nested subvolumes in parallel. */
+#define BTRFS_DESTROY_THREADS 16
+
 /* defined in lxccontainer.c: needs to become common helper */
 extern char *dir_new_path(char *src, const char *oldname, const char *name,
 			  const char *oldpath, const char *lxcpath);
@@ -490,290 +495,554 @@ static int btrfs_do_destroy_subvol(const char *path)
 	return ret;
 }
 
-static int get_btrfs_tree_idx(struct my_btrfs_tree *tree, u64 id)
-{
-	int i;
-	if (!tree)
-		return -1;
-	for (i = 0; i < tree->num; i++) {
-		if (tree->nodes[i].objid == id)
-			return i;
-	}
-	return -1;
-}
+/* A forward root ref: subvolume @child is linked into directory @dirid of
+ * subvolume @parent under @name.
+ */
+struct btrfs_subvol_ref {
+	u64 parent;
+	u64 child;
+	u64 dirid;
+	char *name;
+};
 
-static struct my_btrfs_tree *create_my_btrfs_tree(u64 id, const char *path,
-						  int name_len)
+static void free_btrfs_refs(struct btrfs_subvol_ref *refs, size_t nr)
 {
-	struct my_btrfs_tree *tree;
+	size_t i;
 
-	tree = malloc(sizeof(struct my_btrfs_tree));
-	if (!tree)
-		return NULL;
-	tree->nodes = malloc(sizeof(struct mytree_node));
-	if (!tree->nodes) {
-		free(tree);
-		return NULL;
-	}
-	tree->num = 1;
-	tree->nodes[0].dirname = NULL;
-	tree->nodes[0].name = strdup(path);
-	if (!tree->nodes[0].name) {
-		free(tree->nodes);
-		free(tree);
-		return NULL;
-	}
-	tree->nodes[0].parentid = 0;
-	tree->nodes[0].objid = id;
-	return tree;
+	for (i = 0; i < nr; i++)
+		free(refs[i].name);
+	free(refs);
 }
 
-static bool update_tree_node(struct mytree_node *n, u64 id, u64 parent,
-			     char *name, int name_len, char *dirname)
+/*
+ * Collect the forward root refs of the children of @parent or, if @parent is
+ * 0, of all subvolumes of the filesystem in one pass over the tree of tree
+ * roots.
+ */
+static int btrfs_search_refs(int fd, u64 parent, struct btrfs_subvol_ref **refs,
+			     size_t *nr)
 {
-	if (id)
-		n->objid = id;
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_root_ref *ref;
+	struct btrfs_subvol_ref *tmp;
+	unsigned long off;
+	size_t cap = 0;
+	int i, ret, name_len;
 
-	if (parent)
-		n->parentid = parent;
+	*refs = NULL;
+	*nr = 0;
 
-	if (name) {
-		n->name = malloc(name_len + 1);
-		if (!n->name)
-			return false;
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = 1;
+	sk->min_objectid = parent;
+	sk->max_objectid = parent ? parent : (u64)-1;
+	sk->min_type = BTRFS_ROOT_REF_KEY;
+	sk->max_type = BTRFS_ROOT_REF_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
 
-		(void)strlcpy(n->name, name, name_len + 1);
-	}
+	for (;;) {
+		sk->nr_items = 4096;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0)
+			goto on_error;
 
-	if (dirname) {
-		size_t len;
+		if (sk->nr_items == 0)
+			break;
 
-		len = strlen(dirname);
-		n->dirname = malloc(len + 1);
-		if (!n->dirname) {
-			free(n->name);
-			return false;
+		off = 0;
+		for (i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+
+			/* The range may contain other items in between. */
+			if (sh.type == BTRFS_ROOT_REF_KEY) {
+				if (*nr == cap) {
+					cap = cap ? cap * 2 : 64;
+					tmp = realloc(*refs, cap * sizeof(**refs));
+					if (!tmp)
+						goto on_error;
+					*refs = tmp;
+				}
+
+				ref = (struct btrfs_root_ref *)(args.buf + off);
+				name_len = btrfs_stack_root_ref_name_len(ref);
+				tmp = &(*refs)[*nr];
+				tmp->parent = sh.objectid;
+				tmp->child = sh.offset;
+				tmp->dirid = btrfs_stack_root_ref_dirid(ref);
+				tmp->name = strndup((char *)(ref + 1), name_len);
+				if (!tmp->name)
+					goto on_error;
+				(*nr)++;
+			}
+
+			off += sh.len;
 		}
 
-		(void)strlcpy(n->dirname, dirname, len + 1);
+		/* Continue right after the last key that was returned. */
+		sk->min_objectid = sh.objectid;
+		sk->min_type = sh.type;
+		sk->min_offset = sh.offset + 1;
+		if (sk->min_offset == 0) {
+			sk->min_type++;
+			if (sk->min_type == 0) {
+				sk->min_objectid++;
+				if (sk->min_objectid == 0)
+					break;
+			}
+		}
+
+		if (sk->min_objectid > sk->max_objectid)
+			break;
 	}
-	return true;
+
+	return 0;
+
+on_error:
+	ret = errno;
+	free_btrfs_refs(*refs, *nr);
+	*refs = NULL;
+	*nr = 0;
+	errno = ret;
+	return -1;
 }
 
-static bool add_btrfs_tree_node(struct my_btrfs_tree *tree, u64 id, u64 parent,
-				char *name, int name_len, char *dirname)
+static int cmp_btrfs_ref(const void *a, const void *b)
 {
-	struct mytree_node *tmp;
+	const struct btrfs_subvol_ref *ra = a, *rb = b;
 
-	int i = get_btrfs_tree_idx(tree, id);
-	if (i != -1)
-		return update_tree_node(&tree->nodes[i], id, parent, name,
-				name_len, dirname);
+	if (ra->parent != rb->parent)
+		return ra->parent < rb->parent ? -1 : 1;
+	return 0;
+}
 
-	tmp = realloc(tree->nodes, (tree->num+1) * sizeof(struct mytree_node));
-	if (!tmp)
-		return false;
-	tree->nodes = tmp;
-	memset(&tree->nodes[tree->num], 0, sizeof(struct mytree_node));
-	if (!update_tree_node(&tree->nodes[tree->num], id, parent, name,
-				name_len, dirname))
-		return false;
-	tree->num++;
-	return true;
+struct btrfs_destroy_ctx {
+	/* The subvolume being destroyed. */
+	int fd;
+	u64 root_id;
+	const char *path;
+
+	/* Descendants of root_id, parents before their children. */
+	struct btrfs_subvol_node *nodes;
+	size_t nr;
+
+	/* Nodes all of whose children have been destroyed. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t *ready;
+	size_t nr_ready;
+	unsigned int busy;
+	bool failed;
+	/* BTRFS_IOC_SNAP_DESTROY_V2 by id is not available. */
+	bool by_path;
+};
+
+static void free_btrfs_nodes(struct btrfs_destroy_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->nr; i++) {
+		free(ctx->nodes[i].name);
+		free(ctx->nodes[i].path);
+	}
+	free(ctx->nodes);
+	free(ctx->ready);
+	ctx->nodes = NULL;
+	ctx->ready = NULL;
+	ctx->nr = 0;
 }
 
-static void free_btrfs_tree(struct my_btrfs_tree *tree)
+static int add_btrfs_node(struct btrfs_destroy_ctx *ctx, size_t *cap,
+			  struct btrfs_subvol_ref *ref, ssize_t parent)
 {
-	int i;
-	if (!tree)
-		return;
-	for (i = 0; i < tree->num;  i++) {
-		free(tree->nodes[i].name);
-		free(tree->nodes[i].dirname);
-	}
-	free(tree->nodes);
-	free(tree);
+	struct btrfs_subvol_node *tmp;
+
+	if (ctx->nr == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		tmp = realloc(ctx->nodes, *cap * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+		ctx->nodes = tmp;
+	}
+
+	tmp = &ctx->nodes[ctx->nr++];
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->id = ref->child;
+	tmp->parent = parent;
+	tmp->dirid = ref->dirid;
+	tmp->name = ref->name;
+	ref->name = NULL;
+	if (parent >= 0)
+		ctx->nodes[parent].children++;
+
+	return 0;
 }
 
 /*
- * Given a @tree of subvolumes under @path, ask btrfs to remove each
- * subvolume
+ * Gather all subvolumes below ctx->root_id. Most subvolumes have no children
+ * which is checked with a search restricted to ctx->root_id first. Otherwise
+ * the refs of all subvolumes are read in a single pass and the tree below
+ * ctx->root_id is built from them.
  */
-static bool do_remove_btrfs_children(struct my_btrfs_tree *tree, u64 root_id,
-				     const char *path)
+static int btrfs_gather_subvols(struct btrfs_destroy_ctx *ctx)
 {
-	int i, ret;
-	char *newpath;
-	size_t len;
+	struct btrfs_subvol_ref *refs, key;
+	size_t nr, lo, hi, mid, cap = 0;
+	ssize_t k;
+	int ret;
 
-	for (i = 0; i < tree->num; i++) {
-		if (tree->nodes[i].parentid == root_id) {
-			if (!tree->nodes[i].dirname) {
-				WARN("Odd condition: child objid with no name under %s\n", path);
-				continue;
-			}
-			len = strlen(path) + strlen(tree->nodes[i].dirname) + 2;
-			newpath = malloc(len);
-			if (!newpath) {
-				ERROR("Out of memory");
-				return false;
-			}
-			ret = snprintf(newpath, len, "%s/%s", path, tree->nodes[i].dirname);
-			if (ret < 0 || ret >= len) {
-				free(newpath);
-				return false;
-			}
-			if (!do_remove_btrfs_children(tree, tree->nodes[i].objid, newpath)) {
-				ERROR("Failed to prune %s\n", tree->nodes[i].name);
-				free(newpath);
-				return false;
-			}
-			if (btrfs_do_destroy_subvol(newpath) != 0) {
-				ERROR("Failed to remove %s\n", newpath);
-				free(newpath);
-				return false;
+	ret = btrfs_search_refs(ctx->fd, ctx->root_id, &refs, &nr);
+	if (ret < 0)
+		return -1;
+	free_btrfs_refs(refs, nr);
+	if (nr == 0)
+		return 0;
+
+	ret = btrfs_search_refs(ctx->fd, 0, &refs, &nr);
+	if (ret < 0)
+		return -1;
+
+	qsort(refs, nr, sizeof(*refs), cmp_btrfs_ref);
+
+	/* Breadth-first from the subvolume being destroyed which stands in as
+	 * node -1.
+	 */
+	for (k = -1; k < (ssize_t)ctx->nr; k++) {
+		key.parent = k < 0 ? ctx->root_id : ctx->nodes[k].id;
+
+		lo = 0;
+		hi = nr;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (cmp_btrfs_ref(&refs[mid], &key) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (; lo < nr && refs[lo].parent == key.parent; lo++) {
+			if (add_btrfs_node(ctx, &cap, &refs[lo], k) < 0) {
+				free_btrfs_refs(refs, nr);
+				free_btrfs_nodes(ctx);
+				return -1;
 			}
-			free(newpath);
 		}
 	}
-	return true;
+
+	free_btrfs_refs(refs, nr);
+	return 0;
 }
 
-static int btrfs_recursive_destroy(const char *path)
+/* Resolve the path of node @idx. Called with ctx->lock held. */
+static const char *btrfs_node_path(struct btrfs_destroy_ctx *ctx, size_t idx)
+{
+	struct btrfs_subvol_node *n = &ctx->nodes[idx];
+	const char *parent_path;
+	u64 parent_id;
+	char *rel;
+	size_t len;
+	int ret;
+
+	if (n->path)
+		return n->path;
+
+	if (n->parent < 0) {
+		parent_id = ctx->root_id;
+		parent_path = ctx->path;
+	} else {
+		parent_id = ctx->nodes[n->parent].id;
+		parent_path = btrfs_node_path(ctx, n->parent);
+		if (!parent_path)
+			return NULL;
+	}
+
+	rel = get_btrfs_subvol_path(ctx->fd, parent_id, n->dirid, n->name,
+				    strlen(n->name));
+	if (!rel)
+		return NULL;
+
+	len = strlen(parent_path) + strlen(rel) + 2;
+	n->path = malloc(len);
+	if (!n->path) {
+		free(rel);
+		return NULL;
+	}
+
+	ret = snprintf(n->path, len, "%s/%s", parent_path, rel);
+	free(rel);
+	if (ret < 0 || (size_t)ret >= len) {
+		free(n->path);
+		n->path = NULL;
+	}
+
+	return n->path;
+}
+
+/* Look up the subvolume @id is linked into through its ROOT_BACKREF. */
+static int btrfs_get_parent_id(int fd, u64 id, u64 *parent)
 {
-	u64 root_id;
-	int fd;
 	struct btrfs_ioctl_search_args args;
 	struct btrfs_ioctl_search_key *sk = &args.key;
 	struct btrfs_ioctl_search_header sh;
-	struct btrfs_root_ref *ref;
-	struct my_btrfs_tree *tree;
-	int ret, e, i;
-	unsigned long off = 0;
-	int name_len;
-	char *name;
-	char *tmppath;
-	u64 dir_id;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		ERROR("Failed to open %s\n", path);
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = 1;
+	sk->min_objectid = id;
+	sk->max_objectid = id;
+	sk->min_type = BTRFS_ROOT_BACKREF_KEY;
+	sk->max_type = BTRFS_ROOT_BACKREF_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+	sk->nr_items = 1;
+
+	if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
+		return -1;
+
+	if (sk->nr_items == 0) {
+		errno = ENOENT;
 		return -1;
 	}
 
-	if (btrfs_list_get_path_rootid(fd, &root_id)) {
-		e = errno;
-		close(fd);
-		if (e == EPERM || e == EACCES) {
-			WARN("Will simply try removing");
-			goto ignore_search;
+	memcpy(&sh, args.buf, sizeof(sh));
+	if (sh.objectid != id || sh.type != BTRFS_ROOT_BACKREF_KEY) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*parent = sh.offset;
+	return 0;
+}
+
+/*
+ * Check that the ROOT_BACKREFs of node @idx and all of its ancestors lead back
+ * to the subvolume being destroyed along the path that was gathered. Anything
+ * else means the refs changed or were misread and destroying the subvolume by
+ * id could hit one outside of ctx->path.
+ */
+static bool btrfs_node_verify(struct btrfs_destroy_ctx *ctx, size_t idx)
+{
+	ssize_t cur = idx;
+	u64 parent, expected;
+
+	for (;;) {
+		expected = ctx->nodes[cur].parent < 0
+			       ? ctx->root_id
+			       : ctx->nodes[ctx->nodes[cur].parent].id;
+
+		if (btrfs_get_parent_id(ctx->fd, ctx->nodes[cur].id, &parent) < 0) {
+			SYSERROR("Failed to look up the parent of subvolume %llu",
+				 (unsigned long long)ctx->nodes[cur].id);
+			return false;
 		}
 
-		return -1;
+		if (parent != expected) {
+			ERROR("Subvolume %llu is below %llu, not %llu as expected",
+			      (unsigned long long)ctx->nodes[cur].id,
+			      (unsigned long long)parent,
+			      (unsigned long long)expected);
+			return false;
+		}
+
+		if (ctx->nodes[cur].parent < 0)
+			return true;
+
+		cur = ctx->nodes[cur].parent;
 	}
+}
 
-	tree = create_my_btrfs_tree(root_id, path, strlen(path));
-	if (!tree) {
-		ERROR("Out of memory\n");
-		close(fd);
+static int btrfs_destroy_node(struct btrfs_destroy_ctx *ctx, size_t idx)
+{
+	struct btrfs_ioctl_vol_args_v2 args;
+	const char *path;
+	bool by_path;
+	int ret;
+
+	if (!btrfs_node_verify(ctx, idx)) {
+		ERROR("Refusing to destroy subvolume %llu below %s",
+		      (unsigned long long)ctx->nodes[idx].id, ctx->path);
 		return -1;
 	}
-	/* Walk all subvols looking for any under this id */
-	memset(&args, 0, sizeof(args));
 
-	/* search in the tree of tree roots */
-	sk->tree_id = 1;
+	pthread_mutex_lock(&ctx->lock);
+	by_path = ctx->by_path;
+	pthread_mutex_unlock(&ctx->lock);
 
-	sk->max_type = BTRFS_ROOT_REF_KEY;
-	sk->min_type = BTRFS_ROOT_ITEM_KEY;
-	sk->min_objectid = 0;
-	sk->max_objectid = (u64)-1;
-	sk->max_offset = (u64)-1;
-	sk->min_offset = 0;
-	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
+	if (!by_path) {
+		memset(&args, 0, sizeof(args));
+		args.flags = BTRFS_SUBVOL_SPEC_BY_ID;
+		args.subvolid = ctx->nodes[idx].id;
 
-	while(1) {
-		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
-		e = errno;
-		if (ret < 0) {
-			close(fd);
-			free_btrfs_tree(tree);
-			if (e == EPERM || e == EACCES) {
-				WARN("Warn: can't perform the search under %s. Will simply try removing", path);
-				goto ignore_search;
-			}
+		ret = ioctl(ctx->fd, BTRFS_IOC_SNAP_DESTROY_V2, &args);
+		if (ret == 0) {
+			INFO("btrfs: destroyed subvolume %llu below %s",
+			     (unsigned long long)args.subvolid, ctx->path);
+			return 0;
+		}
 
-			ERROR("Error: can't perform the search under %s\n", path);
+		/* Older kernels or not allowed for this user. */
+		if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL &&
+		    errno != EPERM) {
+			SYSERROR("Failed to destroy subvolume %llu below %s",
+				 (unsigned long long)args.subvolid, ctx->path);
 			return -1;
 		}
-		if (sk->nr_items == 0)
+
+		pthread_mutex_lock(&ctx->lock);
+		if (!ctx->by_path)
+			INFO("btrfs: destroying subvolumes below %s by path", ctx->path);
+		ctx->by_path = true;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	path = btrfs_node_path(ctx, idx);
+	pthread_mutex_unlock(&ctx->lock);
+	if (!path) {
+		ERROR("Failed to find path of subvolume %llu below %s",
+		      (unsigned long long)ctx->nodes[idx].id, ctx->path);
+		return -1;
+	}
+
+	return btrfs_do_destroy_subvol(path);
+}
+
+static void *btrfs_destroy_worker(void *data)
+{
+	struct btrfs_destroy_ctx *ctx = data;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		size_t idx;
+		ssize_t parent;
+		int ret;
+
+		while (ctx->nr_ready == 0 && ctx->busy > 0 && !ctx->failed)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+		if (ctx->nr_ready == 0 || ctx->failed)
 			break;
 
-		off = 0;
-		for (i = 0; i < sk->nr_items; i++) {
-			memcpy(&sh, args.buf + off, sizeof(sh));
-			off += sizeof(sh);
-			/*
-			 * A backref key with the name and dirid of the parent
-			 * comes followed by the reoot ref key which has the
-			 * name of the child subvol in question.
-			 */
-			if (sh.objectid != root_id && sh.type == BTRFS_ROOT_BACKREF_KEY) {
-				ref = (struct btrfs_root_ref *)(args.buf + off);
-				name_len = btrfs_stack_root_ref_name_len(ref);
-				name = (char *)(ref + 1);
-				dir_id = btrfs_stack_root_ref_dirid(ref);
-				tmppath = get_btrfs_subvol_path(fd, sh.offset,
-						dir_id, name, name_len);
-				if (!add_btrfs_tree_node(tree, sh.objectid,
-							sh.offset, name,
-							name_len, tmppath)) {
-					ERROR("Out of memory");
-					free_btrfs_tree(tree);
-					free(tmppath);
-					close(fd);
-					return -1;
-				}
-				free(tmppath);
-			}
-			off += sh.len;
+		idx = ctx->ready[--ctx->nr_ready];
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		ret = btrfs_destroy_node(ctx, idx);
 
-			/*
-			 * record the mins in sk so we can make sure the
-			 * next search doesn't repeat this root
-			 */
-			sk->min_objectid = sh.objectid;
-			sk->min_type = sh.type;
-			sk->min_offset = sh.offset;
+		pthread_mutex_lock(&ctx->lock);
+		ctx->busy--;
+		if (ret < 0) {
+			ctx->failed = true;
+		} else {
+			parent = ctx->nodes[idx].parent;
+			if (parent >= 0 && --ctx->nodes[parent].children == 0)
+				ctx->ready[ctx->nr_ready++] = parent;
 		}
-		sk->nr_items = 4096;
-		sk->min_offset++;
-		if (!sk->min_offset)
-			sk->min_type++;
-		else
-			continue;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
 
-		if (sk->min_type > BTRFS_ROOT_BACKREF_KEY) {
-			sk->min_type = BTRFS_ROOT_ITEM_KEY;
-			sk->min_objectid++;
-		} else
-			continue;
+/* Destroy all nodes leaves first with up to BTRFS_DESTROY_THREADS threads. */
+static int btrfs_destroy_nodes(struct btrfs_destroy_ctx *ctx)
+{
+	pthread_t tids[BTRFS_DESTROY_THREADS];
+	unsigned int i, threads, started = 0;
+	long cpus;
+	size_t j;
+	int ret;
+
+	ctx->ready = malloc(ctx->nr * sizeof(*ctx->ready));
+	if (!ctx->ready)
+		return -1;
 
-		if (sk->min_objectid >= sk->max_objectid)
+	for (j = 0; j < ctx->nr; j++)
+		if (ctx->nodes[j].children == 0)
+			ctx->ready[ctx->nr_ready++] = j;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cpus > 0 ? cpus : 1;
+	if (threads > BTRFS_DESTROY_THREADS)
+		threads = BTRFS_DESTROY_THREADS;
+	if (threads > ctx->nr_ready)
+		threads = ctx->nr_ready;
+
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&tids[i], NULL, btrfs_destroy_worker, ctx);
+		if (ret) {
+			errno = ret;
+			SYSERROR("Failed to create thread");
 			break;
+		}
+		started++;
 	}
-	close(fd);
 
-	/* now actually remove them */
+	/* Do the work ourselves if no thread could be started. */
+	if (started == 0)
+		btrfs_destroy_worker(ctx);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	return ctx->failed ? -1 : 0;
+}
+
+static int btrfs_recursive_destroy(const char *path)
+{
+	int ret, e;
+	struct btrfs_destroy_ctx ctx = {
+		.path = path,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	ctx.fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ctx.fd < 0) {
+		ERROR("Failed to open %s\n", path);
+		return -1;
+	}
+
+	if (btrfs_list_get_path_rootid(ctx.fd, &ctx.root_id)) {
+		e = errno;
+		close(ctx.fd);
+		if (e == EPERM || e == EACCES) {
+			WARN("Will simply try removing");
+			goto ignore_search;
+		}
 
-	if (!do_remove_btrfs_children(tree, root_id, path)) {
-		free_btrfs_tree(tree);
-		ERROR("failed pruning\n");
 		return -1;
 	}
 
-	free_btrfs_tree(tree);
+	if (btrfs_gather_subvols(&ctx) < 0) {
+		e = errno;
+		close(ctx.fd);
+		if (e == EPERM || e == EACCES) {
+			WARN("Warn: can't perform the search under %s. Will simply try removing", path);
+			goto ignore_search;
+		}
+
+		ERROR("Error: can't perform the search under %s\n", path);
+		return -1;
+	}
+
+	if (ctx.nr > 0) {
+		INFO("btrfs: destroying %zu subvolumes below %s", ctx.nr, path);
+		ret = btrfs_destroy_nodes(&ctx);
+		free_btrfs_nodes(&ctx);
+		if (ret < 0) {
+			close(ctx.fd);
+			ERROR("failed pruning\n");
+			return -1;
+		}
+	}
+	close(ctx.fd);
+
 	/* All child subvols have been removed, now remove this one */
 ignore_search:
 	return btrfs_do_destroy_subvol(path);
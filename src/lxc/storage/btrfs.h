@@ -29,6 +29,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <byteswap.h>
+#include <sys/types.h>
 
 #ifndef BTRFS_SUPER_MAGIC
 #  define BTRFS_SUPER_MAGIC       0x9123683E
@@ -100,9 +101,18 @@ struct btrfs_ioctl_vol_args_v2 {
 		};
 		unsigned long long unused[4];
 	};
-	char name[BTRFS_SUBVOL_NAME_MAX + 1];
+	union {
+		char name[BTRFS_SUBVOL_NAME_MAX + 1];
+		unsigned long long devid;
+		unsigned long long subvolid;
+	};
 };
 
+/* Select the subvolume to destroy by id instead of by name (since 5.7). */
+#define BTRFS_SUBVOL_SPEC_BY_ID (1ULL << 4)
+#define BTRFS_IOC_SNAP_DESTROY_V2 _IOW(BTRFS_IOCTL_MAGIC, 63, \
+                                   struct btrfs_ioctl_vol_args_v2)
+
 /*
  * root backrefs tie subvols and snapshots to the directory entries that
  * reference them
@@ -372,16 +382,18 @@ struct bdev_specs;
 
 struct lxc_conf;
 
-struct mytree_node {
-	u64 objid;
-	u64 parentid;
+/* A subvolume below the one being destroyed. */
+struct btrfs_subvol_node {
+	u64 id;
+	/* Index of the parent node or -1 for the subvolume being destroyed. */
+	ssize_t parent;
+	/* Directory of the parent the subvolume is linked into. */
+	u64 dirid;
 	char *name;
-	char *dirname;
-};
-
-struct my_btrfs_tree {
-	struct mytree_node *nodes;
-	int num;
+	/* Only resolved if subvolumes cannot be destroyed by id. */
+	char *path;
+	/* Children that have not been destroyed yet. */
+	unsigned int children;
 };
 
 extern int btrfs_clonepaths(struct lxc_storage *orig, struct lxc_storage *new,
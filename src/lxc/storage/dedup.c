@@ -0,0 +1,1111 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "dedup.h"
+#include "log.h"
+#include "storage.h"
+#include "utils.h"
+
+#ifndef HAVE_STRLCPY
+#include "include/strlcpy.h"
+#endif
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define DEDUP_BUFSIZE (128 * 1024)
+
+lxc_log_define(dedup, lxc);
+
+struct dedup_entry {
+	/* Relative to the root of the tree. */
+	char *path;
+	uint64_t hash;
+	uint64_t size;
+	uint64_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+};
+
+struct dedup_manifest {
+	struct dedup_entry *entries;
+	size_t nr;
+	size_t cap;
+	/* The entries sorted by size and hash. */
+	struct dedup_entry **by_content;
+};
+
+struct ino_map_entry {
+	bool used;
+	uint64_t ino;
+	uint64_t val;
+	char *path;
+};
+
+/* Open addressing hash table keyed by inode number. */
+struct ino_map {
+	struct ino_map_entry *slots;
+	size_t nr;
+	size_t size;
+};
+
+struct dedup_ctx {
+	char src[MAXPATHLEN];
+	char dest[MAXPATHLEN];
+	char base[MAXPATHLEN];
+	size_t src_len;
+	size_t dest_len;
+	size_t base_len;
+	dev_t dev;
+	struct dedup_manifest *old;
+	FILE *out;
+	/* Source inodes with more than one link to the first path they were
+	 * copied to, so the other links can be recreated.
+	 */
+	struct ino_map links;
+	/* Base inodes linked into the tree to the source inode they stand
+	 * for. Two distinct source files with identical content must not end
+	 * up sharing an inode.
+	 */
+	struct ino_map used;
+	struct lxc_dedup_stats *stats;
+	char *buf;
+	char *buf2;
+};
+
+static uint64_t dedup_hash(uint64_t hash, const char *buf, size_t len)
+{
+	size_t i;
+
+	/* FNV-1a. Matches are always verified byte by byte so this only has to
+	 * be good at telling files apart.
+	 */
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+#define DEDUP_HASH_INIT 0xcbf29ce484222325ULL
+
+static int dedup_hash_fd(int fd, char *buf, uint64_t *hash)
+{
+	ssize_t len;
+	uint64_t h = DEDUP_HASH_INIT;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	while ((len = lxc_read_nointr(fd, buf, DEDUP_BUFSIZE)) > 0)
+		h = dedup_hash(h, buf, len);
+	if (len < 0)
+		return -1;
+
+	*hash = h;
+	return 0;
+}
+
+static void ino_map_free(struct ino_map *map)
+{
+	size_t i;
+
+	for (i = 0; i < map->size; i++)
+		free(map->slots[i].path);
+	free(map->slots);
+	map->slots = NULL;
+	map->nr = map->size = 0;
+}
+
+static struct ino_map_entry *ino_map_slot(struct ino_map *map, uint64_t ino)
+{
+	size_t i;
+
+	i = (ino * 0x9e3779b97f4a7c15ULL) & (map->size - 1);
+	while (map->slots[i].used && map->slots[i].ino != ino)
+		i = (i + 1) & (map->size - 1);
+
+	return &map->slots[i];
+}
+
+static struct ino_map_entry *ino_map_get(struct ino_map *map, uint64_t ino)
+{
+	struct ino_map_entry *e;
+
+	if (map->nr == 0)
+		return NULL;
+
+	e = ino_map_slot(map, ino);
+	return e->used ? e : NULL;
+}
+
+static int ino_map_add(struct ino_map *map, uint64_t ino, uint64_t val,
+		       const char *path)
+{
+	struct ino_map_entry *e;
+
+	if (2 * (map->nr + 1) > map->size) {
+		struct ino_map new = {0};
+		size_t i;
+
+		new.size = map->size ? map->size * 2 : 1024;
+		new.slots = calloc(new.size, sizeof(*new.slots));
+		if (!new.slots)
+			return -1;
+
+		for (i = 0; i < map->size; i++) {
+			if (!map->slots[i].used)
+				continue;
+			*ino_map_slot(&new, map->slots[i].ino) = map->slots[i];
+		}
+		new.nr = map->nr;
+		free(map->slots);
+		*map = new;
+	}
+
+	e = ino_map_slot(map, ino);
+	if (!e->used) {
+		e->used = true;
+		e->ino = ino;
+		map->nr++;
+	}
+	e->val = val;
+	if (path) {
+		free(e->path);
+		e->path = strdup(path);
+		if (!e->path)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void dedup_manifest_free(struct dedup_manifest *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->nr; i++)
+		free(m->entries[i].path);
+	free(m->entries);
+	free(m->by_content);
+	m->entries = NULL;
+	m->by_content = NULL;
+	m->nr = m->cap = 0;
+}
+
+static void dedup_escape(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\')
+			fputs("\\\\", f);
+		else if (*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+}
+
+static void dedup_unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++) {
+		if (*s == '\\' && s[1]) {
+			s++;
+			*d++ = *s == 'n' ? '\n' : *s;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	const struct dedup_entry *ea = a, *eb = b;
+
+	return strcmp(ea->path, eb->path);
+}
+
+static int cmp_content(const void *a, const void *b)
+{
+	const struct dedup_entry *ea = *(struct dedup_entry **)a;
+	const struct dedup_entry *eb = *(struct dedup_entry **)b;
+
+	if (ea->size != eb->size)
+		return ea->size < eb->size ? -1 : 1;
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	return 0;
+}
+
+static int dedup_manifest_load(const char *path, struct dedup_manifest *m)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0, i;
+	ssize_t nread;
+	long long msec, csec;
+	long mnsec, cnsec;
+	int off;
+	struct dedup_entry e;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	while ((nread = getline(&line, &len, f)) != -1) {
+		if (nread > 0 && line[nread - 1] == '\n')
+			line[nread - 1] = '\0';
+
+		off = -1;
+		if (sscanf(line, "%" SCNx64 " %" SCNu64 " %" SCNu64 " %lld.%ld %lld.%ld %n",
+			   &e.hash, &e.size, &e.ino, &msec, &mnsec, &csec,
+			   &cnsec, &off) != 7 || off < 0 || !line[off]) {
+			ERROR("Invalid line in %s", path);
+			goto on_error;
+		}
+		e.mtime.tv_sec = msec;
+		e.mtime.tv_nsec = mnsec;
+		e.ctime.tv_sec = csec;
+		e.ctime.tv_nsec = cnsec;
+
+		e.path = strdup(line + off);
+		if (!e.path)
+			goto on_error;
+		dedup_unescape(e.path);
+
+		if (m->nr == m->cap) {
+			struct dedup_entry *tmp;
+			size_t cap = m->cap ? m->cap * 2 : 1024;
+
+			tmp = realloc(m->entries, cap * sizeof(*tmp));
+			if (!tmp) {
+				free(e.path);
+				goto on_error;
+			}
+			m->entries = tmp;
+			m->cap = cap;
+		}
+		m->entries[m->nr++] = e;
+	}
+
+	free(line);
+	fclose(f);
+
+	qsort(m->entries, m->nr, sizeof(*m->entries), cmp_path);
+
+	m->by_content = malloc((m->nr ? m->nr : 1) * sizeof(*m->by_content));
+	if (!m->by_content) {
+		dedup_manifest_free(m);
+		return -1;
+	}
+	for (i = 0; i < m->nr; i++)
+		m->by_content[i] = &m->entries[i];
+	qsort(m->by_content, m->nr, sizeof(*m->by_content), cmp_content);
+
+	return 0;
+
+on_error:
+	free(line);
+	fclose(f);
+	dedup_manifest_free(m);
+	return -1;
+}
+
+static struct dedup_entry *dedup_manifest_find(struct dedup_manifest *m,
+					       const char *path)
+{
+	struct dedup_entry key = { .path = (char *)path };
+
+	if (!m || m->nr == 0)
+		return NULL;
+
+	return bsearch(&key, m->entries, m->nr, sizeof(*m->entries), cmp_path);
+}
+
+/* Index of the first entry in @m->by_content that does not sort before @size
+ * and @hash.
+ */
+static size_t dedup_manifest_lower(struct dedup_manifest *m, uint64_t size,
+				   uint64_t hash)
+{
+	size_t lo = 0, hi = m->nr, mid;
+	struct dedup_entry *e;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = m->by_content[mid];
+		if (e->size < size || (e->size == size && e->hash < hash))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool dedup_manifest_has_size(struct dedup_manifest *m, uint64_t size)
+{
+	size_t i;
+
+	if (!m || m->nr == 0)
+		return false;
+
+	i = dedup_manifest_lower(m, size, 0);
+	return i < m->nr && m->by_content[i]->size == size;
+}
+
+static inline bool timespec_equal(const struct timespec *a,
+				  const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static char *dedup_path(char *buf, size_t root_len, const char *rel)
+{
+	int ret;
+
+	ret = snprintf(buf + root_len, MAXPATHLEN - root_len, "%s%s",
+		       *rel ? "/" : "", rel);
+	if (ret < 0 || (size_t)ret >= MAXPATHLEN - root_len) {
+		ERROR("Path name too long");
+		return NULL;
+	}
+
+	return buf;
+}
+
+static int copy_xattrs(const char *src, const char *dest, bool symlink)
+{
+	ssize_t len, vlen;
+	char *names, *name, *value = NULL;
+	int ret = -1;
+
+	len = llistxattr(src, NULL, 0);
+	if (len <= 0)
+		return (len < 0 && errno != ENOTSUP) ? -1 : 0;
+
+	names = malloc(len);
+	if (!names)
+		return -1;
+
+	len = llistxattr(src, names, len);
+	if (len < 0)
+		goto out;
+
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		vlen = lgetxattr(src, name, NULL, 0);
+		if (vlen < 0)
+			goto out;
+
+		free(value);
+		value = malloc(vlen ? vlen : 1);
+		if (!value)
+			goto out;
+
+		vlen = lgetxattr(src, name, value, vlen);
+		if (vlen < 0)
+			goto out;
+
+		if (lsetxattr(dest, name, value, vlen, 0) < 0) {
+			/* Symlinks cannot carry user xattrs. */
+			if (symlink && errno == EPERM)
+				continue;
+			SYSERROR("Failed to set xattr \"%s\" on %s", name, dest);
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(names);
+	free(value);
+	return ret;
+}
+
+/* Whether @a and @b carry the same set of xattrs. */
+static bool xattrs_equal(const char *a, const char *b)
+{
+	ssize_t len, blen, vlen;
+	char *names = NULL, *name, *va = NULL, *vb = NULL;
+	bool equal = false;
+
+	len = llistxattr(a, NULL, 0);
+	blen = llistxattr(b, NULL, 0);
+	if (len < 0 || blen < 0)
+		return len < 0 && blen < 0;
+	if (len != blen)
+		return false;
+	if (len == 0)
+		return true;
+
+	names = malloc(len);
+	if (!names)
+		return false;
+
+	len = llistxattr(a, names, len);
+	if (len < 0)
+		goto out;
+
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		vlen = lgetxattr(a, name, NULL, 0);
+		if (vlen < 0 || lgetxattr(b, name, NULL, 0) != vlen)
+			goto out;
+
+		free(va);
+		free(vb);
+		va = malloc(vlen ? vlen : 1);
+		vb = malloc(vlen ? vlen : 1);
+		if (!va || !vb)
+			goto out;
+
+		if (lgetxattr(a, name, va, vlen) != vlen ||
+		    lgetxattr(b, name, vb, vlen) != vlen ||
+		    memcmp(va, vb, vlen))
+			goto out;
+	}
+
+	equal = true;
+
+out:
+	free(names);
+	free(va);
+	free(vb);
+	return equal;
+}
+
+/* Apply ownership, mode, xattrs and timestamps of @st to @path in the order
+ * in which they do not clobber each other.
+ */
+static int copy_metadata(const char *src, const char *path,
+			 const struct stat *st)
+{
+	bool symlink = S_ISLNK(st->st_mode);
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (lchown(path, st->st_uid, st->st_gid) < 0) {
+		SYSERROR("Failed to chown %s", path);
+		return -1;
+	}
+
+	if (!symlink && chmod(path, st->st_mode & 07777) < 0) {
+		SYSERROR("Failed to chmod %s", path);
+		return -1;
+	}
+
+	if (copy_xattrs(src, path, symlink) < 0)
+		return -1;
+
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		SYSERROR("Failed to set timestamps of %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool content_equal(struct dedup_ctx *ctx, const char *a, const char *b)
+{
+	int fda, fdb;
+	ssize_t la, lb;
+	bool equal = false;
+
+	fda = open(a, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fda < 0)
+		return false;
+
+	fdb = open(b, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fdb < 0) {
+		close(fda);
+		return false;
+	}
+
+	for (;;) {
+		la = lxc_read_nointr(fda, ctx->buf, DEDUP_BUFSIZE);
+		lb = lxc_read_nointr(fdb, ctx->buf2, DEDUP_BUFSIZE);
+		if (la < 0 || la != lb || memcmp(ctx->buf, ctx->buf2, la))
+			break;
+		if (la == 0) {
+			equal = true;
+			break;
+		}
+	}
+
+	close(fda);
+	close(fdb);
+	return equal;
+}
+
+/* Hardlink @rel of the base snapshot to @dest on behalf of the source inode
+ * @ino.
+ */
+static int link_from_base(struct dedup_ctx *ctx, const char *rel,
+			  const char *dest, uint64_t ino, uint64_t size)
+{
+	struct stat st;
+	struct ino_map_entry *e;
+	const char *base;
+
+	base = dedup_path(ctx->base, ctx->base_len, rel);
+	if (!base)
+		return -1;
+
+	if (lstat(base, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (uint64_t)st.st_size != size)
+		return -1;
+
+	e = ino_map_get(&ctx->used, st.st_ino);
+	if (e && e->val != ino)
+		return -1;
+
+	if (link(base, dest) < 0) {
+		if (errno != EMLINK && errno != ENOENT)
+			WARN("%s - Failed to link %s to %s", strerror(errno),
+			     base, dest);
+		return -1;
+	}
+
+	if (!e && ino_map_add(&ctx->used, st.st_ino, ino, NULL) < 0) {
+		unlink(dest);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Look for a file in the base snapshot with the same content and metadata as
+ * @src and link it to @dest.
+ */
+static int link_by_content(struct dedup_ctx *ctx, const char *src,
+			   const char *dest, const struct stat *st,
+			   uint64_t hash)
+{
+	size_t i;
+	struct stat bst;
+	struct dedup_entry *e;
+	const char *base, *owner;
+
+	for (i = dedup_manifest_lower(ctx->old, st->st_size, hash);
+	     i < ctx->old->nr; i++) {
+		e = ctx->old->by_content[i];
+		if (e->size != (uint64_t)st->st_size || e->hash != hash)
+			break;
+
+		/* Leave the file to its own path if it is still there. */
+		owner = dedup_path(ctx->src, ctx->src_len, e->path);
+		if (owner && lstat(owner, &bst) == 0 &&
+		    (uint64_t)bst.st_ino == e->ino)
+			continue;
+
+		base = dedup_path(ctx->base, ctx->base_len, e->path);
+		if (!base || lstat(base, &bst) < 0)
+			continue;
+
+		if (bst.st_mode != st->st_mode || bst.st_uid != st->st_uid ||
+		    bst.st_gid != st->st_gid ||
+		    !timespec_equal(&bst.st_mtim, &st->st_mtim))
+			continue;
+
+		if (!xattrs_equal(src, base) || !content_equal(ctx, src, base))
+			continue;
+
+		if (link_from_base(ctx, e->path, dest, st->st_ino, st->st_size) == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+/* Copy @src to @dest, reflinking if possible, and compute the hash of its
+ * content unless @hash is NULL.
+ */
+static int copy_regular(struct dedup_ctx *ctx, const char *src,
+			const char *dest, const struct stat *st, uint64_t *hash)
+{
+	int sfd, dfd, ret = -1;
+	ssize_t len;
+	off_t off = 0;
+	uint64_t h = DEDUP_HASH_INIT;
+
+	sfd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (sfd < 0) {
+		SYSERROR("Failed to open %s", src);
+		return -1;
+	}
+
+	dfd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (dfd < 0) {
+		SYSERROR("Failed to create %s", dest);
+		close(sfd);
+		return -1;
+	}
+
+	if (st->st_size > 0 && ioctl(dfd, FICLONE, sfd) == 0) {
+		ctx->stats->reflinked++;
+		if (hash && dedup_hash_fd(sfd, ctx->buf, hash) < 0) {
+			SYSERROR("Failed to read %s", src);
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	while ((len = lxc_read_nointr(sfd, ctx->buf, DEDUP_BUFSIZE)) > 0) {
+		ssize_t i;
+
+		if (hash)
+			h = dedup_hash(h, ctx->buf, len);
+
+		/* Keep runs of zeroes sparse like rsync -S does. */
+		for (i = 0; i < len && !ctx->buf[i]; i++)
+			;
+		if (i == len) {
+			if (lseek(dfd, len, SEEK_CUR) < 0)
+				goto on_write_error;
+		} else if (lxc_write_nointr(dfd, ctx->buf, len) != len) {
+			goto on_write_error;
+		}
+		off += len;
+	}
+	if (len < 0) {
+		SYSERROR("Failed to read %s", src);
+		goto out;
+	}
+
+	if (ftruncate(dfd, off) < 0)
+		goto on_write_error;
+
+	if (hash)
+		*hash = h;
+	ret = 0;
+	goto out;
+
+on_write_error:
+	SYSERROR("Failed to write %s", dest);
+
+out:
+	close(sfd);
+	if (close(dfd) < 0 && ret == 0) {
+		SYSERROR("Failed to write %s", dest);
+		ret = -1;
+	}
+	return ret;
+}
+
+static int dedup_record(struct dedup_ctx *ctx, const char *rel,
+			const struct stat *st, uint64_t hash)
+{
+	fprintf(ctx->out, "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %lld.%09ld %lld.%09ld ",
+		hash, (uint64_t)st->st_size, (uint64_t)st->st_ino,
+		(long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		(long long)st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+	dedup_escape(ctx->out, rel);
+	fputc('\n', ctx->out);
+
+	return ferror(ctx->out) ? -1 : 0;
+}
+
+static int dedup_file(struct dedup_ctx *ctx, const char *rel,
+		      const struct stat *st)
+{
+	char src[MAXPATHLEN], dest[MAXPATHLEN];
+	struct dedup_entry *old;
+	struct ino_map_entry *first;
+	uint64_t hash;
+	bool hashed = false;
+
+	if (!dedup_path(ctx->src, ctx->src_len, rel) ||
+	    !dedup_path(ctx->dest, ctx->dest_len, rel))
+		return -1;
+	(void)strlcpy(src, ctx->src, sizeof(src));
+	(void)strlcpy(dest, ctx->dest, sizeof(dest));
+
+	ctx->stats->files++;
+
+	/* Another link to a file that is already part of the tree. */
+	if (st->st_nlink > 1) {
+		first = ino_map_get(&ctx->links, st->st_ino);
+		if (first) {
+			char *target = dedup_path(ctx->dest, ctx->dest_len, first->path);
+
+			if (!target)
+				return -1;
+
+			if (link(target, dest) < 0) {
+				SYSERROR("Failed to link %s to %s", target, dest);
+				return -1;
+			}
+
+			return dedup_record(ctx, rel, st, first->val);
+		}
+	}
+
+	old = dedup_manifest_find(ctx->old, rel);
+	if (old && old->ino == (uint64_t)st->st_ino &&
+	    old->size == (uint64_t)st->st_size &&
+	    timespec_equal(&old->mtime, &st->st_mtim) &&
+	    timespec_equal(&old->ctime, &st->st_ctim) &&
+	    link_from_base(ctx, rel, dest, st->st_ino, st->st_size) == 0) {
+		hash = old->hash;
+		ctx->stats->linked++;
+		goto out;
+	}
+
+	/* Only read the file twice if something could match. */
+	if (dedup_manifest_has_size(ctx->old, st->st_size)) {
+		int fd;
+
+		fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			SYSERROR("Failed to open %s", src);
+			return -1;
+		}
+
+		if (dedup_hash_fd(fd, ctx->buf, &hash) < 0) {
+			SYSERROR("Failed to read %s", src);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		hashed = true;
+		ctx->stats->hashed++;
+
+		if (link_by_content(ctx, src, dest, st, hash) == 0) {
+			ctx->stats->linked++;
+			goto out;
+		}
+	}
+
+	if (copy_regular(ctx, src, dest, st, hashed ? NULL : &hash) < 0)
+		return -1;
+
+	if (copy_metadata(src, dest, st) < 0)
+		return -1;
+
+	ctx->stats->copied++;
+	ctx->stats->bytes_copied += st->st_size;
+
+out:
+	if (st->st_nlink > 1 &&
+	    ino_map_add(&ctx->links, st->st_ino, hash, rel) < 0)
+		return -1;
+
+	return dedup_record(ctx, rel, st, hash);
+}
+
+static int dedup_special(struct dedup_ctx *ctx, const char *rel,
+			 const struct stat *st)
+{
+	char target[MAXPATHLEN];
+	const char *src, *dest;
+	ssize_t len;
+
+	src = dedup_path(ctx->src, ctx->src_len, rel);
+	dest = dedup_path(ctx->dest, ctx->dest_len, rel);
+	if (!src || !dest)
+		return -1;
+
+	if (S_ISLNK(st->st_mode)) {
+		len = readlink(src, target, sizeof(target) - 1);
+		if (len < 0) {
+			SYSERROR("Failed to read symlink %s", src);
+			return -1;
+		}
+		target[len] = '\0';
+
+		if (symlink(target, dest) < 0) {
+			SYSERROR("Failed to create symlink %s", dest);
+			return -1;
+		}
+	} else if (mknod(dest, st->st_mode, st->st_rdev) < 0) {
+		SYSERROR("Failed to create %s", dest);
+		return -1;
+	}
+
+	return copy_metadata(src, dest, st);
+}
+
+static int dedup_dir(struct dedup_ctx *ctx, char *rel, size_t rel_len);
+
+static int dedup_subdir(struct dedup_ctx *ctx, char *rel, size_t rel_len,
+			const struct stat *st)
+{
+	const char *src, *dest;
+
+	dest = dedup_path(ctx->dest, ctx->dest_len, rel);
+	if (!dest)
+		return -1;
+
+	if (mkdir(dest, 0700) < 0) {
+		SYSERROR("Failed to create %s", dest);
+		return -1;
+	}
+
+	/* Keep mountpoints but not what is mounted on them. */
+	if (st->st_dev == ctx->dev && dedup_dir(ctx, rel, rel_len) < 0)
+		return -1;
+
+	/* The walk below reused the path buffers. */
+	src = dedup_path(ctx->src, ctx->src_len, rel);
+	dest = dedup_path(ctx->dest, ctx->dest_len, rel);
+	if (!src || !dest)
+		return -1;
+
+	return copy_metadata(src, dest, st);
+}
+
+static int dedup_dir(struct dedup_ctx *ctx, char *rel, size_t rel_len)
+{
+	DIR *dir;
+	struct dirent *direntp;
+	struct stat st;
+	int ret = 0;
+
+	if (!dedup_path(ctx->src, ctx->src_len, rel))
+		return -1;
+
+	dir = opendir(ctx->src);
+	if (!dir) {
+		SYSERROR("Failed to open %s", ctx->src);
+		return -1;
+	}
+
+	while ((direntp = readdir(dir))) {
+		size_t len;
+
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+
+		len = rel_len + (rel_len ? 1 : 0) + strlen(direntp->d_name);
+		if (len >= MAXPATHLEN) {
+			ERROR("Path name too long");
+			ret = -1;
+			break;
+		}
+		sprintf(rel + rel_len, "%s%s", rel_len ? "/" : "", direntp->d_name);
+
+		if (fstatat(dirfd(dir), direntp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("Failed to stat %s", rel);
+			ret = -1;
+			break;
+		}
+
+		if (S_ISDIR(st.st_mode))
+			ret = dedup_subdir(ctx, rel, len, &st);
+		else if (S_ISREG(st.st_mode))
+			ret = dedup_file(ctx, rel, &st);
+		else
+			ret = dedup_special(ctx, rel, &st);
+
+		rel[rel_len] = '\0';
+		if (ret < 0)
+			break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int lxc_dedup_copy(const char *src, const char *dest, const char *base,
+		   const char *manifest, struct lxc_dedup_stats *stats)
+{
+	struct dedup_ctx *ctx;
+	struct dedup_manifest old = {0};
+	struct stat st;
+	char tmp[MAXPATHLEN], rel[MAXPATHLEN] = "";
+	int ret = -1;
+
+	memset(stats, 0, sizeof(*stats));
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.tmp", manifest);
+	if (ret < 0 || (size_t)ret >= sizeof(tmp))
+		return -1;
+	ret = -1;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -1;
+	ctx->stats = stats;
+
+	ctx->src_len = strlcpy(ctx->src, src, sizeof(ctx->src));
+	ctx->dest_len = strlcpy(ctx->dest, dest, sizeof(ctx->dest));
+	if (ctx->src_len >= sizeof(ctx->src) ||
+	    ctx->dest_len >= sizeof(ctx->dest)) {
+		ERROR("Path name too long");
+		goto out;
+	}
+
+	if (base) {
+		char path[MAXPATHLEN];
+
+		ret = snprintf(path, sizeof(path), "%s/" LXC_DEDUP_MANIFEST, base);
+		if (ret < 0 || (size_t)ret >= sizeof(path))
+			goto out;
+		ret = -1;
+
+		ctx->base_len = snprintf(ctx->base, sizeof(ctx->base), "%s/rootfs", base);
+		if (ctx->base_len >= sizeof(ctx->base))
+			goto out;
+
+		if (dedup_manifest_load(path, &old) == 0)
+			ctx->old = &old;
+		else
+			WARN("Failed to load %s, copying all files", path);
+	}
+
+	if (stat(src, &st) < 0) {
+		SYSERROR("Failed to stat %s", src);
+		goto out;
+	}
+	ctx->dev = st.st_dev;
+
+	ctx->buf = malloc(DEDUP_BUFSIZE);
+	ctx->buf2 = malloc(DEDUP_BUFSIZE);
+	if (!ctx->buf || !ctx->buf2)
+		goto out;
+
+	ctx->out = fopen(tmp, "we");
+	if (!ctx->out) {
+		SYSERROR("Failed to create %s", tmp);
+		goto out;
+	}
+
+	ret = dedup_dir(ctx, rel, 0);
+	if (ret == 0 && copy_metadata(src, dest, &st) < 0)
+		ret = -1;
+
+	if (fclose(ctx->out) != 0 && ret == 0) {
+		SYSERROR("Failed to write %s", tmp);
+		ret = -1;
+	}
+	ctx->out = NULL;
+
+	if (ret == 0 && rename(tmp, manifest) < 0) {
+		SYSERROR("Failed to rename %s to %s", tmp, manifest);
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmp);
+
+out:
+	dedup_manifest_free(&old);
+	ino_map_free(&ctx->links);
+	ino_map_free(&ctx->used);
+	free(ctx->buf);
+	free(ctx->buf2);
+	free(ctx);
+	return ret;
+}
+
+/* Find the snapshot with the highest index in @lxcpath other than @cname that
+ * was taken by the deduplicating engine.
+ */
+static int dedup_find_base(const char *lxcpath, const char *cname, char *base,
+			   size_t len)
+{
+	DIR *dir;
+	struct dirent *direntp;
+	char path[MAXPATHLEN];
+	int ret, idx, n, best = -1;
+
+	dir = opendir(lxcpath);
+	if (!dir)
+		return -1;
+
+	while ((direntp = readdir(dir))) {
+		n = -1;
+		if (sscanf(direntp->d_name, "snap%d%n", &idx, &n) != 1 ||
+		    direntp->d_name[n] || idx <= best)
+			continue;
+
+		if (!strcmp(direntp->d_name, cname))
+			continue;
+
+		ret = snprintf(path, sizeof(path), "%s/%s/" LXC_DEDUP_MANIFEST,
+			       lxcpath, direntp->d_name);
+		if (ret < 0 || (size_t)ret >= sizeof(path) || !file_exists(path))
+			continue;
+
+		best = idx;
+	}
+	closedir(dir);
+
+	if (best < 0)
+		return -1;
+
+	ret = snprintf(base, len, "%s/snap%d", lxcpath, best);
+	if (ret < 0 || (size_t)ret >= len)
+		return -1;
+
+	return 0;
+}
+
+int dedup_rootfs(struct lxc_storage *orig, struct lxc_storage *new,
+		 const char *lxcpath, const char *cname)
+{
+	char base[MAXPATHLEN], manifest[MAXPATHLEN];
+	const char *src = orig->src;
+	bool has_base;
+	struct lxc_dedup_stats stats;
+	int ret;
+
+	if (strncmp(src, "dir:", 4) == 0)
+		src += 4;
+
+	ret = snprintf(manifest, sizeof(manifest), "%s/%s/" LXC_DEDUP_MANIFEST,
+		       lxcpath, cname);
+	if (ret < 0 || (size_t)ret >= sizeof(manifest))
+		return -1;
+
+	has_base = dedup_find_base(lxcpath, cname, base, sizeof(base)) == 0;
+	if (has_base)
+		INFO("Sharing unchanged files of %s with %s", src, base);
+
+	ret = lxc_dedup_copy(src, new->dest, has_base ? base : NULL, manifest,
+			     &stats);
+	if (ret < 0) {
+		ERROR("Failed to copy %s to %s", src, new->dest);
+		return -1;
+	}
+
+	INFO("%" PRIu64 " files: %" PRIu64 " linked, %" PRIu64 " hashed, %"
+	     PRIu64 " copied (%" PRIu64 " reflinked, %" PRIu64 " bytes)",
+	     stats.files, stats.linked, stats.hashed, stats.copied,
+	     stats.reflinked, stats.bytes_copied);
+	return 0;
+}
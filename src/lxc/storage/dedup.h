@@ -0,0 +1,68 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_DEDUP_H
+#define __LXC_DEDUP_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+/* Name of the file next to the rootfs of a deduplicated snapshot that records
+ * the state of the source tree it was taken from.
+ */
+#define LXC_DEDUP_MANIFEST "manifest"
+
+struct lxc_dedup_stats {
+	/* Regular files in the tree. */
+	uint64_t files;
+	/* Files hardlinked from the base snapshot. */
+	uint64_t linked;
+	/* Files whose content had to be read to look for a match. */
+	uint64_t hashed;
+	/* Files copied and how many of them were reflinked. */
+	uint64_t copied;
+	uint64_t reflinked;
+	uint64_t bytes_copied;
+};
+
+/*
+ * Copy the directory tree @src to the existing directory @dest. Regular files
+ * that did not change since the snapshot @base (a directory holding a rootfs
+ * and a manifest, may be NULL) was taken are hardlinked from it instead of
+ * being copied. A file is considered unchanged if its inode, size, mtime and
+ * ctime match the manifest of @base. Otherwise its content is hashed and
+ * compared against files of the same size in @base, so renamed or rewritten
+ * but identical files are shared as well. Files that still need copying are
+ * reflinked when the filesystem supports it.
+ *
+ * The walk does not cross into other filesystems. The manifest for @dest is
+ * written to @manifest. @stats is filled in in either case.
+ */
+extern int lxc_dedup_copy(const char *src, const char *dest, const char *base,
+			  const char *manifest, struct lxc_dedup_stats *stats);
+
+/*
+ * Copy the directory rootfs of @orig into @new, the rootfs of the snapshot
+ * @cname in @lxcpath, sharing unchanged files with the newest deduplicated
+ * snapshot in @lxcpath.
+ */
+extern int dedup_rootfs(struct lxc_storage *orig, struct lxc_storage *new,
+			const char *lxcpath, const char *cname);
+
+#endif /* __LXC_DEDUP_H */
@@ -23,12 +23,18 @@
 
 #define _GNU_SOURCE
 #define __STDC_FORMAT_MACROS /* Required for PRIu64 to work. */
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h> /* Required for PRIu64 to work. */
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/dm-ioctl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 
@@ -39,6 +45,14 @@
 #include "storage_utils.h"
 #include "utils.h"
 
+#ifndef HAVE_STRLCAT
+#include "include/strlcat.h"
+#endif
+
+#ifndef HAVE_STRLCPY
+#include "include/strlcpy.h"
+#endif
+
 /* major()/minor() */
 #ifdef MAJOR_IN_MKDEV
 #    include <sys/mkdev.h>
@@ -219,13 +233,183 @@ int lvm_compare_lv_attr(const char *path, int pos, const char expected)
 	return 0;
 }
 
+/*
+ * Ask device-mapper for the target types in the table of the device @dev or,
+ * if @dev is 0, of the device called @name. Unlike asking lvs this is a single
+ * lookup in the kernel no matter how many LVs there are. Returns 1 and fills
+ * in @types separated by spaces, 0 if there is no such device and -1 if
+ * device-mapper could not be asked.
+ */
+static int dm_target_types(dev_t dev, const char *name, char *types, size_t len)
+{
+	struct dm_ioctl *dmi = NULL;
+	struct dm_target_spec *spec;
+	size_t size = 16384, off = 0;
+	uint32_t i;
+	int fd, ret = -1;
+
+	fd = open("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	for (;;) {
+		dmi = calloc(1, size);
+		if (!dmi)
+			goto out;
+
+		dmi->version[0] = DM_VERSION_MAJOR;
+		dmi->data_size = size;
+		dmi->data_start = sizeof(*dmi);
+		dmi->flags = DM_STATUS_TABLE_FLAG;
+		if (dev)
+			dmi->dev = (minor(dev) & 0xff) | (major(dev) << 8) |
+				   ((uint64_t)(minor(dev) & ~0xffU) << 12);
+		else
+			(void)strlcpy(dmi->name, name, sizeof(dmi->name));
+
+		if (ioctl(fd, DM_TABLE_STATUS, dmi) < 0) {
+			if (errno == ENXIO)
+				ret = 0;
+			goto out;
+		}
+
+		if (!(dmi->flags & DM_BUFFER_FULL_FLAG))
+			break;
+
+		free(dmi);
+		dmi = NULL;
+		size *= 2;
+	}
+
+	*types = '\0';
+	for (i = 0; i < dmi->target_count; i++) {
+		spec = (struct dm_target_spec *)((char *)dmi + dmi->data_start + off);
+		if (*types)
+			(void)strlcat(types, " ", len);
+		(void)strlcat(types, spec->target_type, len);
+		off = spec->next;
+	}
+	ret = 1;
+
+out:
+	free(dmi);
+	close(fd);
+	return ret;
+}
+
+static bool dm_has_target(const char *types, const char *type)
+{
+	size_t len = strlen(type);
+	const char *p;
+
+	for (p = types; (p = strstr(p, type)); p += len)
+		if ((p == types || p[-1] == ' ') && (!p[len] || p[len] == ' '))
+			return true;
+
+	return false;
+}
+
+/*
+ * Copy @len bytes of @s to @p doubling dashes like device-mapper names of LVs
+ * do. Returns the new end or NULL if @end was reached.
+ */
+static char *dm_mangle(char *p, const char *end, const char *s, size_t len)
+{
+	for (; len > 0; s++, len--) {
+		if (end - p < 3)
+			return NULL;
+		if (*s == '-')
+			*p++ = '-';
+		*p++ = *s;
+	}
+
+	return p;
+}
+
+/*
+ * Check with device-mapper whether the LV at @path is a thin volume or, if
+ * @pool is set, a thin pool. Returns 1 or 0 if that could be decided and -1
+ * otherwise, e.g. if the LV is not active.
+ */
+static int lvm_dm_is_thin(const char *path, bool pool)
+{
+	char types[256], name[DM_NAME_LEN], *p;
+	const char *end = name + sizeof(name);
+	const char *lv, *vg;
+	struct stat st;
+	int ret;
+	bool exists;
+
+	if (strncmp(path, "lvm:", 4) == 0)
+		path += 4;
+
+	exists = stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+	if (exists) {
+		ret = dm_target_types(st.st_rdev, NULL, types, sizeof(types));
+		if (ret < 0)
+			return -1;
+		if (ret > 0 && dm_has_target(types, pool ? "thin-pool" : "thin"))
+			return 1;
+		if (!pool)
+			return ret > 0 ? 0 : -1;
+	}
+
+	/* Active thin pools are stacked on a "$vg-$lv-tpool" device. */
+	lv = strrchr(path, '/');
+	if (!lv || lv == path)
+		return -1;
+	for (vg = lv - 1; vg > path && vg[-1] != '/'; vg--)
+		;
+
+	p = dm_mangle(name, end, vg, lv - vg);
+	if (p) {
+		*p++ = '-';
+		p = dm_mangle(p, end, lv + 1, strlen(lv + 1));
+	}
+	if (!p || (size_t)(end - p) < sizeof("-tpool"))
+		return -1;
+	strcpy(p, "-tpool");
+
+	ret = dm_target_types(0, name, types, sizeof(types));
+	if (ret < 0)
+		return -1;
+	if (ret > 0 && dm_has_target(types, "thin-pool"))
+		return 1;
+
+	return exists ? 0 : -1;
+}
+
+static bool lvm_use_dm_status(void)
+{
+	const char *value;
+
+	value = lxc_global_config_value("lxc.bdev.lvm.dm_status");
+	return value && strcmp(value, "1") == 0;
+}
+
 int lvm_is_thin_volume(const char *path)
 {
+	int ret;
+
+	if (lvm_use_dm_status()) {
+		ret = lvm_dm_is_thin(path, false);
+		if (ret >= 0)
+			return ret;
+	}
+
 	return lvm_compare_lv_attr(path, 6, 't');
 }
 
 int lvm_is_thin_pool(const char *path)
 {
+	int ret;
+
+	if (lvm_use_dm_status()) {
+		ret = lvm_dm_is_thin(path, true);
+		if (ret >= 0)
+			return ret;
+	}
+
 	return lvm_compare_lv_attr(path, 0, 't');
 }
 
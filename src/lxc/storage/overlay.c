@@ -22,6 +22,7 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,8 @@ static int ovl_rsync_wrapper(void *data);
 static int ovl_remount_on_enodev(const char *lower, const char *target,
 				 const char *name, unsigned long mountflags,
 				 const void *options);
+static int ovl_dir_empty(const char *path);
+static int ovl_mount_tmpfs(const char *path, const char *size);
 
 int ovl_clonepaths(struct lxc_storage *orig, struct lxc_storage *new, const char *oldname,
 		   const char *cname, const char *oldpath, const char *lxcpath,
@@ -353,22 +356,78 @@ int ovl_mount(struct lxc_storage *bdev)
 	if (mkdir_p(upper, 0755) < 0 && errno != EEXIST)
 		return -22;
 
-	/*
-	 * overlayfs.v22 or higher needs workdir option:
-	 * if upper is
-	 *	/var/lib/lxc/c2/delta0
-	 * then workdir is
-	 *	/var/lib/lxc/c2/olwork
-	 */
-	lastslash = strrchr(upper, '/');
-	if (!lastslash)
-		return -22;
-	lastslash++;
-	lastslashidx = lastslash - upper;
+	if (bdev->ovl_tmpfs) {
+		/*
+		 * Keep upperdir and workdir in a tmpfs mounted over the delta:
+		 *	/var/lib/lxc/c2/delta0/upper
+		 *	/var/lib/lxc/c2/delta0/work
+		 * If the delta already holds changes, e.g. those rsynced from
+		 * an overlay source container, it is stacked on top of the
+		 * lower layers and the tmpfs goes onto the workdir instead:
+		 *	lowerdir=/var/lib/lxc/c2/delta0:<lower>
+		 *	/var/lib/lxc/c2/olwork/upper
+		 *	/var/lib/lxc/c2/olwork/work
+		 */
+		char *tmpfs = upper;
+
+		ret = ovl_dir_empty(upper);
+		if (ret < 0)
+			return -22;
+
+		if (ret == 0) {
+			lastslash = strrchr(upper, '/');
+			if (!lastslash)
+				return -22;
+			lastslashidx = lastslash - upper + 1;
+
+			tmpfs = alloca(lastslashidx + 7);
+			memcpy(tmpfs, upper, lastslashidx);
+			strcpy(tmpfs + lastslashidx, "olwork");
+			if (mkdir_p(tmpfs, 0755) < 0 && errno != EEXIST)
+				return -22;
+
+			len = strlen(upper) + strlen(lower) + 2;
+			tmp = alloca(len);
+			ret = snprintf(tmp, len, "%s:%s", upper, lower);
+			if (ret < 0 || ret >= len)
+				return -1;
+			lower = tmp;
+		}
+
+		if (ovl_mount_tmpfs(tmpfs, bdev->ovl_tmpfs) < 0)
+			return -1;
+
+		len = strlen(tmpfs) + 7;
+		upper = alloca(len);
+		ret = snprintf(upper, len, "%s/upper", tmpfs);
+		if (ret < 0 || ret >= len)
+			return -1;
 
-	work = alloca(lastslashidx + 7);
-	strncpy(work, upper, lastslashidx + 7);
-	strcpy(work + lastslashidx, "olwork");
+		work = alloca(len);
+		ret = snprintf(work, len, "%s/work", tmpfs);
+		if (ret < 0 || ret >= len)
+			return -1;
+
+		if (mkdir(upper, 0755) < 0 && errno != EEXIST)
+			return -22;
+	} else {
+		/*
+		 * overlayfs.v22 or higher needs workdir option:
+		 * if upper is
+		 *	/var/lib/lxc/c2/delta0
+		 * then workdir is
+		 *	/var/lib/lxc/c2/olwork
+		 */
+		lastslash = strrchr(upper, '/');
+		if (!lastslash)
+			return -22;
+		lastslash++;
+		lastslashidx = lastslash - upper;
+
+		work = alloca(lastslashidx + 7);
+		strncpy(work, upper, lastslashidx + 7);
+		strcpy(work + lastslashidx, "olwork");
+	}
 
 	if (parse_mntopts(bdev->mntopts, &mntflags, &mntdata) < 0) {
 		free(mntdata);
@@ -656,6 +715,9 @@ int ovl_update_abs_paths(struct lxc_conf *lxc_conf, const char *lxc_path,
 		free(tmp_mnt_entry);
 	}
 
+	if (lxc_tokenize_mount_entries(lxc_conf) < 0)
+		goto err;
+
 	fret = 0;
 err:
 	free(cleanpath);
@@ -676,6 +738,58 @@ static int ovl_remount_on_enodev(const char *lower, const char *target,
         return ret;
 }
 
+/* Returns 1 if the directory @path is empty, 0 if it is not and -1 on error. */
+static int ovl_dir_empty(const char *path)
+{
+	DIR *dir;
+	struct dirent *direntp;
+	int ret = 1;
+
+	dir = opendir(path);
+	if (!dir) {
+		SYSERROR("Failed to open \"%s\"", path);
+		return -1;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * The tmpfs is mounted in the mount namespace of the container. Writes to the
+ * rootfs never reach the disk and are dropped together with the namespace when
+ * the container stops. When the host swaps to zram, tmpfs pages that are pushed
+ * out end up compressed in the shared zram device.
+ */
+static int ovl_mount_tmpfs(const char *path, const char *size)
+{
+	int ret;
+	char options[64];
+
+	ret = snprintf(options, sizeof(options), "size=%s,mode=0755", size);
+	if (ret < 0 || (size_t)ret >= sizeof(options))
+		return -1;
+
+	ret = mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, options);
+	if (ret < 0) {
+		SYSERROR("Failed to mount tmpfs with options \"%s\" onto \"%s\"",
+			 options, path);
+		return -1;
+	}
+
+	INFO("Mounted tmpfs with options \"%s\" onto \"%s\"", options, path);
+	return 0;
+}
+
 static int ovl_rsync(struct rsync_data *data)
 {
 	int ret;
@@ -43,6 +43,7 @@
 #include "btrfs.h"
 #include "conf.h"
 #include "config.h"
+#include "dedup.h"
 #include "dir.h"
 #include "error.h"
 #include "log.h"
@@ -444,6 +445,18 @@ struct lxc_storage *storage_copy(struct lxc_container *c0, const char *cname,
 		return new;
 	}
 
+	/* Directories don't need to be mounted to be copied. */
+	if ((flags & LXC_STORAGE_DEDUP) && !am_guest_unpriv() &&
+	    strcmp(orig->type, "dir") == 0 && strcmp(new->type, "dir") == 0) {
+		ret = dedup_rootfs(orig, new, lxcpath, cname);
+		storage_put(orig);
+		if (ret < 0) {
+			storage_put(new);
+			return NULL;
+		}
+		return new;
+	}
+
 	pid = fork();
 	if (pid < 0) {
 		SYSERROR("fork");
@@ -60,6 +60,11 @@
 #define MS_STRICTATIME (1 << 24)
 #endif
 
+/* Passed by snapshot() to storage_copy() to copy a directory rootfs with the
+ * deduplicating snapshot engine. Not one of the public LXC_CLONE_* flags.
+ */
+#define LXC_STORAGE_DEDUP (1 << 30)
+
 #define DEFAULT_FS_SIZE 1073741824
 #define DEFAULT_FSTYPE "ext4"
 
@@ -99,6 +104,11 @@ struct lxc_storage {
 	int lofd;
 	/* index for the connected nbd device. */
 	int nbd_idx;
+	/* Size of the tmpfs the overlay upper layer is mounted in. Only set
+	 * when the rootfs is mounted for a container start and owned by its
+	 * configuration.
+	 */
+	const char *ovl_tmpfs;
 };
 
 extern bool storage_is_dir(struct lxc_conf *conf, const char *path);
@@ -22,12 +22,20 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "config.h"
 #include "log.h"
@@ -35,6 +43,10 @@
 #include "utils.h"
 #include "zfs.h"
 
+#ifndef HAVE_STRLCPY
+#include "include/strlcpy.h"
+#endif
+
 lxc_log_define(zfs, lxc);
 
 /*
@@ -46,41 +58,309 @@ lxc_log_define(zfs, lxc);
  * noop, but for the sake of flexibility let's always bind-mount.
  */
 
-int zfs_list_entry(const char *path, char *output, size_t inlen)
+struct zfs_mount {
+	char *dataset;
+	char *mountpoint;
+};
+
+/*
+ * Inventory of the mounted zfs datasets. Since every container dataset is
+ * mounted on its rootfs this answers most lookups without asking zfs which
+ * has to list every dataset of every pool. The mount table is only read again
+ * once the kernel reports that it changed. Only used if lxc.bdev.zfs.inventory
+ * is set.
+ */
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	pid_t pid;
+	ino_t mntns;
+	struct zfs_mount *mounts;
+	size_t nr;
+} zfs_inventory = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static void zfs_inventory_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < zfs_inventory.nr; i++) {
+		free(zfs_inventory.mounts[i].dataset);
+		free(zfs_inventory.mounts[i].mountpoint);
+	}
+	free(zfs_inventory.mounts);
+	zfs_inventory.mounts = NULL;
+	zfs_inventory.nr = 0;
+}
+
+/* Undo the octal escapes of spaces, tabs, newlines and backslashes. */
+static void zfs_unescape(char *s)
+{
+	char *d = s;
+
+	for (; *s; s++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 3;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+static int zfs_inventory_read(void)
+{
+	FILE *f;
+	int fd;
+	char *line = NULL, *mountpoint, *fstype, *source, *p;
+	size_t len = 0, cap = 0;
+	struct zfs_mount *tmp;
+	int i;
+
+	zfs_inventory_clear();
+
+	fd = dup(zfs_inventory.fd);
+	if (fd < 0)
+		return -1;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+
+	while (getline(&line, &len, f) != -1) {
+		/* 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - zfs tank/c1 rw */
+		p = strstr(line, " - ");
+		if (!p)
+			continue;
+		*p = '\0';
+		fstype = p + 3;
+
+		p = strchr(fstype, ' ');
+		if (!p)
+			continue;
+		*p = '\0';
+		if (strcmp(fstype, "zfs"))
+			continue;
+		source = p + 1;
+
+		p = strchr(source, ' ');
+		if (p)
+			*p = '\0';
+
+		mountpoint = line;
+		for (i = 0; i < 4 && mountpoint; i++) {
+			mountpoint = strchr(mountpoint, ' ');
+			if (mountpoint)
+				mountpoint++;
+		}
+		if (!mountpoint)
+			continue;
+
+		p = strchr(mountpoint, ' ');
+		if (p)
+			*p = '\0';
+
+		if (zfs_inventory.nr == cap) {
+			cap = cap ? cap * 2 : 64;
+			tmp = realloc(zfs_inventory.mounts, cap * sizeof(*tmp));
+			if (!tmp)
+				goto on_error;
+			zfs_inventory.mounts = tmp;
+		}
+
+		tmp = &zfs_inventory.mounts[zfs_inventory.nr];
+		tmp->dataset = strdup(source);
+		tmp->mountpoint = strdup(mountpoint);
+		if (!tmp->dataset || !tmp->mountpoint) {
+			free(tmp->dataset);
+			free(tmp->mountpoint);
+			goto on_error;
+		}
+		zfs_unescape(tmp->dataset);
+		zfs_unescape(tmp->mountpoint);
+		zfs_inventory.nr++;
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+
+on_error:
+	free(line);
+	fclose(f);
+	zfs_inventory_clear();
+	return -1;
+}
+
+/* Called with zfs_inventory.lock held. */
+static int zfs_inventory_refresh(void)
+{
+	struct pollfd pfd;
+	struct stat st;
+	bool stale = false;
+
+	/* The table is per process and per mount namespace. */
+	if (stat("/proc/self/ns/mnt", &st) < 0)
+		st.st_ino = 0;
+
+	/* After a fork the descriptor may have been closed by
+	 * lxc_check_inherited() and its number reused, so forget it instead
+	 * of closing it.
+	 */
+	if (zfs_inventory.fd >= 0 &&
+	    (zfs_inventory.pid != getpid() || zfs_inventory.mntns != st.st_ino))
+		zfs_inventory.fd = -1;
+
+	if (zfs_inventory.fd < 0) {
+		zfs_inventory.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+		if (zfs_inventory.fd < 0)
+			return -1;
+		zfs_inventory.pid = getpid();
+		zfs_inventory.mntns = st.st_ino;
+		stale = true;
+	} else {
+		pfd.fd = zfs_inventory.fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) != 0)
+			stale = true;
+	}
+
+	if (!stale)
+		return 0;
+
+	if (zfs_inventory_read() < 0) {
+		close(zfs_inventory.fd);
+		zfs_inventory.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Ask zfs for the dataset mounted on @path. Used for datasets that are not
+ * mounted right now.
+ */
+static int zfs_list_entry(const char *path, char *dataset, size_t len)
 {
 	struct lxc_popen_FILE *f;
-	int found=0;
+	char *output, *p;
+	int found = 0;
+
+	output = malloc(LXC_LOG_BUFFER_SIZE);
+	if (!output)
+		return 0;
 
-	f = lxc_popen("zfs list 2> /dev/null");
+	f = lxc_popen("zfs list -H -o name,mountpoint 2> /dev/null");
 	if (f == NULL) {
 		SYSERROR("popen failed");
+		free(output);
 		return 0;
 	}
 
-	while (fgets(output, inlen, f->f)) {
-		if (strstr(output, path)) {
-			found = 1;
+	while (fgets(output, LXC_LOG_BUFFER_SIZE, f->f)) {
+		output[strcspn(output, "\n")] = '\0';
+
+		p = strchr(output, '\t');
+		if (!p)
+			continue;
+		*p++ = '\0';
+
+		if (strcmp(p, path) == 0 || strcmp(output, path) == 0) {
+			found = strlcpy(dataset, output, len) < len;
 			break;
 		}
 	}
 	(void) lxc_pclose(f);
+	free(output);
 
 	return found;
 }
 
-int zfs_detect(const char *path)
+/*
+ * Whether @path could be the mountpoint of a dataset that is not mounted right
+ * now, i.e. it doesn't exist or is an empty directory. Anything else either
+ * is mounted and would be in the inventory or is not a zfs rootfs at all.
+ */
+static bool zfs_maybe_unmounted(const char *path)
 {
-	char *output = malloc(LXC_LOG_BUFFER_SIZE);
+	DIR *dir;
+	struct dirent *direntp;
+	bool empty = true;
 
-	if (!output) {
-		ERROR("out of memory");
-		return 0;
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT || errno == ENOTDIR;
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
+			continue;
+
+		empty = false;
+		break;
 	}
+	closedir(dir);
 
-	int found = zfs_list_entry(path, output, LXC_LOG_BUFFER_SIZE);
-	free(output);
+	return empty;
+}
 
-	return found;
+/*
+ * Find the dataset mounted on @path or named @path and copy its name to
+ * @dataset. Returns 1 if one was found and 0 otherwise.
+ */
+static int zfs_find_dataset(const char *path, char *dataset, size_t len)
+{
+	size_t i;
+	int ret, found = 0;
+	const char *inventory;
+
+	inventory = lxc_global_config_value("lxc.bdev.zfs.inventory");
+	if (!inventory || strcmp(inventory, "1"))
+		return zfs_list_entry(path, dataset, len);
+
+	pthread_mutex_lock(&zfs_inventory.lock);
+	ret = zfs_inventory_refresh();
+	if (ret == 0) {
+		for (i = 0; i < zfs_inventory.nr; i++) {
+			if (strcmp(zfs_inventory.mounts[i].mountpoint, path) &&
+			    strcmp(zfs_inventory.mounts[i].dataset, path))
+				continue;
+
+			found = strlcpy(dataset, zfs_inventory.mounts[i].dataset, len) < len;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&zfs_inventory.lock);
+
+	if (found)
+		return 1;
+
+	/* Only ask zfs, which lists every dataset of every pool, if the
+	 * inventory can't tell. This keeps detecting the many rootfs that are
+	 * not on zfs cheap.
+	 */
+	if (ret == 0 && !zfs_maybe_unmounted(path))
+		return 0;
+
+	return zfs_list_entry(path, dataset, len);
+}
+
+int zfs_detect(const char *path)
+{
+	char dataset[MAXPATHLEN];
+
+	return zfs_find_dataset(path, dataset, sizeof(dataset));
 }
 
 int zfs_mount(struct lxc_storage *bdev)
@@ -115,22 +395,38 @@ int zfs_umount(struct lxc_storage *bdev)
 	return umount(bdev->dest);
 }
 
+/* Run zfs with the arguments in @argv and wait for it to exit. */
+static int zfs_run(const char *const argv[], bool quiet)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (!pid) {
+		if (quiet) {
+			int dev0 = open("/dev/null", O_WRONLY);
+			if (dev0 >= 0)
+				dup2(dev0, STDERR_FILENO);
+		}
+		execvp("zfs", (char *const *)argv);
+		exit(EXIT_FAILURE);
+	}
+
+	return wait_for_pid(pid);
+}
+
 int zfs_clone(const char *opath, const char *npath, const char *oname,
 		const char *nname, const char *lxcpath, int snapshot)
 {
-	// use the 'zfs list | grep opath' entry to get the zfsroot
-	char output[MAXPATHLEN], option[MAXPATHLEN];
+	// the new dataset is created next to the one mounted on opath
+	char output[MAXPATHLEN], option[MAXPATHLEN], dev[MAXPATHLEN];
 	char *p;
 	const char *zfsroot = output;
 	int ret;
-	pid_t pid;
-
-	if (zfs_list_entry(opath, output, MAXPATHLEN)) {
-		// zfsroot is output up to ' '
-		if ((p = strchr(output, ' ')) == NULL)
-			return -1;
-		*p = '\0';
 
+	if (zfs_find_dataset(opath, output, MAXPATHLEN)) {
 		if ((p = strrchr(output, '/')) == NULL)
 			return -1;
 		*p = '\0';
@@ -142,62 +438,38 @@ int zfs_clone(const char *opath, const char *npath, const char *oname,
 	if (ret < 0  || ret >= MAXPATHLEN)
 		return -1;
 
+	ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, nname);
+	if (ret < 0  || ret >= MAXPATHLEN)
+		return -1;
+
 	// zfs create -omountpoint=$lxcpath/$lxcname $zfsroot/$nname
 	if (!snapshot) {
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			char dev[MAXPATHLEN];
-			ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, nname);
-			if (ret < 0  || ret >= MAXPATHLEN)
-				exit(EXIT_FAILURE);
-			execlp("zfs", "zfs", "create", option, dev, (char *)NULL);
-			exit(EXIT_FAILURE);
-		}
-		return wait_for_pid(pid);
+		const char *argv[] = { "zfs", "create", option, dev, NULL };
+
+		return zfs_run(argv, false);
 	} else {
 		// if snapshot, do
 		// 'zfs snapshot zfsroot/oname@nname
 		// zfs clone zfsroot/oname@nname zfsroot/nname
-		char path1[MAXPATHLEN], path2[MAXPATHLEN];
+		char path1[MAXPATHLEN];
+		const char *snap_argv[] = { "zfs", "snapshot", path1, NULL };
+		const char *destroy_argv[] = { "zfs", "destroy", path1, NULL };
+		const char *clone_argv[] = { "zfs", "clone", option, path1, dev, NULL };
 
 		ret = snprintf(path1, MAXPATHLEN, "%s/%s@%s", zfsroot,
 				oname, nname);
 		if (ret < 0 || ret >= MAXPATHLEN)
 			return -1;
-		(void) snprintf(path2, MAXPATHLEN, "%s/%s", zfsroot, nname);
 
-		// if the snapshot exists, delete it
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			int dev0 = open("/dev/null", O_WRONLY);
-			if (dev0 >= 0)
-				dup2(dev0, STDERR_FILENO);
-			execlp("zfs", "zfs", "destroy", path1, (char *)NULL);
-			exit(EXIT_FAILURE);
+		// a stale snapshot of the same name is rare, so only remove
+		// it once taking the snapshot failed
+		if (zfs_run(snap_argv, true) < 0) {
+			(void) zfs_run(destroy_argv, true);
+			if (zfs_run(snap_argv, false) < 0)
+				return -1;
 		}
-		// it probably doesn't exist so destroy probably will fail.
-		(void) wait_for_pid(pid);
 
-		// run first (snapshot) command
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "snapshot", path1, (char *)NULL);
-			exit(EXIT_FAILURE);
-		}
-		if (wait_for_pid(pid) < 0)
-			return -1;
-
-		// run second (clone) command
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "clone", option, path1, path2, (char *)NULL);
-			exit(EXIT_FAILURE);
-		}
-		return wait_for_pid(pid);
+		return zfs_run(clone_argv, false);
 	}
 }
 
@@ -237,27 +509,15 @@ int zfs_clonepaths(struct lxc_storage *orig, struct lxc_storage *new, const char
  */
 int zfs_destroy(struct lxc_storage *orig)
 {
-	pid_t pid;
 	char output[MAXPATHLEN];
-	char *p;
+	const char *argv[] = { "zfs", "destroy", "-r", output, NULL };
 
-	if ((pid = fork()) < 0)
-		return -1;
-	if (pid)
-		return wait_for_pid(pid);
-
-	if (!zfs_list_entry(orig->src, output, MAXPATHLEN)) {
+	if (!zfs_find_dataset(orig->src, output, MAXPATHLEN)) {
 		ERROR("Error: zfs entry for %s not found", orig->src);
 		return -1;
 	}
 
-	// zfs mount is output up to ' '
-	if ((p = strchr(output, ' ')) == NULL)
-		return -1;
-	*p = '\0';
-
-	execlp("zfs", "zfs", "destroy", "-r", output, (char *)NULL);
-	exit(EXIT_FAILURE);
+	return zfs_run(argv, false);
 }
 
 int zfs_create(struct lxc_storage *bdev, const char *dest, const char *n,
@@ -59,6 +59,12 @@ struct lxc_arguments {
 
 	/* for lxc-start */
 	const char *share_ns[32]; // size must be greater than LXC_NS_MAX
+	int profile;
+	const char *profile_path;
+
+	/* for lxc-shift and lxc-create */
+	unsigned int jobs;
+	const char *shift_rootfs;
 
 	/* for lxc-console */
 	unsigned int ttynum;
@@ -91,6 +97,7 @@ struct lxc_arguments {
 	char *lvname, *vgname, *thinpool;
 	char *rbdname, *rbdpool;
 	char *zfsroot, *lowerdir, *dir;
+	unsigned int count;
 
 	/* lxc-execute */
 	uid_t uid;
@@ -112,6 +119,7 @@ struct lxc_arguments {
 		RENAME,
 	} task;
 	int print_comments;
+	int print_sizes;
 	char *commentfile;
 	char *newname;
 	char *newpath;
@@ -119,6 +127,8 @@ struct lxc_arguments {
 	int keepdata;
 	int keepname;
 	int keepmac;
+	int from_pool;
+	char *tmpfs_size;
 
 	/* lxc-ls */
 	char *ls_fancy_format;
@@ -19,6 +19,8 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -36,6 +38,19 @@ static bool stop = false;
 static bool verbose = false;
 static bool do_restore = false;
 static bool daemonize_set = false;
+static bool iterative = false;
+static unsigned int max_iterations = 0;
+static uint64_t converge_pages = 0;
+static char *pageserver_address = NULL;
+static char *pageserver_port = NULL;
+static bool stream = false;
+static int stream_fd = -1;
+
+#define OPT_MAX_ITERATIONS (OPT_USAGE + 1)
+#define OPT_CONVERGE_PAGES (OPT_USAGE + 2)
+#define OPT_PAGESERVER_ADDRESS (OPT_USAGE + 3)
+#define OPT_PAGESERVER_PORT (OPT_USAGE + 4)
+#define OPT_STREAM (OPT_USAGE + 5)
 
 static const struct option my_longopts[] = {
 	{"checkpoint-dir", required_argument, 0, 'D'},
@@ -44,6 +59,12 @@ static const struct option my_longopts[] = {
 	{"restore", no_argument, 0, 'r'},
 	{"daemon", no_argument, 0, 'd'},
 	{"foreground", no_argument, 0, 'F'},
+	{"iterative", no_argument, 0, 'i'},
+	{"max-iterations", required_argument, 0, OPT_MAX_ITERATIONS},
+	{"converge-pages", required_argument, 0, OPT_CONVERGE_PAGES},
+	{"page-server-address", required_argument, 0, OPT_PAGESERVER_ADDRESS},
+	{"page-server-port", required_argument, 0, OPT_PAGESERVER_PORT},
+	{"stream", no_argument, 0, OPT_STREAM},
 	LXC_COMMON_OPTIONS
 };
 
@@ -58,6 +79,26 @@ static int my_checker(const struct lxc_arguments *args)
 		return -1;
 	}
 
+	if (do_restore && iterative) {
+		lxc_error(args, "-i not compatible with -r.");
+		return -1;
+	}
+
+	if (!iterative && (max_iterations || converge_pages)) {
+		lxc_error(args, "--max-iterations/--converge-pages require -i.");
+		return -1;
+	}
+
+	if (stream && iterative) {
+		lxc_error(args, "--stream not compatible with -i.");
+		return -1;
+	}
+
+	if (!pageserver_address != !pageserver_port) {
+		lxc_error(args, "--page-server-address and --page-server-port must be used together.");
+		return -1;
+	}
+
 	if (checkpoint_dir == NULL) {
 		lxc_error(args, "-D is required.");
 		return -1;
@@ -91,6 +132,30 @@ static int my_parser(struct lxc_arguments *args, int c, char *arg)
 		args->daemonize = 0;
 		daemonize_set = true;
 		break;
+	case 'i':
+		iterative = true;
+		break;
+	case OPT_MAX_ITERATIONS:
+		if (lxc_safe_uint(arg, &max_iterations) < 0) {
+			lxc_error(args, "invalid number of iterations: %s", arg);
+			return -1;
+		}
+		break;
+	case OPT_CONVERGE_PAGES:
+		if (lxc_safe_uint64(arg, &converge_pages, 10) < 0) {
+			lxc_error(args, "invalid number of pages: %s", arg);
+			return -1;
+		}
+		break;
+	case OPT_PAGESERVER_ADDRESS:
+		pageserver_address = arg;
+		break;
+	case OPT_PAGESERVER_PORT:
+		pageserver_port = arg;
+		break;
+	case OPT_STREAM:
+		stream = true;
+		break;
 	}
 	return 0;
 }
@@ -109,8 +174,17 @@ Options :\n\
   -r, --restore             Restore container\n\
   -D, --checkpoint-dir=DIR  directory to save the checkpoint in\n\
   -v, --verbose             Enable verbose criu logs\n\
+  --stream                  Write the checkpoint images to stdout, or read\n\
+                            them from stdin when restoring, instead of\n\
+                            storing them in DIR\n\
   Checkpoint options:\n\
   -s, --stop                Stop the container after checkpointing.\n\
+  -i, --iterative           Pre-dump repeatedly until the dirty memory\n\
+                            converges, then do the final dump.\n\
+  --max-iterations=N        Run at most N pre-dumps (default: 8)\n\
+  --converge-pages=N        Stop pre-dumping once at most N pages were dirtied\n\
+  --page-server-address=ADDR Send memory pages to the criu page server at ADDR\n\
+  --page-server-port=PORT   Port of the criu page server\n\
   Restore options:\n\
   -d, --daemon              Daemonize the container (default)\n\
   -F, --foreground          Start with the current tty attached to /dev/console\n\
@@ -122,9 +196,19 @@ Options :\n\
 	.checker   = my_checker,
 };
 
+static void print_iteration(const struct migrate_iteration_stats *stats, void *data)
+{
+	printf("%s %u: %" PRIu64 " pages written, %" PRIu64 " unchanged, "
+	       "frozen for %" PRIu32 "us\n",
+	       stats->final ? "dump" : "pre-dump", stats->iteration,
+	       stats->pages_written, stats->pages_skipped_parent,
+	       stats->frozen_time);
+}
+
 static bool checkpoint(struct lxc_container *c)
 {
 	bool ret;
+	struct migrate_opts opts;
 
 	if (!c->is_running(c)) {
 		fprintf(stderr, "%s not running, not checkpointing.\n", my_args.name);
@@ -132,7 +216,25 @@ static bool checkpoint(struct lxc_container *c)
 		return false;
 	}
 
-	ret = c->checkpoint(c, checkpoint_dir, stop, verbose);
+	if (iterative || pageserver_address || stream) {
+		memset(&opts, 0, sizeof(opts));
+
+		opts.directory = checkpoint_dir;
+		opts.stop = stop;
+		opts.verbose = verbose;
+		opts.pageserver_address = pageserver_address;
+		opts.pageserver_port = pageserver_port;
+		opts.predump_iterations = max_iterations;
+		opts.predump_converge_pages = converge_pages;
+		opts.iteration_cb = print_iteration;
+		opts.stream = stream;
+		opts.stream_fd = STDOUT_FILENO;
+
+		ret = !c->migrate(c, iterative ? MIGRATE_ITERATIVE_DUMP : MIGRATE_DUMP,
+				  &opts, sizeof(opts));
+	} else {
+		ret = c->checkpoint(c, checkpoint_dir, stop, verbose);
+	}
 	lxc_container_put(c);
 
 	if (!ret) {
@@ -145,7 +247,23 @@ static bool checkpoint(struct lxc_container *c)
 
 static bool restore_finalize(struct lxc_container *c)
 {
-	bool ret = c->restore(c, checkpoint_dir, verbose);
+	bool ret;
+
+	if (stream) {
+		struct migrate_opts opts;
+
+		memset(&opts, 0, sizeof(opts));
+
+		opts.directory = checkpoint_dir;
+		opts.verbose = verbose;
+		opts.stream = true;
+		opts.stream_fd = stream_fd;
+
+		ret = !c->migrate(c, MIGRATE_RESTORE, &opts, sizeof(opts));
+	} else {
+		ret = c->restore(c, checkpoint_dir, verbose);
+	}
+
 	if (!ret) {
 		fprintf(stderr, "Restoring %s failed.\n", my_args.name);
 	}
@@ -162,6 +280,16 @@ static bool restore(struct lxc_container *c)
 		return false;
 	}
 
+	/* The daemonized restore closes stdin, so hold on to the stream. */
+	if (stream) {
+		stream_fd = dup(STDIN_FILENO);
+		if (stream_fd < 0) {
+			perror("dup");
+			lxc_container_put(c);
+			return false;
+		}
+	}
+
 	if (my_args.daemonize) {
 		pid_t pid;
 
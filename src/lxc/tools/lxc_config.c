@@ -35,7 +35,9 @@ static struct lxc_config_items items[] =
 	{ .name = "lxc.lxcpath", },
 	{ .name = "lxc.bdev.lvm.vg", },
 	{ .name = "lxc.bdev.lvm.thin_pool", },
+	{ .name = "lxc.bdev.lvm.dm_status", },
 	{ .name = "lxc.bdev.zfs.root", },
+	{ .name = "lxc.bdev.zfs.inventory", },
 	{ .name = "lxc.cgroup.use", },
 	{ .name = "lxc.cgroup.pattern", },
 	{ .name = NULL, },
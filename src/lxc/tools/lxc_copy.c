@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
@@ -50,6 +52,9 @@
 #include <../include/getsubopt.h>
 #endif
 
+#define OPT_FROM_POOL (OPT_USAGE + 1)
+#define OPT_TMPFS (OPT_USAGE + 2)
+
 enum mnttype {
 	LXC_MNT_BIND,
 	LXC_MNT_AUFS,
@@ -85,6 +90,8 @@ static const struct option my_longopts[] = {
 	{ "keepdata", no_argument, 0, 'D'},
 	{ "keepname", no_argument, 0, 'K'},
 	{ "keepmac", no_argument, 0, 'M'},
+	{ "from-pool", no_argument, 0, OPT_FROM_POOL},
+	{ "tmpfs", required_argument, 0, OPT_TMPFS},
 	LXC_COMMON_OPTIONS
 };
 
@@ -100,7 +107,8 @@ static struct lxc_arguments my_args = {
 	.progname = "lxc-copy",
 	.help = "\n\
 --name=NAME [-P lxcpath] -N newname [-p newpath] [-B backingstorage] [-s] [-K] [-M] [-L size [unit]] -- hook options\n\
---name=NAME [-P lxcpath] [-N newname] [-p newpath] [-B backingstorage] -e [-d] [-D] [-K] [-M] [-m {bind,aufs,overlay}=/src:/dest] -- hook options\n\
+--name=NAME [-P lxcpath] [-N newname] [-p newpath] [-B backingstorage] -e [-d] [-D] [-K] [-M] [--tmpfs=SIZE] [-m {bind,aufs,overlay}=/src:/dest] -- hook options\n\
+--name=NAME [-P lxcpath] [-B backingstorage] -e --from-pool [-d] [-K] [-M] [--tmpfs=SIZE] [-m {bind,aufs,overlay}=/src:/dest] -- hook options\n\
 --name=NAME [-P lxcpath] -N newname -R\n\
 \n\
 lxc-copy clone a container\n\
@@ -122,6 +130,10 @@ Options :\n\
   -K, --keepname            keep the hostname of the original container\n\
   --  hook options          arguments passed to the hook program\n\
   -M, --keepmac             keep the MAC address of the original container\n\
+  --from-pool               take the ephemeral container from the pool of NAME\n\
+                            and refill the pool in the background\n\
+  --tmpfs=SIZE              keep the writable layer of the ephemeral overlay\n\
+                            container in a tmpfs of SIZE\n\
   --rcfile=FILE             Load configuration file FILE\n",
 	.options = my_longopts,
 	.parser = my_parser,
@@ -142,6 +154,9 @@ static int do_clone(struct lxc_container *c, char *newname, char *newpath,
 static int do_clone_ephemeral(struct lxc_container *c,
 			      struct lxc_arguments *arg, char **args,
 			      int flags);
+static int do_clone_from_pool(struct lxc_container *c,
+			      struct lxc_arguments *arg, char **args,
+			      int flags);
 static int do_clone_rename(struct lxc_container *c, char *newname);
 static int do_clone_task(struct lxc_container *c, enum task task, int flags,
 			 char **args);
@@ -191,6 +206,12 @@ int main(int argc, char *argv[])
 		exit(ret);
 	}
 
+	if (my_args.tmpfs_size && (my_args.task != DESTROY || my_args.keepdata)) {
+		if (!my_args.quiet)
+			printf("Error: --tmpfs can only be used for ephemeral containers.\n");
+		exit(ret);
+	}
+
 	if (my_args.task == SNAP || my_args.task == DESTROY)
 		flags |= LXC_CLONE_SNAPSHOT;
 	if (my_args.keepname)
@@ -383,73 +404,91 @@ static int do_clone(struct lxc_container *c, char *newname, char *newpath,
 	return 0;
 }
 
-static int do_clone_ephemeral(struct lxc_container *c,
-		struct lxc_arguments *arg, char **args, int flags)
+/* Make @clone ephemeral and apply the options given for ephemeral containers. */
+static int set_ephemeral_config(struct lxc_container *clone,
+				struct lxc_arguments *arg)
 {
-	char randname[MAXPATHLEN];
-	unsigned int i;
-	int ret = 0;
-	bool bret = true, started = false;
-	struct lxc_container *clone;
+	if (!arg->keepdata)
+		if (!clone->set_config_item(clone, "lxc.ephemeral", "1"))
+			return -1;
 
-	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
-	attach_options.env_policy = LXC_ATTACH_CLEAR_ENV;
+	/* A clone does not inherit the pool of its parent. */
+	if (!clone->clear_config_item(clone, "lxc.ephemeral.pool.size") ||
+	    !clone->clear_config_item(clone, "lxc.ephemeral.pool.frozen"))
+		return -1;
 
-	if (!arg->newname) {
-		ret = snprintf(randname, MAXPATHLEN, "%s/%s_XXXXXX", arg->newpath, arg->name);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return -1;
-		if (!mkdtemp(randname))
-			return -1;
-		if (chmod(randname, 0770) < 0) {
-			(void)remove(randname);
+	if (arg->tmpfs_size) {
+		if (strncmp(clone->lxc_conf->rootfs.path, "overlayfs:", 10) != 0) {
+			fprintf(stderr, "Error: --tmpfs needs an overlay snapshot\n");
 			return -1;
 		}
-		arg->newname = randname + strlen(arg->newpath) + 1;
+
+		if (!clone->set_config_item(clone, "lxc.rootfs.overlay.tmpfs",
+					    arg->tmpfs_size))
+			return -1;
 	}
 
-	clone = c->clone(c, arg->newname, arg->newpath, flags,
-			 arg->bdevtype, NULL, arg->fssize, args);
-	if (!clone)
-		return -1;
+	return 0;
+}
 
-	if (!arg->keepdata)
-		if (!clone->set_config_item(clone, "lxc.ephemeral", "1"))
-			goto destroy_and_put;
+/* Add the mount entries requested with -m to @clone. */
+static int set_mnt_entries(struct lxc_container *clone,
+			   struct lxc_arguments *arg)
+{
+	unsigned int i;
+	bool bret;
+	struct mnts *n = NULL;
 
 	/* allocate and create random upper- and workdirs for overlay mounts */
 	if (mk_rand_ovl_dirs(mnt_table, mnt_table_size, arg) < 0)
-		goto destroy_and_put;
+		return -1;
 
 	/* allocate and set mount entries */
-	struct mnts *n = NULL;
 	for (i = 0, n = mnt_table; i < mnt_table_size; i++, n++) {
 		char *mntentry = NULL;
 		mntentry = set_mnt_entry(n);
 		if (!mntentry)
-			goto destroy_and_put;
+			return -1;
 		bret = clone->set_config_item(clone, "lxc.mount.entry", mntentry);
 		free(mntentry);
 		if (!bret)
-			goto destroy_and_put;
+			return -1;
 	}
 
-	if (!clone->save_config(clone, NULL))
-		goto destroy_and_put;
+	return 0;
+}
 
-	if (!my_args.quiet)
-		printf("Created %s as clone of %s\n", arg->newname, arg->name);
+/* Start @clone, or thaw it if it was handed out frozen from the pool, and run
+ * the command if one was given. Drops the reference to @clone.
+ */
+static int start_ephemeral(struct lxc_container *clone,
+			   struct lxc_arguments *arg, bool thaw)
+{
+	int ret = 0;
+	bool started = false;
 
-	if (!arg->daemonize && arg->argc) {
-		clone->want_daemonize(clone, true);
-		arg->daemonize = 1;
-	} else if (!arg->daemonize) {
-		clone->want_daemonize(clone, false);
-	}
+	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
+	attach_options.env_policy = LXC_ATTACH_CLEAR_ENV;
 
-	started = clone->start(clone, 0, NULL);
-	if (!started)
-		goto destroy_and_put;
+	if (thaw) {
+		if (!clone->unfreeze(clone)) {
+			/* Stopping an ephemeral container destroys it. */
+			clone->stop(clone);
+			goto put;
+		}
+		started = true;
+	} else {
+		if (!arg->daemonize && arg->argc) {
+			clone->want_daemonize(clone, true);
+			arg->daemonize = 1;
+		} else if (!arg->daemonize) {
+			clone->want_daemonize(clone, false);
+		}
+
+		started = clone->start(clone, 0, NULL);
+		if (!started)
+			goto destroy_and_put;
+	}
 
 	if (arg->daemonize && arg->argc) {
 		ret = clone->attach_run_wait(clone, &attach_options, arg->argv[0], (const char *const *)arg->argv);
@@ -467,11 +506,324 @@ destroy_and_put:
 		clone->shutdown(clone, -1);
 	if (!started || clone->lxc_conf->ephemeral != 1)
 		clone->destroy(clone);
+put:
 	free_mnts();
 	lxc_container_put(clone);
 	return -1;
 }
 
+static int do_clone_ephemeral(struct lxc_container *c,
+		struct lxc_arguments *arg, char **args, int flags)
+{
+	char randname[MAXPATHLEN];
+	int ret = 0;
+	struct lxc_container *clone;
+
+	if (!arg->newname) {
+		ret = snprintf(randname, MAXPATHLEN, "%s/%s_XXXXXX", arg->newpath, arg->name);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			return -1;
+		if (!mkdtemp(randname))
+			return -1;
+		if (chmod(randname, 0770) < 0) {
+			(void)remove(randname);
+			return -1;
+		}
+		arg->newname = randname + strlen(arg->newpath) + 1;
+	}
+
+	clone = c->clone(c, arg->newname, arg->newpath, flags,
+			 arg->bdevtype, NULL, arg->fssize, args);
+	if (!clone)
+		return -1;
+
+	if (set_ephemeral_config(clone, arg) < 0)
+		goto destroy_and_put;
+
+	if (set_mnt_entries(clone, arg) < 0)
+		goto destroy_and_put;
+
+	if (!clone->save_config(clone, NULL))
+		goto destroy_and_put;
+
+	if (!my_args.quiet)
+		printf("Created %s as clone of %s\n", arg->newname, arg->name);
+
+	return start_ephemeral(clone, arg, false);
+
+destroy_and_put:
+	clone->destroy(clone);
+	free_mnts();
+	lxc_container_put(clone);
+	return -1;
+}
+
+/* The pool of ephemeral clones of a container is kept in the ephemeral_pool
+ * directory of the container. Every entry in it names a clone that is ready to
+ * be handed out. A clone is claimed by removing its entry which makes claiming
+ * safe against concurrent lxc-copy invocations. The directory itself is locked
+ * while the pool is being refilled.
+ */
+static int pool_path(struct lxc_container *c, char *path)
+{
+	int ret;
+
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/ephemeral_pool", c->config_path,
+		       c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	return 0;
+}
+
+static int pool_count(const char *path)
+{
+	int count = 0;
+	DIR *dir;
+	struct dirent *direntp;
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((direntp = readdir(dir)))
+		if (direntp->d_name[0] != '.')
+			count++;
+
+	closedir(dir);
+	return count;
+}
+
+/* Get rid of a pool member that can not be handed out. */
+static void pool_discard(struct lxc_container *member)
+{
+	if (member->is_running(member))
+		member->stop(member);
+	else if (member->is_defined(member))
+		member->destroy(member);
+
+	lxc_container_put(member);
+}
+
+static struct lxc_container *pool_claim(struct lxc_container *c, bool frozen)
+{
+	char path[MAXPATHLEN];
+	DIR *dir;
+	struct dirent *direntp;
+	struct lxc_container *member = NULL;
+
+	if (pool_path(c, path) < 0)
+		return NULL;
+
+	dir = opendir(path);
+	if (!dir)
+		return NULL;
+
+	while ((direntp = readdir(dir))) {
+		if (direntp->d_name[0] == '.')
+			continue;
+
+		/* Somebody else claimed it first. */
+		if (unlinkat(dirfd(dir), direntp->d_name, 0) < 0)
+			continue;
+
+		member = lxc_container_new(direntp->d_name, c->config_path);
+		if (!member)
+			continue;
+
+		/* Members that were stopped by a reboot or that were created
+		 * before the pool was reconfigured are dropped.
+		 */
+		if (member->is_defined(member) &&
+		    strcmp(member->state(member), frozen ? "FROZEN" : "STOPPED") == 0)
+			break;
+
+		pool_discard(member);
+		member = NULL;
+	}
+
+	closedir(dir);
+	return member;
+}
+
+static int pool_add(struct lxc_container *c, const char *path, bool frozen,
+		    int flags, char **args)
+{
+	char name[MAXPATHLEN];
+	int fd, ret;
+	struct lxc_container *member;
+	bool started = false;
+
+	ret = snprintf(name, MAXPATHLEN, "%s/%s_pool_XXXXXX", c->config_path, c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	if (!mkdtemp(name))
+		return -1;
+	if (chmod(name, 0770) < 0) {
+		(void)remove(name);
+		return -1;
+	}
+
+	member = c->clone(c, name + strlen(c->config_path) + 1, c->config_path,
+			  flags, my_args.bdevtype, NULL, my_args.fssize, args);
+	if (!member) {
+		(void)rmdir(name);
+		return -1;
+	}
+
+	if (set_ephemeral_config(member, &my_args) < 0 ||
+	    !member->save_config(member, NULL))
+		goto on_error;
+
+	if (frozen) {
+		member->want_daemonize(member, true);
+		started = member->start(member, 0, NULL);
+		if (!started || !member->freeze(member))
+			goto on_error;
+	}
+
+	ret = snprintf(name, MAXPATHLEN, "%s/%s", path, member->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto on_error;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+	if (fd < 0)
+		goto on_error;
+	close(fd);
+
+	lxc_container_put(member);
+	return 0;
+
+on_error:
+	if (started)
+		member->stop(member);
+	else
+		member->destroy(member);
+	lxc_container_put(member);
+	return -1;
+}
+
+static void pool_refill(struct lxc_container *c, int flags, char **args)
+{
+	char path[MAXPATHLEN];
+	int count, fd;
+	unsigned int size = c->lxc_conf->ephemeral_pool_size;
+	bool frozen = c->lxc_conf->ephemeral_pool_frozen;
+
+	if (pool_path(c, path) < 0)
+		return;
+
+	for (;;) {
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		/* Another lxc-copy is refilling the pool. Members claimed
+		 * before it drops the lock are picked up by its final count.
+		 */
+		if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+			close(fd);
+			return;
+		}
+
+		while ((count = pool_count(path)) >= 0 && (unsigned int)count < size)
+			if (pool_add(c, path, frozen, flags, args) < 0)
+				break;
+		close(fd);
+
+		if (count < 0 || (unsigned int)count < size)
+			return;
+
+		count = pool_count(path);
+		if (count < 0 || (unsigned int)count >= size)
+			return;
+	}
+}
+
+/* Refill the pool from a detached child so the caller can go on right away. */
+static void pool_refill_background(struct lxc_container *c, int flags,
+				   char **args)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return;
+
+	if (pid > 0) {
+		(void)wait_for_pid(pid);
+		return;
+	}
+
+	if (setsid() < 0)
+		_exit(EXIT_FAILURE);
+
+	pid = fork();
+	if (pid != 0)
+		_exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	(void)null_stdfds();
+	pool_refill(c, flags, args);
+	_exit(EXIT_SUCCESS);
+}
+
+static int do_clone_from_pool(struct lxc_container *c,
+			      struct lxc_arguments *arg, char **args,
+			      int flags)
+{
+	char path[MAXPATHLEN];
+	int ret;
+	struct lxc_container *member;
+	bool frozen = c->lxc_conf->ephemeral_pool_frozen;
+
+	if (c->lxc_conf->ephemeral_pool_size == 0) {
+		fprintf(stderr, "Error: %s has no pool, set lxc.ephemeral.pool.size\n", c->name);
+		return -1;
+	}
+
+	if (arg->newname || arg->keepdata || strcmp(arg->newpath, c->config_path)) {
+		fprintf(stderr, "Error: --from-pool can not be used with -N, -p or -D\n");
+		return -1;
+	}
+
+	if (frozen && (!arg->daemonize || mnt_table_size > 0)) {
+		fprintf(stderr, "Error: containers from a frozen pool can not be "
+				"started in the foreground or get extra mounts\n");
+		return -1;
+	}
+
+	if (pool_path(c, path) < 0)
+		return -1;
+
+	ret = mkdir(path, 0750);
+	if (ret < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: failed to create %s\n", path);
+		return -1;
+	}
+
+	member = pool_claim(c, frozen);
+	pool_refill_background(c, flags, args);
+
+	/* An empty pool is no error, the clone is made on the spot. */
+	if (!member)
+		return do_clone_ephemeral(c, arg, args, flags);
+
+	arg->newname = member->name;
+	if (mnt_table_size > 0) {
+		if (set_mnt_entries(member, arg) < 0 ||
+		    !member->save_config(member, NULL)) {
+			pool_discard(member);
+			free_mnts();
+			return -1;
+		}
+	}
+
+	if (!my_args.quiet)
+		printf("Created %s as clone of %s\n", arg->newname, arg->name);
+
+	return start_ephemeral(member, arg, frozen);
+}
+
 static int do_clone_rename(struct lxc_container *c, char *newname)
 {
 	if (!c->rename(c, newname)) {
@@ -489,7 +841,10 @@ static int do_clone_task(struct lxc_container *c, enum task task, int flags,
 
 	switch (task) {
 	case DESTROY:
-		ret = do_clone_ephemeral(c, &my_args, args, flags);
+		if (my_args.from_pool)
+			ret = do_clone_from_pool(c, &my_args, args, flags);
+		else
+			ret = do_clone_ephemeral(c, &my_args, args, flags);
 		break;
 	case RENAME:
 		ret = do_clone_rename(c, my_args.newname);
@@ -604,6 +959,13 @@ static int my_parser(struct lxc_arguments *args, int c, char *arg)
 	case 'M':
 		args->keepmac = 1;
 		break;
+	case OPT_FROM_POOL:
+		args->from_pool = 1;
+		args->task = DESTROY;
+		break;
+	case OPT_TMPFS:
+		args->tmpfs_size = arg;
+		break;
 	}
 
 	return 0;
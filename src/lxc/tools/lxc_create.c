@@ -22,6 +22,7 @@
 #include <libgen.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <lxc/lxccontainer.h>
 #include <sys/types.h>
@@ -81,6 +82,14 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case '6': args->dir = arg; break;
 	case '7': args->rbdname = arg; break;
 	case '8': args->rbdpool = arg; break;
+	case '9':
+		if (lxc_safe_uint(arg, &args->count) < 0)
+			return -1;
+		break;
+	case 'j':
+		if (lxc_safe_uint(arg, &args->jobs) < 0 || args->jobs == 0)
+			return -1;
+		break;
 	}
 	return 0;
 }
@@ -98,6 +107,8 @@ static const struct option my_longopts[] = {
 	{"dir", required_argument, 0, '6'},
 	{"rbdname", required_argument, 0, '7'},
 	{"rbdpool", required_argument, 0, '8'},
+	{"count", required_argument, 0, '9'},
+	{"jobs", required_argument, 0, 'j'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -140,6 +151,10 @@ Options :\n\
   -t, --template=TEMPLATE       Template to use to setup container\n\
   -B, --bdev=BDEV               Backing store type to use\n\
       --dir=DIR                 Place rootfs directory under DIR\n\
+      --count=N                 Also create N snapshot clones NAME-1 to NAME-N\n\
+                                of the new container\n\
+  -j, --jobs=JOBS               Update the rootfs of up to JOBS clones at once\n\
+                                (Default: number of CPUs)\n\
 \n\
   BDEV options for LVM (with -B/--bdev lvm):\n\
       --lvname=LVNAME           Use LVM lv name LVNAME\n\
@@ -170,6 +185,68 @@ Options :\n\
 	.checker  = NULL,
 };
 
+static double timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Clone the freshly created container @c into NAME-1 to NAME-@count. */
+static bool create_clones(struct lxc_container *c, unsigned int count,
+			  unsigned int jobs)
+{
+	int created;
+	unsigned int i;
+	double start, elapsed;
+	char **names;
+	bool ret = false;
+
+	names = calloc(count, sizeof(*names));
+	if (!names) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		names[i] = malloc(strlen(c->name) + 12);
+		if (!names[i]) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			goto out;
+		}
+		sprintf(names[i], "%s-%u", c->name, i + 1);
+	}
+
+	if (jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+
+	start = timestamp();
+	created = lxc_clone_many(c, names, count, NULL, LXC_CLONE_SNAPSHOT,
+				 NULL, jobs);
+	elapsed = timestamp() - start;
+	if (created < 0) {
+		fprintf(stderr, "Error cloning container %s\n", c->name);
+		goto out;
+	}
+
+	if (!my_args.quiet)
+		printf("Created %d of %u clones of %s in %.2fs (%.1f containers/s)\n",
+		       created, count, c->name, elapsed,
+		       elapsed > 0 ? created / elapsed : 0);
+
+	ret = (unsigned int)created == count;
+
+out:
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+
+	return ret;
+}
+
 static bool validate_bdev_args(struct lxc_arguments *a)
 {
 	if (strcmp(a->bdevtype, "best") != 0) {
@@ -326,6 +403,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (my_args.count > 0 && !create_clones(c, my_args.count, my_args.jobs)) {
+		lxc_container_put(c);
+		exit(EXIT_FAILURE);
+	}
+
 	lxc_container_put(c);
 	exit(EXIT_SUCCESS);
 }
@@ -21,6 +21,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -31,6 +32,7 @@
 
 #include <lxc/lxccontainer.h>
 
+#include "cgroup_stats.h"
 #include "lxc.h"
 #include "log.h"
 #include "utils.h"
@@ -201,7 +203,10 @@ static void print_net_stats(struct lxc_container *c)
 	}
 }
 
-static void print_stats(struct lxc_container *c)
+/* Fallback for cgroup drivers that don't allow direct access to the
+ * container's cgroups.
+ */
+static void print_stats_items(struct lxc_container *c)
 {
 	int i, ret;
 	char buf[4096];
@@ -258,6 +263,54 @@ static void print_stats(struct lxc_container *c)
 	}
 }
 
+static void print_stats_size(const char *key, uint64_t val)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%" PRIu64, val);
+	str_size_humanize(buf, sizeof(buf));
+	printf("%-15s %s\n", key, buf);
+	fflush(stdout);
+}
+
+static void print_stats(struct lxc_container *c)
+{
+	int ret;
+	struct cgroup_stats_handle *h;
+	struct lxc_cgroup_stats cgstats;
+
+	h = cgroup_stats_open(c->name, c->config_path);
+	if (!h) {
+		print_stats_items(c);
+		return;
+	}
+
+	ret = cgroup_stats_read(h, &cgstats);
+	cgroup_stats_close(h);
+	if (ret < 0)
+		return;
+
+	if (cgstats.valid & LXC_CGROUP_STATS_CPU) {
+		if (humanize)
+			printf("%-15s %.2f seconds\n", "CPU use:",
+			       cgstats.cpu_use_nanos / 1000000000.0);
+		else
+			printf("%-15s %" PRIu64 "\n", "CPU use:",
+			       cgstats.cpu_use_nanos);
+		fflush(stdout);
+	}
+
+	if (cgstats.valid & LXC_CGROUP_STATS_IO)
+		print_stats_size("BlkIO use:",
+				 cgstats.io_read_bytes + cgstats.io_write_bytes);
+
+	if (cgstats.valid & LXC_CGROUP_STATS_MEM)
+		print_stats_size("Memory use:", cgstats.mem_used);
+
+	if (cgstats.valid & LXC_CGROUP_STATS_KMEM)
+		print_stats_size("KMem use:", cgstats.kmem_used);
+}
+
 static void print_info_msg_int(const char *key, int value)
 {
 	if (humanize)
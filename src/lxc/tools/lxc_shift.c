@@ -0,0 +1,206 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "arguments.h"
+#include "conf.h"
+#include "idshift.h"
+#include "log.h"
+#include "lxc.h"
+#include "storage.h"
+#include "utils.h"
+
+#define OPT_ROOTFS (OPT_USAGE + 1)
+
+static int my_parser(struct lxc_arguments *args, int c, char *arg);
+
+static const struct option my_longopts[] = {
+	{"jobs", required_argument, 0, 'j'},
+	{"rootfs", required_argument, 0, OPT_ROOTFS},
+	LXC_COMMON_OPTIONS
+};
+
+static struct lxc_arguments my_args = {
+	.progname = "lxc-shift",
+	.help     = "\
+--name=NAME [-j JOBS] [--rootfs=PATH]\n\
+\n\
+lxc-shift shifts the ownership of the root filesystem of the stopped container\n\
+NAME according to its lxc.idmap entries so it can run unprivileged.\n\
+An interrupted run can be resumed by running lxc-shift again.\n\
+\n\
+Options :\n\
+  -n, --name=NAME   NAME of the container\n\
+  -j, --jobs=JOBS   Use JOBS threads (default: twice the number of CPUs)\n\
+  --rootfs=PATH     Shift PATH instead of the container's directory rootfs\n\
+  --rcfile=FILE     Load configuration file FILE\n",
+	.options  = my_longopts,
+	.parser   = my_parser,
+	.checker  = NULL,
+};
+
+static int my_parser(struct lxc_arguments *args, int c, char *arg)
+{
+	switch (c) {
+	case 'j':
+		if (lxc_safe_uint(arg, &args->jobs) < 0 || args->jobs == 0)
+			return -1;
+		break;
+	case OPT_ROOTFS:
+		args->shift_rootfs = arg;
+		break;
+	}
+
+	return 0;
+}
+
+/* Redraw the progress line in place when stderr is a terminal. */
+static bool progress_tty;
+
+static void print_progress(const struct lxc_idshift_stats *stats, void *data)
+{
+	fprintf(stderr, "%s%" PRIu64 " inodes, %" PRIu64 " shifted, %.0f inodes/s%s",
+		progress_tty ? "\r" : "", stats->inodes, stats->shifted,
+		stats->seconds > 0 ? stats->inodes / stats->seconds : 0,
+		progress_tty ? "" : "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	long cpus;
+	const char *rootfs;
+	struct lxc_container *c;
+	struct lxc_log log;
+	struct lxc_idshift_stats stats;
+
+	if (lxc_arguments_parse(&my_args, argc, argv))
+		exit(EXIT_FAILURE);
+
+	if (!my_args.log_file)
+		my_args.log_file = "none";
+
+	log.name = my_args.name;
+	log.file = my_args.log_file;
+	log.level = my_args.log_priority;
+	log.prefix = my_args.progname;
+	log.quiet = my_args.quiet;
+	log.lxcpath = my_args.lxcpath[0];
+
+	if (lxc_log_init(&log))
+		exit(EXIT_FAILURE);
+	lxc_log_options_no_override();
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s must be run as root\n", my_args.progname);
+		exit(EXIT_FAILURE);
+	}
+
+	c = lxc_container_new(my_args.name, my_args.lxcpath[0]);
+	if (!c) {
+		fprintf(stderr, "No such container: %s:%s\n", my_args.lxcpath[0], my_args.name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (my_args.rcfile) {
+		c->clear_config(c);
+		if (!c->load_config(c, my_args.rcfile)) {
+			fprintf(stderr, "Failed to load rcfile\n");
+			lxc_container_put(c);
+			exit(EXIT_FAILURE);
+		}
+		c->configfile = strdup(my_args.rcfile);
+		if (!c->configfile) {
+			fprintf(stderr, "Out of memory setting new config filename\n");
+			lxc_container_put(c);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!c->is_defined(c)) {
+		fprintf(stderr, "No such container: %s:%s\n", my_args.lxcpath[0], my_args.name);
+		lxc_container_put(c);
+		exit(EXIT_FAILURE);
+	}
+
+	if (c->is_running(c)) {
+		fprintf(stderr, "%s:%s must be stopped\n", my_args.lxcpath[0], my_args.name);
+		lxc_container_put(c);
+		exit(EXIT_FAILURE);
+	}
+
+	if (lxc_list_empty(&c->lxc_conf->id_map)) {
+		fprintf(stderr, "%s:%s has no id mappings configured\n",
+			my_args.lxcpath[0], my_args.name);
+		lxc_container_put(c);
+		exit(EXIT_FAILURE);
+	}
+
+	rootfs = my_args.shift_rootfs;
+	if (!rootfs) {
+		rootfs = c->lxc_conf->rootfs.path;
+		if (!rootfs || !storage_is_dir(c->lxc_conf, rootfs)) {
+			fprintf(stderr, "The rootfs of %s:%s is not a directory, "
+				"mount it and pass it with --rootfs\n",
+				my_args.lxcpath[0], my_args.name);
+			lxc_container_put(c);
+			exit(EXIT_FAILURE);
+		}
+
+		if (strncmp(rootfs, "dir:", 4) == 0)
+			rootfs += 4;
+	}
+
+	if (my_args.jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		my_args.jobs = cpus > 0 ? cpus * 2 : 1;
+	}
+
+	progress_tty = isatty(STDERR_FILENO);
+	ret = lxc_idshift_tree(rootfs, &c->lxc_conf->id_map, my_args.jobs,
+			       my_args.quiet ? NULL : print_progress, NULL,
+			       &stats);
+	if (!my_args.quiet) {
+		if (progress_tty && stats.seconds >= 1)
+			fprintf(stderr, "\n");
+		printf("%" PRIu64 " inodes in %.1fs (%.0f inodes/s): %" PRIu64
+		       " shifted, %" PRIu64 " xattrs, %" PRIu64 " unmapped, %"
+		       PRIu64 " errors\n", stats.inodes, stats.seconds,
+		       stats.seconds > 0 ? stats.inodes / stats.seconds : 0,
+		       stats.shifted, stats.xattrs, stats.unmapped, stats.errors);
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "Failed to shift %s\n", rootfs);
+		lxc_container_put(c);
+		exit(EXIT_FAILURE);
+	}
+
+	lxc_container_put(c);
+	exit(EXIT_SUCCESS);
+}
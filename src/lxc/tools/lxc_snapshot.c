@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <inttypes.h>
 
 #include <lxc/lxccontainer.h>
 
@@ -42,13 +43,14 @@ static const struct option my_longopts[] = {
 	{"destroy", required_argument, 0, 'd'},
 	{"comment", required_argument, 0, 'c'},
 	{"showcomments", no_argument, 0, 'C'},
+	{"showsizes", no_argument, 0, 'S'},
 	LXC_COMMON_OPTIONS
 };
 
 static struct lxc_arguments my_args = {
 	.progname = "lxc-snapshot",
 	.help = "\
---name=NAME [-P lxcpath] [-L [-C]] [-c commentfile] [-r snapname [-N newname]]\n\
+--name=NAME [-P lxcpath] [-L [-C] [-S]] [-c commentfile] [-r snapname [-N newname]]\n\
 \n\
 lxc-snapshot snapshots a container\n\
 \n\
@@ -61,6 +63,7 @@ Options :\n\
                          use ALL to destroy all snapshots\n\
   -c, --comment=FILE     add FILE as a comment\n\
   -C, --showcomments     show snapshot comments\n\
+  -S, --showsizes        show snapshot sizes in bytes\n\
   --rcfile=FILE          Load configuration file FILE\n",
 	.options = my_longopts,
 	.parser = my_parser,
@@ -70,7 +73,8 @@ Options :\n\
 
 static int do_snapshot(struct lxc_container *c, char *commentfile);
 static int do_snapshot_destroy(struct lxc_container *c, char *snapname);
-static int do_snapshot_list(struct lxc_container *c, int print_comments);
+static int do_snapshot_list(struct lxc_container *c, int print_comments,
+			    int print_sizes);
 static int do_snapshot_restore(struct lxc_container *c,
 			       struct lxc_arguments *args);
 static int do_snapshot_task(struct lxc_container *c, enum task task);
@@ -159,7 +163,8 @@ static int do_snapshot_task(struct lxc_container *c, enum task task)
 		ret = do_snapshot_destroy(c, my_args.snapname);
 		break;
 	case LIST:
-		ret = do_snapshot_list(c, my_args.print_comments);
+		ret = do_snapshot_list(c, my_args.print_comments,
+				       my_args.print_sizes);
 		break;
 	case RESTORE:
 		ret = do_snapshot_restore(c, &my_args);
@@ -198,6 +203,9 @@ static int my_parser(struct lxc_arguments *args, int c, char *arg)
 	case 'C':
 		args->print_comments = 1;
 		break;
+	case 'S':
+		args->print_sizes = 1;
+		break;
 	}
 
 	return 0;
@@ -233,7 +241,8 @@ static int do_snapshot_destroy(struct lxc_container *c, char *snapname)
 	return 0;
 }
 
-static int do_snapshot_list(struct lxc_container *c, int print_comments)
+static int do_snapshot_list(struct lxc_container *c, int print_comments,
+			    int print_sizes)
 {
 	struct lxc_snapshot *s;
 	int i, n;
@@ -249,7 +258,10 @@ static int do_snapshot_list(struct lxc_container *c, int print_comments)
 	}
 
 	for (i = 0; i < n; i++) {
-		printf("%s (%s) %s\n", s[i].name, s[i].lxcpath, s[i].timestamp);
+		printf("%s (%s) %s", s[i].name, s[i].lxcpath, s[i].timestamp);
+		if (print_sizes)
+			printf(" %" PRId64, lxc_snapshot_size(&s[i]));
+		printf("\n");
 		if (print_comments)
 			print_file(s[i].comment_pathname);
 		s[i].free(&s[i]);
@@ -49,6 +49,9 @@
 #include "utils.h"
 #include "confile.h"
 #include "arguments.h"
+#include "profiler.h"
+
+#define OPT_PROFILE (OPT_USAGE + 1)
 
 static struct lxc_list defines;
 
@@ -143,6 +146,10 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case OPT_SHARE_NET: args->share_ns[LXC_NS_NET] = arg; break;
 	case OPT_SHARE_IPC: args->share_ns[LXC_NS_IPC] = arg; break;
 	case OPT_SHARE_UTS: args->share_ns[LXC_NS_UTS] = arg; break;
+	case OPT_PROFILE:
+		args->profile = 1;
+		args->profile_path = arg;
+		break;
 	}
 	return 0;
 }
@@ -159,6 +166,7 @@ static const struct option my_longopts[] = {
 	{"share-net", required_argument, 0, OPT_SHARE_NET},
 	{"share-ipc", required_argument, 0, OPT_SHARE_IPC},
 	{"share-uts", required_argument, 0, OPT_SHARE_UTS},
+	{"profile", optional_argument, 0, OPT_PROFILE},
 	LXC_COMMON_OPTIONS
 };
 
@@ -182,6 +190,8 @@ Options :\n\
                          Note: --daemon implies --close-all-fds\n\
   -s, --define KEY=VAL   Assign VAL to configuration variable KEY\n\
       --share-[net|ipc|uts]=NAME Share a namespace with another container or pid\n\
+      --profile[=FILE]   Time the start phases, write them to FILE as JSON\n\
+                         and print them once the container is running\n\
 ",
 	.options   = my_longopts,
 	.parser    = my_parser,
@@ -197,6 +207,7 @@ int main(int argc, char *argv[])
 	struct lxc_log log;
 	char *const *args;
 	char *rcfile = NULL;
+	char *profile_path = NULL;
 	char *const default_args[] = {
 		"/sbin/init",
 		NULL,
@@ -342,6 +353,35 @@ int main(int argc, char *argv[])
 		conf->inherit_ns_fd[i] = fd;
 	}
 
+	if (my_args.profile) {
+		/* The daemonized start changes to / before the profile is
+		 * written, so relative paths are taken from our cwd now.
+		 */
+		if (!my_args.profile_path) {
+			if (asprintf(&profile_path, "%s/%s/start-profile.json",
+				     lxcpath, c->name) < 0)
+				profile_path = NULL;
+		} else if (my_args.profile_path[0] != '/') {
+			char *cwd = getcwd(NULL, 0);
+
+			if (!cwd || asprintf(&profile_path, "%s/%s", cwd,
+					     my_args.profile_path) < 0)
+				profile_path = NULL;
+			free(cwd);
+		} else {
+			profile_path = strdup(my_args.profile_path);
+		}
+		if (!profile_path) {
+			fprintf(stderr, "failed to allocate memory\n");
+			goto out;
+		}
+
+		/* Don't report a stale profile if this start fails early. */
+		(void)unlink(profile_path);
+		if (!c->set_config_item(c, "lxc.start.profile", profile_path))
+			goto out;
+	}
+
 	if (!my_args.daemonize) {
 		c->want_daemonize(c, false);
 	}
@@ -362,10 +402,15 @@ int main(int argc, char *argv[])
 		      "--logfile and --logpriority options.\n");
 		err = c->error_num;
 		lxc_container_put(c);
+		free(profile_path);
 		exit(err);
 	}
 
+	if (profile_path && lxc_prof_print_file(profile_path) < 0)
+		fprintf(stderr, "No start profile was written to %s\n", profile_path);
+
 out:
 	lxc_container_put(c);
+	free(profile_path);
 	exit(err);
 }
@@ -26,16 +26,21 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <lxc/lxccontainer.h>
 
 #include "arguments.h"
+#include "cgroup_stats.h"
 #include "log.h"
 #include "lxc.h"
 #include "mainloop.h"
+#include "monitor.h"
+#include "state.h"
 #include "utils.h"
 
 #define USER_HZ   100
@@ -54,28 +59,44 @@ struct stats {
 	uint64_t cpu_use_user;
 	uint64_t cpu_use_sys;
 	uint64_t blkio;
+	/* CPU use since the previous refresh in percent of one CPU. */
+	double cpu_pct;
 };
 
+/* Running containers are tracked across refreshes. The table is updated from
+ * the state changes lxc-monitord reports so neither the list of containers nor
+ * the location of their cgroups has to be looked up again on every refresh.
+ */
 struct ct {
+	char *name;
+	/* Only used for cgroup drivers without direct cgroup access. */
 	struct lxc_container *c;
-	struct stats *stats;
+	struct cgroup_stats_handle *h;
+	struct stats stats;
+	struct timespec sampled;
 };
 
-static int delay = 3;
+static double delay = 3;
 static char sort_by = 'n';
 static int sort_reverse = 0;
 
 static struct termios oldtios;
 static struct ct *ct = NULL;
+static int ct_cnt = 0;
 static int ct_alloc_cnt = 0;
 
 static int my_parser(struct lxc_arguments* args, int c, char* arg)
 {
 	switch (c) {
-	case 'd':
-		if (lxc_safe_int(arg, &delay) < 0)
+	case 'd': {
+		char *end;
+
+		errno = 0;
+		delay = strtod(arg, &end);
+		if (errno || end == arg || *end || delay < 0.1)
 			return -1;
 		break;
+	}
 	case 's':
 		sort_by = arg[0];
 		break;
@@ -101,10 +122,11 @@ static struct lxc_arguments my_args = {
 lxc-top monitors the state of the active containers\n\
 \n\
 Options :\n\
-  -d, --delay     delay in seconds between refreshes (default: 3.0)\n\
+  -d, --delay     delay in seconds between refreshes, at least 0.1\n\
+                  (default: 3.0)\n\
   -s, --sort      sort by [n,c,b,m] (default: n) where\n\
                   n = Name\n\
-                  c = CPU use\n\
+                  c = CPU use since the last refresh\n\
                   b = Block I/O use\n\
                   m = Memory use\n\
                   k = Kernel memory use\n\
@@ -265,39 +287,91 @@ out:
 	return val;
 }
 
-static void stats_get(struct lxc_container *c, struct ct *ct, struct stats *total)
+/* Fallback for cgroup drivers that don't allow direct access to the
+ * container's cgroups.
+ */
+static void stats_get_items(struct lxc_container *c, struct stats *stats)
 {
-	ct->c = c;
-	ct->stats->mem_used      = stat_get_int(c, "memory.usage_in_bytes");
-	ct->stats->mem_limit     = stat_get_int(c, "memory.limit_in_bytes");
-	ct->stats->kmem_used     = stat_get_int(c, "memory.kmem.usage_in_bytes");
-	ct->stats->kmem_limit    = stat_get_int(c, "memory.kmem.limit_in_bytes");
-	ct->stats->cpu_use_nanos = stat_get_int(c, "cpuacct.usage");
-	ct->stats->cpu_use_user  = stat_match_get_int(c, "cpuacct.stat", "user", 1);
-	ct->stats->cpu_use_sys   = stat_match_get_int(c, "cpuacct.stat", "system", 1);
-	ct->stats->blkio         = stat_match_get_int(c, "blkio.throttle.io_service_bytes", "Total", 1);
+	stats->mem_used      = stat_get_int(c, "memory.usage_in_bytes");
+	stats->mem_limit     = stat_get_int(c, "memory.limit_in_bytes");
+	stats->kmem_used     = stat_get_int(c, "memory.kmem.usage_in_bytes");
+	stats->kmem_limit    = stat_get_int(c, "memory.kmem.limit_in_bytes");
+	stats->cpu_use_nanos = stat_get_int(c, "cpuacct.usage");
+	stats->cpu_use_user  = stat_match_get_int(c, "cpuacct.stat", "user", 1) * (1000000000 / USER_HZ);
+	stats->cpu_use_sys   = stat_match_get_int(c, "cpuacct.stat", "system", 1) * (1000000000 / USER_HZ);
+	stats->blkio         = stat_match_get_int(c, "blkio.throttle.io_service_bytes", "Total", 1);
+}
+
+static int64_t timespec_diff_nsec(const struct timespec *start,
+				  const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+	       (end->tv_nsec - start->tv_nsec);
+}
+
+static void stats_get(struct ct *ct, struct stats *total)
+{
+	int64_t elapsed;
+	struct timespec now;
+	struct lxc_cgroup_stats cgstats;
+	uint64_t prev_cpu = ct->stats.cpu_use_nanos;
+
+	/* Resolving the cgroup paths costs a command round-trip per
+	 * hierarchy so it is only done once per container.
+	 */
+	if (!ct->h && !ct->c) {
+		ct->h = cgroup_stats_open(ct->name, my_args.lxcpath[0]);
+		if (!ct->h)
+			ct->c = lxc_container_new(ct->name, my_args.lxcpath[0]);
+	}
+
+	if (ct->c) {
+		stats_get_items(ct->c, &ct->stats);
+	} else if (ct->h) {
+		if (cgroup_stats_read(ct->h, &cgstats) < 0)
+			memset(&cgstats, 0, sizeof(cgstats));
+
+		ct->stats.mem_used      = cgstats.mem_used;
+		ct->stats.mem_limit     = cgstats.mem_limit;
+		ct->stats.kmem_used     = cgstats.kmem_used;
+		ct->stats.kmem_limit    = cgstats.kmem_limit;
+		ct->stats.cpu_use_nanos = cgstats.cpu_use_nanos;
+		ct->stats.cpu_use_user  = cgstats.cpu_user_nanos;
+		ct->stats.cpu_use_sys   = cgstats.cpu_sys_nanos;
+		ct->stats.blkio         = cgstats.io_read_bytes + cgstats.io_write_bytes;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ct->stats.cpu_pct = 0;
+	if (ct->sampled.tv_sec || ct->sampled.tv_nsec) {
+		elapsed = timespec_diff_nsec(&ct->sampled, &now);
+		if (elapsed > 0 && ct->stats.cpu_use_nanos >= prev_cpu)
+			ct->stats.cpu_pct = (double)(ct->stats.cpu_use_nanos - prev_cpu) * 100 / elapsed;
+	}
+	ct->sampled = now;
 
 	if (total) {
-		total->mem_used      = total->mem_used      + ct->stats->mem_used;
-		total->mem_limit     = total->mem_limit     + ct->stats->mem_limit;
-		total->kmem_used     = total->kmem_used     + ct->stats->kmem_used;
-		total->kmem_limit    = total->kmem_limit    + ct->stats->kmem_limit;
-		total->cpu_use_nanos = total->cpu_use_nanos + ct->stats->cpu_use_nanos;
-		total->cpu_use_user  = total->cpu_use_user  + ct->stats->cpu_use_user;
-		total->cpu_use_sys   = total->cpu_use_sys   + ct->stats->cpu_use_sys;
-		total->blkio         = total->blkio         + ct->stats->blkio;
+		total->mem_used      = total->mem_used      + ct->stats.mem_used;
+		total->mem_limit     = total->mem_limit     + ct->stats.mem_limit;
+		total->kmem_used     = total->kmem_used     + ct->stats.kmem_used;
+		total->kmem_limit    = total->kmem_limit    + ct->stats.kmem_limit;
+		total->cpu_use_nanos = total->cpu_use_nanos + ct->stats.cpu_use_nanos;
+		total->cpu_use_user  = total->cpu_use_user  + ct->stats.cpu_use_user;
+		total->cpu_use_sys   = total->cpu_use_sys   + ct->stats.cpu_use_sys;
+		total->blkio         = total->blkio         + ct->stats.blkio;
+		total->cpu_pct       = total->cpu_pct       + ct->stats.cpu_pct;
 	}
 }
 
 static void stats_print_header(struct stats *stats)
 {
 	printf(TERMRVRS TERMBOLD);
-	printf("%-18s %12s %12s %12s %14s %10s", "Container", "CPU",  "CPU",  "CPU",  "BlkIO", "Mem");
+	printf("%-18s %7s %12s %12s %12s %14s %10s", "Container", "CPU", "CPU",  "CPU",  "CPU",  "BlkIO", "Mem");
 	if (stats->kmem_used > 0)
 		printf(" %10s", "KMem");
 	printf("\n");
 
-	printf("%-18s %12s %12s %12s %14s %10s", "Name",      "Used", "Sys",  "User", "Total", "Used");
+	printf("%-18s %7s %12s %12s %12s %14s %10s", "Name",      "%",   "Used", "Sys",  "User", "Total", "Used");
 	if (stats->kmem_used > 0)
 		printf(" %10s", "Used");
 	printf("\n");
@@ -314,11 +388,12 @@ static void stats_print(const char *name, const struct stats *stats,
 	size_humanize(stats->blkio, blkio_str, sizeof(blkio_str));
 	size_humanize(stats->mem_used, mem_used_str, sizeof(mem_used_str));
 
-	printf("%-18.18s %12.2f %12.2f %12.2f %14s %10s",
+	printf("%-18.18s %7.1f %12.2f %12.2f %12.2f %14s %10s",
 	       name,
+	       stats->cpu_pct,
 	       (float)stats->cpu_use_nanos / 1000000000,
-	       (float)stats->cpu_use_sys  / USER_HZ,
-	       (float)stats->cpu_use_user / USER_HZ,
+	       (float)stats->cpu_use_sys  / 1000000000,
+	       (float)stats->cpu_use_user / 1000000000,
 	       blkio_str,
 	       mem_used_str);
 	if (total->kmem_used > 0) {
@@ -333,8 +408,8 @@ static int cmp_name(const void *sct1, const void *sct2)
 	const struct ct *ct2 = sct2;
 
 	if (sort_reverse)
-		return strcmp(ct2->c->name, ct1->c->name);
-	return strcmp(ct1->c->name, ct2->c->name);
+		return strcmp(ct2->name, ct1->name);
+	return strcmp(ct1->name, ct2->name);
 }
 
 static int cmp_cpuuse(const void *sct1, const void *sct2)
@@ -343,8 +418,8 @@ static int cmp_cpuuse(const void *sct1, const void *sct2)
 	const struct ct *ct2 = sct2;
 
 	if (sort_reverse)
-		return ct2->stats->cpu_use_nanos < ct1->stats->cpu_use_nanos;
-	return ct1->stats->cpu_use_nanos < ct2->stats->cpu_use_nanos;
+		return ct2->stats.cpu_pct < ct1->stats.cpu_pct;
+	return ct1->stats.cpu_pct < ct2->stats.cpu_pct;
 }
 
 static int cmp_blkio(const void *sct1, const void *sct2)
@@ -353,8 +428,8 @@ static int cmp_blkio(const void *sct1, const void *sct2)
 	const struct ct *ct2 = sct2;
 
 	if (sort_reverse)
-		return ct2->stats->blkio < ct1->stats->blkio;
-	return ct1->stats->blkio < ct2->stats->blkio;
+		return ct2->stats.blkio < ct1->stats.blkio;
+	return ct1->stats.blkio < ct2->stats.blkio;
 }
 
 static int cmp_memory(const void *sct1, const void *sct2)
@@ -363,8 +438,8 @@ static int cmp_memory(const void *sct1, const void *sct2)
 	const struct ct *ct2 = sct2;
 
 	if (sort_reverse)
-		return ct2->stats->mem_used < ct1->stats->mem_used;
-	return ct1->stats->mem_used < ct2->stats->mem_used;
+		return ct2->stats.mem_used < ct1->stats.mem_used;
+	return ct1->stats.mem_used < ct2->stats.mem_used;
 }
 
 static int cmp_kmemory(const void *sct1, const void *sct2)
@@ -373,8 +448,8 @@ static int cmp_kmemory(const void *sct1, const void *sct2)
 	const struct ct *ct2 = sct2;
 
 	if (sort_reverse)
-		return ct2->stats->kmem_used < ct1->stats->kmem_used;
-	return ct1->stats->kmem_used < ct2->stats->kmem_used;
+		return ct2->stats.kmem_used < ct1->stats.kmem_used;
+	return ct1->stats.kmem_used < ct2->stats.kmem_used;
 }
 
 static void ct_sort(int active)
@@ -392,40 +467,171 @@ static void ct_sort(int active)
 	qsort(ct, active, sizeof(*ct), (int (*)(const void *,const void *))cmp_func);
 }
 
-static void ct_free(void)
+static int ct_find(const char *name)
 {
 	int i;
 
-	for (i = 0; i < ct_alloc_cnt; i++) {
-		if (ct[i].c) {
-			lxc_container_put(ct[i].c);
-			ct[i].c = NULL;
-		}
-		free(ct[i].stats);
-		ct[i].stats = NULL;
-	}
+	for (i = 0; i < ct_cnt; i++)
+		if (strcmp(ct[i].name, name) == 0)
+			return i;
+
+	return -1;
 }
 
-static void ct_realloc(int active_cnt)
+static void ct_add(const char *name)
 {
-	int i;
+	struct ct *new;
+
+	if (ct_find(name) >= 0)
+		return;
 
-	if (active_cnt > ct_alloc_cnt) {
-		ct_free();
-		ct = realloc(ct, sizeof(*ct) * active_cnt);
-		if (!ct) {
+	if (ct_cnt == ct_alloc_cnt) {
+		int alloc_cnt = ct_alloc_cnt ? ct_alloc_cnt * 2 : 64;
+
+		new = realloc(ct, sizeof(*ct) * alloc_cnt);
+		if (!new) {
 			fprintf(stderr, "cannot alloc mem\n");
 			exit(EXIT_FAILURE);
 		}
-		for (i = 0; i < active_cnt; i++) {
-			ct[i].stats = malloc(sizeof(*ct[0].stats));
-			if (!ct[i].stats) {
-				fprintf(stderr, "cannot alloc mem\n");
-				exit(EXIT_FAILURE);
-			}
-		}
-		ct_alloc_cnt = active_cnt;
+		ct = new;
+		ct_alloc_cnt = alloc_cnt;
 	}
+
+	new = &ct[ct_cnt];
+	memset(new, 0, sizeof(*new));
+	new->name = strdup(name);
+	if (!new->name) {
+		fprintf(stderr, "cannot alloc mem\n");
+		exit(EXIT_FAILURE);
+	}
+	ct_cnt++;
+}
+
+static void ct_del(int i)
+{
+	cgroup_stats_close(ct[i].h);
+	if (ct[i].c)
+		lxc_container_put(ct[i].c);
+	free(ct[i].name);
+
+	ct[i] = ct[--ct_cnt];
+}
+
+/* Make the table match @names. */
+static void ct_sync(char **names, int cnt)
+{
+	int i, j;
+
+	for (i = 0; i < ct_cnt;) {
+		for (j = 0; j < cnt; j++)
+			if (strcmp(ct[i].name, names[j]) == 0)
+				break;
+
+		if (j == cnt)
+			ct_del(i);
+		else
+			i++;
+	}
+
+	for (j = 0; j < cnt; j++)
+		ct_add(names[j]);
+}
+
+static void ct_list_active(void)
+{
+	int i, cnt;
+	char **names;
+
+	cnt = list_active_containers(my_args.lxcpath[0], &names, NULL);
+	if (cnt < 0)
+		return;
+
+	ct_sync(names, cnt);
+
+	for (i = 0; i < cnt; i++)
+		free(names[i]);
+	free(names);
+}
+
+/* Without lxc-monitord the list of active containers is refreshed on every
+ * update instead.
+ */
+static int monitor_fd = -EBADF;
+
+static int monitor_handler(int fd, uint32_t events, void *data,
+			   struct lxc_epoll_descr *descr)
+{
+	int i, ret;
+	struct lxc_msg msg;
+
+	ret = lxc_monitor_read_timeout(fd, &msg, 0);
+	if (ret == -2)
+		return 0;
+
+	if (ret <= 0) {
+		lxc_mainloop_del_handler(descr, fd);
+		close(fd);
+		monitor_fd = -EBADF;
+		return LXC_MAINLOOP_CLOSE;
+	}
+
+	if (msg.type != lxc_msg_state)
+		return 0;
+
+	msg.name[sizeof(msg.name) - 1] = '\0';
+	switch (msg.value) {
+	case RUNNING:
+	case FREEZING:
+	case FROZEN:
+	case THAWED:
+		ct_add(msg.name);
+		break;
+	case STOPPED:
+		i = ct_find(msg.name);
+		if (i >= 0)
+			ct_del(i);
+		break;
+	default:
+		break;
+	}
+
+	/* Let the caller check whether the next refresh is due. */
+	return LXC_MAINLOOP_CLOSE;
+}
+
+static void ct_free(void)
+{
+	while (ct_cnt > 0)
+		ct_del(ct_cnt - 1);
+	free(ct);
+	ct = NULL;
+	ct_alloc_cnt = 0;
+}
+
+static void ct_print(int ct_print_cnt)
+{
+	int i;
+	struct stats total;
+	char total_name[30];
+
+	if (monitor_fd < 0)
+		ct_list_active();
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < ct_cnt; i++)
+		stats_get(&ct[i], &total);
+
+	ct_sort(ct_cnt);
+
+	printf(TERMCLEAR);
+	stats_print_header(&total);
+	for (i = 0; i < ct_cnt && i < ct_print_cnt; i++) {
+		stats_print(ct[i].name, &ct[i].stats, &total);
+		printf("\n");
+	}
+	sprintf(total_name, "TOTAL %d of %d", i, ct_cnt);
+	stats_print(total_name, &total, &total);
+	fflush(stdout);
 }
 
 int main(int argc, char *argv[])
@@ -433,6 +639,7 @@ int main(int argc, char *argv[])
 	struct lxc_epoll_descr descr;
 	int ret, ct_print_cnt;
 	char in_char;
+	struct timespec next, now;
 
 	ret = EXIT_FAILURE;
 	if (lxc_arguments_parse(&my_args, argc, argv))
@@ -461,41 +668,48 @@ int main(int argc, char *argv[])
 		goto err1;
 	}
 
-	for(;;) {
-		struct lxc_container **active;
-		int i, active_cnt;
-		struct stats total;
-		char total_name[30];
-
-		active_cnt = list_active_containers(my_args.lxcpath[0], NULL, &active);
-		ct_realloc(active_cnt);
-
-		memset(&total, 0, sizeof(total));
-		for (i = 0; i < active_cnt; i++)
-			stats_get(active[i], &ct[i], &total);
-
-		ct_sort(active_cnt);
-
-		printf(TERMCLEAR);
-		stats_print_header(&total);
-		for (i = 0; i < active_cnt && i < ct_print_cnt; i++) {
-			stats_print(ct[i].c->name, ct[i].stats, &total);
-			printf("\n");
+	/* Subscribe before listing so no container that starts in between is
+	 * missed.
+	 */
+	lxc_monitord_spawn(my_args.lxcpath[0]);
+	monitor_fd = lxc_monitor_open(my_args.lxcpath[0]);
+	if (monitor_fd >= 0) {
+		ret = lxc_mainloop_add_handler(&descr, monitor_fd,
+					       monitor_handler, NULL);
+		if (ret) {
+			close(monitor_fd);
+			monitor_fd = -EBADF;
 		}
-		sprintf(total_name, "TOTAL %d of %d", i, active_cnt);
-		stats_print(total_name, &total, &total);
-		fflush(stdout);
+		ct_list_active();
+	}
 
-		for (i = 0; i < active_cnt; i++) {
-			lxc_container_put(ct[i].c);
-			ct[i].c = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for(;;) {
+		int64_t timeout;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = timespec_diff_nsec(&now, &next) / 1000000;
+		if (timeout <= 0) {
+			ct_print(ct_print_cnt);
+
+			next = now;
+			next.tv_sec += (time_t)delay;
+			next.tv_nsec += (long)((delay - (time_t)delay) * 1000000000);
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+			timeout = delay * 1000;
 		}
 
 		in_char = '\0';
-		ret = lxc_mainloop(&descr, 1000 * delay);
+		ret = lxc_mainloop(&descr, timeout);
 		if (ret != 0 || in_char == 'q')
 			break;
 		switch(in_char) {
+		case '\0':
+			/* Timeout or monitor event. */
+			continue;
 		case 'r':
 			sort_reverse ^= 1;
 			break;
@@ -510,11 +724,15 @@ int main(int argc, char *argv[])
 				sort_reverse = 0;
 			sort_by = in_char;
 		}
+
+		/* Redraw right away with the new sort order. */
+		next = now;
 	}
 	ret = EXIT_SUCCESS;
 
 err1:
 	lxc_mainloop_close(&descr);
+	ct_free();
 out:
 	exit(ret);
 }
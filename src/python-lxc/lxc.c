@@ -28,6 +28,7 @@
 #include "lxc/utils.h"
 #include "lxc/namespace.h"
 #include "lxc/confile.h"
+#include "lxc/cgroups/cgroup_stats.h"
 #include <stdio.h>
 #include <sys/wait.h>
 
@@ -110,6 +111,49 @@ error:
     return NULL;
 }
 
+/* Convert a NULL-terminated array of strings returned by liblxc into a tuple
+ * and free the array.
+ */
+static PyObject *
+convert_char_pointer_array_to_tuple(char **array)
+{
+    int i = 0;
+    PyObject *ret;
+
+    if (!array)
+        return PyTuple_New(0);
+
+    /* Count the entries */
+    while (array[i])
+        i++;
+
+    /* Create the new tuple */
+    ret = PyTuple_New(i);
+
+    /* Add the entries to the tuple */
+    i = 0;
+    while (ret && array[i]) {
+        PyObject *unicode = PyUnicode_FromString(array[i]);
+        if (!unicode) {
+            Py_DECREF(ret);
+            ret = NULL;
+            break;
+        }
+        PyTuple_SET_ITEM(ret, i, unicode);
+        i++;
+    }
+
+    /* Free the array */
+    i = 0;
+    while (array[i]) {
+        free(array[i]);
+        i++;
+    }
+    free(array);
+
+    return ret;
+}
+
 struct lxc_attach_python_payload {
     PyObject *fn;
     PyObject *arg;
@@ -363,6 +407,104 @@ LXC_get_version(PyObject *self, PyObject *args)
     return PyUnicode_FromString(rv);
 }
 
+/* State of a container gathered by list_containers(details=True). */
+struct lxc_python_container_info {
+    const char *state;
+    pid_t init_pid;
+    bool have_stats;
+    struct lxc_cgroup_stats stats;
+};
+
+/* Called without the GIL. */
+static void
+lxc_get_container_info(const char *name, const char *config_path,
+                       struct lxc_python_container_info *info)
+{
+    struct lxc_container *c;
+    struct cgroup_stats_handle *h;
+
+    memset(info, 0, sizeof(*info));
+    info->init_pid = -1;
+
+    c = lxc_container_new(name, config_path);
+    if (!c)
+        return;
+
+    info->state = c->state(c);
+    if (!info->state || strcmp(info->state, "STOPPED") == 0)
+        goto out;
+
+    info->init_pid = c->init_pid(c);
+
+    h = cgroup_stats_open(c->name, c->config_path);
+    if (h) {
+        info->have_stats = cgroup_stats_read(h, &info->stats) == 0;
+        cgroup_stats_close(h);
+    }
+
+out:
+    lxc_container_put(c);
+}
+
+static PyObject *
+lxc_container_info_to_dict(const char *name,
+                           struct lxc_python_container_info *info)
+{
+    PyObject *dict, *stats;
+
+    dict = Py_BuildValue("{s:s,s:z,s:i}", "name", name, "state", info->state,
+                         "init_pid", (int)info->init_pid);
+    if (!dict)
+        return NULL;
+
+    if (!info->have_stats) {
+        if (PyDict_SetItemString(dict, "stats", Py_None) < 0)
+            goto on_error;
+
+        return dict;
+    }
+
+    stats = PyDict_New();
+    if (!stats)
+        goto on_error;
+
+    #define PYLXC_SET_STAT(group, member)                                   \
+        if (info->stats.valid & LXC_CGROUP_STATS_##group) {                 \
+            PyObject *v = PyLong_FromUnsignedLongLong(info->stats.member);  \
+            if (!v || PyDict_SetItemString(stats, #member, v) < 0) {        \
+                Py_XDECREF(v);                                              \
+                Py_DECREF(stats);                                           \
+                goto on_error;                                              \
+            }                                                               \
+            Py_DECREF(v);                                                   \
+        }
+
+    PYLXC_SET_STAT(CPU, cpu_use_nanos);
+    PYLXC_SET_STAT(CPU, cpu_user_nanos);
+    PYLXC_SET_STAT(CPU, cpu_sys_nanos);
+    PYLXC_SET_STAT(MEM, mem_used);
+    PYLXC_SET_STAT(MEM, mem_limit);
+    PYLXC_SET_STAT(KMEM, kmem_used);
+    PYLXC_SET_STAT(KMEM, kmem_limit);
+    PYLXC_SET_STAT(IO, io_read_bytes);
+    PYLXC_SET_STAT(IO, io_write_bytes);
+    PYLXC_SET_STAT(PIDS, pids_current);
+
+    #undef PYLXC_SET_STAT
+
+    if (PyDict_SetItemString(dict, "stats", stats) < 0) {
+        Py_DECREF(stats);
+        goto on_error;
+    }
+    Py_DECREF(stats);
+
+    return dict;
+
+on_error:
+    Py_DECREF(dict);
+    return NULL;
+}
+
 static PyObject *
 LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
 {
@@ -372,20 +514,23 @@ LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
 
     int list_active = 1;
     int list_defined = 1;
+    int details = 0;
 
     PyObject *py_list_active = NULL;
     PyObject *py_list_defined = NULL;
+    PyObject *py_details = NULL;
 
     char* config_path = NULL;
+    struct lxc_python_container_info *infos = NULL;
 
     int i = 0;
-    PyObject *vargs = NULL;
-    static char *kwlist[] = {"active", "defined", "config_path", NULL};
+    static char *kwlist[] = {"active", "defined", "config_path", "details",
+                             NULL};
 
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|OOs", kwlist,
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|OOsO", kwlist,
                                       &py_list_active,
                                       &py_list_defined,
-                                      &config_path, &vargs))
+                                      &config_path, &py_details))
         return NULL;
 
     /* We default to listing everything */
@@ -397,7 +542,15 @@ LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
         list_defined = 0;
     }
 
-    /* Call the right API function based on filters */
+    if (py_details && py_details == Py_True) {
+        details = 1;
+    }
+
+    /* Call the right API function based on filters and gather the state of
+     * every container in the same pass so that callers don't need one
+     * round-trip per container and attribute.
+     */
+    Py_BEGIN_ALLOW_THREADS
     if (list_active == 1 && list_defined == 1)
         list_count = list_all_containers(config_path, &names, NULL);
     else if (list_active == 1)
@@ -405,23 +558,50 @@ LXC_list_containers(PyObject *self, PyObject *args, PyObject *kwds)
     else if (list_defined == 1)
         list_count = list_defined_containers(config_path, &names, NULL);
 
+    if (details && list_count > 0) {
+        infos = calloc(list_count, sizeof(*infos));
+        for (i = 0; infos && i < list_count; i++)
+            lxc_get_container_info(names[i], config_path, &infos[i]);
+    }
+    Py_END_ALLOW_THREADS
+
     /* Handle failure */
     if (list_count < 0) {
         PyErr_SetString(PyExc_ValueError, "failure to list containers");
         return NULL;
     }
 
+    if (details && list_count > 0 && !infos) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
     /* Generate the tuple */
     list = PyTuple_New(list_count);
-    for (i = 0; i < list_count; i++) {
+    for (i = 0; list && i < list_count; i++) {
+        PyObject *entry;
+
         if (!names[i]) {
             continue;
         }
 
-        PyTuple_SET_ITEM(list, i, PyUnicode_FromString(names[i]));
-        free(names[i]);
+        if (details)
+            entry = lxc_container_info_to_dict(names[i], &infos[i]);
+        else
+            entry = PyUnicode_FromString(names[i]);
+        if (!entry) {
+            Py_CLEAR(list);
+            break;
+        }
+
+        PyTuple_SET_ITEM(list, i, entry);
     }
+
+out:
+    for (i = 0; i < list_count; i++)
+        free(names[i]);
     free(names);
+    free(infos);
 
     return list;
 }
@@ -517,7 +697,13 @@ Container_defined(Container *self, void *closure)
 static PyObject *
 Container_init_pid(Container *self, void *closure)
 {
-    return PyLong_FromLong(self->container->init_pid(self->container));
+    pid_t pid;
+
+    Py_BEGIN_ALLOW_THREADS
+    pid = self->container->init_pid(self->container);
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromLong(pid);
 }
 
 static PyObject *
@@ -533,7 +719,13 @@ Container_name(Container *self, void *closure)
 static PyObject *
 Container_running(Container *self, void *closure)
 {
-    if (self->container->is_running(self->container)) {
+    bool running;
+
+    Py_BEGIN_ALLOW_THREADS
+    running = self->container->is_running(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (running) {
         Py_RETURN_TRUE;
     }
 
@@ -545,7 +737,9 @@ Container_state(Container *self, void *closure)
 {
     const char *rv = NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     rv = self->container->state(self->container);
+    Py_END_ALLOW_THREADS
 
     if (!rv) {
         return PyUnicode_FromString("");
@@ -563,6 +757,7 @@ Container_attach_interface(Container *self, PyObject *args, PyObject *kwds)
     char *dst_name = NULL;
     PyObject *py_src_name = NULL;
     PyObject *py_dst_name = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|O&", kwlist,
                                       PyUnicode_FSConverter, &py_src_name,
@@ -579,7 +774,11 @@ Container_attach_interface(Container *self, PyObject *args, PyObject *kwds)
         assert(dst_name != NULL);
     }
 
-    if (self->container->attach_interface(self->container, src_name, dst_name)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->attach_interface(self->container, src_name, dst_name);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_src_name);
         Py_XDECREF(py_dst_name);
         Py_RETURN_TRUE;
@@ -596,6 +795,7 @@ Container_detach_interface(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"ifname", NULL};
     char *ifname = NULL;
     PyObject *py_ifname = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist,
                                       PyUnicode_FSConverter, &py_ifname))
@@ -606,7 +806,11 @@ Container_detach_interface(Container *self, PyObject *args, PyObject *kwds)
         assert(ifname != NULL);
     }
 
-    if (self->container->detach_interface(self->container, ifname, NULL)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->detach_interface(self->container, ifname, NULL);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_ifname);
         Py_RETURN_TRUE;
     }
@@ -623,6 +827,7 @@ Container_add_device_node(Container *self, PyObject *args, PyObject *kwds)
     char *dst_path = NULL;
     PyObject *py_src_path = NULL;
     PyObject *py_dst_path = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|O&", kwlist,
                                       PyUnicode_FSConverter, &py_src_path,
@@ -639,8 +844,12 @@ Container_add_device_node(Container *self, PyObject *args, PyObject *kwds)
         assert(dst_path != NULL);
     }
 
-    if (self->container->add_device_node(self->container, src_path,
-                                         dst_path)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->add_device_node(self->container, src_path,
+                                           dst_path);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_src_path);
         Py_XDECREF(py_dst_path);
         Py_RETURN_TRUE;
@@ -671,6 +880,9 @@ Container_attach_and_possibly_wait(Container *self, PyObject *args,
     if (!options)
         return NULL;
 
+    /* Keep the GIL across attach() itself: the forked child runs the Python
+     * payload and needs to inherit it.
+     */
     ret = self->container->attach(self->container, lxc_attach_python_exec,
                                   &payload, options, &pid);
     if (ret < 0)
@@ -772,9 +984,11 @@ Container_clone(Container *self, PyObject *args, PyObject *kwds)
         assert(config_path != NULL);
     }
 
+    Py_BEGIN_ALLOW_THREADS
     new_container = self->container->clone(self->container, newname,
                                            config_path, flags, bdevtype,
                                            bdevdata, newsize, hookargs);
+    Py_END_ALLOW_THREADS
 
     Py_XDECREF(py_config_path);
 
@@ -799,14 +1013,19 @@ Container_console(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"ttynum", "stdinfd", "stdoutfd", "stderrfd",
                              "escape", NULL};
     int ttynum = -1, stdinfd = 0, stdoutfd = 1, stderrfd = 2, escape = 1;
+    int ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|iiiii", kwlist,
                                       &ttynum, &stdinfd, &stdoutfd, &stderrfd,
                                       &escape))
         return NULL;
 
-    if (self->container->console(self->container, ttynum,
-            stdinfd, stdoutfd, stderrfd, escape) == 0) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->console(self->container, ttynum,
+            stdinfd, stdoutfd, stderrfd, escape);
+    Py_END_ALLOW_THREADS
+
+    if (ret == 0) {
         Py_RETURN_TRUE;
     }
     Py_RETURN_FALSE;
@@ -817,12 +1036,17 @@ Container_console_getfd(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"ttynum", NULL};
     int ttynum = -1, masterfd;
+    int ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &ttynum))
         return NULL;
 
-    if (self->container->console_getfd(self->container, &ttynum,
-                                       &masterfd) < 0) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->console_getfd(self->container, &ttynum,
+                                         &masterfd);
+    Py_END_ALLOW_THREADS
+
+    if (ret < 0) {
         PyErr_SetString(PyExc_ValueError, "Unable to allocate tty");
         return NULL;
     }
@@ -839,6 +1063,7 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
     PyObject *vargs = NULL;
     char *bdevtype = NULL;
     int i = 0;
+    bool ret;
     static char *kwlist[] = {"template", "flags", "bdevtype", "args", NULL};
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|sisO", kwlist,
                                       &template_name, &flags, &bdevtype, &vargs))
@@ -857,8 +1082,12 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
         }
     }
 
-    if (self->container->create(self->container, template_name, bdevtype, NULL,
-                                flags, create_args))
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->create(self->container, template_name, bdevtype,
+                                  NULL, flags, create_args);
+    Py_END_ALLOW_THREADS
+
+    if (ret)
         retval = Py_True;
     else
         retval = Py_False;
@@ -879,7 +1108,13 @@ Container_create(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_destroy(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->destroy(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->destroy(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -889,7 +1124,13 @@ Container_destroy(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_freeze(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->freeze(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->freeze(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -901,7 +1142,7 @@ Container_get_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"key", NULL};
     char* key = NULL;
-    int len = 0;
+    int len = 0, ret_len;
     char* value;
     PyObject *ret = NULL;
 
@@ -909,7 +1150,9 @@ Container_get_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
                                       &key))
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     len = self->container->get_cgroup_item(self->container, key, NULL, 0);
+    Py_END_ALLOW_THREADS
 
     if (len < 0) {
         PyErr_SetString(PyExc_KeyError, "Invalid cgroup entry");
@@ -920,8 +1163,12 @@ Container_get_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
     if (value == NULL)
         return PyErr_NoMemory();
 
-    if (self->container->get_cgroup_item(self->container,
-                                            key, value, len + 1) != len) {
+    Py_BEGIN_ALLOW_THREADS
+    ret_len = self->container->get_cgroup_item(self->container, key, value,
+                                               len + 1);
+    Py_END_ALLOW_THREADS
+
+    if (ret_len != len) {
         PyErr_SetString(PyExc_ValueError, "Unable to read config value");
         free(value);
         return NULL;
@@ -1025,52 +1272,14 @@ Container_get_keys(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_get_interfaces(Container *self)
 {
-    int i = 0;
     char** interfaces = NULL;
 
-    PyObject* ret;
-
     /* Get the interfaces */
+    Py_BEGIN_ALLOW_THREADS
     interfaces = self->container->get_interfaces(self->container);
-    if (!interfaces)
-        return PyTuple_New(0);
-
-    /* Count the entries */
-    while (interfaces[i])
-        i++;
-
-    /* Create the new tuple */
-    ret = PyTuple_New(i);
-    if (!ret)
-        return NULL;
-
-    /* Add the entries to the tuple and free the memory */
-    i = 0;
-    while (interfaces[i]) {
-        if (!interfaces[i]) {
-            i++;
-            continue;
-        }
+    Py_END_ALLOW_THREADS
 
-        PyObject *unicode = PyUnicode_FromString(interfaces[i]);
-        if (!unicode) {
-            Py_DECREF(ret);
-            ret = NULL;
-            break;
-        }
-        PyTuple_SET_ITEM(ret, i, unicode);
-        i++;
-    }
-
-    /* Free the list of IPs */
-    i = 0;
-    while (interfaces[i]) {
-        free(interfaces[i]);
-        i++;
-    }
-    free(interfaces);
-
-    return ret;
+    return convert_char_pointer_array_to_tuple(interfaces);
 }
 
 static PyObject *
@@ -1081,56 +1290,18 @@ Container_get_ips(Container *self, PyObject *args, PyObject *kwds)
     char* family = NULL;
     int scope = 0;
 
-    int i = 0;
     char** ips = NULL;
 
-    PyObject* ret;
-
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ssi", kwlist,
                                       &interface, &family, &scope))
         return NULL;
 
     /* Get the IPs */
+    Py_BEGIN_ALLOW_THREADS
     ips = self->container->get_ips(self->container, interface, family, scope);
-    if (!ips)
-        return PyTuple_New(0);
-
-    /* Count the entries */
-    while (ips[i])
-        i++;
-
-    /* Create the new tuple */
-    ret = PyTuple_New(i);
-    if (!ret)
-        return NULL;
-
-    /* Add the entries to the tuple and free the memory */
-    i = 0;
-    while (ips[i]) {
-        if (!ips[i]) {
-            i++;
-            continue;
-        }
-
-        PyObject *unicode = PyUnicode_FromString(ips[i]);
-        if (!unicode) {
-            Py_DECREF(ret);
-            ret = NULL;
-            break;
-        }
-        PyTuple_SET_ITEM(ret, i, unicode);
-        i++;
-    }
-
-    /* Free the list of IPs */
-    i = 0;
-    while (ips[i]) {
-        free(ips[i]);
-        i++;
-    }
-    free(ips);
+    Py_END_ALLOW_THREADS
 
-    return ret;
+    return convert_char_pointer_array_to_tuple(ips);
 }
 
 static PyObject *
@@ -1185,7 +1356,13 @@ Container_load_config(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_reboot(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->reboot(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->reboot(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1197,12 +1374,17 @@ Container_rename(Container *self, PyObject *args, PyObject *kwds)
 {
     char *new_name = NULL;
     static char *kwlist[] = {"new_name", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist,
                                       &new_name))
         return NULL;
 
-    if (self->container->rename(self->container, new_name)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->rename(self->container, new_name);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1217,6 +1399,7 @@ Container_remove_device_node(Container *self, PyObject *args, PyObject *kwds)
     char *dst_path = NULL;
     PyObject *py_src_path = NULL;
     PyObject *py_dst_path = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|O&", kwlist,
                                       PyUnicode_FSConverter, &py_src_path,
@@ -1233,8 +1416,12 @@ Container_remove_device_node(Container *self, PyObject *args, PyObject *kwds)
         assert(dst_path != NULL);
     }
 
-    if (self->container->remove_device_node(self->container, src_path,
-                                            dst_path)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->remove_device_node(self->container, src_path,
+                                              dst_path);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_XDECREF(py_src_path);
         Py_XDECREF(py_dst_path);
         Py_RETURN_TRUE;
@@ -1276,12 +1463,17 @@ Container_set_cgroup_item(Container *self, PyObject *args, PyObject *kwds)
     static char *kwlist[] = {"key", "value", NULL};
     char *key = NULL;
     char *value = NULL;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "ss", kwlist,
                                       &key, &value))
         return NULL;
 
-    if (self->container->set_cgroup_item(self->container, key, value)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->set_cgroup_item(self->container, key, value);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1328,12 +1520,17 @@ Container_shutdown(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"timeout", NULL};
     int timeout = -1;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist,
                                       &timeout))
         return NULL;
 
-    if (self->container->shutdown(self->container, timeout)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->shutdown(self->container, timeout);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1359,7 +1556,9 @@ Container_snapshot(Container *self, PyObject *args, PyObject *kwds)
         assert(comment_path != NULL);
     }
 
+    Py_BEGIN_ALLOW_THREADS
     retval = self->container->snapshot(self->container, comment_path);
+    Py_END_ALLOW_THREADS
 
     Py_XDECREF(py_comment_path);
 
@@ -1380,12 +1579,17 @@ Container_snapshot_destroy(Container *self, PyObject *args, PyObject *kwds)
 {
     char *name = NULL;
     static char *kwlist[] = {"name", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist,
                                       &name))
         return NULL;
 
-    if (self->container->snapshot_destroy(self->container, name)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->snapshot_destroy(self->container, name);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1400,7 +1604,9 @@ Container_snapshot_list(Container *self, PyObject *args, PyObject *kwds)
     PyObject *list = NULL;
     int i = 0;
 
+    Py_BEGIN_ALLOW_THREADS
     snap_count = self->container->snapshot_list(self->container, &snap);
+    Py_END_ALLOW_THREADS
 
     if (snap_count < 0) {
         PyErr_SetString(PyExc_KeyError, "Unable to list snapshots");
@@ -1436,12 +1642,17 @@ Container_snapshot_restore(Container *self, PyObject *args, PyObject *kwds)
     char *name = NULL;
     char *newname = NULL;
     static char *kwlist[] = {"name", "newname", NULL};
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|s", kwlist,
                                       &name, &newname))
         return NULL;
 
-    if (self->container->snapshot_restore(self->container, name, newname)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->snapshot_restore(self->container, name, newname);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1460,6 +1671,7 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
 
     PyObject *retval = NULL;
     int init_useinit = 0, i = 0;
+    bool ret;
     static char *kwlist[] = {"useinit", "daemonize", "close_fds",
                              "cmd", NULL};
 
@@ -1493,7 +1705,11 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
         self->container->want_daemonize(self->container, false);
     }
 
-    if (self->container->start(self->container, init_useinit, init_args))
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->start(self->container, init_useinit, init_args);
+    Py_END_ALLOW_THREADS
+
+    if (ret)
         retval = Py_True;
     else
         retval = Py_False;
@@ -1514,7 +1730,13 @@ Container_start(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_stop(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->stop(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->stop(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1524,25 +1746,60 @@ Container_stop(Container *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Container_unfreeze(Container *self, PyObject *args, PyObject *kwds)
 {
-    if (self->container->unfreeze(self->container)) {
+    bool ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->unfreeze(self->container);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
     Py_RETURN_FALSE;
 }
 
+static PyObject *
+Container_wait_ips(Container *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"interface", "family", "scope", "timeout", NULL};
+    char* interface = NULL;
+    char* family = NULL;
+    int scope = 0;
+    int timeout = -1;
+
+    char** ips = NULL;
+
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|zzii", kwlist,
+                                      &interface, &family, &scope, &timeout))
+        return NULL;
+
+    /* Block until the monitor reports an address or the timeout expires */
+    Py_BEGIN_ALLOW_THREADS
+    ips = self->container->wait_ips(self->container, interface, family, scope,
+                                    timeout);
+    Py_END_ALLOW_THREADS
+
+    return convert_char_pointer_array_to_tuple(ips);
+}
+
 static PyObject *
 Container_wait(Container *self, PyObject *args, PyObject *kwds)
 {
     static char *kwlist[] = {"state", "timeout", NULL};
     char *state = NULL;
     int timeout = -1;
+    bool ret;
 
     if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|i", kwlist,
                                       &state, &timeout))
         return NULL;
 
-    if (self->container->wait(self->container, state, timeout)) {
+    Py_BEGIN_ALLOW_THREADS
+    ret = self->container->wait(self->container, state, timeout);
+    Py_END_ALLOW_THREADS
+
+    if (ret) {
         Py_RETURN_TRUE;
     }
 
@@ -1818,6 +2075,12 @@ static PyMethodDef Container_methods[] = {
      "\n"
      "Wait for the container to reach a given state or timeout."
     },
+    {"wait_ips", (PyCFunction)Container_wait_ips,
+     METH_VARARGS|METH_KEYWORDS,
+     "wait_ips(interface, family, scope, timeout = -1) -> tuple\n"
+     "\n"
+     "Wait until the container has an IP and return a tuple of its IPs."
+    },
     {NULL, NULL, 0, NULL}
 };
 
@@ -1879,7 +2142,9 @@ static PyMethodDef LXC_methods[] = {
      "Returns the current LXC library version"},
     {"list_containers", (PyCFunction)LXC_list_containers,
      METH_VARARGS|METH_KEYWORDS,
-     "Returns a list of container names or objects"},
+     "Returns a list of container names or, with details=True, of dicts "
+     "holding the name, state, init pid and cgroup statistics of each "
+     "container"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -26,7 +26,6 @@
 import _lxc
 import os
 import subprocess
-import time
 
 default_config_path = _lxc.get_global_config_item("lxc.lxcpath")
 get_global_config_item = _lxc.get_global_config_item
@@ -338,18 +337,23 @@ class Container(_lxc.Container):
         if scope:
             kwargs['scope'] = scope
 
-        ips = None
         timeout = int(os.environ.get('LXC_GETIP_TIMEOUT', timeout))
 
-        while not ips:
-            ips = _lxc.Container.get_ips(self, **kwargs)
-            if timeout == 0:
-                break
+        if timeout == 0:
+            return _lxc.Container.get_ips(self, **kwargs)
 
-            timeout -= 1
-            time.sleep(1)
+        return self.wait_ip(interface, family, scope, timeout)
 
-        return ips
+    def wait_ip(self, interface=None, family=None, scope=None, timeout=-1):
+        """
+            Wait until the container has an IP and return a tuple of its
+            IPs, or an empty tuple on timeout.
+            The container's monitor pushes address changes so this doesn't
+            poll. A negative timeout waits forever.
+        """
+
+        return _lxc.Container.wait_ips(self, interface, family, scope or 0,
+                                       timeout)
 
     def rename(self, new_name):
         """
@@ -418,9 +422,13 @@ class Container(_lxc.Container):
 
 
 def list_containers(active=True, defined=True,
-                    as_object=False, config_path=None):
+                    as_object=False, config_path=None, details=False):
     """
         List the containers on the system.
+        With details=True a dict with the name, state, init_pid and cgroup
+        stats of each container is returned instead of its name. All of it
+        is gathered in a single call. as_object then adds the Container
+        object under the "container" key.
     """
 
     if config_path:
@@ -428,16 +436,23 @@ def list_containers(active=True, defined=True,
             return tuple()
         try:
             entries = _lxc.list_containers(active=active, defined=defined,
-                                           config_path=config_path)
+                                           config_path=config_path,
+                                           details=details)
         except ValueError:
             return tuple()
     else:
         try:
-            entries = _lxc.list_containers(active=active, defined=defined)
+            entries = _lxc.list_containers(active=active, defined=defined,
+                                           details=details)
         except ValueError:
             return tuple()
 
-    if as_object:
+    if details:
+        if as_object:
+            for entry in entries:
+                entry['container'] = Container(entry['name'], config_path)
+        return entries
+    elif as_object:
         return tuple([Container(name, config_path) for name in entries])
     else:
         return entries
@@ -0,0 +1,221 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "lxctest.h"
+#include "storage/btrfs.h"
+#include "utils.h"
+
+static char root[] = "/tmp/lxc-test-btrfs-XXXXXX";
+static char mnt[sizeof(root) + 4];
+
+static bool have_btrfs(void)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	bool found = false;
+
+	f = fopen("/proc/filesystems", "re");
+	if (!f)
+		return false;
+
+	while (getline(&line, &len, f) != -1) {
+		if (strstr(line, "\tbtrfs\n")) {
+			found = true;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return found;
+}
+
+static void mksubvol(const char *name)
+{
+	int fd;
+	char path[MAXPATHLEN];
+	struct btrfs_ioctl_vol_args args;
+	const char *base;
+
+	snprintf(path, sizeof(path), "%s/%s", mnt, name);
+	base = strrchr(path, '/');
+	path[base - path] = '\0';
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	lxc_test_assert_abort(fd >= 0);
+
+	memset(&args, 0, sizeof(args));
+	snprintf(args.name, sizeof(args.name), "%s", base + 1);
+	lxc_test_assert_abort(ioctl(fd, BTRFS_IOC_SUBVOL_CREATE, &args) == 0);
+	close(fd);
+}
+
+static bool exists(const char *name)
+{
+	struct stat st;
+	char path[MAXPATHLEN];
+
+	snprintf(path, sizeof(path), "%s/%s", mnt, name);
+	return lstat(path, &st) == 0;
+}
+
+/*
+ * A rootfs subvolume with subvolumes nested four levels deep, one linked
+ * into a plain directory and enough siblings to keep several threads busy.
+ */
+static void mktree(const char *name)
+{
+	int i;
+	char path[MAXPATHLEN];
+
+	mksubvol(name);
+
+	snprintf(path, sizeof(path), "%s/a", name);
+	mksubvol(path);
+	snprintf(path, sizeof(path), "%s/a/b", name);
+	mksubvol(path);
+	snprintf(path, sizeof(path), "%s/a/b/c", name);
+	mksubvol(path);
+	snprintf(path, sizeof(path), "%s/a/b/c/d", name);
+	mksubvol(path);
+
+	snprintf(path, sizeof(path), "%s/%s/dir", mnt, name);
+	lxc_test_assert_abort(mkdir(path, 0755) == 0);
+	snprintf(path, sizeof(path), "%s/dir/e", name);
+	mksubvol(path);
+
+	for (i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "%s/s%d", name, i);
+		mksubvol(path);
+		snprintf(path, sizeof(path), "%s/s%d/t", name, i);
+		mksubvol(path);
+	}
+}
+
+static bool destroy(const char *name)
+{
+	char path[MAXPATHLEN];
+
+	snprintf(path, sizeof(path), "%s/%s", mnt, name);
+	return btrfs_try_remove_subvol(path);
+}
+
+/* Make destroying subvolumes by id fail with EPERM like it does for callers
+ * without CAP_SYS_ADMIN.
+ */
+static void deny_destroy_by_id(void)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_ioctl, 0, 3),
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[1])),
+#else
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[1]) + 4),
+#endif
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (__u32)BTRFS_IOC_SNAP_DESTROY_V2, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(filter) / sizeof(filter[0]),
+		.filter = filter,
+	};
+
+	lxc_test_assert_abort(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0);
+	lxc_test_assert_abort(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int status;
+	char img[sizeof(root) + 4], cmd[256];
+	pid_t pid;
+
+	if (geteuid() != 0) {
+		lxc_debug("%s\n", "Skipping: must be run as root");
+		exit(EXIT_SUCCESS);
+	}
+
+	if (!have_btrfs() &&
+	    (system("modprobe btrfs >/dev/null 2>&1") != 0 || !have_btrfs())) {
+		lxc_debug("%s\n", "Skipping: no btrfs support in the kernel");
+		exit(EXIT_SUCCESS);
+	}
+
+	lxc_test_assert_abort(mkdtemp(root));
+	snprintf(img, sizeof(img), "%s/img", root);
+	snprintf(mnt, sizeof(mnt), "%s/mnt", root);
+	lxc_test_assert_abort(mkdir(mnt, 0755) == 0);
+
+	snprintf(cmd, sizeof(cmd),
+		 "truncate -s 256M %s && mkfs.btrfs -q %s >/dev/null 2>&1 && "
+		 "mount -o loop,user_subvol_rm_allowed %s %s",
+		 img, img, img, mnt);
+	if (system(cmd) != 0) {
+		lxc_debug("%s\n", "Skipping: failed to set up a btrfs loop mount");
+		(void)lxc_rmdir_onedev(root, NULL);
+		exit(EXIT_SUCCESS);
+	}
+
+	/* A subvolume next to the one being destroyed that must survive. */
+	mksubvol("keep");
+	mksubvol("keep/k");
+
+	mktree("c1");
+	lxc_test_assert_abort(destroy("c1"));
+	lxc_test_assert_abort(!exists("c1"));
+	lxc_test_assert_abort(exists("keep/k"));
+
+	/* Destroying by id is not permitted so paths have to be used. */
+	mktree("c2");
+	pid = fork();
+	lxc_test_assert_abort(pid >= 0);
+	if (pid == 0) {
+		deny_destroy_by_id();
+		_exit(destroy("c2") ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	lxc_test_assert_abort(waitpid(pid, &status, 0) == pid);
+	lxc_test_assert_abort(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	lxc_test_assert_abort(!exists("c2"));
+	lxc_test_assert_abort(exists("keep/k"));
+
+	lxc_test_assert_abort(destroy("keep"));
+	lxc_test_assert_abort(umount2(mnt, MNT_DETACH) == 0);
+	lxc_test_assert_abort(lxc_rmdir_onedev(root, NULL) == 0);
+
+	exit(EXIT_SUCCESS);
+}
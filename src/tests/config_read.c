@@ -0,0 +1,160 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "conf.h"
+#include "confile.h"
+#include "lxctest.h"
+#include "utils.h"
+
+static char root[] = "/tmp/lxc-test-config-read-XXXXXX";
+static char config[MAXPATHLEN], include[MAXPATHLEN];
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *f;
+
+	f = fopen(path, "we");
+	lxc_test_assert_abort(f);
+	lxc_test_assert_abort(fputs(content, f) >= 0);
+	lxc_test_assert_abort(fclose(f) == 0);
+}
+
+static void set_mtime(const char *path, time_t sec)
+{
+	struct timespec ts[2] = {
+		{ .tv_sec = sec },
+		{ .tv_sec = sec },
+	};
+
+	lxc_test_assert_abort(utimensat(AT_FDCWD, path, ts, 0) == 0);
+}
+
+/* Load @config, which includes @include, and check the utsname it sets. */
+static void check_include(const char *expected)
+{
+	struct lxc_conf *conf;
+
+	conf = lxc_conf_init();
+	lxc_test_assert_abort(conf);
+	lxc_test_assert_abort(lxc_config_read(config, conf, false) == 0);
+	lxc_test_assert_abort(conf->utsname);
+	if (strcmp(conf->utsname->nodename, expected)) {
+		lxc_error("expected \"%s\", got \"%s\"\n", expected,
+			  conf->utsname->nodename);
+		exit(EXIT_FAILURE);
+	}
+	lxc_conf_free(conf);
+}
+
+/* Rewrite @path in place over and over, like save_config() does. */
+static void rewrite_loop(const char *path)
+{
+	int i, j;
+	FILE *f;
+
+	for (i = 0; i < 200; i++) {
+		f = fopen(path, "w");
+		if (!f)
+			_exit(EXIT_FAILURE);
+		for (j = 0; j < 2000; j++)
+			fprintf(f, "lxc.environment = VAR%d=%d\n", j, i);
+		fclose(f);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, status;
+	char path[MAXPATHLEN], line[MAXPATHLEN + 16];
+	pid_t pid;
+	struct lxc_conf *conf;
+
+	lxc_test_assert_abort(mkdtemp(root));
+	snprintf(config, sizeof(config), "%s/config", root);
+	snprintf(include, sizeof(include), "%s/include", root);
+	snprintf(line, sizeof(line), "lxc.include = %s\n", include);
+	write_file(config, line);
+
+	write_file(include, "lxc.utsname = one\n");
+	set_mtime(include, 1000);
+	check_include("one");
+
+	/* Same inode, size and mtime: served from the cache. */
+	write_file(include, "lxc.utsname = two\n");
+	set_mtime(include, 1000);
+	check_include("one");
+
+	/* A different size invalidates the entry. */
+	write_file(include, "lxc.utsname = three\n");
+	set_mtime(include, 1000);
+	check_include("three");
+
+	/* So does a different mtime. */
+	write_file(include, "lxc.utsname = fours\n");
+	set_mtime(include, 2000);
+	check_include("fours");
+
+	/* And a different inode. */
+	snprintf(path, sizeof(path), "%s/include.new", root);
+	write_file(path, "lxc.utsname = fives\n");
+	set_mtime(path, 2000);
+	lxc_test_assert_abort(rename(path, include) == 0);
+	check_include("fives");
+
+	/* A file that is truncated and rewritten while it is being parsed must
+	 * not bring the reader down. The lines it sees may be cut short, so
+	 * only the final read is checked.
+	 */
+	snprintf(path, sizeof(path), "%s/racy", root);
+	write_file(path, "lxc.utsname = racy\n");
+
+	pid = fork();
+	lxc_test_assert_abort(pid >= 0);
+	if (pid == 0)
+		rewrite_loop(path);
+
+	for (i = 0; waitpid(pid, &status, WNOHANG) == 0; i++) {
+		conf = lxc_conf_init();
+		lxc_test_assert_abort(conf);
+		(void)lxc_config_read(path, conf, false);
+		lxc_conf_free(conf);
+	}
+	lxc_test_assert_abort(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	lxc_debug("parsed the file %d times while it was rewritten\n", i);
+
+	conf = lxc_conf_init();
+	lxc_test_assert_abort(conf);
+	lxc_test_assert_abort(lxc_config_read(path, conf, false) == 0);
+	lxc_test_assert_abort(lxc_list_len(&conf->environment) == 2000);
+	lxc_conf_free(conf);
+
+	lxc_test_assert_abort(lxc_rmdir_onedev(root, NULL) == 0);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,201 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "lxctest.h"
+#include "storage/dedup.h"
+#include "utils.h"
+
+#define XATTR "trusted.lxc.test"
+
+static char root[] = "/tmp/lxc-test-dedup-XXXXXX";
+
+static void mkpath(char *buf, const char *dir, const char *name)
+{
+	snprintf(buf, MAXPATHLEN, "%s/%s/%s", root, dir, name);
+}
+
+static void mkfile(const char *name, const char *content)
+{
+	int fd;
+	char path[MAXPATHLEN];
+
+	mkpath(path, "src", name);
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	lxc_test_assert_abort(fd >= 0);
+	lxc_test_assert_abort(lxc_write_nointr(fd, content, strlen(content)) ==
+			      (ssize_t)strlen(content));
+	close(fd);
+}
+
+static ino_t inode(const char *dir, const char *name)
+{
+	struct stat st;
+	char path[MAXPATHLEN];
+
+	mkpath(path, dir, name);
+	lxc_test_assert_abort(lstat(path, &st) == 0);
+	return st.st_ino;
+}
+
+static void check_content(const char *dir, const char *name,
+			  const char *content)
+{
+	int fd;
+	ssize_t len;
+	char buf[64], path[MAXPATHLEN];
+
+	mkpath(path, dir, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	lxc_test_assert_abort(fd >= 0);
+	len = lxc_read_nointr(fd, buf, sizeof(buf));
+	close(fd);
+	lxc_test_assert_abort(len == (ssize_t)strlen(content));
+	lxc_test_assert_abort(memcmp(buf, content, len) == 0);
+}
+
+static void check_xattr(const char *dir, const char *name, const char *value)
+{
+	ssize_t len;
+	char buf[64], path[MAXPATHLEN];
+
+	mkpath(path, dir, name);
+	len = lgetxattr(path, XATTR, buf, sizeof(buf));
+	lxc_test_assert_abort(len == (ssize_t)strlen(value));
+	lxc_test_assert_abort(memcmp(buf, value, len) == 0);
+}
+
+static int snapshot(const char *name, const char *base,
+		    struct lxc_dedup_stats *stats)
+{
+	char dir[MAXPATHLEN], src[MAXPATHLEN], dest[MAXPATHLEN],
+	     manifest[MAXPATHLEN], base_dir[MAXPATHLEN];
+
+	snprintf(src, sizeof(src), "%s/src", root);
+	snprintf(dir, sizeof(dir), "%s/%s", root, name);
+	snprintf(dest, sizeof(dest), "%s/%s/rootfs", root, name);
+	snprintf(manifest, sizeof(manifest), "%s/%s/" LXC_DEDUP_MANIFEST, root, name);
+	if (base)
+		snprintf(base_dir, sizeof(base_dir), "%s/%s", root, base);
+
+	lxc_test_assert_abort(mkdir(dir, 0755) == 0);
+	lxc_test_assert_abort(mkdir(dest, 0755) == 0);
+
+	return lxc_dedup_copy(src, dest, base ? base_dir : NULL, manifest, stats);
+}
+
+int main(int argc, char *argv[])
+{
+	bool have_xattr;
+	char path[MAXPATHLEN], old[MAXPATHLEN];
+	struct lxc_dedup_stats stats;
+
+	if (geteuid() != 0) {
+		lxc_debug("%s\n", "Skipping: must be run as root");
+		exit(EXIT_SUCCESS);
+	}
+
+	lxc_test_assert_abort(mkdtemp(root));
+
+	snprintf(path, sizeof(path), "%s/src", root);
+	lxc_test_assert_abort(mkdir(path, 0755) == 0);
+	snprintf(path, sizeof(path), "%s/src/dir", root);
+	lxc_test_assert_abort(mkdir(path, 0755) == 0);
+
+	mkfile("a", "renamed");
+	mkfile("b", "rewritten");
+	mkfile("c", "relabeled");
+	mkfile("x", "labeled");
+	mkfile("h1", "linked");
+	mkfile("dir/f", "unchanged");
+	mkpath(old, "src", "h1");
+	mkpath(path, "src", "h2");
+	lxc_test_assert_abort(link(old, path) == 0);
+
+	mkpath(path, "src", "x");
+	have_xattr = lsetxattr(path, XATTR, "x", 1, 0) == 0;
+	if (have_xattr) {
+		mkpath(path, "src", "c");
+		lxc_test_assert_abort(lsetxattr(path, XATTR, "c", 1, 0) == 0);
+	}
+
+	/* Without a base everything is copied. */
+	lxc_test_assert_abort(snapshot("snap0", NULL, &stats) == 0);
+	lxc_test_assert_abort(stats.files == 7);
+	lxc_test_assert_abort(stats.copied == 6);
+	lxc_test_assert_abort(stats.linked == 0);
+
+	lxc_test_assert_abort(inode("snap0/rootfs", "a") != inode("src", "a"));
+	lxc_test_assert_abort(inode("snap0/rootfs", "h1") == inode("snap0/rootfs", "h2"));
+	lxc_test_assert_abort(inode("snap0/rootfs", "h1") != inode("src", "h1"));
+	check_content("snap0/rootfs", "dir/f", "unchanged");
+	if (have_xattr) {
+		check_xattr("snap0/rootfs", "x", "x");
+		check_xattr("snap0/rootfs", "c", "c");
+	}
+
+	/* Make sure the changes below move the ctime of the files. */
+	usleep(50000);
+
+	mkpath(old, "src", "a");
+	mkpath(path, "src", "a2");
+	lxc_test_assert_abort(rename(old, path) == 0);
+	mkfile("b", "rewritten again");
+	if (have_xattr) {
+		mkpath(path, "src", "c");
+		lxc_test_assert_abort(lsetxattr(path, XATTR, "C", 1, 0) == 0);
+	}
+
+	lxc_test_assert_abort(snapshot("snap1", "snap0", &stats) == 0);
+	lxc_test_assert_abort(stats.files == 7);
+
+	/* Unchanged files, hardlinks included, are shared with the base. */
+	lxc_test_assert_abort(inode("snap1/rootfs", "x") == inode("snap0/rootfs", "x"));
+	lxc_test_assert_abort(inode("snap1/rootfs", "dir/f") == inode("snap0/rootfs", "dir/f"));
+	lxc_test_assert_abort(inode("snap1/rootfs", "h1") == inode("snap0/rootfs", "h1"));
+	lxc_test_assert_abort(inode("snap1/rootfs", "h2") == inode("snap0/rootfs", "h2"));
+
+	/* A renamed file is found by its content. */
+	lxc_test_assert_abort(inode("snap1/rootfs", "a2") == inode("snap0/rootfs", "a"));
+	check_content("snap1/rootfs", "a2", "renamed");
+
+	/* Modified files get their own copy and the base is left alone. */
+	lxc_test_assert_abort(inode("snap1/rootfs", "b") != inode("snap0/rootfs", "b"));
+	check_content("snap1/rootfs", "b", "rewritten again");
+	check_content("snap0/rootfs", "b", "rewritten");
+
+	if (have_xattr) {
+		lxc_test_assert_abort(inode("snap1/rootfs", "c") != inode("snap0/rootfs", "c"));
+		check_xattr("snap1/rootfs", "c", "C");
+		check_xattr("snap0/rootfs", "c", "c");
+		lxc_test_assert_abort(stats.linked == 4);
+		lxc_test_assert_abort(stats.copied == 2);
+	}
+
+	lxc_test_assert_abort(lxc_rmdir_onedev(root, NULL) == 0);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,239 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "conf.h"
+#include "idshift.h"
+#include "list.h"
+#include "lxctest.h"
+#include "utils.h"
+
+#define HOSTID 100000
+
+/* v2 file capabilities granting cap_net_raw. */
+static const uint32_t caps_v2[5] = {
+	0x02000001, 1 << 13, 0, 0, 0,
+};
+
+/* An access ACL with a named user entry for nsid 1000. */
+struct acl {
+	uint32_t version;
+	struct {
+		uint16_t tag;
+		uint16_t perm;
+		uint32_t id;
+	} e[5];
+};
+
+/* Must match the record kept by idshift.c. */
+struct restore {
+	uint32_t mode;
+	uint32_t caps_len;
+	uint32_t caps[6];
+};
+
+static char root[] = "/tmp/lxc-test-idshift-XXXXXX";
+
+static void mkpath(char *buf, const char *name)
+{
+	snprintf(buf, MAXPATHLEN, "%s/%s", root, name);
+}
+
+static void mkfile(const char *name, uid_t uid, gid_t gid, mode_t mode)
+{
+	int fd;
+	char path[MAXPATHLEN];
+
+	mkpath(path, name);
+	fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+	lxc_test_assert_abort(fd >= 0);
+	close(fd);
+	lxc_test_assert_abort(chown(path, uid, gid) == 0);
+	lxc_test_assert_abort(chmod(path, mode) == 0);
+}
+
+static void check_owner(const char *name, uid_t uid, gid_t gid, mode_t mode)
+{
+	struct stat st;
+	char path[MAXPATHLEN];
+
+	mkpath(path, name);
+	lxc_test_assert_abort(lstat(path, &st) == 0);
+	lxc_test_assert_abort(st.st_uid == uid);
+	lxc_test_assert_abort(st.st_gid == gid);
+	if (mode)
+		lxc_test_assert_abort((st.st_mode & 07777) == mode);
+}
+
+static void check_caps(const char *name)
+{
+	uint32_t caps[6];
+	char path[MAXPATHLEN];
+
+	mkpath(path, name);
+	lxc_test_assert_abort(lgetxattr(path, "security.capability", caps,
+					sizeof(caps)) == sizeof(caps));
+	lxc_test_assert_abort(le32toh(caps[0]) == 0x03000001);
+	lxc_test_assert_abort(le32toh(caps[1]) == 1 << 13);
+	lxc_test_assert_abort(le32toh(caps[5]) == HOSTID);
+	lxc_test_assert_abort(lgetxattr(path, "trusted.lxc.idshift", NULL, 0) < 0);
+}
+
+static void add_map(struct lxc_list *idmap, enum idtype type)
+{
+	struct id_map *map;
+	struct lxc_list *it;
+
+	map = malloc(sizeof(*map));
+	it = malloc(sizeof(*it));
+	lxc_test_assert_abort(map && it);
+
+	map->idtype = type;
+	map->nsid = 0;
+	map->hostid = HOSTID;
+	map->range = 65536;
+	lxc_list_add_elem(it, map);
+	lxc_list_add_tail(idmap, it);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret;
+	bool have_caps, have_acl;
+	char path[MAXPATHLEN];
+	struct acl acl;
+	struct restore r;
+	struct lxc_list idmap, *it, *next;
+	struct lxc_idshift_stats stats;
+
+	if (geteuid() != 0) {
+		lxc_debug("%s\n", "Skipping: must be run as root");
+		exit(EXIT_SUCCESS);
+	}
+
+	lxc_test_assert_abort(mkdtemp(root));
+
+	lxc_list_init(&idmap);
+	add_map(&idmap, ID_TYPE_UID);
+	add_map(&idmap, ID_TYPE_GID);
+
+	/* Enough directories for the walk to be spread over the threads. */
+	for (i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, i);
+		lxc_test_assert_abort(mkdir(path, 0755) == 0);
+		snprintf(path, sizeof(path), "d%d/f", i);
+		mkfile(path, i, i, 0644);
+	}
+
+	mkfile("user", 1000, 1000, 0600);
+	mkfile("setuid", 0, 0, 04755);
+	mkfile("setgid", 0, 0, 02755);
+	mkfile("foreign", 70000, 70000, 0644);
+	mkpath(path, "link");
+	lxc_test_assert_abort(symlink("user", path) == 0);
+	lxc_test_assert_abort(lchown(path, 1000, 1000) == 0);
+
+	mkfile("caps", 0, 0, 0755);
+	mkpath(path, "caps");
+	have_caps = lsetxattr(path, "security.capability", caps_v2,
+			      sizeof(caps_v2), 0) == 0;
+
+	mkfile("acl", 0, 0, 0640);
+	mkpath(path, "acl");
+	memset(&acl, 0, sizeof(acl));
+	acl.version = htole32(2);
+	acl.e[0].tag = htole16(0x01); acl.e[0].perm = htole16(6);
+	acl.e[1].tag = htole16(0x02); acl.e[1].perm = htole16(4); acl.e[1].id = htole32(1000);
+	acl.e[2].tag = htole16(0x04); acl.e[2].perm = htole16(4);
+	acl.e[3].tag = htole16(0x10); acl.e[3].perm = htole16(4);
+	acl.e[4].tag = htole16(0x20); acl.e[4].perm = htole16(4);
+	have_acl = lsetxattr(path, "system.posix_acl_access", &acl,
+			     sizeof(acl), 0) == 0;
+
+	ret = lxc_idshift_tree(root, &idmap, 4, NULL, NULL, &stats);
+	lxc_test_assert_abort(ret == 0);
+	lxc_test_assert_abort(stats.errors == 0);
+	lxc_test_assert_abort(stats.unmapped == 1);
+
+	check_owner("", HOSTID, HOSTID, 0);
+	for (i = 0; i < 64; i++) {
+		snprintf(path, sizeof(path), "d%d/f", i);
+		check_owner(path, HOSTID + i, HOSTID + i, 0644);
+	}
+	check_owner("user", HOSTID + 1000, HOSTID + 1000, 0600);
+	check_owner("link", HOSTID + 1000, HOSTID + 1000, 0);
+	check_owner("setuid", HOSTID, HOSTID, 04755);
+	check_owner("setgid", HOSTID, HOSTID, 02755);
+	check_owner("foreign", 70000, 70000, 0644);
+
+	if (have_caps)
+		check_caps("caps");
+
+	if (have_acl) {
+		mkpath(path, "acl");
+		lxc_test_assert_abort(getxattr(path, "system.posix_acl_access",
+					       &acl, sizeof(acl)) == sizeof(acl));
+		lxc_test_assert_abort(le32toh(acl.e[1].id) == HOSTID + 1000);
+	}
+
+	/* A second run has nothing left to do. */
+	ret = lxc_idshift_tree(root, &idmap, 4, NULL, NULL, &stats);
+	lxc_test_assert_abort(ret == 0);
+	lxc_test_assert_abort(stats.shifted == 0);
+
+	/* A run interrupted right after the chown of "resume" left it without
+	 * its setuid bit and capabilities. The next run puts them back.
+	 */
+	mkfile("resume", HOSTID, HOSTID, 0755);
+	mkpath(path, "resume");
+	memset(&r, 0, sizeof(r));
+	r.mode = S_IFREG | 04755;
+	if (have_caps) {
+		r.caps_len = 24;
+		r.caps[0] = htole32(0x03000001);
+		r.caps[1] = htole32(1 << 13);
+		r.caps[5] = htole32(HOSTID);
+	}
+	if (setxattr(path, "trusted.lxc.idshift", &r, sizeof(r), 0) == 0) {
+		ret = lxc_idshift_tree(root, &idmap, 1, NULL, NULL, &stats);
+		lxc_test_assert_abort(ret == 0);
+		check_owner("resume", HOSTID, HOSTID, 04755);
+		if (have_caps)
+			check_caps("resume");
+		lxc_test_assert_abort(getxattr(path, "trusted.lxc.idshift", NULL, 0) < 0);
+	}
+
+	lxc_list_for_each_safe(it, &idmap, next) {
+		lxc_list_del(it);
+		free(it->elem);
+		free(it);
+	}
+
+	lxc_test_assert_abort(lxc_rmdir_onedev(root, NULL) == 0);
+
+	exit(EXIT_SUCCESS);
+}
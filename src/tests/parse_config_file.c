@@ -344,6 +344,12 @@ int main(int argc, char *argv[])
 		goto non_test_error;
 	}
 
+	/* lxc.rootfs.overlay.tmpfs */
+	if (set_get_compare_clear_save_load(c, "lxc.rootfs.overlay.tmpfs", "512m", tmpf, true) < 0) {
+		lxc_error("%s\n", "lxc.rootfs.overlay.tmpfs");
+		goto non_test_error;
+	}
+
 	/* lxc.utsname */
 	if (set_get_compare_clear_save_load(c, "lxc.utsname", "the-shire", tmpf, true) < 0) {
 		lxc_error("%s\n", "lxc.utsname");
@@ -525,6 +531,24 @@ int main(int argc, char *argv[])
 		goto non_test_error;
 	}
 
+	/* lxc.ephemeral.pool.size */
+	if (set_get_compare_clear_save_load(c, "lxc.ephemeral.pool.size", "4", tmpf, true) < 0) {
+		lxc_error("%s\n", "lxc.ephemeral.pool.size");
+		goto non_test_error;
+	}
+
+	/* lxc.ephemeral.pool.frozen */
+	if (set_get_compare_clear_save_load(c, "lxc.ephemeral.pool.frozen", "1", tmpf, true) < 0) {
+		lxc_error("%s\n", "lxc.ephemeral.pool.frozen");
+		goto non_test_error;
+	}
+
+	/* lxc.snapshot.dedup */
+	if (set_get_compare_clear_save_load(c, "lxc.snapshot.dedup", "1", tmpf, true) < 0) {
+		lxc_error("%s\n", "lxc.snapshot.dedup");
+		goto non_test_error;
+	}
+
 	if (test_idmap_parser() < 0) {
 		lxc_error("%s\n", "failed to test parser for \"lxc.id_map\"");
 		goto non_test_error;
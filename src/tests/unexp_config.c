@@ -0,0 +1,258 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conf.h"
+#include "confile_utils.h"
+#include "lxctest.h"
+
+/* The unexpanded config used to be a single string. This is how it was
+ * appended to and cleared, and what write_config() wrote out.
+ */
+struct ref_config {
+	char *buf;
+	size_t len, alloced;
+};
+
+static void ref_append(struct ref_config *r, const char *line)
+{
+	size_t linelen = strlen(line);
+
+	while (r->alloced <= r->len + linelen + 2) {
+		r->buf = realloc(r->buf, r->alloced + 1024);
+		lxc_test_assert_abort(r->buf);
+		if (!r->alloced)
+			*r->buf = '\0';
+		r->alloced += 1024;
+	}
+	strcat(r->buf, line);
+	r->len += linelen;
+	if (line[linelen - 1] != '\n') {
+		strcat(r->buf, "\n");
+		r->len++;
+	}
+}
+
+static void ref_clear(struct ref_config *r, const char *key, bool rm_subkeys)
+{
+	char *lend;
+	char *lstart = r->buf;
+
+	if (!r->buf)
+		return;
+
+	while (*lstart) {
+		char v;
+
+		lend = strchr(lstart, '\n');
+		if (!lend)
+			lend = lstart + strlen(lstart);
+		else
+			lend++;
+		if (strncmp(lstart, key, strlen(key)) != 0) {
+			lstart = lend;
+			continue;
+		}
+		if (!rm_subkeys) {
+			v = lstart[strlen(key)];
+			if (!isspace(v) && v != '=') {
+				lstart = lend;
+				continue;
+			}
+		}
+		r->len -= (lend - lstart);
+		if (*lend == '\0') {
+			*lstart = '\0';
+			return;
+		}
+		memmove(lstart, lend, strlen(lend) + 1);
+	}
+}
+
+static char *unexp_text(const struct lxc_unexp_config *u, size_t *len)
+{
+	FILE *f;
+	char *buf = NULL;
+
+	f = open_memstream(&buf, len);
+	lxc_test_assert_abort(f);
+	lxc_test_assert_abort(lxc_unexp_config_write(u, f, NULL) == 0);
+	lxc_test_assert_abort(fclose(f) == 0);
+
+	return buf;
+}
+
+static void check_same(const struct lxc_unexp_config *u,
+		       const struct ref_config *r)
+{
+	char *buf;
+	size_t len;
+
+	buf = unexp_text(u, &len);
+	if (len != r->len || (len && memcmp(buf, r->buf, len))) {
+		lxc_error("unexpanded config differs:\n%s\n--- expected:\n%s\n",
+			  buf, r->len ? r->buf : "");
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+}
+
+static void check_text(const struct lxc_unexp_config *u, const char *expected)
+{
+	char *buf;
+	size_t len;
+
+	buf = unexp_text(u, &len);
+	if (len != strlen(expected) || memcmp(buf, expected, len)) {
+		lxc_error("got:\n%s\n--- expected:\n%s\n", buf, expected);
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+}
+
+static void append(struct lxc_unexp_config *u, struct ref_config *r,
+		   const char *line)
+{
+	lxc_test_assert_abort(lxc_unexp_config_append(u, line) == 0);
+	ref_append(r, line);
+}
+
+static void clear(struct lxc_unexp_config *u, struct ref_config *r,
+		  const char *key, bool prefix)
+{
+	lxc_unexp_config_clear(u, key, prefix);
+	ref_clear(r, key, prefix);
+	check_same(u, r);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	char line[64], key[32];
+	double elapsed;
+	struct timespec start, end;
+	struct lxc_unexp_config u;
+	struct ref_config r;
+
+	/* Appending, then clearing by exact key and by prefix. */
+	memset(&u, 0, sizeof(u));
+	memset(&r, 0, sizeof(r));
+	append(&u, &r, "# a comment\n");
+	append(&u, &r, "lxc.utsname = c1\n");
+	append(&u, &r, "lxc.network.type = veth");
+	append(&u, &r, "lxc.network.link = br0\n");
+	append(&u, &r, "lxc.network= \n");
+	append(&u, &r, "\n");
+	append(&u, &r, "  lxc.utsname = indented\n");
+	append(&u, &r, "lxc.utsnamex = other\n");
+	check_same(&u, &r);
+
+	clear(&u, &r, "lxc.utsname", false);
+	check_text(&u, "# a comment\n"
+		       "lxc.network.type = veth\n"
+		       "lxc.network.link = br0\n"
+		       "lxc.network= \n"
+		       "\n"
+		       "  lxc.utsname = indented\n"
+		       "lxc.utsnamex = other\n");
+
+	clear(&u, &r, "lxc.network", true);
+	check_text(&u, "# a comment\n"
+		       "\n"
+		       "  lxc.utsname = indented\n"
+		       "lxc.utsnamex = other\n");
+
+	/* A key that is set several times, like clear_unexp_config_line()
+	 * removing all lxc.mount.entry lines.
+	 */
+	append(&u, &r, "lxc.mount.entry = a\n");
+	append(&u, &r, "lxc.mount.auto = proc\n");
+	append(&u, &r, "lxc.mount.entry = b\n");
+	append(&u, &r, "lxc.mount.entry=c\n");
+	clear(&u, &r, "lxc.mount.entry", false);
+	check_text(&u, "# a comment\n"
+		       "\n"
+		       "  lxc.utsname = indented\n"
+		       "lxc.utsnamex = other\n"
+		       "lxc.mount.auto = proc\n");
+
+	/* Clearing a key that was set again after it was cleared. */
+	append(&u, &r, "lxc.mount.entry = d\n");
+	check_same(&u, &r);
+	lxc_unexp_config_free(&u);
+	free(r.buf);
+
+	/* Enough cleared lines to compact the vector, with the output compared
+	 * against the old string based config after every step.
+	 */
+	memset(&u, 0, sizeof(u));
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < 400; i++) {
+		snprintf(line, sizeof(line), "lxc.k%d.v%d = %d\n", i % 7, i % 3, i);
+		append(&u, &r, line);
+		if (i % 10 == 0)
+			append(&u, &r, "# comment\n");
+	}
+	check_same(&u, &r);
+
+	clear(&u, &r, "lxc.k1", true);
+	clear(&u, &r, "lxc.k2.v0", false);
+	clear(&u, &r, "lxc.k3", true);
+	clear(&u, &r, "lxc.k4.v1", false);
+	lxc_test_assert_abort(u.nr_cleared != 0);
+	clear(&u, &r, "lxc.k5", true);
+	clear(&u, &r, "lxc.k6", true);
+	lxc_test_assert_abort(u.nr_cleared == 0);
+
+	for (i = 0; i < 100; i++) {
+		snprintf(line, sizeof(line), "lxc.k%d.v%d = again %d\n", i % 5, i % 2, i);
+		append(&u, &r, line);
+	}
+	clear(&u, &r, "lxc.k0.v0", false);
+	clear(&u, &r, "lxc.k", true);
+	lxc_test_assert_abort(u.nr_cleared == 0);
+	lxc_unexp_config_free(&u);
+	free(r.buf);
+
+	/* 50000 lines appended and cleared one key at a time. Done on a single
+	 * string this copies the rest of the config for every clear.
+	 */
+	memset(&u, 0, sizeof(u));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 50000; i++) {
+		snprintf(line, sizeof(line), "lxc.environment.k%d = %d\n", i, i);
+		lxc_test_assert_abort(lxc_unexp_config_append(&u, line) == 0);
+	}
+	for (i = 0; i < 50000; i++) {
+		snprintf(key, sizeof(key), "lxc.environment.k%d", i);
+		lxc_unexp_config_clear(&u, key, false);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	check_text(&u, "");
+	lxc_unexp_config_free(&u);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	lxc_debug("50000 appends and clears took %.3fs\n", elapsed);
+	lxc_test_assert_abort(elapsed < 5);
+
+	exit(EXIT_SUCCESS);
+}